@@ -91,7 +91,6 @@ cp util-linux/OUTPUT/bin/* "$CDROOT/bin/"
 cp util-linux/OUTPUT/sbin/* "$CDROOT/bin/"
 cp util-linux/cfdisk "$CDROOT/bin/"
 cp util-linux/sfdisk "$CDROOT/bin/"
-cp util-linux/lsblk "$CDROOT/bin/"
 cp pciutils/lspci "$CDROOT/bin/"
 cp pciutils/setpci "$CDROOT/bin/"
 cp pciutils/pci.ids "$CDROOT/bin/"
@@ -0,0 +1,231 @@
+/*
+ * LUNMERCY - Extraction benchmark (lunmercy_bench)
+ *
+ * Runs the MercyPak extraction engine (mercypak.c) on the build host, without any UI, so changes
+ * to the MappedFile backends can be compared without booting real hardware.
+ *
+ * Build it with build_bench.sh, it builds one binary per backend and block size.
+ * The target directory can be anything: a tmpfs directory or a loop mounted FAT image.
+ * On non-FAT targets setting the DOS attributes fails, that is reported but doesn't stop anything.
+ *
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mappedfile.h"
+#include "mercypak.h"
+#include "trace.h"
+
+#ifndef LUNMERCY_BENCH_BACKEND
+#define LUNMERCY_BENCH_BACKEND "unknown"
+#endif
+
+#define BENCH_DEFAULT_READAHEAD (64 * 1024 * 1024)
+#define BENCH_MAX_PACKS (16)
+
+typedef struct {
+    size_t readahead;
+    unsigned repeats;
+    bool dropCaches;
+    bool keep;
+    const char *traceFile;
+    const char *target;
+    const char *packs[BENCH_MAX_PACKS];
+    size_t packCount;
+} bench_Options;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int bench_removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    if (ftw->level == 0) return 0;  // Keep the target directory itself, it may be a mount point
+    return remove(path);
+}
+
+/* Empties the target directory so every run starts from the same state */
+static bool bench_cleanTarget(const char *target) {
+    return nftw(target, bench_removeEntry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+/* Flushes everything and drops the page cache, so the packs are read cold. Needs root. */
+static void bench_dropCaches(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1) {
+        fprintf(stderr, "WARNING: Could not drop caches (not root?)\n");
+    }
+    if (fd >= 0) close(fd);
+}
+
+/* Flushes the file system the target directory is on */
+static void bench_syncTarget(const char *target) {
+    int fd = open(target, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || syncfs(fd) != 0) {
+        sync();
+    }
+    if (fd >= 0) close(fd);
+}
+
+static long bench_peakRssKb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void bench_printHeader(void) {
+    printf("%-10s %-12s %4s %9s %8s %7s %7s %7s %7s %9s %9s %9s %8s %8s %8s %8s %8s %7s %10s\n",
+        "backend", "pack", "run", "MB", "extr s", "sync s", "wait s", "write s", "meta s", "MB/s", "files/s",
+        "syscalls", "read", "write", "open", "meta", "madvise", "waits", "peakRSS kB");
+}
+
+/* Extracts one pack to the target, prints a result line. Returns false on errors. */
+static bool bench_runPack(const bench_Options *opt, const char *pack, unsigned run, double *totalMb, double *totalSeconds) {
+    mercypak_Stats stats = {0};
+    mappedFile_Stats fileStats = {0};
+
+    double start = bench_now();
+
+    MappedFile *file = mappedFile_open(pack, opt->readahead);
+
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", pack);
+        return false;
+    }
+
+    bool success = mercypak_extract(file, opt->target, NULL, &stats);
+    mappedFile_getStats(file, &fileStats);
+    mappedFile_close(file);
+
+    double extracted = bench_now();
+    bench_syncTarget(opt->target);
+    double end = bench_now();
+
+    double seconds = end - start;
+    double mb = (double) stats.bytesWritten / (1024.0 * 1024.0);
+    uint64_t syscalls = fileStats.readCalls + fileStats.writeCalls + fileStats.adviseCalls
+                      + stats.mkdirCalls + stats.openCalls + stats.closeCalls + stats.metadataCalls;
+
+    const char *packName = strrchr(pack, '/');
+    packName = packName ? packName + 1 : pack;
+
+    printf("%-10s %-12s %4u %9.1f %8.2f %7.2f %7.2f %7.2f %7.2f %9.2f %9.1f %9llu %8llu %8llu %8llu %8llu %8llu %7llu %10ld%s\n",
+        LUNMERCY_BENCH_BACKEND, packName, run, mb, extracted - start, end - extracted,
+        (double) fileStats.waitMicroseconds / 1e6, (double) fileStats.writeMicroseconds / 1e6,
+        (double) (stats.mkdirMicroseconds + stats.openMicroseconds + stats.closeMicroseconds + stats.metadataMicroseconds) / 1e6,
+        mb / seconds, (double) stats.files / seconds,
+        (unsigned long long) syscalls,
+        (unsigned long long) fileStats.readCalls,
+        (unsigned long long) fileStats.writeCalls,
+        (unsigned long long) stats.openCalls,
+        (unsigned long long) stats.metadataCalls,
+        (unsigned long long) fileStats.adviseCalls,
+        (unsigned long long) fileStats.waits,
+        bench_peakRssKb(),
+        success ? "" : " (errors)");
+
+    fflush(stdout);
+
+    *totalMb += mb;
+    *totalSeconds += seconds;
+    return true;
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-r readahead MB] [-n runs] [-d] [-k] [-t trace.json] <target dir> <pack> [pack...]\n"
+        "  -r  readahead given to the MappedFile backend (default %d MB)\n"
+        "  -n  number of runs (default 1)\n"
+        "  -d  drop the page cache before every run (needs root)\n"
+        "  -k  keep the extracted files after the last run\n"
+        "  -t  write a Chrome trace of the last run(s) to this file (see trace.h)\n"
+        "Packs are extracted in the given order, like the installer does.\n",
+        name, BENCH_DEFAULT_READAHEAD / (1024 * 1024));
+}
+
+int main(int argc, char *argv[]) {
+    bench_Options opt = { BENCH_DEFAULT_READAHEAD, 1, false, false, NULL, NULL, {0}, 0 };
+    int c;
+
+    while ((c = getopt(argc, argv, "r:n:dkt:h")) != -1) {
+        switch (c) {
+            case 'r': opt.readahead = (size_t) strtoul(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'n': opt.repeats = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 'd': opt.dropCaches = true; break;
+            case 'k': opt.keep = true; break;
+            case 't': opt.traceFile = optarg; break;
+            default:
+                bench_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2 || opt.repeats == 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    opt.target = argv[optind++];
+
+    while (optind < argc && opt.packCount < BENCH_MAX_PACKS) {
+        opt.packs[opt.packCount++] = argv[optind++];
+    }
+
+    if (opt.traceFile != NULL && !trace_init(256 * 1024)) {
+        fprintf(stderr, "ERROR: Not enough memory for tracing\n");
+        return 1;
+    }
+
+    printf("lunmercy_bench: backend %s, readahead %zu MB, target %s\n", LUNMERCY_BENCH_BACKEND, opt.readahead / (1024 * 1024), opt.target);
+    bench_printHeader();
+
+    double totalMb = 0.0;
+    double totalSeconds = 0.0;
+
+    for (unsigned run = 1; run <= opt.repeats; run++) {
+        if (!bench_cleanTarget(opt.target)) {
+            perror("Cleaning target directory");
+            return 1;
+        }
+
+        if (opt.dropCaches) {
+            bench_dropCaches();
+        }
+
+        for (size_t i = 0; i < opt.packCount; i++) {
+            if (!bench_runPack(&opt, opt.packs[i], run, &totalMb, &totalSeconds)) {
+                return 1;
+            }
+        }
+    }
+
+    if (!opt.keep) {
+        bench_cleanTarget(opt.target);
+    }
+
+    if (opt.traceFile != NULL && !trace_dump(opt.traceFile)) {
+        perror("Writing trace");
+    }
+
+    printf("%-10s %-12s %4s %9.1f %8.2f %7s %7s %7s %7s %9.2f\n", LUNMERCY_BENCH_BACKEND, "TOTAL", "", totalMb, totalSeconds, "", "", "", "", totalMb / totalSeconds);
+
+    return 0;
+}
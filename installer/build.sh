@@ -6,7 +6,7 @@ set -e 1
 
 ANBUI_FILES=$(anbui/get_build_files.sh)
 
-$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror -pthread $ANBUI_FILES disk.c install.c util.c mappedfile_mt.c main.c -lpthread -olunmercy
-$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror $ANBUI_FILES disk.c install.c util.c mappedfile.c main.c -olunmercy_singlethread
+$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror -pthread $ANBUI_FILES disk.c drivers.c fanout.c format.c golden.c install.c journal.c mercypak.c trace.c unattend.c util.c verify.c mappedfile_mt.c main.c -lpthread -olunmercy
+$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror $ANBUI_FILES disk.c drivers.c fanout.c format.c golden.c install.c journal.c mercypak.c trace.c unattend.c util.c verify.c mappedfile.c main.c -olunmercy_singlethread
 
 ls -l lunmercy*
@@ -0,0 +1,53 @@
+#!/bin/sh
+
+# Builds lunmercy_bench (see bench.c) for the build host, once for every MappedFile backend and block size.
+# If a target directory and pack files are given, all of them are run one after the other:
+#
+#   ./build_bench.sh /mnt/fatimage ../_OUTPUT_/osroots/1/FULL.866 ../_OUTPUT_/osroots/1/DRIVER.866
+#
+# BENCH_ARGS can contain extra arguments for the benchmark, e.g. BENCH_ARGS="-n 3 -d"
+#
+# To simulate slow drives (see slowdev.c), set a device profile for the source and/or the target:
+#
+#   SLOWDEV_SOURCE_PROFILE=cd4x SLOWDEV_TARGET_PROFILE=hdd-pio2 ./build_bench.sh /tmp/target SYNTH.866
+
+CC=${CC:-cc}
+
+set -e
+
+ANBUI_FILES=$(anbui/get_build_files.sh)
+COMMON_FILES="bench.c fanout.c mercypak.c trace.c util.c"
+CFLAGS="-O2 -g -Wall -Wextra -pedantic -Werror"
+
+BLOCK_SIZES="256 1024 4096"
+
+mkdir -p bench
+
+for BLOCK_SIZE in $BLOCK_SIZES; do
+    $CC $CFLAGS -pthread -DMAPPEDFILE_BLOCK_SIZE="($BLOCK_SIZE*1024)" -DLUNMERCY_BENCH_BACKEND="\"mt-${BLOCK_SIZE}k\"" \
+        $ANBUI_FILES $COMMON_FILES mappedfile_mt.c -lpthread -obench/lunmercy_bench_mt_${BLOCK_SIZE}k
+done
+
+$CC $CFLAGS -DLUNMERCY_BENCH_BACKEND="\"mmap\"" $ANBUI_FILES $COMMON_FILES mappedfile.c -obench/lunmercy_bench_mmap
+
+$CC $CFLAGS -fPIC -shared -pthread slowdev.c -ldl -obench/slowdev.so
+
+ls -l bench/lunmercy_bench* bench/slowdev.so
+
+if [ $# -lt 2 ]; then
+    exit 0
+fi
+
+# The source is the directory of the first pack, the target is the target directory
+PRELOAD=
+if [ -n "$SLOWDEV_SOURCE_PROFILE$SLOWDEV_TARGET_PROFILE" ]; then
+    PRELOAD=$PWD/bench/slowdev.so
+    export SLOWDEV_TARGET=${SLOWDEV_TARGET:-$1}
+    export SLOWDEV_SOURCE=${SLOWDEV_SOURCE:-$(dirname "$2")}
+fi
+
+# Every backend runs in its own process, so the peak RSS is per backend
+for BENCH in bench/lunmercy_bench_*; do
+    LD_PRELOAD=$PRELOAD $BENCH $BENCH_ARGS "$@"
+    echo
+done
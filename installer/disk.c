@@ -11,14 +11,28 @@
 #include <malloc.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
 
 #include "qi_assert.h"
 
-#define CMD_SURPRESS_OUTPUT " 2>/dev/null 1>/dev/null"
+#define DISK_SYSFS_BLOCK "/sys/block"
+#define DISK_PROC_PARTITIONS "/proc/partitions"
 
-#define CMD_LSBLK_ALL "lsblk -I 8,3 -n -b -p -P -oTYPE,KNAME,PARTTYPE,SIZE,MIN-IO,OPT-IO,MODEL"
+// /sys/block entries that are never hard disks, everything else is (sd*, hd*, nvme*, mmcblk*, ...)
+static const char *const DISK_SKIPPED_PREFIXES[] = { "loop", "ram", "zram", "sr", "fd", "md", "dm-" };
+
+#define DISK_MBR_PARTITION_TABLE_OFFSET (0x1BE)
+#define DISK_MBR_PARTITION_ENTRY_SIZE   (16)
+#define DISK_MBR_PRIMARY_PARTITIONS     (4)
+#define DISK_MAX_PARTITIONS             (64)    // Also the limit for following the extended partition chain
+
+#define DISK_SYSFS_PATH_LENGTH (sizeof(DISK_SYSFS_BLOCK) + 2 * 256 + 32)
 
 // Update parents after a reallocation of a hard disk array
 static inline void util_HardDisksUpdatePartitionParents(util_HardDisk *hdds, size_t diskCount) {
@@ -49,7 +63,7 @@ static util_HardDisk *util_HardDiskArrayAppend(util_HardDiskArray *hda, const ch
 
     memset(ret, 0, sizeof(util_HardDisk));
 
-    strncpy(ret->device, device, sizeof(ret->device));
+    snprintf(ret->device, sizeof(ret->device), "%s", device);
     strncpy(ret->model, model, sizeof(ret->model));
 
     ret->size = size;
@@ -59,7 +73,7 @@ static util_HardDisk *util_HardDiskArrayAppend(util_HardDiskArray *hda, const ch
     return ret;
 }
 
-static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, const char *device, uint64_t size, uint32_t sectorSize, util_FileSystem fileSystem, size_t indexOnParent) {
+static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, const char *device, uint64_t offset, uint64_t size, uint32_t sectorSize, util_FileSystem fileSystem, size_t indexOnParent) {
     QI_ASSERT(hd != NULL);
 
     hd->partitionCount++;
@@ -71,8 +85,9 @@ static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, const char *
 
     memset(ret, 0, sizeof(util_Partition));
 
-    strncpy(ret->device, device, sizeof(ret->device));
+    snprintf(ret->device, sizeof(ret->device), "%s", device);
 
+    ret->offset = offset;
     ret->size = size;
     ret->sectorSize = sectorSize;
     ret->fileSystem = fileSystem;
@@ -82,104 +97,253 @@ static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, const char *
     return ret;
 }
 
-// Gets a value for a given key from a '<key>="value" <key2>="value2"' esque input string
-static bool util_getValueFromKey(const char *input, const char *key, char *value, size_t valueBufSize) {
-    const char *curPos = input;
+// Reads a small sysfs attribute file into buf, without the trailing new line. Returns false if it doesn't exist.
+static bool util_readSysfsString(const char *path, char *buf, size_t bufSize) {
+    int fd = open(path, O_RDONLY);
 
-    QI_ASSERT(input != NULL);
-    QI_ASSERT(key != NULL);
-    QI_ASSERT(value != NULL);
+    if (fd < 0)
+        return false;
 
-    size_t keyLen = strlen(key);
-    const char equalsQuote[] = "=\"";
+    ssize_t len = read(fd, buf, bufSize - 1);
+    close(fd);
 
-    while (!(util_stringStartsWith(curPos, key) && util_stringStartsWith(curPos + keyLen, equalsQuote))) {
-        if (*curPos == 0x00)
-            return false;
+    if (len < 0)
+        return false;
 
-        curPos++;
-    }
+    // Models are padded with spaces
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+        len--;
+
+    buf[len] = 0x00;
+    return true;
+}
+
+static uint64_t util_readSysfsNumber(const char *path) {
+    char tmp[32];
+    return util_readSysfsString(path, tmp, sizeof(tmp)) ? strtoull(tmp, NULL, 10) : 0;
+}
+
+// Checks if a /sys/block entry is a hard disk, we don't want loop devices, RAM disks, optical or floppy drives
+static bool util_isSysfsHardDisk(const char *name) {
+    char path[DISK_SYSFS_PATH_LENGTH];
+    char media[16];
 
-    // If we're still here, the string actually matches what we need, skip to the actual value
-    curPos += keyLen + sizeof(equalsQuote) - 1;
+    for (size_t i = 0; i < util_arraySize(DISK_SKIPPED_PREFIXES); i++) {
+        if (strncmp(name, DISK_SKIPPED_PREFIXES[i], strlen(DISK_SKIPPED_PREFIXES[i])) == 0)
+            return false;
+    }
 
-    // Find the closing quote for the value
-    const char *valueEnd = strchr(curPos, '\"');
+    // IDE CD-ROM drives are hd* too
+    snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/device/media", name);
 
-    if (valueEnd == NULL)
+    if (util_readSysfsString(path, media, sizeof(media)) && !util_stringEquals(media, "disk"))
         return false;
 
-    size_t valueLength = valueEnd - curPos;
-    
-    // Cap to buffer size
-    valueLength = MIN(valueLength, valueBufSize - 1);
-    memcpy(value, curPos, valueLength);
-    value[valueLength] = 0x00;
-    
     return true;
 }
 
+static int util_compareStrings(const void *a, const void *b) {
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Reads the partition type bytes from the MBR and the extended partition chain.
+   types[n] is the type of partition number n (like Linux numbers them: 1-4 primary, 5+ logical), 0 = none. */
+static void util_readPartitionTypes(int fd, uint32_t sectorSize, uint8_t types[DISK_MAX_PARTITIONS + 1]) {
+    uint8_t sector[4096];
+    uint64_t extendedStart = 0;
+    uint64_t ebr = 0;
+    size_t logicalIndex = 5;
+
+    memset(types, 0, DISK_MAX_PARTITIONS + 1);
+
+    if (sectorSize > sizeof(sector) || pread(fd, sector, sectorSize, 0) != (ssize_t) sectorSize)
+        return;
+
+    if (sector[510] != 0x55 || sector[511] != 0xAA)
+        return;
+
+    for (size_t i = 0; i < DISK_MBR_PRIMARY_PARTITIONS; i++) {
+        const uint8_t *entry = &sector[DISK_MBR_PARTITION_TABLE_OFFSET + i * DISK_MBR_PARTITION_ENTRY_SIZE];
+        types[i + 1] = entry[4];
+
+        if (entry[4] == 0x05 || entry[4] == 0x0F || entry[4] == 0x85)
+            extendedStart = util_getUInt32fromBuffer(entry, 8);
+    }
+
+    // Logical partitions: every EBR has the partition in entry 0 and the link to the next EBR in entry 1
+    ebr = extendedStart;
+
+    while (ebr != 0 && logicalIndex <= DISK_MAX_PARTITIONS) {
+        if (pread(fd, sector, sectorSize, (off_t) (ebr * sectorSize)) != (ssize_t) sectorSize)
+            break;
+
+        if (sector[510] != 0x55 || sector[511] != 0xAA)
+            break;
+
+        const uint8_t *entry = &sector[DISK_MBR_PARTITION_TABLE_OFFSET];
+        const uint8_t *next = entry + DISK_MBR_PARTITION_ENTRY_SIZE;
+
+        if (entry[4] != 0x00)
+            types[logicalIndex++] = entry[4];
+
+        uint32_t nextStart = util_getUInt32fromBuffer(next, 8);
+        ebr = (next[4] != 0x00 && nextStart != 0) ? extendedStart + nextStart : 0;
+    }
+}
+
+/* Adds the partitions of a disk from /sys/block/<disk>/<partition>. Their names come from there too,
+   sda1 but nvme0n1p1 and mmcblk0p1. */
+static void util_addPartitionsFromSysfs(util_HardDisk *disk, const char *name, const uint8_t types[DISK_MAX_PARTITIONS + 1]) {
+    char path[DISK_SYSFS_PATH_LENGTH];
+    size_t nameLength = strlen(name);
+    char *names[DISK_MAX_PARTITIONS + 1] = { NULL };
+    uint64_t sizes[DISK_MAX_PARTITIONS + 1] = { 0 };
+    uint64_t offsets[DISK_MAX_PARTITIONS + 1] = { 0 };
+    struct dirent *entry;
+
+    snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s", name);
+
+    DIR *dir = opendir(path);
+
+    if (dir == NULL)
+        return;
+
+    // Collect them first, readdir order is random and we want them sorted by number
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, name, nameLength) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/%s/partition", name, entry->d_name);
+        size_t number = (size_t) util_readSysfsNumber(path);
+
+        if (number == 0 || number > DISK_MAX_PARTITIONS || names[number] != NULL)
+            continue;
+
+        snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/%s/size", name, entry->d_name);
+        sizes[number] = util_readSysfsNumber(path) * 512ULL;    // sysfs sizes are always in 512 byte units
+        snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/%s/start", name, entry->d_name);
+        offsets[number] = util_readSysfsNumber(path) * 512ULL;
+        names[number] = strdup(entry->d_name);
+        QI_ASSERT(names[number] != NULL);
+    }
+
+    closedir(dir);
+
+    for (size_t number = 1; number <= DISK_MAX_PARTITIONS; number++) {
+        char device[UTIL_HDD_DEVICE_STRING_LENGTH];
+
+        if (names[number] == NULL)
+            continue;
+
+        // A name that doesn't fit would be some other device
+        if (snprintf(device, sizeof(device), "/dev/%s", names[number]) < (int) sizeof(device))
+            util_HardDiskAddPartition(disk, device, offsets[number], sizes[number], disk->sectorSize,
+                util_partitionTypeByteToUtilFilesystem(types[number]), number);
+
+        free(names[number]);
+    }
+}
+
+/* Gets a disk from sysfs and the device itself (sector sizes via ioctl, partition types from the partition table) */
+static void util_addHardDiskFromSysfs(util_HardDiskArray *hda, const char *name) {
+    char path[DISK_SYSFS_PATH_LENGTH];
+    char device[UTIL_HDD_DEVICE_STRING_LENGTH];
+    char model[UTIL_HDD_MODEL_STRING_LENGTH] = "";
+    uint8_t types[DISK_MAX_PARTITIONS + 1];
+    int sectorSize = 512;
+    unsigned int optIoSize = 0;
+
+    snprintf(device, sizeof(device), "/dev/%s", name);
+
+    snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/device/model", name);
+    util_readSysfsString(path, model, sizeof(model));
+
+    snprintf(path, sizeof(path), DISK_SYSFS_BLOCK "/%s/size", name);
+    uint64_t size = util_readSysfsNumber(path) * 512ULL;
+
+    memset(types, 0, sizeof(types));
+
+    int fd = open(device, O_RDONLY);
+
+    if (fd >= 0) {
+        if (ioctl(fd, BLKSSZGET, &sectorSize) != 0 || sectorSize <= 0)
+            sectorSize = 512;
+
+        if (ioctl(fd, BLKIOOPT, &optIoSize) != 0)
+            optIoSize = 0;
+
+        util_readPartitionTypes(fd, (uint32_t) sectorSize, types);
+        close(fd);
+    }
+
+    util_HardDisk *disk = util_HardDiskArrayAppend(hda, device, model, size, (uint32_t) sectorSize, (uint32_t) optIoSize);
+    util_addPartitionsFromSysfs(disk, name, types);
+}
+
+/* Gets a hash of /proc/partitions. The kernel updates it whenever a disk shows up or goes away
+   or a partition table is read again, so if it's the same, our disk list is still good. */
+static uint32_t util_getPartitionListFingerprint(void) {
+    uint8_t buf[1024];
+    uint32_t hash = 2166136261U;    // FNV-1a
+    ssize_t len;
+    int fd = open(DISK_PROC_PARTITIONS, O_RDONLY);
+
+    if (fd < 0)
+        return 0;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < len; i++) {
+            hash = (hash ^ buf[i]) * 16777619U;
+        }
+    }
+
+    close(fd);
+    return hash;
+}
+
+bool util_hardDiskArrayIsCurrent(const util_HardDiskArray *hdds) {
+    return hdds != NULL && !hdds->stale && hdds->fingerprint == util_getPartitionListFingerprint();
+}
+
+void util_hardDiskArrayInvalidate(util_HardDiskArray *hdds) {
+    if (hdds != NULL)
+        hdds->stale = true;
+}
+
 util_HardDiskArray *util_getSystemHardDisks() {
     util_HardDiskArray *ret = calloc(1, sizeof(util_HardDiskArray));
+    char *names[256];
+    size_t nameCount = 0;
+    struct dirent *entry;
 
     QI_ASSERT(ret != NULL);
 
-    // Get disk models
-    util_CommandOutput *lsblkOut = util_commandOutputCapture(CMD_LSBLK_ALL);
+    ret->fingerprint = util_getPartitionListFingerprint();
 
-    QI_ASSERT(lsblkOut != NULL);
+    DIR *dir = opendir(DISK_SYSFS_BLOCK);
 
-    if (lsblkOut->lineCount == 0) {
-        util_commandOutputDestroy(lsblkOut);
+    if (dir == NULL)
         return ret;
-    }
 
-    util_HardDisk *currentDisk = NULL;
-
-    for (size_t i = 0; i < lsblkOut->lineCount; ++i) {
-        char tmpType        [4+1] = "";
-        char tmpDevice      [UTIL_HDD_DEVICE_STRING_LENGTH];
-        char tmpModel       [UTIL_HDD_MODEL_STRING_LENGTH];
-        char tmpNumStr      [64+1] = "";
-        bool success = true;
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "TYPE", tmpType, sizeof(tmpType));
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "KNAME", tmpDevice, sizeof(tmpDevice));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "MODEL", tmpModel, sizeof(tmpModel));
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "PARTTYPE", tmpNumStr, sizeof(tmpNumStr));
-        util_FileSystem tmpFileSystem = util_partitionTypeByteToUtilFilesystem(strtoul(tmpNumStr, NULL, 16));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "SIZE", tmpNumStr, sizeof(tmpNumStr));
-        uint64_t tmpSize = strtoull(tmpNumStr, NULL, 10);
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "MIN-IO", tmpNumStr, sizeof(tmpNumStr));
-        uint32_t tmpSectorSize = strtoull(tmpNumStr, NULL, 10);
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "OPT-IO", tmpNumStr, sizeof(tmpNumStr));
-        uint32_t tmpOptIoSize = strtoull(tmpNumStr, NULL, 10);
-
-        if (util_stringEquals(tmpType, "disk")) {
-            /* This is a hard disk. */
-            currentDisk = util_HardDiskArrayAppend(ret, tmpDevice, tmpModel, tmpSize, tmpSectorSize, tmpOptIoSize);
-        } else if (util_stringEquals(tmpType, "part")) {
-            /* This is a partition. */
-            QI_ASSERT(currentDisk != NULL);
-            
-            /* The beginning of the device name must match the parent disk's as a child partition of that disk. */
-            QI_ASSERT(util_stringStartsWith(tmpDevice, currentDisk->device) == true);
-
-            size_t index = (size_t) atoi(tmpDevice + strlen(currentDisk->device));   // so for example "/dev/sda1" would have atoi called on the "1" part
-            util_HardDiskAddPartition(currentDisk,tmpDevice, tmpSize, tmpSectorSize, tmpFileSystem, index);
-        } else {
-            /* Tape streamer or other weird thing, not of interest for us... */
+    while ((entry = readdir(dir)) != NULL && nameCount < util_arraySize(names)) {
+        if (entry->d_name[0] == '.' || !util_isSysfsHardDisk(entry->d_name))
             continue;
-        }
+
+        names[nameCount] = strdup(entry->d_name);
+        QI_ASSERT(names[nameCount] != NULL);
+        nameCount++;
+    }
+
+    closedir(dir);
+
+    // Same order as the kernel named them
+    qsort(names, nameCount, sizeof(char *), util_compareStrings);
+
+    for (size_t i = 0; i < nameCount; i++) {
+        util_addHardDiskFromSysfs(ret, names[i]);
+        free(names[i]);
     }
 
-    util_commandOutputDestroy(lsblkOut);
     return ret;
 }
 
@@ -239,16 +403,26 @@ const char *util_shortDeviceString(const char *str) {
 }
 
 // mounts a disk under a special name, i.e. /dev/sda1 will be mounted at /dev_sda1
-bool util_mountPartition(util_Partition *part) {
+// Same as the kernel defaults (CONFIG_FAT_DEFAULT_*), given explicitly so nothing has to be looked up by name.
+// iso8859-1 is a plain table lookup, much cheaper than utf8 for every file name.
+#define DISK_VFAT_OPTIONS "codepage=437,iocharset=iso8859-1"
+
+static unsigned long util_getMountFlags(util_MountProfile profile) {
+    // vfat never writes directory access times anyway. No "flush" option either, that would write every file out when it's closed.
+    return profile == UTIL_MOUNT_BULK_INSTALL ? (MS_NOATIME | MS_NODIRATIME) : 0;
+}
+
+bool util_mountPartition(util_Partition *part, util_MountProfile profile) {
+    // Can still be mounted from an earlier attempt, the disk list is kept around
+    if (part->mountPath != NULL)
+        return util_remountPartition(part, profile);
+
     char *mountPath = strdup(part->device);
     assert(mountPath && strlen(mountPath) > 1);
     util_stringReplaceChar(&mountPath[1], '/', '_'); // Ignore initial '/' character
     mkdir(mountPath, 0777);
-    
 
-    char mountCmd[1024];
-    snprintf(mountCmd, sizeof(mountCmd), "mount -t vfat %s %s" CMD_SURPRESS_OUTPUT, part->device, mountPath);
-    if (system(mountCmd) == 0) {
+    if (mount(part->device, mountPath, "vfat", util_getMountFlags(profile), DISK_VFAT_OPTIONS) == 0) {
         part->mountPath = mountPath;
         return true;
     } else {
@@ -258,13 +432,20 @@ bool util_mountPartition(util_Partition *part) {
     }
 }
 
+bool util_remountPartition(util_Partition *part, util_MountProfile profile) {
+    if (part->mountPath == NULL)
+        return false;
+
+    // vfat can't change its options on a remount, only the flags change
+    return mount(part->device, part->mountPath, "vfat", MS_REMOUNT | util_getMountFlags(profile), NULL) == 0;
+}
+
 bool util_unmountPartition(util_Partition *part) {
     if (part->mountPath != NULL) {
-        char mountCmd[1024];
-        snprintf(mountCmd, sizeof(mountCmd), "umount %s" CMD_SURPRESS_OUTPUT, part->mountPath);
+        bool success = (umount(part->mountPath) == 0);
         free(part->mountPath);
         part->mountPath = NULL;
-        return (system(mountCmd) == 0);
+        return success;
     } else {
         return true;
     }
@@ -297,26 +478,28 @@ util_Partition *util_getPartitionFromIndex(util_HardDiskArray *hdds, size_t inde
     return NULL;
 }
 
-// Reads bytes from a file descriptor in a loop until all of them are read
-static bool util_readFromFD(int fd, uint8_t *buf, size_t length) {    
+// Reads bytes at an offset from a file descriptor in a loop until all of them are read
+static bool util_readFromFD(int fd, uint8_t *buf, size_t length, off_t offset) {
     ssize_t bytesRead;
     while (length) {
-        bytesRead = read(fd, buf, length);
-        if (bytesRead < 0) return false;
+        bytesRead = pread(fd, buf, length, offset);
+        if (bytesRead <= 0) return false;
         length -= bytesRead;
-        buf += bytesRead;        
+        buf += bytesRead;
+        offset += bytesRead;
     }
     return true;
 }
 
-// Writes bytes to a file descriptor in a loop until all of them are read
-static bool util_writeToFD(int fd, const uint8_t *buf, size_t length) {    
+// Writes bytes at an offset to a file descriptor in a loop until all of them are written
+static bool util_writeToFD(int fd, const uint8_t *buf, size_t length, off_t offset) {
     ssize_t bytesWritten;
     while (length) {
-        bytesWritten = write(fd, buf, length);
-        if (bytesWritten < 0) return false;
+        bytesWritten = pwrite(fd, buf, length, offset);
+        if (bytesWritten <= 0) return false;
         length -= bytesWritten;
-        buf += bytesWritten;        
+        buf += bytesWritten;
+        offset += bytesWritten;
     }
     return true;
 }
@@ -326,9 +509,7 @@ static bool util_readSector(char *dev, size_t sector, size_t ioSize, uint8_t *bu
     int disk = open(dev, O_RDONLY);
     if (disk < 0) return false;
 
-    size_t offset = ioSize * sector;
-    lseek(disk, offset, SEEK_SET);
-    bool result = util_readFromFD(disk, buf, ioSize);
+    bool result = util_readFromFD(disk, buf, ioSize, (off_t) ioSize * sector);
     close(disk);
     return result;
 }
@@ -346,13 +527,10 @@ static uint8_t *util_readSectorAllocate(char *dev, size_t sector, size_t ioSize)
 
 // Write a sector to a device
 static bool util_writeSector(char *dev, size_t sector, size_t ioSize, const uint8_t *buf) {
-
     int disk = open(dev, O_WRONLY);
-    if (!disk) return false;
+    if (disk < 0) return false;
 
-    size_t offset = ioSize * sector;
-    lseek(disk, offset, SEEK_SET);
-    bool result = util_writeToFD(disk, buf, ioSize);
+    bool result = util_writeToFD(disk, buf, ioSize, (off_t) ioSize * sector);
     close(disk);
     return result;
 }
@@ -381,95 +559,250 @@ uint8_t *util_readSectorFromPartitionAllocate(util_Partition *part, size_t secto
     return util_readSectorAllocate(part->device, sector, part->sectorSize);
 }
 
-#include "mbr_boot_win98.h"
+bool util_sectorSessionOpen(util_SectorSession *session, util_HardDisk *hdd) {
+    QI_ASSERT(session != NULL);
+    QI_ASSERT(hdd != NULL);
 
-bool util_writeWin98MBRToDrive(util_HardDisk *hdd) {
-    // Read existing MBR first
-    uint8_t *existingMBR = util_readSectorFromDiskAllocate(hdd, 0);
-    if (!existingMBR) return false;
+    memset(session, 0, sizeof(util_SectorSession));
 
-    // Overwrite the start with the win98 MBR code
-    memcpy(existingMBR, __MBR_WIN98__, DISK_MBR_CODE_LENGTH);
+    session->fd = open(hdd->device, O_RDWR);
+    session->sectorSize = hdd->sectorSize;
 
-    // write it back to the disk
-    bool result = util_writeSectorToDisk(hdd, 0, existingMBR);
-    free(existingMBR);
-    return result;
+    return session->fd >= 0;
 }
 
-static bool util_modifyBootSector(util_Partition *part, util_BootSectorModifierList modifierList) {
-    uint8_t *sector = NULL;
-    size_t oldSectorIndex = 0;
-    bool success = true;
-    for (size_t i = 0; i < modifierList.count; i++) {
-        util_BootSectorModifier mod = modifierList.modifiers[i];
-        // New sector index found in the list = we need to write previous sector and free its databuffer
-        if (sector && (mod.sectorIndex != oldSectorIndex)) {
-            success = util_writeSectorToPartition(part, oldSectorIndex, sector);
-            free (sector);
-            sector = NULL;
+size_t util_sectorSessionPartitionSector(const util_SectorSession *session, const util_Partition *part, size_t sector) {
+    return (size_t) (part->offset / session->sectorSize) + sector;
+}
+
+bool util_sectorSessionRead(util_SectorSession *session, size_t sector, size_t count, uint8_t *buf) {
+    QI_ASSERT(session->fd >= 0);
+
+    if (!util_readFromFD(session->fd, buf, count * session->sectorSize, (off_t) sector * session->sectorSize))
+        return false;
+
+    // Anything queued but not written yet is newer than what is on the disk
+    for (size_t i = 0; i < session->pendingCount; i++) {
+        util_SectorSessionWrite *w = &session->pending[i];
+        if (w->sector >= sector && w->sector < sector + count) {
+            memcpy(buf + (w->sector - sector) * session->sectorSize, w->data, session->sectorSize);
         }
-        
-        // printf("%d %d %d %d\n", i, (int) mod.sectorIndex, (int) mod.offset, (int) mod.length);
-        // util_hexDump(mod.replacementData, 0, mod.length);
-
-        // If we need to read a new sector
-        if (sector == NULL) {
-            sector = util_readSectorFromPartitionAllocate(part, mod.sectorIndex);
-            oldSectorIndex = mod.sectorIndex;
-            success &= (sector != NULL);
+    }
+
+    return true;
+}
+
+bool util_sectorSessionWrite(util_SectorSession *session, size_t sector, size_t count, const uint8_t *buf) {
+    QI_ASSERT(session->fd >= 0);
+
+    for (size_t s = 0; s < count; s++, sector++, buf += session->sectorSize) {
+        util_SectorSessionWrite *w = NULL;
+
+        // Writing the same sector twice only keeps the last one
+        for (size_t i = 0; i < session->pendingCount && w == NULL; i++) {
+            if (session->pending[i].sector == sector) w = &session->pending[i];
         }
 
-        assert(success && "modifyBootSector failed");
+        if (w == NULL) {
+            if (session->pendingCount == UTIL_SECTOR_SESSION_MAX_PENDING)
+                return false;
 
-        if (!success) {
-            free(sector);
-            return false;
+            w = &session->pending[session->pendingCount];
+            w->data = malloc(session->sectorSize);
+
+            if (w->data == NULL)
+                return false;
+
+            w->sector = sector;
+            session->pendingCount++;
         }
 
-        // Copy the replacement data therefore injecting the boot sector code
+        memcpy(w->data, buf, session->sectorSize);
+    }
+
+    return true;
+}
+
+static int util_sectorSessionCompareWrites(const void *a, const void *b) {
+    size_t sa = ((const util_SectorSessionWrite *) a)->sector;
+    size_t sb = ((const util_SectorSessionWrite *) b)->sector;
+    return (sa > sb) - (sa < sb);
+}
 
-        memcpy(sector + mod.offset, mod.replacementData, mod.length);
+// Writes all queued sectors, every run of contiguous sectors with one pwritev
+static bool util_sectorSessionWritePending(util_SectorSession *session) {
+    struct iovec iov[UTIL_SECTOR_SESSION_MAX_PENDING];
+    bool success = true;
+    size_t i = 0;
+
+    qsort(session->pending, session->pendingCount, sizeof(util_SectorSessionWrite), util_sectorSessionCompareWrites);
+
+    while (i < session->pendingCount) {
+        size_t runStart = i;
+        size_t count = 0;
+
+        do {
+            iov[count].iov_base = session->pending[i].data;
+            iov[count].iov_len = session->sectorSize;
+            count++;
+            i++;
+        } while (i < session->pendingCount && session->pending[i].sector == session->pending[i - 1].sector + 1);
+
+        off_t offset = (off_t) session->pending[runStart].sector * session->sectorSize;
+        ssize_t expected = (ssize_t) (count * session->sectorSize);
+        ssize_t written = pwritev(session->fd, iov, (int) count, offset);
+
+        // Short write, unlikely on a block device. Do the rest sector by sector.
+        if (written >= 0 && written < expected) {
+            for (size_t s = (size_t) written / session->sectorSize; s < count; s++) {
+                success &= util_writeToFD(session->fd, iov[s].iov_base, session->sectorSize, offset + (off_t) (s * session->sectorSize));
+            }
+        } else {
+            success &= (written == expected);
+        }
     }
 
-    // If there is a pending sector write left, execute it now
-    if (sector) {
-        success = util_writeSectorToPartition(part, oldSectorIndex, sector);
-        free(sector);
+    return success;
+}
+
+bool util_sectorSessionClose(util_SectorSession *session, bool commit) {
+    bool success = true;
+
+    if (session->fd >= 0 && commit && session->pendingCount > 0) {
+        success = util_sectorSessionWritePending(session);
+        success &= (fsync(session->fd) == 0);
+    }
+
+    for (size_t i = 0; i < session->pendingCount; i++) {
+        free(session->pending[i].data);
     }
 
+    if (session->fd >= 0)
+        close(session->fd);
+
+    session->fd = -1;
+    session->pendingCount = 0;
     return success;
 }
 
-bool util_writeWin98BootSectorToPartition(util_Partition *part) {
+#include "mbr_boot_win98.h"
+
+// Puts the Win98 MBR code into the MBR, keeping the partition table. Optionally marks one primary partition active,
+// fails if activeIndex isn't one of them.
+static bool util_queueWin98MBR(util_SectorSession *session, size_t activeIndex) {
+    if (activeIndex > DISK_MBR_PRIMARY_PARTITIONS)
+        return false;
+
+    uint8_t *mbr = malloc(session->sectorSize);
+    bool success = (mbr != NULL) && util_sectorSessionRead(session, 0, 1, mbr);
+
+    if (success) {
+        memcpy(mbr, __MBR_WIN98__, DISK_MBR_CODE_LENGTH);
+
+        // Same as sfdisk --activate: the given partition gets the boot flag, all others lose it
+        if (activeIndex > 0) {
+            for (size_t i = 0; i < DISK_MBR_PRIMARY_PARTITIONS; i++) {
+                mbr[DISK_MBR_PARTITION_TABLE_OFFSET + i * DISK_MBR_PARTITION_ENTRY_SIZE] = (i + 1 == activeIndex) ? 0x80 : 0x00;
+            }
+        }
+
+        success = util_sectorSessionWrite(session, 0, 1, mbr);
+    }
+
+    free(mbr);
+    return success;
+}
+
+// Reads the partition's boot sectors (and FSInfo on FAT32) in one go, injects the boot code and queues them,
+// plus the FAT32 backup copy. Nothing is written until the session is closed.
+static bool util_queueWin98BootSector(util_SectorSession *session, util_Partition *part) {
     // Fat16 only has one boot sector and smaller BPB, so we need to use a different, simpler modification list for it
-    util_BootSectorModifierList bsModifierList = part->fileSystem == fs_fat16 ? __WIN98_FAT16_BOOT_SECTOR_MODIFIER_LIST__ 
-                                                                              : __WIN98_FAT32_BOOT_SECTOR_MODIFIER_LIST__;
-    bool result = util_modifyBootSector(part, bsModifierList);
-
-    if (result && part->fileSystem == fs_fat32) {
-        // Copy sectors to backup now (FAT32 only, FAT16 has no backup it seems, at least not on Win9x)
-        size_t backupSectorIndex = 0;
-
-        for (size_t i = 0; i < 3; i++) {
-            uint8_t *sector = util_readSectorFromPartitionAllocate(part, i);
-            assert(sector);
-            // Get backup sector index
-            if (i == 0) backupSectorIndex = (size_t) util_getUInt16fromBuffer(sector, 0x32);
-
-            // Write sector to backup location
-            result &= util_writeSectorToPartition(part, i + backupSectorIndex, sector);
-            free(sector);
+    util_BootSectorModifierList modifierList = part->fileSystem == fs_fat16 ? __WIN98_FAT16_BOOT_SECTOR_MODIFIER_LIST__
+                                                                            : __WIN98_FAT32_BOOT_SECTOR_MODIFIER_LIST__;
+    // FAT32 keeps a backup of the first 3 sectors (FAT16 has no backup it seems, at least not on Win9x)
+    size_t sectorCount = part->fileSystem == fs_fat32 ? 3 : 1;
+    size_t first = util_sectorSessionPartitionSector(session, part, 0);
+
+    for (size_t i = 0; i < modifierList.count; i++) {
+        sectorCount = MAX(sectorCount, modifierList.modifiers[i].sectorIndex + 1);
+    }
+
+    uint8_t *sectors = malloc(sectorCount * session->sectorSize);
+    bool success = (sectors != NULL) && util_sectorSessionRead(session, first, sectorCount, sectors);
+
+    assert(success && "modifyBootSector failed");
+
+    if (success) {
+        for (size_t i = 0; i < modifierList.count; i++) {
+            const util_BootSectorModifier *mod = &modifierList.modifiers[i];
+            // Copy the replacement data therefore injecting the boot sector code
+            memcpy(sectors + mod->sectorIndex * session->sectorSize + mod->offset, mod->replacementData, mod->length);
         }
+
+        success = util_sectorSessionWrite(session, first, sectorCount, sectors);
     }
 
-    return result;
+    if (success && part->fileSystem == fs_fat32) {
+        size_t backupSectorIndex = (size_t) util_getUInt16fromBuffer(sectors, 0x32);
+        success = util_sectorSessionWrite(session, first + backupSectorIndex, 3, sectors);
+    }
+
+    free(sectors);
+    return success;
+}
+
+bool util_writeWin98MBRToDrive(util_HardDisk *hdd) {
+    util_SectorSession session;
+
+    if (!util_sectorSessionOpen(&session, hdd)) {
+        util_sectorSessionClose(&session, false);
+        return false;
+    }
+
+    bool success = util_queueWin98MBR(&session, 0);
+    success &= util_sectorSessionClose(&session, success);
+    return success;
+}
+
+bool util_writeWin98BootSectorToPartition(util_Partition *part) {
+    return util_writeWin98BootRecords(part, false);
+}
+
+bool util_writeWin98BootRecords(util_Partition *part, bool mbrAndActive) {
+    util_SectorSession session;
+
+    if (!util_sectorSessionOpen(&session, part->parent)) {
+        util_sectorSessionClose(&session, false);
+        return false;
+    }
+
+    bool success = util_queueWin98BootSector(&session, part);
+
+    if (success && mbrAndActive) {
+        success = util_queueWin98MBR(&session, part->indexOnParent);
+    }
+
+    // All of it goes out with a single flush, or nothing does
+    success &= util_sectorSessionClose(&session, success);
+
+    // We went through the disk device, make sure nobody sees stale boot sectors through the partition device
+    int fd = open(part->device, O_RDONLY);
+    if (fd >= 0) {
+        ioctl(fd, BLKFLSBUF, 0);
+        close(fd);
+    }
+
+    return success;
 }
 
 bool util_isPartitionMounted(util_Partition *part) {
     return (part->mountPath != NULL);
 }
 
+bool util_isPrimaryPartition(const util_Partition *part) {
+    return part->indexOnParent >= 1 && part->indexOnParent <= DISK_MBR_PRIMARY_PARTITIONS;
+}
+
 bool util_getFormatCommand(util_Partition *part, util_FileSystem fs, char *buf, size_t bufSize) {
     assert(part);
     if (util_isPartitionMounted(part)) {
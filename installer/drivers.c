@@ -0,0 +1,341 @@
+/*
+ * LUNMERCY - Picking the drivers for the hardware of this machine
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "drivers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define DRIVERS_LINE_LENGTH (512)       // Keyword + MercyPak path (255 chars max)
+#define DRIVERS_ID_LENGTH (64)
+#define DRIVERS_PATH_LENGTH (512)
+#define DRIVERS_PCI_REVISION_OFFSET (8) // In the config space, for kernels without the revision file
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} drivers_StringList;
+
+typedef struct {
+    bool detectable;            // Has PCI IDs, otherwise it's always installed
+    bool matched;               // One of them is one of the devices here
+} drivers_Driver;
+
+typedef struct {
+    char *path;
+    size_t driver;
+} drivers_File;
+
+struct drivers_Selection {
+    drivers_StringList leftOut; // Files only used by drivers that aren't installed, sorted without case
+    size_t driverCount;
+    size_t selectedCount;
+    size_t deviceCount;
+};
+
+static void drivers_addString(drivers_StringList *list, const char *str) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(char *));
+        QI_ASSERT(list->items);
+    }
+
+    list->items[list->count] = strdup(str);
+    QI_ASSERT(list->items[list->count]);
+    list->count++;
+}
+
+static void drivers_freeStrings(drivers_StringList *list) {
+    for (size_t i = 0; i < list->count; i++)
+        free(list->items[i]);
+
+    free(list->items);
+    memset(list, 0, sizeof(drivers_StringList));
+}
+
+static int drivers_compareStrings(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+static int drivers_comparePaths(const void *a, const void *b) {
+    return strcasecmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+static int drivers_compareFiles(const void *a, const void *b) {
+    return strcasecmp(((const drivers_File *) a)->path, ((const drivers_File *) b)->path);
+}
+
+/* Reads a hex value from a sysfs file of a device, e.g. "0x8086" */
+static bool drivers_readHex(const char *devicePath, const char *name, unsigned long *value) {
+    char path[DRIVERS_PATH_LENGTH + 32];
+    char line[32] = {0};
+    char *end;
+
+    snprintf(path, sizeof(path), "%s/%s", devicePath, name);
+
+    if (!util_readFirstLineFromFileIntoBuffer(path, line, sizeof(line)))
+        return false;
+
+    *value = strtoul(line, &end, 16);
+    return end != line;
+}
+
+static bool drivers_readRevision(const char *devicePath, unsigned long *revision) {
+    char path[DRIVERS_PATH_LENGTH + 32];
+    uint8_t value;
+
+    if (drivers_readHex(devicePath, "revision", revision))
+        return true;
+
+    snprintf(path, sizeof(path), "%s/config", devicePath);
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    bool success = pread(fd, &value, 1, DRIVERS_PCI_REVISION_OFFSET) == 1;
+    close(fd);
+
+    *revision = value;
+    return success;
+}
+
+/* Adds the hardware IDs Windows makes for a PCI device, from the most to the least specific one */
+static void drivers_addDeviceIds(drivers_StringList *ids, unsigned long vendor, unsigned long device, unsigned long subsystem,
+                                 unsigned long classCode, unsigned long revision, bool haveRevision) {
+    char id[DRIVERS_ID_LENGTH];
+    unsigned long baseClass = classCode >> 8;
+
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX&SUBSYS_%08lX", vendor, device, subsystem);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX", vendor, device);
+    drivers_addString(ids, id);
+
+    if (haveRevision) {
+        snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX&SUBSYS_%08lX&REV_%02lX", vendor, device, subsystem, revision);
+        drivers_addString(ids, id);
+        snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX&REV_%02lX", vendor, device, revision);
+        drivers_addString(ids, id);
+    }
+
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX&CC_%06lX", vendor, device, classCode);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&DEV_%04lX&CC_%04lX", vendor, device, baseClass);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&CC_%06lX", vendor, classCode);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX&CC_%04lX", vendor, baseClass);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\VEN_%04lX", vendor);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\CC_%06lX", classCode);
+    drivers_addString(ids, id);
+    snprintf(id, sizeof(id), "PCI\\CC_%04lX", baseClass);
+    drivers_addString(ids, id);
+}
+
+/* Gets the hardware IDs of all PCI devices below pciDevicesPath into ids, sorted. Returns the number of devices. */
+static size_t drivers_scanDevices(const char *pciDevicesPath, drivers_StringList *ids) {
+    DIR *dir = opendir(pciDevicesPath);
+    struct dirent *entry;
+    size_t devices = 0;
+
+    if (dir == NULL)
+        return 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char devicePath[DRIVERS_PATH_LENGTH];
+        unsigned long vendor, device, classCode;
+        unsigned long revision = 0;
+        unsigned long subsystemVendor = 0;
+        unsigned long subsystemDevice = 0;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        snprintf(devicePath, sizeof(devicePath), "%s/%s", pciDevicesPath, entry->d_name);
+
+        if (!drivers_readHex(devicePath, "vendor", &vendor) || !drivers_readHex(devicePath, "device", &device)
+         || !drivers_readHex(devicePath, "class", &classCode))
+            continue;
+
+        // Not every device has these, Windows makes SUBSYS_00000000 then
+        drivers_readHex(devicePath, "subsystem_vendor", &subsystemVendor);
+        drivers_readHex(devicePath, "subsystem_device", &subsystemDevice);
+
+        bool haveRevision = drivers_readRevision(devicePath, &revision);
+
+        drivers_addDeviceIds(ids, vendor & 0xffff, device & 0xffff, ((subsystemDevice & 0xffff) << 16) | (subsystemVendor & 0xffff),
+                             classCode & 0xffffff, revision & 0xff, haveRevision);
+        devices++;
+    }
+
+    closedir(dir);
+
+    if (ids->count > 0)
+        qsort(ids->items, ids->count, sizeof(char *), drivers_compareStrings);
+
+    return devices;
+}
+
+/* Reads the index, the files of every driver go into files. Returns false if it can't be read. */
+static bool drivers_readIndex(const char *indexFile, const drivers_StringList *ids, drivers_Driver **drivers, size_t *driverCount,
+                              drivers_File **files, size_t *fileCount) {
+    FILE *f = fopen(indexFile, "r");
+    char line[DRIVERS_LINE_LENGTH];
+    size_t driverCapacity = 0;
+    size_t fileCapacity = 0;
+
+    if (f == NULL)
+        return false;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *end = util_endOfString(line);
+
+        while (end > line && isspace((unsigned char) end[-1]))
+            *--end = 0x00;
+
+        char *value = strchr(line, ' ');
+
+        if (value == NULL)
+            continue;
+
+        *value++ = 0x00;
+
+        if (util_stringEquals(line, "driver")) {
+            if (*driverCount == driverCapacity) {
+                driverCapacity = driverCapacity ? driverCapacity * 2 : 64;
+                *drivers = realloc(*drivers, driverCapacity * sizeof(drivers_Driver));
+                QI_ASSERT(*drivers);
+            }
+
+            (*drivers)[(*driverCount)++] = (drivers_Driver) { false, false };
+        } else if (util_stringEquals(line, "id") && *driverCount > 0) {
+            char *id = value;
+
+            for (char *c = id; *c; c++)
+                *c = (char) toupper((unsigned char) *c);
+
+            (*drivers)[*driverCount - 1].detectable = true;
+
+            if (bsearch(&id, ids->items, ids->count, sizeof(char *), drivers_compareStrings) != NULL)
+                (*drivers)[*driverCount - 1].matched = true;
+
+            continue;
+        } else if (!util_stringEquals(line, "file") || *driverCount == 0) {
+            continue;
+        }
+
+        // "driver" names its INF, that's one of its files too
+        if (*fileCount == fileCapacity) {
+            fileCapacity = fileCapacity ? fileCapacity * 2 : 128;
+            *files = realloc(*files, fileCapacity * sizeof(drivers_File));
+            QI_ASSERT(*files);
+        }
+
+        (*files)[*fileCount].path = strdup(value);
+        (*files)[*fileCount].driver = *driverCount - 1;
+        QI_ASSERT((*files)[*fileCount].path);
+        (*fileCount)++;
+    }
+
+    fclose(f);
+    return true;
+}
+
+drivers_Selection *drivers_select(const char *indexFile, const char *pciDevicesPath) {
+    QI_ASSERT(indexFile != NULL && pciDevicesPath != NULL);
+
+    drivers_StringList ids = { 0 };
+    drivers_Driver *drivers = NULL;
+    drivers_File *files = NULL;
+    size_t driverCount = 0;
+    size_t fileCount = 0;
+    size_t deviceCount = drivers_scanDevices(pciDevicesPath, &ids);
+
+    // Without any devices something is off, better install everything
+    if (deviceCount == 0 || !drivers_readIndex(indexFile, &ids, &drivers, &driverCount, &files, &fileCount)) {
+        drivers_freeStrings(&ids);
+        return NULL;
+    }
+
+    drivers_freeStrings(&ids);
+
+    drivers_Selection *selection = calloc(1, sizeof(drivers_Selection));
+    QI_ASSERT(selection);
+
+    selection->driverCount = driverCount;
+    selection->deviceCount = deviceCount;
+
+    for (size_t i = 0; i < driverCount; i++)
+        selection->selectedCount += (!drivers[i].detectable || drivers[i].matched) ? 1 : 0;
+
+    // A file is only left out if every driver it belongs to is (drivers can share CABs)
+    if (fileCount > 0)
+        qsort(files, fileCount, sizeof(drivers_File), drivers_compareFiles);
+
+    for (size_t i = 0; i < fileCount; ) {
+        size_t next = i;
+        bool needed = false;
+
+        while (next < fileCount && strcasecmp(files[next].path, files[i].path) == 0) {
+            const drivers_Driver *driver = &drivers[files[next].driver];
+            needed = needed || !driver->detectable || driver->matched;
+            next++;
+        }
+
+        if (!needed)
+            drivers_addString(&selection->leftOut, files[i].path);
+
+        i = next;
+    }
+
+    for (size_t i = 0; i < fileCount; i++)
+        free(files[i].path);
+
+    free(files);
+    free(drivers);
+
+    return selection;
+}
+
+void drivers_destroy(drivers_Selection *selection) {
+    if (selection == NULL)
+        return;
+
+    drivers_freeStrings(&selection->leftOut);
+    free(selection);
+}
+
+bool drivers_wantFile(const drivers_Selection *selection, const char *path) {
+    QI_ASSERT(selection != NULL && path != NULL);
+
+    if (selection->leftOut.count == 0)
+        return true;
+
+    return bsearch(&path, selection->leftOut.items, selection->leftOut.count, sizeof(char *), drivers_comparePaths) == NULL;
+}
+
+size_t drivers_getCount(const drivers_Selection *selection) {
+    return selection->driverCount;
+}
+
+size_t drivers_getSelectedCount(const drivers_Selection *selection) {
+    return selection->selectedCount;
+}
+
+size_t drivers_getDeviceCount(const drivers_Selection *selection) {
+    return selection->deviceCount;
+}
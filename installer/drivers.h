@@ -0,0 +1,38 @@
+#ifndef DRIVERS_H
+#define DRIVERS_H
+
+/*
+ * LUNMERCY - Picking the drivers for the hardware of this machine
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * The driver library (DRIVER.866) has drivers for a lot of hardware, a given machine needs a handful of them.
+ * sysprep writes an index of which files in it belong to which driver and the PCI IDs every driver is for
+ * (drivers.txt, see sysprep/driverindex.py).
+ *
+ * The PCI devices of this machine are read from sysfs and turned into the hardware IDs Windows would make for them
+ * (PCI\VEN_xxxx&DEV_xxxx&SUBSYS_xxxxxxxx&REV_xx down to PCI\CC_xxxx). Drivers for any of those are installed, and so
+ * is everything the installer can't detect: drivers without PCI IDs (ISA PnP, ACPI, USB, ...) and files that don't
+ * belong to any driver. The rest is left out, its data is skipped in the pack.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DRIVERS_PCI_DEVICES_PATH "/sys/bus/pci/devices"
+
+typedef struct drivers_Selection drivers_Selection;
+
+// Reads the driver index and the PCI devices below pciDevicesPath (usually DRIVERS_PCI_DEVICES_PATH) and picks the
+// drivers for them. Returns NULL if the index can't be read or no PCI devices were found.
+drivers_Selection *drivers_select(const char *indexFile, const char *pciDevicesPath);
+// Frees a selection
+void drivers_destroy(drivers_Selection *selection);
+// Checks if a file of the driver pack is needed, path is relative to the pack with '/' as separator
+bool drivers_wantFile(const drivers_Selection *selection, const char *path);
+// Gets how many drivers are in the index and how many of them are installed
+size_t drivers_getCount(const drivers_Selection *selection);
+size_t drivers_getSelectedCount(const drivers_Selection *selection);
+// Gets how many PCI devices were found
+size_t drivers_getDeviceCount(const drivers_Selection *selection);
+
+#endif
@@ -0,0 +1,462 @@
+/*
+ * LUNMERCY - Writing the same files to several install targets at once
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "fanout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "qi_assert.h"
+#include "trace.h"
+#include "util.h"
+
+#define FANOUT_CHUNK_SIZE (256 * 1024)  // Most file data in one queue entry
+#define FANOUT_IDLE_SLEEP_US (1000)     // Our kernel has no futexes, so waiting is polling. Sleeping a bit instead
+                                        // of sched_yield() leaves the CPU to the threads that have work to do.
+
+typedef enum {
+    FANOUT_OP_HEAD = 0,     // Start of the queue, part of the writer, never freed
+    FANOUT_OP_MKDIR,
+    FANOUT_OP_OPEN,
+    FANOUT_OP_DATA,
+    FANOUT_OP_CLOSE,
+    FANOUT_OP_STOP,
+} fanout_OpType;
+
+typedef struct fanout_Op {
+    struct fanout_Op *next;
+    fanout_OpType type;
+    size_t pending;         // Targets that aren't done with this entry yet
+    size_t size;            // Memory it takes up
+    size_t length;          // Bytes of file data
+    uint32_t mode;
+    uint8_t attributes;
+    uint16_t dosDate;
+    uint16_t dosTime;
+    uint8_t data[];         // The path (0-terminated) or the file data
+} fanout_Op;
+
+// A file a target has open, with what has to be set when it's closed
+typedef struct {
+    int fd;
+    uint8_t attributes;
+    uint16_t dosDate;
+    uint16_t dosTime;
+} fanout_OpenFile;
+
+typedef struct {
+    struct fanout_Writer *writer;
+    size_t index;
+    pthread_t thread;
+    char *path;             // Install path + room for the path of the current file / dir
+    char *pathAppend;
+    bool failed;            // Gave up on this one
+    bool errors;            // Something went wrong that doesn't stop the install, like with mercypak.c (metadata, mkdir)
+    size_t openCount;
+    fanout_OpenFile open[FANOUT_MAX_OPEN_FILES];
+    mercypak_Stats stats;
+} fanout_Target;
+
+struct fanout_Writer {
+    pthread_mutex_t lock;
+    fanout_Op *head;
+    fanout_Op *last;        // Newest entry, only touched by the extracting thread
+    size_t bufferSize;
+    size_t queued;          // Memory taken up by entries that not all targets are done with
+    size_t running;         // Targets with a writer thread
+    size_t failed;
+    size_t openFiles;       // Just to check the caller
+    uint64_t queueWaits;
+    uint64_t queueWaitMicroseconds;
+    fanout_Target targets[FANOUT_MAX_TARGETS];
+};
+
+static inline void fanout_lock(fanout_Writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+}
+
+static inline void fanout_unlock(fanout_Writer *writer) {
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static inline trace_Track fanout_traceTrack(const fanout_Target *target) {
+    return (trace_Track) (TRACE_TRACK_TARGET + target->index);
+}
+
+/* Gives up on a target after an error. It keeps following the queue but doesn't do anything anymore. */
+static void fanout_targetFail(fanout_Target *target) {
+    for (size_t i = 0; i < target->openCount; i++) {
+        close(target->open[i].fd);
+    }
+
+    target->openCount = 0;
+    target->failed = true;
+
+    fanout_lock(target->writer);
+    target->writer->failed++;
+    fanout_unlock(target->writer);
+}
+
+static bool fanout_targetMkdir(fanout_Target *target, const fanout_Op *op) {
+    strcpy(target->pathAppend, (const char *) op->data);
+
+    uint64_t start = util_getMicroseconds();
+    bool success = (mkdir(target->path, op->mode) == 0 || errno == EEXIST);  // Already existing is fine, same as mercypak.c
+    target->stats.mkdirMicroseconds += util_getMicroseconds() - start;
+    trace_span(fanout_traceTrack(target), "mkdir", start, success, target->path);
+
+    target->stats.mkdirCalls++;
+    target->stats.dirs++;
+    return success;
+}
+
+static bool fanout_targetOpen(fanout_Target *target, const fanout_Op *op) {
+    fanout_OpenFile *file = &target->open[target->openCount];
+
+    strcpy(target->pathAppend, (const char *) op->data);
+
+    uint64_t start = util_getMicroseconds();
+    file->fd = open(target->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    target->stats.openMicroseconds += util_getMicroseconds() - start;
+    trace_span(fanout_traceTrack(target), "open", start, file->fd, target->path);
+    target->stats.openCalls++;
+
+    if (file->fd < 0)
+        return false;
+
+    file->attributes = op->attributes;
+    file->dosDate = op->dosDate;
+    file->dosTime = op->dosTime;
+    target->openCount++;
+    return true;
+}
+
+static bool fanout_targetWrite(fanout_Target *target, const fanout_Op *op) {
+    uint64_t start = util_getMicroseconds();
+
+    for (size_t i = 0; i < target->openCount; i++) {
+        ssize_t written = write(target->open[i].fd, op->data, op->length);
+
+        if (written < 0 || (size_t) written != op->length)
+            return false;
+    }
+
+    target->stats.writeMicroseconds += util_getMicroseconds() - start;
+    trace_span(fanout_traceTrack(target), "write", start, (int64_t) op->length * (int64_t) target->openCount, NULL);
+    target->stats.writeCalls += target->openCount;
+    target->stats.bytesWritten += (uint64_t) op->length * target->openCount;
+    return true;
+}
+
+static bool fanout_targetClose(fanout_Target *target) {
+    bool success = true;
+
+    for (size_t i = 0; i < target->openCount; i++) {
+        const fanout_OpenFile *file = &target->open[i];
+        uint64_t start = util_getMicroseconds();
+        success &= util_setDosFileTime(file->fd, file->dosDate, file->dosTime);
+        success &= util_setDosFileAttributes(file->fd, file->attributes);
+        uint64_t metadataDone = util_getMicroseconds();
+        close(file->fd);
+        target->stats.metadataMicroseconds += metadataDone - start;
+        target->stats.closeMicroseconds += util_getMicroseconds() - metadataDone;
+        trace_span(fanout_traceTrack(target), "close", start, file->fd, NULL);
+        target->stats.metadataCalls += 2;
+        target->stats.closeCalls++;
+    }
+
+    target->stats.files += target->openCount;
+    target->openCount = 0;
+    return success;
+}
+
+static void fanout_targetRun(fanout_Target *target, const fanout_Op *op) {
+    if (target->failed)
+        return;
+
+    switch (op->type) {
+        case FANOUT_OP_MKDIR:
+            target->errors |= !fanout_targetMkdir(target, op);
+            break;
+        case FANOUT_OP_OPEN:
+            if (!fanout_targetOpen(target, op))
+                fanout_targetFail(target);
+            break;
+        case FANOUT_OP_DATA:
+            if (!fanout_targetWrite(target, op))
+                fanout_targetFail(target);
+            break;
+        case FANOUT_OP_CLOSE:
+            target->errors |= !fanout_targetClose(target);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Waits until the entry after op has been queued */
+static fanout_Op *fanout_waitForNext(fanout_Writer *writer, fanout_Op *op) {
+    while (true) {
+        fanout_lock(writer);
+        fanout_Op *next = op->next;
+        fanout_unlock(writer);
+
+        if (next != NULL)
+            return next;
+
+        usleep(FANOUT_IDLE_SLEEP_US);
+    }
+}
+
+/* One target is done with op, the last one frees it. Entries are always released in order. */
+static void fanout_release(fanout_Writer *writer, fanout_Op *op) {
+    bool last;
+
+    if (op->type == FANOUT_OP_HEAD)
+        return;
+
+    fanout_lock(writer);
+    last = (--op->pending == 0);
+    if (last)
+        writer->queued -= op->size;
+    fanout_unlock(writer);
+
+    if (last)
+        free(op);
+}
+
+static void *fanout_threadFunc(void *param) {
+    fanout_Target *target = (fanout_Target *) param;
+    fanout_Op *op = target->writer->head;
+
+    while (op->type != FANOUT_OP_STOP) {
+        fanout_Op *next = fanout_waitForNext(target->writer, op);
+        fanout_release(target->writer, op);
+        fanout_targetRun(target, next);
+        op = next;
+    }
+
+    fanout_release(target->writer, op);
+    return NULL;
+}
+
+/* Gets a new queue entry, after waiting until the slowest target is far enough along for it to fit in the buffer */
+static fanout_Op *fanout_newOp(fanout_Writer *writer, fanout_OpType type, size_t dataSize) {
+    size_t size = sizeof(fanout_Op) + dataSize;
+    uint64_t waitStart = 0;
+
+    while (true) {
+        // The newest entry doesn't count, the targets can only let go of it once there's one after it
+        fanout_lock(writer);
+        size_t queued = writer->queued - writer->last->size;
+        fanout_unlock(writer);
+
+        bool fits = (queued == 0 || queued + size <= writer->bufferSize);
+
+        if (fits)
+            break;
+
+        if (waitStart == 0) {
+            waitStart = util_getMicroseconds();
+            writer->queueWaits++;
+        }
+
+        usleep(FANOUT_IDLE_SLEEP_US);
+    }
+
+    if (waitStart != 0) {
+        writer->queueWaitMicroseconds += util_getMicroseconds() - waitStart;
+        trace_span(TRACE_TRACK_MAIN, "wait for targets", waitStart, (int64_t) writer->queued, NULL);
+    }
+
+    fanout_Op *op = malloc(size);
+    QI_ASSERT(op);
+
+    memset(op, 0, sizeof(fanout_Op));
+    op->type = type;
+    op->size = size;
+    return op;
+}
+
+static void fanout_append(fanout_Writer *writer, fanout_Op *op) {
+    fanout_lock(writer);
+    op->pending = writer->running;
+    writer->queued += op->size;
+    writer->last->next = op;
+    writer->last = op;
+    fanout_unlock(writer);
+
+    trace_counter("fan-out queue", (int64_t) writer->queued);
+}
+
+/* There's no point in going on if every target has failed already */
+static bool fanout_anyTargetLeft(fanout_Writer *writer) {
+    fanout_lock(writer);
+    bool result = writer->failed < writer->running;
+    fanout_unlock(writer);
+    return result;
+}
+
+static fanout_Op *fanout_newPathOp(fanout_Writer *writer, fanout_OpType type, const char *path) {
+    fanout_Op *op = fanout_newOp(writer, type, strlen(path) + 1);
+    strcpy((char *) op->data, path);
+    return op;
+}
+
+/* Queues the end and waits for all writer threads */
+static void fanout_stop(fanout_Writer *writer) {
+    if (writer->running == 0)
+        return;
+
+    fanout_append(writer, fanout_newOp(writer, FANOUT_OP_STOP, 0));
+
+    for (size_t i = 0; i < writer->running; i++) {
+        pthread_join(writer->targets[i].thread, NULL);
+    }
+}
+
+static void fanout_destroy(fanout_Writer *writer) {
+    for (size_t i = 0; i < FANOUT_MAX_TARGETS; i++) {
+        free(writer->targets[i].path);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->head);
+    free(writer);
+}
+
+fanout_Writer *fanout_create(const char *const *installPaths, size_t targetCount, size_t bufferSize) {
+    QI_ASSERT(targetCount > 0 && targetCount <= FANOUT_MAX_TARGETS);
+
+    fanout_Writer *writer = calloc(1, sizeof(fanout_Writer));
+    QI_ASSERT(writer);
+
+    writer->head = calloc(1, sizeof(fanout_Op));
+    QI_ASSERT(writer->head);
+
+    writer->head->type = FANOUT_OP_HEAD;   // size 0
+    writer->last = writer->head;
+    writer->bufferSize = bufferSize;
+
+    if (pthread_mutex_init(&writer->lock, NULL) != 0) {
+        free(writer->head);
+        free(writer);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < targetCount; i++) {
+        fanout_Target *target = &writer->targets[i];
+
+        target->writer = writer;
+        target->index = i;
+        target->path = malloc(strlen(installPaths[i]) + 256 + 1);   // MercyPak strings are 255 chars max
+        QI_ASSERT(target->path);
+        sprintf(target->path, "%s/", installPaths[i]);
+        target->pathAppend = util_endOfString(target->path);
+
+        if (pthread_create(&target->thread, NULL, fanout_threadFunc, target) != 0) {
+            fanout_stop(writer);
+            fanout_destroy(writer);
+            return NULL;
+        }
+
+        writer->running++;
+    }
+
+    return writer;
+}
+
+bool fanout_mkdir(fanout_Writer *writer, const char *path, uint32_t mode) {
+    fanout_Op *op = fanout_newPathOp(writer, FANOUT_OP_MKDIR, path);
+    op->mode = mode;
+    fanout_append(writer, op);
+    return fanout_anyTargetLeft(writer);
+}
+
+bool fanout_openFile(fanout_Writer *writer, const char *path, uint8_t attributes, uint16_t dosDate, uint16_t dosTime) {
+    QI_ASSERT(writer->openFiles < FANOUT_MAX_OPEN_FILES);
+
+    fanout_Op *op = fanout_newPathOp(writer, FANOUT_OP_OPEN, path);
+    op->attributes = attributes;
+    op->dosDate = dosDate;
+    op->dosTime = dosTime;
+    fanout_append(writer, op);
+    writer->openFiles++;
+    return fanout_anyTargetLeft(writer);
+}
+
+bool fanout_write(fanout_Writer *writer, MappedFile *file, size_t len) {
+    while (len > 0) {
+        size_t chunk = MIN(len, FANOUT_CHUNK_SIZE);
+        fanout_Op *op = fanout_newOp(writer, FANOUT_OP_DATA, chunk);
+
+        if (!mappedFile_read(file, op->data, chunk)) {
+            free(op);
+            return false;
+        }
+
+        op->length = chunk;
+        fanout_append(writer, op);
+        len -= chunk;
+
+        if (!fanout_anyTargetLeft(writer))
+            return false;
+    }
+
+    return true;
+}
+
+bool fanout_closeFiles(fanout_Writer *writer) {
+    fanout_append(writer, fanout_newOp(writer, FANOUT_OP_CLOSE, 0));
+    writer->openFiles = 0;
+    return fanout_anyTargetLeft(writer);
+}
+
+bool fanout_finish(fanout_Writer *writer, mercypak_Stats *stats, bool *targetOk) {
+    bool success = true;
+
+    // If the pack broke off in the middle of a file
+    if (writer->openFiles > 0)
+        fanout_closeFiles(writer);
+
+    fanout_stop(writer);
+
+    for (size_t i = 0; i < writer->running; i++) {
+        const fanout_Target *target = &writer->targets[i];
+        const mercypak_Stats *ts = &target->stats;
+
+        stats->dirs += ts->dirs;
+        stats->files += ts->files;
+        stats->bytesWritten += ts->bytesWritten;
+        stats->mkdirCalls += ts->mkdirCalls;
+        stats->openCalls += ts->openCalls;
+        stats->closeCalls += ts->closeCalls;
+        stats->metadataCalls += ts->metadataCalls;
+        stats->mkdirMicroseconds += ts->mkdirMicroseconds;
+        stats->openMicroseconds += ts->openMicroseconds;
+        stats->closeMicroseconds += ts->closeMicroseconds;
+        stats->metadataMicroseconds += ts->metadataMicroseconds;
+        stats->writeCalls += ts->writeCalls;
+        stats->writeMicroseconds += ts->writeMicroseconds;
+
+        if (targetOk != NULL)
+            targetOk[i] = !target->failed && !target->errors;
+
+        success &= !target->failed && !target->errors;
+    }
+
+    stats->queueWaits += writer->queueWaits;
+    stats->queueWaitMicroseconds += writer->queueWaitMicroseconds;
+
+    fanout_destroy(writer);
+    return success;
+}
@@ -0,0 +1,45 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/*
+ * LUNMERCY - Writing the same files to several install targets at once
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * The extraction engine puts every directory, file and piece of file data on one queue, once. Every target
+ * has its own writer thread that works through the queue at its own pace and does the syscalls below its
+ * own install path. The data is held in memory only once no matter how many targets there are, an entry is
+ * freed when the slowest target is done with it.
+ *
+ * The queue is bounded: adding to it waits while the slowest target is more than bufferSize bytes behind.
+ * So a slow disk only holds up the others once it is that far behind.
+ *
+ * A target that fails (can't create a file, disk full...) skips everything from then on and the rest carry on.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mappedfile.h"
+#include "mercypak.h"
+
+#define FANOUT_MAX_TARGETS (8)
+#define FANOUT_MAX_OPEN_FILES (16)  // Copies of one file written at the same time (identical files in v2 packs)
+
+typedef struct fanout_Writer fanout_Writer;
+
+// Starts a writer thread for every install path. Returns NULL if that didn't work.
+fanout_Writer *fanout_create(const char *const *installPaths, size_t targetCount, size_t bufferSize);
+// Queues creating a directory. path is relative to the install paths.
+bool fanout_mkdir(fanout_Writer *writer, const char *path, uint32_t mode);
+// Queues creating a file. The following fanout_write data goes to all files opened since the last fanout_closeFiles.
+bool fanout_openFile(fanout_Writer *writer, const char *path, uint8_t attributes, uint16_t dosDate, uint16_t dosTime);
+// Reads len bytes from file and queues writing them to the open files
+bool fanout_write(fanout_Writer *writer, MappedFile *file, size_t len);
+// Queues setting the time stamps and attributes of the open files and closing them
+bool fanout_closeFiles(fanout_Writer *writer);
+// Waits for all targets to finish, adds their counters to stats and frees the writer.
+// targetOk (can be NULL) gets which targets had no errors. Returns true if none of them had any.
+bool fanout_finish(fanout_Writer *writer, mercypak_Stats *stats, bool *targetOk);
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * LUNMERCY - Built-in FAT16 / FAT32 formatter
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "format.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/hdreg.h>
+
+#include "qi_assert.h"
+
+#define FORMAT_FAT_COUNT        (2)
+#define FORMAT_MEDIA_DESCRIPTOR (0xF8)
+#define FORMAT_DRIVE_NUMBER     (0x80)
+
+#define FORMAT_FAT16_MIN_CLUSTERS (4085)
+#define FORMAT_FAT16_MAX_CLUSTERS (65524)
+#define FORMAT_FAT16_ROOT_ENTRIES (512)
+#define FORMAT_FAT16_RESERVED     (1)
+#define FORMAT_FAT32_MIN_CLUSTERS (65525)
+#define FORMAT_FAT32_MAX_CLUSTERS (0x0FFFFFF5)
+#define FORMAT_FAT32_RESERVED     (32)
+#define FORMAT_FAT32_DEFAULT_CLUSTER_BYTES (4096)
+#define FORMAT_FAT32_FSINFO_SECTOR (1)
+#define FORMAT_FAT32_BACKUP_SECTOR (6)
+#define FORMAT_FAT32_BOOT_SECTORS  (3)
+
+#define FORMAT_MAX_CLUSTER_BYTES (32768)            // Bigger than this, Win9x can't use it
+#define FORMAT_MAX_ALIGNMENT     (4 * 1024 * 1024)  // Ignore optimal I/O sizes above this, some USB bridges report nonsense
+#define FORMAT_ZERO_CHUNK        (1024 * 1024)      // Bytes per zeroing write, also the progress granularity
+
+#define FORMAT_WIN98_MAX_CLUSTERS    (4177920)      // FAT32 volumes with more clusters than this upset ScanDisk
+#define FORMAT_PLAN_MAX_SLACK_PERCENT (10)          // Wasted space allowed, in % of the installed data
+#define FORMAT_PACK_NAME_LENGTH      (32)
+
+static void format_putUInt16(uint8_t *buf, size_t offset, uint16_t value) {
+    buf[offset + 0] = (uint8_t) (value);
+    buf[offset + 1] = (uint8_t) (value >> 8);
+}
+
+static void format_putUInt32(uint8_t *buf, size_t offset, uint32_t value) {
+    buf[offset + 0] = (uint8_t) (value);
+    buf[offset + 1] = (uint8_t) (value >> 8);
+    buf[offset + 2] = (uint8_t) (value >> 16);
+    buf[offset + 3] = (uint8_t) (value >> 24);
+}
+
+/* Fills in FAT size, data start and cluster count for the current reserved sectors and cluster size */
+static void format_calculateFat(format_Layout *l) {
+    uint32_t entryBytes = l->fileSystem == fs_fat32 ? 4 : 2;
+    uint32_t fixed = l->reservedSectors + l->rootSectors;
+
+    // Grow the FAT from the smallest size until it covers the clusters that are left next to it. The first pass sizes it
+    // for the clusters there would be with a 1 sector FAT, that's enough, so the second pass only confirms it.
+    l->fatSectors = 1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t used = fixed + FORMAT_FAT_COUNT * l->fatSectors;
+        uint32_t clusters = l->totalSectors > used ? (l->totalSectors - used) / l->sectorsPerCluster : 0;
+        uint32_t needed = (uint32_t) (((uint64_t) clusters + 2) * entryBytes + l->sectorSize - 1) / l->sectorSize;
+
+        if (needed <= l->fatSectors)
+            break;
+
+        l->fatSectors = needed;
+    }
+
+    l->dataStart = fixed + FORMAT_FAT_COUNT * l->fatSectors;
+    l->clusterCount = l->totalSectors > l->dataStart ? (l->totalSectors - l->dataStart) / l->sectorsPerCluster : 0;
+}
+
+/* Pads the reserved sectors so the data region starts on an alignment boundary on the disk */
+static void format_alignDataRegion(format_Layout *l) {
+    uint32_t misalignment = (l->hiddenSectors + l->dataStart) % l->alignment;
+
+    if (misalignment == 0)
+        return;
+
+    // The FAT stays as big as it is, there are only fewer clusters now
+    l->reservedSectors += l->alignment - misalignment;
+    l->dataStart += l->alignment - misalignment;
+    l->clusterCount = l->totalSectors > l->dataStart ? (l->totalSectors - l->dataStart) / l->sectorsPerCluster : 0;
+}
+
+static bool format_clusterCountValid(const format_Layout *l) {
+    if (l->fileSystem == fs_fat16)
+        return l->clusterCount >= FORMAT_FAT16_MIN_CLUSTERS && l->clusterCount <= FORMAT_FAT16_MAX_CLUSTERS;
+
+    return l->clusterCount >= FORMAT_FAT32_MIN_CLUSTERS && l->clusterCount <= FORMAT_FAT32_MAX_CLUSTERS;
+}
+
+static void format_calculateLayout(format_Layout *l, uint32_t optIoSize) {
+    uint32_t clusterBytes = l->sectorsPerCluster * l->sectorSize;
+    uint32_t alignBytes = clusterBytes;
+
+    if (optIoSize > alignBytes && optIoSize <= FORMAT_MAX_ALIGNMENT && (optIoSize % l->sectorSize) == 0)
+        alignBytes = optIoSize;
+
+    l->alignment = alignBytes / l->sectorSize;
+    l->reservedSectors = l->fileSystem == fs_fat32 ? FORMAT_FAT32_RESERVED : FORMAT_FAT16_RESERVED;
+
+    format_calculateFat(l);
+    format_alignDataRegion(l);
+}
+
+bool format_planLayout(const util_Partition *part, util_FileSystem fs, uint32_t sectorsPerCluster, format_Layout *layout) {
+    QI_ASSERT(part != NULL && part->parent != NULL);
+    QI_ASSERT(layout != NULL);
+
+    format_Layout *l = layout;
+    uint64_t totalSectors = part->size / part->sectorSize;
+    uint32_t maxSectorsPerCluster = FORMAT_MAX_CLUSTER_BYTES / part->sectorSize;
+
+    memset(l, 0, sizeof(format_Layout));
+
+    if ((fs != fs_fat16 && fs != fs_fat32) || totalSectors > UINT32_MAX || maxSectorsPerCluster == 0)
+        return false;
+
+    l->fileSystem = fs;
+    l->sectorSize = part->sectorSize;
+    l->totalSectors = (uint32_t) totalSectors;
+    l->hiddenSectors = (uint32_t) (part->offset / part->sectorSize);
+    l->usedClusters = fs == fs_fat32 ? 1 : 0;
+
+    if (fs == fs_fat16) {
+        l->rootEntries = FORMAT_FAT16_ROOT_ENTRIES;
+        l->rootSectors = (l->rootEntries * 32 + l->sectorSize - 1) / l->sectorSize;
+    }
+
+    // A given cluster size is used as is, it just has to work
+    if (sectorsPerCluster != 0) {
+        if (sectorsPerCluster > maxSectorsPerCluster || (sectorsPerCluster & (sectorsPerCluster - 1)) != 0)
+            return false;
+
+        l->sectorsPerCluster = sectorsPerCluster;
+        format_calculateLayout(l, part->parent->optIoSize);
+        return format_clusterCountValid(l);
+    }
+
+    if (fs == fs_fat16) {
+        // Smallest clusters that keep the cluster count in range
+        for (l->sectorsPerCluster = 1; l->sectorsPerCluster <= maxSectorsPerCluster; l->sectorsPerCluster *= 2) {
+            format_calculateLayout(l, part->parent->optIoSize);
+            if (l->clusterCount <= FORMAT_FAT16_MAX_CLUSTERS)
+                break;
+        }
+    } else {
+        // 4 KB like before, smaller if the partition is too small to have enough clusters, bigger if it's huge
+        l->sectorsPerCluster = MAX(FORMAT_FAT32_DEFAULT_CLUSTER_BYTES / l->sectorSize, 1);
+        format_calculateLayout(l, part->parent->optIoSize);
+
+        while (l->clusterCount < FORMAT_FAT32_MIN_CLUSTERS && l->sectorsPerCluster > 1) {
+            l->sectorsPerCluster /= 2;
+            format_calculateLayout(l, part->parent->optIoSize);
+        }
+
+        while (l->clusterCount > FORMAT_FAT32_MAX_CLUSTERS && l->sectorsPerCluster < maxSectorsPerCluster) {
+            l->sectorsPerCluster *= 2;
+            format_calculateLayout(l, part->parent->optIoSize);
+        }
+    }
+
+    return l->sectorsPerCluster <= maxSectorsPerCluster && format_clusterCountValid(l);
+}
+
+bool format_planImageLayout(const util_Partition *part, uint32_t sectorsPerCluster, uint32_t dataStart, uint32_t maxFatSectors,
+    uint32_t usedClusters, format_Layout *layout) {
+    QI_ASSERT(part != NULL && layout != NULL);
+
+    format_Layout *l = layout;
+    uint64_t totalSectors = part->size / part->sectorSize;
+    uint32_t entriesPerSector = part->sectorSize / 4;
+
+    memset(l, 0, sizeof(format_Layout));
+
+    if (totalSectors > UINT32_MAX || totalSectors <= dataStart || sectorsPerCluster == 0 || (sectorsPerCluster & (sectorsPerCluster - 1)) != 0
+        || sectorsPerCluster * part->sectorSize > FORMAT_MAX_CLUSTER_BYTES)
+        return false;
+
+    uint64_t clusters = (totalSectors - dataStart) / sectorsPerCluster;
+    uint64_t maxClusters = MIN((uint64_t) maxFatSectors * entriesPerSector - 2, (uint64_t) FORMAT_WIN98_MAX_CLUSTERS);
+
+    l->fileSystem = fs_fat32;
+    l->sectorSize = part->sectorSize;
+    l->totalSectors = (uint32_t) totalSectors;
+    l->hiddenSectors = (uint32_t) (part->offset / part->sectorSize);
+    l->sectorsPerCluster = sectorsPerCluster;
+    l->alignment = sectorsPerCluster;
+    l->dataStart = dataStart;
+    l->usedClusters = usedClusters;
+
+    // The file system just ends before the rest of the partition then
+    if (clusters > maxClusters) {
+        clusters = maxClusters;
+        l->totalSectors = dataStart + (uint32_t) clusters * sectorsPerCluster;
+    }
+
+    l->clusterCount = (uint32_t) clusters;
+    l->fatSectors = (l->clusterCount + 2 + entriesPerSector - 1) / entriesPerSector;
+
+    if ((uint64_t) FORMAT_FAT_COUNT * l->fatSectors + FORMAT_FAT32_RESERVED > dataStart)
+        return false;
+
+    l->reservedSectors = dataStart - FORMAT_FAT_COUNT * l->fatSectors;
+
+    return l->reservedSectors <= UINT16_MAX && usedClusters <= l->clusterCount && format_clusterCountValid(l);
+}
+
+bool format_readSizeHistogram(const char *filename, const char *const *packs, size_t packCount, format_SizeHistogram *histogram) {
+    FILE *f = fopen(filename, "r");
+    char line[128];
+    bool found = false;
+
+    memset(histogram, 0, sizeof(format_SizeHistogram));
+
+    if (f == NULL)
+        return false;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char pack[FORMAT_PACK_NAME_LENGTH];
+        unsigned sizeClass;
+        unsigned long long files;
+        unsigned long long bytes;
+
+        if (sscanf(line, "%31s %u %llu %llu", pack, &sizeClass, &files, &bytes) != 4 || sizeClass >= FORMAT_SIZE_CLASSES)
+            continue;
+
+        for (size_t i = 0; i < packCount; i++) {
+            if (strcasecmp(pack, packs[i]) == 0) {
+                histogram->files[sizeClass] += files;
+                histogram->bytes[sizeClass] += bytes;
+                found = true;
+            }
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
+/* Space lost to partially used clusters. Power of two cluster sizes never fall inside a size class. */
+static uint64_t format_estimateSlack(const format_SizeHistogram *histogram, uint32_t clusterBytes) {
+    uint64_t slack = 0;
+
+    // Class 0 are empty files, they don't take a cluster
+    for (uint32_t c = 1; c < FORMAT_SIZE_CLASSES; c++) {
+        if ((1ULL << c) <= clusterBytes) {
+            // All of these are smaller than one cluster
+            slack += histogram->files[c] * clusterBytes - histogram->bytes[c];
+        } else {
+            // Half a cluster per file on average
+            slack += histogram->files[c] * (clusterBytes / 2);
+        }
+    }
+
+    return slack;
+}
+
+uint32_t format_planClusterSize(const util_Partition *part, util_FileSystem fs, const format_SizeHistogram *histogram) {
+    QI_ASSERT(part != NULL && part->parent != NULL);
+    QI_ASSERT(histogram != NULL);
+
+    uint64_t dataBytes = 0;
+    uint32_t preferredMin = fs == fs_fat32 ? FORMAT_FAT32_DEFAULT_CLUSTER_BYTES : part->sectorSize;
+    uint32_t best = 0;          // Biggest one that ticks all boxes
+    uint32_t preferred = 0;     // Smallest one that ticks all boxes but the wasted space
+    uint32_t fallback = 0;      // Biggest one that the files fit on at all
+    format_Layout layout;
+
+    for (uint32_t c = 0; c < FORMAT_SIZE_CLASSES; c++)
+        dataBytes += histogram->bytes[c];
+
+    preferredMin = MAX(preferredMin, MIN(part->parent->optIoSize, (uint32_t) FORMAT_MAX_CLUSTER_BYTES));
+
+    for (uint32_t clusterBytes = part->sectorSize; clusterBytes <= FORMAT_MAX_CLUSTER_BYTES; clusterBytes *= 2) {
+        uint32_t sectorsPerCluster = clusterBytes / part->sectorSize;
+
+        if (!format_planLayout(part, fs, sectorsPerCluster, &layout))
+            continue;
+
+        uint64_t slack = format_estimateSlack(histogram, clusterBytes);
+
+        if (dataBytes + slack > (uint64_t) layout.clusterCount * clusterBytes)
+            continue;
+
+        fallback = sectorsPerCluster;
+
+        if (clusterBytes < preferredMin || (fs == fs_fat32 && layout.clusterCount > FORMAT_WIN98_MAX_CLUSTERS))
+            continue;
+
+        if (preferred == 0)
+            preferred = sectorsPerCluster;
+
+        if (slack * 100 <= dataBytes * FORMAT_PLAN_MAX_SLACK_PERCENT)
+            best = sectorsPerCluster;
+    }
+
+    if (best != 0)
+        return best;
+
+    return preferred != 0 ? preferred : fallback;
+}
+
+/* Builds the boot sector. The boot code is a stub that just gives control back to the BIOS. */
+static void format_buildBootSector(const format_Layout *l, int fd, uint8_t *bs) {
+    static const uint8_t stub[] = { 0xCD, 0x18, 0xEB, 0xFE };  // int 18h, jmp $
+    struct hd_geometry geometry = { 255, 63, 0, 0 };
+    uint32_t volumeId = (uint32_t) time(NULL);
+    size_t codeOffset = l->fileSystem == fs_fat32 ? 0x5A : 0x3E;
+    size_t extendedBpb = l->fileSystem == fs_fat32 ? 0x40 : 0x24;
+
+    // Same source as mkfs.fat, the Win98 FAT16 boot code needs it for CHS addressing
+    if (ioctl(fd, HDIO_GETGEO, &geometry) != 0 || geometry.heads == 0 || geometry.sectors == 0) {
+        geometry.heads = 255;
+        geometry.sectors = 63;
+    }
+
+    memset(bs, 0, l->sectorSize);
+
+    bs[0] = 0xEB;
+    bs[1] = (uint8_t) (codeOffset - 2);
+    bs[2] = 0x90;
+    memcpy(bs + 3, "MSWIN4.1", 8);
+    format_putUInt16(bs, 0x0B, (uint16_t) l->sectorSize);
+    bs[0x0D] = (uint8_t) l->sectorsPerCluster;
+    format_putUInt16(bs, 0x0E, (uint16_t) l->reservedSectors);
+    bs[0x10] = FORMAT_FAT_COUNT;
+    format_putUInt16(bs, 0x11, (uint16_t) l->rootEntries);
+    bs[0x15] = FORMAT_MEDIA_DESCRIPTOR;
+    format_putUInt16(bs, 0x18, geometry.sectors);
+    format_putUInt16(bs, 0x1A, geometry.heads);
+    format_putUInt32(bs, 0x1C, l->hiddenSectors);
+
+    if (l->fileSystem == fs_fat16 && l->totalSectors < 65536)
+        format_putUInt16(bs, 0x13, (uint16_t) l->totalSectors);
+    else
+        format_putUInt32(bs, 0x20, l->totalSectors);
+
+    if (l->fileSystem == fs_fat16) {
+        format_putUInt16(bs, 0x16, (uint16_t) l->fatSectors);
+    } else {
+        format_putUInt32(bs, 0x24, l->fatSectors);
+        format_putUInt32(bs, 0x2C, 2);     // Root directory cluster
+        format_putUInt16(bs, 0x30, FORMAT_FAT32_FSINFO_SECTOR);
+        format_putUInt16(bs, 0x32, FORMAT_FAT32_BACKUP_SECTOR);
+    }
+
+    bs[extendedBpb + 0] = FORMAT_DRIVE_NUMBER;
+    bs[extendedBpb + 2] = 0x29;
+    format_putUInt32(bs, extendedBpb + 3, volumeId);
+    memcpy(bs + extendedBpb + 7, "NO NAME    ", 11);
+    memcpy(bs + extendedBpb + 18, l->fileSystem == fs_fat32 ? "FAT32   " : "FAT16   ", 8);
+
+    memcpy(bs + codeOffset, stub, sizeof(stub));
+    bs[0x1FE] = 0x55;
+    bs[0x1FF] = 0xAA;
+}
+
+static void format_buildFsInfo(const format_Layout *l, uint8_t *fsInfo) {
+    memset(fsInfo, 0, l->sectorSize);
+    format_putUInt32(fsInfo, 0x000, 0x41615252);
+    format_putUInt32(fsInfo, 0x1E4, 0x61417272);
+    format_putUInt32(fsInfo, 0x1E8, l->clusterCount - l->usedClusters);
+    format_putUInt32(fsInfo, 0x1EC, l->usedClusters + 2);   // Next free cluster
+    format_putUInt32(fsInfo, 0x1FC, 0xAA550000);
+}
+
+/* First sector of a FAT: media descriptor, end of chain marker and on FAT32 the root directory cluster */
+static void format_buildFatStart(const format_Layout *l, uint8_t *fat) {
+    memset(fat, 0, l->sectorSize);
+
+    if (l->fileSystem == fs_fat32) {
+        format_putUInt32(fat, 0, 0x0FFFFF00 | FORMAT_MEDIA_DESCRIPTOR);
+        format_putUInt32(fat, 4, 0x0FFFFFFF);
+        format_putUInt32(fat, 8, 0x0FFFFFFF);
+    } else {
+        format_putUInt16(fat, 0, 0xFF00 | FORMAT_MEDIA_DESCRIPTOR);
+        format_putUInt16(fat, 2, 0xFFFF);
+    }
+}
+
+static bool format_writeAt(int fd, const uint8_t *buf, size_t length, uint64_t offset) {
+    while (length) {
+        ssize_t written = pwrite(fd, buf, length, (off_t) offset);
+        if (written <= 0) return false;
+        length -= written;
+        buf += written;
+        offset += written;
+    }
+    return true;
+}
+
+/* Zeroes sectors [first, end). Lets the kernel do it if it can (BLKZEROOUT), else big writes from a zero buffer.
+   Progress is reported as progressDone + sectors done. */
+static bool format_zeroSectors(int fd, const format_Layout *l, uint64_t first, uint64_t end, const format_Callbacks *callbacks,
+    uint64_t progressDone, uint64_t progressTotal) {
+    uint64_t start = first * l->sectorSize;
+    uint64_t pos = start;
+    end *= l->sectorSize;
+
+    uint8_t *zero = NULL;
+    bool useIoctl = true;
+    bool success = true;
+
+    while (success && pos < end) {
+        uint64_t length = MIN((uint64_t) FORMAT_ZERO_CHUNK, end - pos);
+
+        if (useIoctl) {
+            uint64_t range[2] = { pos, length };
+            if (ioctl(fd, BLKZEROOUT, range) == 0) {
+                pos += length;
+            } else {
+                // Not a block device, or an old kernel. Fall back to writing.
+                useIoctl = false;
+                zero = calloc(1, FORMAT_ZERO_CHUNK);
+                success = (zero != NULL);
+            }
+        } else {
+            success = format_writeAt(fd, zero, (size_t) length, pos);
+            pos += length;
+        }
+
+        if (callbacks != NULL && callbacks->progress != NULL)
+            callbacks->progress(callbacks->userData, progressDone + (pos - start) / l->sectorSize, progressTotal);
+    }
+
+    free(zero);
+    return success;
+}
+
+/* Writes boot sector(s), FAT32 FSInfo and backup, and the start of both FATs */
+static bool format_writeMetadata(int fd, const format_Layout *l) {
+    bool fat32 = l->fileSystem == fs_fat32;
+    size_t bootBytes = (fat32 ? FORMAT_FAT32_BOOT_SECTORS : 1) * l->sectorSize;
+    uint64_t fatOffset = (uint64_t) l->reservedSectors * l->sectorSize;
+    uint8_t *sectors = calloc(FORMAT_FAT32_BOOT_SECTORS + 1, l->sectorSize);
+    uint8_t *fatStart = sectors + FORMAT_FAT32_BOOT_SECTORS * l->sectorSize;
+
+    if (sectors == NULL)
+        return false;
+
+    format_buildBootSector(l, fd, sectors);
+    format_buildFatStart(l, fatStart);
+
+    if (fat32) {
+        format_buildFsInfo(l, sectors + l->sectorSize);
+        // Sector 2 is empty apart from the signature, the Win98 boot code goes there later
+        sectors[2 * l->sectorSize + 0x1FE] = 0x55;
+        sectors[2 * l->sectorSize + 0x1FF] = 0xAA;
+    }
+
+    bool success = format_writeAt(fd, sectors, bootBytes, 0);
+
+    if (fat32)
+        success &= format_writeAt(fd, sectors, bootBytes, (uint64_t) FORMAT_FAT32_BACKUP_SECTOR * l->sectorSize);
+
+    for (uint32_t i = 0; i < FORMAT_FAT_COUNT; i++) {
+        success &= format_writeAt(fd, fatStart, l->sectorSize, fatOffset + (uint64_t) i * l->fatSectors * l->sectorSize);
+    }
+
+    free(sectors);
+    return success;
+}
+
+bool format_partition(util_Partition *part, const format_Layout *layout, const format_Callbacks *callbacks) {
+    QI_ASSERT(part != NULL && layout != NULL);
+    QI_ASSERT(part->mountPath == NULL);
+
+    // Everything up to the data region, plus the root directory cluster on FAT32, has to be empty. Except for the reserved
+    // sectors that are only there as padding in front of the FATs (alignment, golden images), nothing ever reads those.
+    uint64_t bootSectors = MIN(layout->reservedSectors, layout->fileSystem == fs_fat32 ? FORMAT_FAT32_RESERVED : FORMAT_FAT16_RESERVED);
+    uint64_t zeroEnd = (uint64_t) layout->dataStart + (layout->fileSystem == fs_fat32 ? layout->sectorsPerCluster : 0);
+    uint64_t progressTotal = bootSectors + (zeroEnd - layout->reservedSectors) + 1;
+
+    int fd = open(part->device, O_RDWR | O_EXCL);
+
+    if (fd < 0)
+        return false;
+
+    bool success = format_zeroSectors(fd, layout, 0, bootSectors, callbacks, 0, progressTotal);
+    success = success && format_zeroSectors(fd, layout, layout->reservedSectors, zeroEnd, callbacks, bootSectors, progressTotal);
+    success = success && format_writeMetadata(fd, layout);
+    // One flush for all of it
+    success = success && (fsync(fd) == 0);
+
+    close(fd);
+
+    if (!success)
+        return false;
+
+    if (callbacks != NULL && callbacks->progress != NULL)
+        callbacks->progress(callbacks->userData, progressTotal, progressTotal);
+
+    part->fileSystem = layout->fileSystem;
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+/*
+ * LUNMERCY - Built-in FAT16 / FAT32 formatter
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * Replaces running mkfs.fat. The data region (and with it every cluster) is aligned on the disk to the
+ * cluster size or the device's optimal I/O size, whichever is bigger. Only the areas that have to be
+ * empty (boot sectors, FATs, root directory) are zeroed, with large writes, everything else is left alone.
+ * The boot code is a stub, the Windows 98 one is put in later (util_writeWin98BootRecords).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+typedef struct {
+    util_FileSystem fileSystem;
+    uint32_t sectorSize;
+    uint32_t totalSectors;
+    uint32_t hiddenSectors;     // Start of the partition on the disk, in sectors
+    uint32_t reservedSectors;   // Includes the padding for the data region alignment
+    uint32_t fatSectors;        // Size of one FAT
+    uint32_t rootEntries;       // FAT16 only
+    uint32_t rootSectors;       // FAT16 only
+    uint32_t sectorsPerCluster;
+    uint32_t clusterCount;
+    uint32_t dataStart;         // First sector of cluster 2
+    uint32_t alignment;         // Data region alignment on the disk, in sectors
+    uint32_t usedClusters;      // Clusters from 2 on that are taken right away (FAT32 root directory, golden images)
+} format_Layout;
+
+typedef struct {
+    // Called while zeroing and writing, with the number of sectors done and the total
+    void (*progress)(void *userData, uint64_t done, uint64_t total);
+    void *userData;
+} format_Callbacks;
+
+#define FORMAT_SIZE_CLASSES (33)
+
+// Sizes of the files that are going to be installed. Class n holds files of [2^(n-1), 2^n) bytes, class 0 empty ones.
+typedef struct {
+    uint64_t files[FORMAT_SIZE_CLASSES];
+    uint64_t bytes[FORMAT_SIZE_CLASSES];
+} format_SizeHistogram;
+
+// Adds up the size histograms of the given packs from a sizes.txt written by sysprep ("<pack> <class> <files> <bytes>"
+// per line). Returns false if the file can't be read or has nothing on any of the packs.
+bool format_readSizeHistogram(const char *filename, const char *const *packs, size_t packCount, format_SizeHistogram *histogram);
+// Picks the cluster size (in sectors) for installing files with this size histogram. The biggest clusters win (fewer FAT
+// updates while installing, less FAT walking in Windows) as long as the wasted space stays small, the files fit and
+// Win98's ScanDisk can still handle the cluster count. Clusters smaller than the device's optimal I/O size are avoided.
+// If every size wastes too much, the smallest allowed one is used, if none is allowed the biggest one that works.
+// Returns 0 (= format_planLayout default) if nothing fits.
+uint32_t format_planClusterSize(const util_Partition *part, util_FileSystem fs, const format_SizeHistogram *histogram);
+
+// Calculates the layout for formatting a partition with fs. sectorsPerCluster 0 = default (4 KB clusters on FAT32,
+// as few sectors as possible on FAT16). Returns false if the partition can't hold that file system.
+bool format_planLayout(const util_Partition *part, util_FileSystem fs, uint32_t sectorsPerCluster, format_Layout *layout);
+// Calculates a FAT32 layout with the data region at dataStart, for a file system that was laid out ahead of time with
+// usedClusters clusters in use (see golden.h). The FAT is sized for the partition, whatever it doesn't need in front of
+// the data region becomes reserved sectors. A partition with more clusters than maxFatSectors of FAT (or ScanDisk) can
+// handle only gets that many. Returns false if the partition is too small or the layout doesn't work out.
+bool format_planImageLayout(const util_Partition *part, uint32_t sectorsPerCluster, uint32_t dataStart, uint32_t maxFatSectors,
+    uint32_t usedClusters, format_Layout *layout);
+// Formats the partition with a layout from format_planLayout or format_planImageLayout. The partition must not be mounted. callbacks can be NULL.
+bool format_partition(util_Partition *part, const format_Layout *layout, const format_Callbacks *callbacks);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * LUNMERCY - Golden partition images
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "golden.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "qi_assert.h"
+#include "trace.h"
+#include "util.h"
+
+#define GOLDEN_MAGIC "QIGOLD01"
+#define GOLDEN_CHUNK_SIZE (1024 * 1024)     // Bytes per write, also the progress granularity
+#define GOLDEN_MAX_SECTOR_SIZE (4096)
+
+static uint32_t golden_getUInt32(const uint8_t *buf, size_t offset) {
+    return (uint32_t) buf[offset] | ((uint32_t) buf[offset + 1] << 8) | ((uint32_t) buf[offset + 2] << 16) | ((uint32_t) buf[offset + 3] << 24);
+}
+
+static inline bool golden_isPowerOfTwo(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+bool golden_readHeader(MappedFile *file, golden_Header *header) {
+    QI_ASSERT(file != NULL && header != NULL);
+
+    uint8_t buf[GOLDEN_HEADER_SIZE];
+
+    memset(header, 0, sizeof(golden_Header));
+
+    if (!mappedFile_read(file, buf, sizeof(buf)) || memcmp(buf, GOLDEN_MAGIC, 8) != 0)
+        return false;
+
+    header->sectorSize = golden_getUInt32(buf, 8);
+    header->sectorsPerCluster = golden_getUInt32(buf, 12);
+    header->dataStart = golden_getUInt32(buf, 16);
+    header->maxFatSectors = golden_getUInt32(buf, 20);
+    header->usedClusters = golden_getUInt32(buf, 24);
+    header->fatSectors = golden_getUInt32(buf, 28);
+
+    if (!golden_isPowerOfTwo(header->sectorSize) || header->sectorSize > GOLDEN_MAX_SECTOR_SIZE || !golden_isPowerOfTwo(header->sectorsPerCluster))
+        return false;
+
+    // The image has to be as big as the header says, the root directory at least is in there
+    uint64_t clusterBytes = (uint64_t) header->sectorsPerCluster * header->sectorSize;
+    uint64_t size = GOLDEN_HEADER_SIZE + (uint64_t) header->fatSectors * header->sectorSize + header->usedClusters * clusterBytes;
+
+    return header->usedClusters > 0 && header->fatSectors > 0 && size <= mappedFile_getFileSize(file);
+}
+
+bool golden_planLayout(const util_Partition *part, const golden_Header *header, format_Layout *layout) {
+    QI_ASSERT(part != NULL && header != NULL && layout != NULL);
+
+    if (part->fileSystem != fs_fat32 || part->sectorSize != header->sectorSize)
+        return false;
+
+    if (!format_planImageLayout(part, header->sectorsPerCluster, header->dataStart, header->maxFatSectors, header->usedClusters, layout))
+        return false;
+
+    // A FAT that is sized for the partition is never smaller than the used part of it, but don't trust the image on that
+    return header->fatSectors <= layout->fatSectors;
+}
+
+static bool golden_writeAt(int fd, const uint8_t *buf, size_t length, uint64_t offset, mercypak_Stats *stats) {
+    uint64_t start = util_getMicroseconds();
+    bool success = true;
+
+    while (success && length) {
+        ssize_t written = pwrite(fd, buf, length, (off_t) offset);
+        success = (written > 0);
+
+        if (success) {
+            length -= written;
+            buf += written;
+            offset += written;
+        }
+
+        if (stats != NULL)
+            stats->writeCalls++;
+    }
+
+    if (stats != NULL)
+        stats->writeMicroseconds += util_getMicroseconds() - start;
+
+    return success;
+}
+
+static size_t golden_countOk(const bool *ok, size_t count) {
+    size_t left = 0;
+
+    for (size_t i = 0; i < count; i++)
+        left += ok[i] ? 1 : 0;
+
+    return left;
+}
+
+bool golden_write(MappedFile *file, const golden_Header *header, util_Partition *const *parts, const format_Layout *layouts,
+    size_t count, const golden_Callbacks *callbacks, mercypak_Stats *stats, bool *ok) {
+    QI_ASSERT(file != NULL && header != NULL && parts != NULL && layouts != NULL && ok != NULL);
+
+    int *fds = calloc(count, sizeof(int));
+    uint64_t fatBytes = (uint64_t) header->fatSectors * header->sectorSize;
+    uint64_t dataBytes = (uint64_t) header->usedClusters * header->sectorsPerCluster * header->sectorSize;
+    uint64_t total = fatBytes + dataBytes;
+    uint64_t done = 0;
+    size_t bufferSize = (size_t) MAX(fatBytes, (uint64_t) GOLDEN_CHUNK_SIZE);
+    uint8_t *buffer = malloc(bufferSize);
+    bool readOk = (fds != NULL && buffer != NULL);
+
+    for (size_t i = 0; i < count && fds != NULL; i++) {
+        fds[i] = ok[i] ? open(parts[i]->device, O_RDWR | O_EXCL) : -1;
+        ok[i] = ok[i] && fds[i] >= 0;
+    }
+
+    // The used start of the FAT, to both FATs. The formatter zeroed the rest of them.
+    uint64_t start = util_getMicroseconds();
+    readOk = readOk && mappedFile_read(file, buffer, (size_t) fatBytes);
+
+    for (size_t i = 0; i < count && readOk; i++) {
+        uint64_t fatOffset = (uint64_t) layouts[i].reservedSectors * layouts[i].sectorSize;
+        uint64_t fatSize = (uint64_t) layouts[i].fatSectors * layouts[i].sectorSize;
+
+        ok[i] = ok[i] && golden_writeAt(fds[i], buffer, (size_t) fatBytes, fatOffset, stats);
+        ok[i] = ok[i] && golden_writeAt(fds[i], buffer, (size_t) fatBytes, fatOffset + fatSize, stats);
+    }
+
+    trace_span(TRACE_TRACK_MAIN, "golden FAT", start, (int64_t) fatBytes, NULL);
+    done += fatBytes;
+
+    // The data region, in cluster order. Every target's data region starts at the same sector.
+    start = util_getMicroseconds();
+
+    for (uint64_t pos = 0; readOk && pos < dataBytes && golden_countOk(ok, count) > 0; ) {
+        size_t length = (size_t) MIN((uint64_t) GOLDEN_CHUNK_SIZE, dataBytes - pos);
+
+        readOk = mappedFile_read(file, buffer, length);
+
+        for (size_t i = 0; i < count && readOk; i++) {
+            ok[i] = ok[i] && golden_writeAt(fds[i], buffer, length, (uint64_t) header->dataStart * header->sectorSize + pos, stats);
+
+            if (ok[i] && stats != NULL)
+                stats->bytesWritten += length;
+        }
+
+        pos += length;
+        done += length;
+
+        if (callbacks != NULL && callbacks->progress != NULL)
+            callbacks->progress(callbacks->userData, done, total);
+    }
+
+    trace_span(TRACE_TRACK_MAIN, "golden data", start, (int64_t) dataBytes, NULL);
+
+    for (size_t i = 0; i < count && fds != NULL; i++) {
+        if (fds[i] < 0)
+            continue;
+
+        // Our writes went through the page cache, they're only done once they're on the disk
+        ok[i] = ok[i] && readOk && fsync(fds[i]) == 0;
+        close(fds[i]);
+    }
+
+    for (size_t i = 0; i < count && !readOk; i++)
+        ok[i] = false;
+
+    free(buffer);
+    free(fds);
+
+    return golden_countOk(ok, count) > 0;
+}
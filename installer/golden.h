@@ -0,0 +1,52 @@
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+/*
+ * LUNMERCY - Golden partition images
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * sysprep.py --golden lays out the default install choices (FULL.866, DRIVER.866 and FASTPNP.866) in a FAT32 file
+ * system ahead of time, see sysprep/golden.py for the file format. Installing one is formatting the partition with a
+ * FAT sized for it and then writing the used start of the FAT and the data region with big sequential writes.
+ * No file system driver is involved at all.
+ *
+ * The data region starts at the same sector on every partition, whatever the FAT doesn't need in front of it
+ * becomes reserved sectors (format_planImageLayout).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "format.h"
+#include "mappedfile.h"
+#include "mercypak.h"
+
+#define GOLDEN_HEADER_SIZE (512)
+
+typedef struct {
+    uint32_t sectorSize;
+    uint32_t sectorsPerCluster;
+    uint32_t dataStart;         // First sector of cluster 2 on the partition
+    uint32_t maxFatSectors;     // Biggest FAT that fits in front of dataStart
+    uint32_t usedClusters;      // Clusters 2 to usedClusters + 1 are taken, everything after that is free
+    uint32_t fatSectors;        // Sectors of FAT stored in the image
+} golden_Header;
+
+typedef struct {
+    // Called while writing, with the bytes of the image done and the total
+    void (*progress)(void *userData, uint64_t done, uint64_t total);
+    void *userData;
+} golden_Callbacks;
+
+// Reads the header at the start of the image. Returns false if it isn't a golden image.
+bool golden_readHeader(MappedFile *file, golden_Header *header);
+// Calculates the layout to format a partition with for the image. Returns false if the image can't go on it.
+bool golden_planLayout(const util_Partition *part, const golden_Header *header, format_Layout *layout);
+// Writes the rest of the image (after golden_readHeader) to partitions formatted with layouts from golden_planLayout,
+// reading it only once for all of them. ok gets which ones worked, only the ones that are ok to begin with are written.
+// callbacks and stats can be NULL. Returns false if there are none left that worked.
+bool golden_write(MappedFile *file, const golden_Header *header, util_Partition *const *parts, const format_Layout *layouts,
+    size_t count, const golden_Callbacks *callbacks, mercypak_Stats *stats, bool *ok);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <malloc.h>
 #include <pthread.h>
 #include <string.h>
@@ -23,8 +24,15 @@
 #include <locale.h>
 
 #include "qi_assert.h"
+#include "drivers.h"
+#include "format.h"
+#include "golden.h"
+#include "journal.h"
 #include "mappedfile.h"
+#include "mercypak.h"
+#include "trace.h"
 #include "util.h"
+#include "verify.h"
 #include "version.h"
 
 #include "anbui/anbui.h"
@@ -42,32 +50,11 @@ typedef enum {
     INSTALL_MBR_ACTIVE_BOOT_PROMPT,
     INSTALL_REGISTRY_VARIANT_PROMPT,
     INSTALL_INTEGRATED_DRIVERS_PROMPT,
+    INSTALL_VERIFY_PROMPT,
     INSTALL_DO_INSTALL,
 } inst_InstallStep;
 
 
-#pragma pack(1)
-
-typedef struct {
-    uint8_t fileFlags;
-    uint16_t fileDate;
-    uint16_t fileTime;
-    uint32_t fileSize;
-    int32_t fileno;
-} inst_MercyPakFileDescriptor;
-
-#pragma pack()
-
-// -sizeof(int) because the fileno is not part of the descriptor read from the mercypak file
-#define MERCYPAK_FILE_DESCRIPTOR_SIZE (sizeof(inst_MercyPakFileDescriptor) - sizeof(int))
-// -sizeof(uint32_t) because the filesize is not part of the descriptor read from the mercypak v2 file
-#define MERCYPAK_V2_FILE_DESCRIPTOR_SIZE ((MERCYPAK_FILE_DESCRIPTOR_SIZE) - sizeof(uint32_t))
-
-#define MERCYPAK_V2_MAX_IDENTICAL_FILES (16)
-
-#define MERCYPAK_V1_MAGIC "ZIEG"
-#define MERCYPAK_V2_MAGIC "MRCY"
-
 #define INST_CFDISK_CMD "cfdisk "
 #define INST_COLS (74)
 
@@ -75,14 +62,116 @@ typedef struct {
 #define INST_DRIVER_FILE  "DRIVER.866"
 #define INST_SLOWPNP_FILE "SLOWPNP.866"
 #define INST_FASTPNP_FILE "FASTPNP.866"
+#define INST_SIZES_FILE   "sizes.txt"
+#define INST_GOLDEN_FILE  "GOLDEN.IMG"
+#define INST_CHECKSUM_FILE "checksums.txt"
+#define INST_DRIVER_INDEX_FILE "drivers.txt"
 
 #define INST_CDROM_IO_SIZE (512*1024)
 #define INST_DISK_IO_SIZE (512*1024)
 
+#define INST_STATS_FILE "/tmp/lunmercy_stats.txt"
+#define INST_TRACE_FILE "/tmp/lunmercy_trace.json"
+#define INST_MEDIA_TEST_FILE "/tmp/lunmercy_mediatest.txt"
+#define INST_VERIFY_FILE "/tmp/lunmercy_verify.txt"
+#define INST_MAX_PACKS (3)
+#define INST_FANOUT_BUFFER_MAX (8 * 1024 * 1024)   // How far the slowest target may fall behind when installing to several
+#define INST_JOURNAL_INTERVAL_US (15000000ULL)      // How often the resume journal is updated, every update flushes the partition
+
 static const char *cdrompath = NULL;    // Path to install source media
 static const char *cdromdev = NULL;     // Block device for install source media
                                         // ^ initialized in install_main
 
+// Timing and I/O statistics of one unpacked pack file
+typedef struct {
+    const char *name;
+    uint64_t microseconds;
+    mercypak_Stats pak;
+    mappedFile_Stats file;
+} inst_PackStats;
+
+// Statistics of an install run, written to INST_STATS_FILE so we can see where the time went
+typedef struct {
+    uint64_t startTime;
+    uint64_t formatMicroseconds;
+    uint32_t clusterBytes;      // 0 if the partition wasn't formatted (or mkfs.fat did it)
+    uint64_t mountMicroseconds;
+    uint64_t syncMicroseconds;
+    uint64_t verifyMicroseconds;
+    uint64_t bootSectorMicroseconds;
+    uint64_t journalWrites;     // Resume journal updates (see journal.h) and the time they took, flushing included
+    uint64_t journalMicroseconds;
+    const char *resumedPack;    // The pack an interrupted install was picked up in, NULL if it started from the beginning
+    uint64_t resumedOffset;
+    size_t targetCount;
+    size_t packCount;
+    inst_PackStats packs[INST_MAX_PACKS];
+} inst_InstallStats;
+
+static inst_InstallStats inst_stats;
+
+// The destination partitions. Unattended installs can have several, they all get the same install at the same time.
+typedef struct {
+    size_t count;
+    util_Partition *parts[UNATTEND_MAX_PARTITIONS];
+    bool ok[UNATTEND_MAX_PARTITIONS];   // Set to false when something goes wrong on one, it's left out from then on
+} inst_Targets;
+
+static inline size_t inst_targetsLeft(const inst_Targets *targets) {
+    size_t left = 0;
+
+    for (size_t i = 0; i < targets->count; i++) {
+        left += targets->ok[i] ? 1 : 0;
+    }
+
+    return left;
+}
+
+/* Comma separated device names of the targets, only the ones that are (still) ok or the ones that failed */
+static const char *inst_getTargetList(const inst_Targets *targets, bool ok) {
+    static char staticListBuf[UNATTEND_MAX_PARTITIONS * (UTIL_HDD_DEVICE_STRING_LENGTH + 2)];
+    char *end = staticListBuf;
+
+    staticListBuf[0] = 0x00;
+
+    for (size_t i = 0; i < targets->count; i++) {
+        if (targets->ok[i] == ok)
+            end += sprintf(end, "%s%s", end == staticListBuf ? "" : ", ", targets->parts[i]->device);
+    }
+
+    return staticListBuf;
+}
+
+static const unattend_Options *inst_unattended = NULL;   // Settings for an unattended install, NULL if interactive
+
+/* Shows a message box, or prints the message to the console when installing unattended */
+static void inst_messageBox(const char *title, const char *fmt, ...) {
+    char message[1024];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    if (inst_unattended) {
+        printf("%s: %s\n", title, message);
+        fflush(stdout);
+    } else {
+        ad_okBox(title, false, "%s", message);
+    }
+}
+
+/* Runs a command, in a command box when interactive. Returns the exit code. */
+static int inst_runCommand(const char *title, const char *command) {
+    if (inst_unattended) {
+        printf("%s\n", title);
+        fflush(stdout);
+        return system(command);
+    }
+
+    return ad_runCommandBox(title, command);
+}
+
 /* Gets the absolute CDROM path of a file. 
    osVariantIndex is the index for the source variant, 0 means from the root. */
 static const char *inst_getCDFilePath(size_t osVariantIndex, const char *filepath) {
@@ -127,25 +216,35 @@ static inline void inst_showInstallationSourceDiskError() {
 
 /* Tells the user he is trying to install to the install source partition */
 static inline void inst_showInstallationSourcePartitionError() {
-    ad_okBox("Atenção", false, "A partição selecionada contém a fonte de instalação.\nEla não pode ser o destino da instalação.");
+    inst_messageBox("Atenção", "A partição selecionada contém a fonte de instalação.\nEla não pode ser o destino da instalação.");
 }
 
 /* Tells the user he is trying to install to a non-FAT partition */
 static inline void inst_showUnsupportedFileSystemError() {
-    ad_okBox("Atenção", false, "A partição selecionada tem um sistema de arquivos não suportado.\nEla não pode ser o destino da instalação.");
+    inst_messageBox("Atenção", "A partição selecionada tem um sistema de arquivos não suportado.\nEla não pode ser o destino da instalação.");
 }
 
 /* Tells the user he is trying to install to a computer without hard disks. */
 static inline void inst_noHardDisksFoundError() {
-    ad_okBox("Atenção", false, "Nenhum disco rígido encontrado!\nPor favor, instale um disco rígido e tente novamente!");
+    inst_messageBox("Atenção", "Nenhum disco rígido encontrado!\nPor favor, instale um disco rígido e tente novamente!");
 }
 
 /* Tells the user about an oopsie trying to open a file for reading. */
 static inline void inst_showFileError() {
-    ad_okBox("Atenção", false, "ERRO: Ocorreu um problema ao lidar com um arquivo para esta variante do SO.\n(%d: %s)", errno, strerror(errno));
+    inst_messageBox("Atenção", "ERRO: Ocorreu um problema ao lidar com um arquivo para esta variante do SO.\n(%d: %s)", errno, strerror(errno));
 }
 
-static inline util_HardDiskArray *inst_getSystemHardDisks() {
+/* Gets the hard disks of the system. The list is only scanned again if something changed (disks or partitions),
+   otherwise 'current' is returned as it is, so going back and forth in the menus doesn't unmount anything. */
+static util_HardDiskArray *inst_updateSystemHardDisks(util_HardDiskArray *current) {
+    if (util_hardDiskArrayIsCurrent(current))
+        return current;
+
+    util_hardDiskArrayDestroy(current);
+
+    if (inst_unattended)
+        return util_getSystemHardDisks();
+
     ad_setFooterText("Obtendo informações sobre os discos rígidos do sistema...");
     util_HardDiskArray *ret = util_getSystemHardDisks();
     ad_clearFooter();
@@ -155,6 +254,7 @@ static inline util_HardDiskArray *inst_getSystemHardDisks() {
 typedef enum {
     SETUP_ACTION_INSTALL = 0,
     SETUP_ACTION_PARTITION_WIZARD,
+    SETUP_ACTION_MEDIA_TEST,
     SETUP_ACTION_EXIT_TO_SHELL,
 } inst_SetupAction;
 
@@ -164,6 +264,7 @@ static inst_SetupAction inst_showMainMenu() {
 
 ad_menuAddItemFormatted(menu, "[INSTALAR] Instalar a variante do Sistema Operacional selecionada");
 ad_menuAddItemFormatted(menu, " [CFDISK] Particionar os discos rígidos");
+ad_menuAddItemFormatted(menu, " [TESTAR] Verificar a mídia de instalação (velocidade e checksums)");
 ad_menuAddItemFormatted(menu, "  [SHELL] Sair para o shell de diagnóstico mínimo do Linux");
 
     int menuResult = ad_menuExecute(menu);
@@ -280,10 +381,18 @@ static void inst_showPartitionWizard(util_HardDiskArray *hdds) {
             continue;
         }
 
+        // Nothing on the disk may be mounted while it is partitioned
+        for (size_t part = 0; part < hdds->disks[menuResult].partitionCount; part++) {
+            util_unmountPartition(&hdds->disks[menuResult].partitions[part]);
+        }
+
         // Invoke cfdisk command for chosen drive.
         snprintf(cfdiskCmd, UTIL_MAX_CMD_LENGTH, "%s%s", INST_CFDISK_CMD, hdds->disks[menuResult].device);      
         system(cfdiskCmd);
 
+        // The partitions may have changed, even if the kernel didn't pick it up (e.g. only the type)
+        util_hardDiskArrayInvalidate(hdds);
+
         ad_restore();
         ad_okBox("Atenção", false,
             "Lembre-se de responder 'sim' ao prompt de formatação\n"
@@ -364,13 +473,6 @@ static inline int inst_formatPartitionDialog(util_Partition *part) {
         part->device);
 }
 
-static bool inst_formatPartition(util_Partition *part) {
-    char formatCmd[UTIL_MAX_CMD_LENGTH];
-    bool ret = util_getFormatCommand(part, part->fileSystem, formatCmd, UTIL_MAX_CMD_LENGTH);
-    QI_ASSERT(ret && "GetFormatCommand");
-    return (0 == ad_runCommandBox("Formatando partição...", formatCmd));
-}
-
 /* Asks user if he wants to overwrite the MBR and set the partition active. Returns true if so. */
 static inline int inst_askUserToOverwriteMBRAndSetActive(util_Partition *part) {
     return ad_yesNoBox("Confirmar", true,
@@ -382,7 +484,7 @@ static inline int inst_askUserToOverwriteMBRAndSetActive(util_Partition *part) {
 
 /* Show message box informing user that formatting failed. */
 static inline void inst_showFailedFormat(util_Partition *part) {
-    ad_okBox("Erro", false,
+    inst_messageBox("Erro",
         "A partição %s não pôde ser formatada.\n"
         "O último erro registrado foi: '%s'.\n"
         "Pode haver um problema com o disco.\n"
@@ -393,7 +495,7 @@ static inline void inst_showFailedFormat(util_Partition *part) {
 
 /* Show message box informing user that mount failed*/
 static inline void inst_showFailedMount(util_Partition *part) {
-    ad_okBox("Erro", false,
+    inst_messageBox("Erro",
         "A partição %s não pôde ser acessada.\n"
         "O último erro registrado foi: '%s'.\n"
         "Pode haver um problema com o disco.\n"
@@ -404,7 +506,7 @@ static inline void inst_showFailedMount(util_Partition *part) {
 
 /* Show message box informing user that copying failed*/
 static inline void inst_showFailedCopy(const char *sourceFile) {
-    ad_okBox("Erro", false,
+    inst_messageBox("Erro",
         "Ocorreu um erro ao descompactar '%s'\n"
         "para esta variante do sistema operacional.\n"
         "O último erro registrado foi: '%s'.\n"
@@ -416,201 +518,1044 @@ static inline void inst_showFailedCopy(const char *sourceFile) {
 }
 
 
+/* Ask user if he wants to pick up an install that was cut short */
+static inline int inst_showResumePrompt(util_Partition *part, const journal_State *state) {
+    return ad_yesNoBox("Confirmar", true,
+        "Uma instalação interrompida foi encontrada na partição '%s'.\n"
+        "Ela parou em '%s' (%llu arquivos prontos).\n"
+        "Gostaria de continuar de onde ela parou, sem formatar a partição?",
+        part->device, state->packFile, (unsigned long long) state->checkpoint.filesDone);
+}
+
+/* Asks the user what to do with files that are on the partition already, when it isn't formatted. Returns false if
+   the user canceled. */
+static bool inst_askUserForExistingFiles(mercypak_ExistingFiles *existing) {
+    const mercypak_ExistingFiles options[] = {
+        MERCYPAK_EXISTING_OVERWRITE,
+        MERCYPAK_EXISTING_REFRESH,
+        MERCYPAK_EXISTING_COMPARE
+    };
+    const char *optionLabels[] = {
+        "Substituir todos os arquivos.",
+        "Atualizar: pular arquivos com o mesmo tamanho e data.",
+        "Atualizar e comparar o conteúdo (lê os arquivos existentes, mais lento)."
+    };
+
+    int menuResult = ad_menuExecuteDirectly("Arquivos existentes", true,
+        util_arraySize(optionLabels), optionLabels,
+        "A partição não será formatada. O que fazer com os arquivos que já estão nela?");
+
+    if (menuResult == AD_CANCELED) {
+        return false;
+    }
+
+    QI_ASSERT(menuResult < (int) util_arraySize(optionLabels));
+    *existing = options[menuResult];
+    return true;
+}
+
 /* Ask user if he wants to install driver package */
 static inline int inst_showDriverPrompt() {
     return ad_yesNoBox("Seleção", true, "Você gostaria de instalar os drivers integrados?");
 }
 
-/* Gets a MercyPak string (8 bit length + n chars) into dst. Must be a buffer of >= 256 bytes size. */
-static inline bool inst_getMercyPakString(MappedFile *file, char *dst) {
-    bool success;
-    uint8_t count;
-    success = mappedFile_getUInt8(file, &count);
-    success &= mappedFile_read(file, (uint8_t*) dst, (size_t) (count));
-    dst[(size_t) count] = 0x00;
+/* Asks the user which drivers of the driver package to install, when the ones for this machine can be picked.
+   Returns false if the user canceled. */
+static bool inst_askUserForDrivers(const drivers_Selection *selection, bool *installDrivers, bool *detectDrivers) {
+    char allLabel[80];
+    char detectLabel[80];
+    const char *optionLabels[] = { allLabel, detectLabel, "Não instalar os drivers integrados." };
+
+    snprintf(allLabel, sizeof(allLabel), "Instalar todos os drivers (%zu).", drivers_getCount(selection));
+    snprintf(detectLabel, sizeof(detectLabel), "Somente os drivers para o hardware deste computador (%zu de %zu).",
+        drivers_getSelectedCount(selection), drivers_getCount(selection));
+
+    int menuResult = ad_menuExecuteDirectly("Seleção", true,
+        util_arraySize(optionLabels), optionLabels,
+        "Foram encontrados %zu dispositivos PCI neste computador.\n"
+        "Drivers para hardware que não é PCI são sempre instalados.\n"
+        "Quais drivers integrados você gostaria de instalar?", drivers_getDeviceCount(selection));
+
+    if (menuResult == AD_CANCELED) {
+        return false;
+    }
+
+    QI_ASSERT(menuResult < (int) util_arraySize(optionLabels));
+    *installDrivers = (menuResult != 2);
+    *detectDrivers = (menuResult == 1);
+    return true;
+}
+
+/* Ask user if he wants the installed files read back and checked */
+static inline int inst_showVerifyPrompt() {
+    return ad_yesNoBox("Seleção", true,
+        "Você gostaria de verificar os arquivos depois da instalação?\n"
+        "Tudo é lido de volta do disco e comparado, isso leva mais tempo,\n"
+        "mas encontra erros causados por memória RAM ou cabos com defeito.");
+}
+
+/*
+ * Progress display.
+ *
+ * Redrawing the progress box for every single file costs a lot of time on a slow machine,
+ * so it is only redrawn a few times per second. The clock is only checked every
+ * INST_PROGRESS_CHECK_BYTES bytes / INST_PROGRESS_CHECK_CALLS updates to keep this cheap.
+ *
+ * Everything here uses integer math only, a 486SX doesn't have an FPU.
+ */
+
+#define INST_PROGRESS_INTERVAL_US   (250000)        // Max. 4 redraws per second
+#define INST_PROGRESS_CONSOLE_INTERVAL_US (2000000) // Unattended installs print a line every 2 seconds
+#define INST_PROGRESS_CHECK_BYTES   (64 * 1024)
+#define INST_PROGRESS_CHECK_CALLS   (16)
+
+// Moving average of a rate (things per second)
+typedef struct {
+    uint64_t lastTime;
+    uint64_t lastValue;
+    uint64_t rate;
+} inst_RateMeter;
+
+static inline void inst_rateMeterStart(inst_RateMeter *meter, uint64_t now, uint64_t value) {
+    meter->lastTime = now;
+    meter->lastValue = value;
+    meter->rate = 0;
+}
+
+/* Updates the moving average with the current value. The newest sample gets a weight of 30%. */
+static void inst_rateMeterUpdate(inst_RateMeter *meter, uint64_t now, uint64_t value) {
+    uint64_t elapsed = now - meter->lastTime;
+
+    if (elapsed == 0 || value < meter->lastValue)
+        return;
+
+    uint64_t sample = (value - meter->lastValue) * 1000000ULL / elapsed;
+
+    meter->rate = (meter->rate == 0) ? sample : (meter->rate * 7 + sample * 3) / 10;
+    meter->lastTime = now;
+    meter->lastValue = value;
+}
+
+/* Formats the estimated time left as MM:SS into buf */
+static void inst_formatEta(char *buf, size_t bufSize, uint64_t remaining, uint64_t rate) {
+    if (rate == 0) {
+        snprintf(buf, bufSize, "--:--");
+        return;
+    }
+
+    uint64_t seconds = remaining / rate;
+    snprintf(buf, bufSize, "%02llu:%02llu", (unsigned long long) MIN(seconds / 60, 99), (unsigned long long) (seconds % 60));
+}
+
+/* Formats a byte rate as MB/s with one decimal into buf */
+static void inst_formatByteRate(char *buf, size_t bufSize, uint64_t bytesPerSecond) {
+    uint64_t tenths = bytesPerSecond * 10 / (1024 * 1024);
+    snprintf(buf, bufSize, "%llu.%llu MB/s", (unsigned long long) (tenths / 10), (unsigned long long) (tenths % 10));
+}
+
+/* Progress callbacks for the extraction engine, these show the progress boxes */
+typedef struct {
+    const char *filePromptString;
+    const mercypak_Stats *stats;    // Live counters of the engine, for the file rate
+    ad_ProgressBox *pbox;
+    size_t total;
+    size_t lastChecked;
+    uint32_t callsSinceCheck;
+    uint64_t lastRedraw;
+    inst_RateMeter mainRate;        // Bytes or directories per second
+    inst_RateMeter fileRate;        // Files per second
+    verify_Manifest *manifest;      // Gets the CRC32 of every file, if the install is verified
+    journal_Journal *journal;       // Gets the checkpoints, if there's one target
+    journal_State *journalState;
+    uint64_t lastJournalWrite;
+    const drivers_Selection *drivers;   // Picks the files to unpack, if only the drivers for this machine are installed
+} inst_CopyProgress;
+
+static const char *inst_getPhaseText(mercypak_Phase phase) {
+    switch (phase) {
+        case MERCYPAK_PHASE_DIRS:   return "Criando Diretórios";
+        case MERCYPAK_PHASE_VERIFY: return "Verificando";
+        default:                    return "Copiando Arquivos";
+    }
+}
+
+static void inst_copyPhaseBegin(void *userData, mercypak_Phase phase, size_t total) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+    uint64_t now = util_getMicroseconds();
+
+    if (inst_unattended) {
+        printf("%s (%s)...\n", inst_getPhaseText(phase), cp->filePromptString);
+        fflush(stdout);
+    } else {
+        cp->pbox = ad_progressBoxCreate("Instalador do Windows 9x", total, "%s (%s)...", inst_getPhaseText(phase), cp->filePromptString);
+        QI_ASSERT(cp->pbox);
+    }
+
+    cp->total = total;
+    cp->lastChecked = 0;
+    cp->callsSinceCheck = 0;
+    cp->lastRedraw = now;
+    inst_rateMeterStart(&cp->mainRate, now, 0);
+    inst_rateMeterStart(&cp->fileRate, now, cp->stats->files);
+}
+
+static void inst_copyProgressRedraw(inst_CopyProgress *cp, mercypak_Phase phase, size_t current, uint64_t now) {
+    char footer[128];
+    char eta[16];
+    char byteRate[24];
+
+    inst_rateMeterUpdate(&cp->mainRate, now, current);
+    inst_rateMeterUpdate(&cp->fileRate, now, cp->stats->files);
+    inst_formatEta(eta, sizeof(eta), cp->total > current ? cp->total - current : 0, cp->mainRate.rate);
+
+    if (phase == MERCYPAK_PHASE_DIRS) {
+        snprintf(footer, sizeof(footer), "%llu diretórios/s | Restante: %s",
+            (unsigned long long) cp->mainRate.rate, eta);
+    } else {
+        inst_formatByteRate(byteRate, sizeof(byteRate), cp->mainRate.rate);
+        snprintf(footer, sizeof(footer), "%s | %llu arquivos/s | Restante: %s",
+            byteRate, (unsigned long long) cp->fileRate.rate, eta);
+    }
+
+    if (inst_unattended) {
+        printf("  %3llu%% %s\n", (unsigned long long) (cp->total ? (uint64_t) current * 100ULL / cp->total : 100ULL), footer);
+        fflush(stdout);
+    } else {
+        ad_progressBoxUpdate(cp->pbox, current);
+        ad_setFooterText(footer);
+    }
+
+    cp->lastRedraw = now;
+}
+
+static void inst_copyProgress(void *userData, mercypak_Phase phase, size_t current) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+
+    // Cheap checks first, this is called for every file
+    if (++cp->callsSinceCheck < INST_PROGRESS_CHECK_CALLS && current - cp->lastChecked < INST_PROGRESS_CHECK_BYTES)
+        return;
+
+    cp->callsSinceCheck = 0;
+    cp->lastChecked = current;
+
+    uint64_t now = util_getMicroseconds();
+
+    if (now - cp->lastRedraw < (inst_unattended ? INST_PROGRESS_CONSOLE_INTERVAL_US : INST_PROGRESS_INTERVAL_US))
+        return;
+
+    trace_counter(phase == MERCYPAK_PHASE_DIRS ? "progress (dirs)" : "progress (bytes)", (int64_t) current);
+    inst_copyProgressRedraw(cp, phase, current, now);
+}
+
+static void inst_copyFileWritten(void *userData, const char *path, uint32_t size, uint32_t crc32) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+    verify_manifestAdd(cp->manifest, path, size, crc32);
+}
+
+static bool inst_copyWantFile(void *userData, const char *path) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+    return drivers_wantFile(cp->drivers, path);
+}
+
+static void inst_writeJournal(inst_CopyProgress *cp) {
+    uint64_t start = util_getMicroseconds();
+
+    // If it doesn't work the install goes on, it just can't be picked up from here
+    journal_write(cp->journal, cp->journalState);
+
+    cp->lastJournalWrite = util_getMicroseconds();
+    inst_stats.journalMicroseconds += cp->lastJournalWrite - start;
+    inst_stats.journalWrites++;
+}
+
+static void inst_copyCheckpoint(void *userData, const mercypak_Checkpoint *checkpoint) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+
+    cp->journalState->checkpoint = *checkpoint;
+
+    if (util_getMicroseconds() - cp->lastJournalWrite >= INST_JOURNAL_INTERVAL_US)
+        inst_writeJournal(cp);
+}
+
+static void inst_copyPhaseEnd(void *userData, mercypak_Phase phase) {
+    inst_CopyProgress *cp = (inst_CopyProgress *) userData;
+    (void) phase;
+
+    if (inst_unattended)
+        return;
+
+    ad_progressBoxUpdate(cp->pbox, cp->total);
+    ad_progressBoxDestroy(cp->pbox);
+    ad_clearFooter();
+    cp->pbox = NULL;
+}
+
+typedef struct {
+    ad_ProgressBox *pbox;
+    uint64_t lastRedraw;
+} inst_FormatProgress;
+
+static void inst_formatProgress(void *userData, uint64_t done, uint64_t total) {
+    inst_FormatProgress *fp = (inst_FormatProgress *) userData;
+    uint64_t now = util_getMicroseconds();
+
+    if (done < total && now - fp->lastRedraw < (inst_unattended ? INST_PROGRESS_CONSOLE_INTERVAL_US : INST_PROGRESS_INTERVAL_US))
+        return;
+
+    fp->lastRedraw = now;
+
+    if (inst_unattended) {
+        printf("  %3llu%%\n", (unsigned long long) (done * 100ULL / total));
+        fflush(stdout);
+    } else {
+        ad_progressBoxUpdate(fp->pbox, (uint32_t) (done * 1000ULL / total));
+    }
+}
+
+/* Cluster size (in sectors) to format with: the one from the unattended settings, otherwise planned from the
+   sizes of the files in the packs we're going to install. 0 = formatter default. */
+static uint32_t inst_getSectorsPerCluster(util_Partition *part, size_t osVariantIndex, const char *registryFile, bool installDrivers) {
+    const char *packs[] = { INST_SYSROOT_FILE, registryFile, INST_DRIVER_FILE };
+    format_SizeHistogram histogram;
+
+    if (inst_unattended && inst_unattended->clusterSize != 0)
+        return MAX(inst_unattended->clusterSize / part->sectorSize, 1);
+
+    // Images made before sysprep wrote this don't have it
+    if (!format_readSizeHistogram(inst_getCDFilePath(osVariantIndex, INST_SIZES_FILE), packs, installDrivers ? 3 : 2, &histogram))
+        return 0;
+
+    return format_planClusterSize(part, part->fileSystem, &histogram);
+}
+
+static bool inst_formatWithLayout(util_Partition *part, const format_Layout *layout) {
+    inst_FormatProgress progress = { NULL, util_getMicroseconds() };
+    const format_Callbacks callbacks = { inst_formatProgress, &progress };
+
+    if (util_isPartitionMounted(part)) {
+        util_unmountPartition(part);
+    }
+
+    if (inst_unattended) {
+        printf("Formatando %s (%s, clusters de %u bytes)...\n", part->device,
+            layout->fileSystem == fs_fat32 ? "FAT32" : "FAT16", layout->sectorsPerCluster * layout->sectorSize);
+        fflush(stdout);
+    } else {
+        progress.pbox = ad_progressBoxCreate("Instalador do Windows 9x", 1000, "Formatando partição %s (%s, clusters de %u bytes)...",
+            part->device, layout->fileSystem == fs_fat32 ? "FAT32" : "FAT16", layout->sectorsPerCluster * layout->sectorSize);
+        QI_ASSERT(progress.pbox);
+    }
+
+    bool success = format_partition(part, layout, &callbacks);
+
+    if (!inst_unattended) {
+        ad_progressBoxDestroy(progress.pbox);
+    }
+
+    if (success)
+        inst_stats.clusterBytes = layout->sectorsPerCluster * layout->sectorSize;
+
     return success;
 }
 
-static bool inst_copyFiles(MappedFile *file, const char *installPath, const char *filePromptString) {
-    char fileHeader[5] = {0};
-    char *destPath = malloc(strlen(installPath) + 256 + 1);   // Full path of destination dir/file, the +256 is because mercypak strings can only be 255 chars max
-    char *destPathAppend = destPath + strlen(installPath) + 1;  // Pointer to first char after the base install path in the destination path + 1 for the extra "/" we're gonna append
-    bool mercypakV2 = false;
+static bool inst_formatPartition(util_Partition *part, uint32_t sectorsPerCluster) {
+    format_Layout layout;
+    bool haveLayout;
+
+    if (util_isPartitionMounted(part)) {
+        util_unmountPartition(part);
+    }
+
+    haveLayout = format_planLayout(part, part->fileSystem, sectorsPerCluster, &layout);
+
+    if (!haveLayout && inst_unattended && inst_unattended->clusterSize != 0) {
+        inst_messageBox("Erro", "Não é possível formatar %s com clusters de %lu bytes.", part->device, (unsigned long) inst_unattended->clusterSize);
+        return false;
+    }
+
+    if (!haveLayout && sectorsPerCluster != 0)
+        haveLayout = format_planLayout(part, part->fileSystem, 0, &layout);
 
-    sprintf(destPath, "%s/", installPath);
+    // Anything our formatter can't lay out (odd sizes) is left to mkfs.fat, like before
+    if (!haveLayout) {
+        char formatCmd[UTIL_MAX_CMD_LENGTH];
+        bool ret = util_getFormatCommand(part, part->fileSystem, formatCmd, UTIL_MAX_CMD_LENGTH);
+        QI_ASSERT(ret && "GetFormatCommand");
+        return (0 == inst_runCommand("Formatando partição...", formatCmd));
+    }
 
-    uint32_t dirCount;
-    uint32_t fileCount;
-    bool success = true;
+    return inst_formatWithLayout(part, &layout);
+}
 
-    success &= mappedFile_read(file, (uint8_t*) fileHeader, 4);
-    QI_ASSERT(success && "fileHeader");
-    success &= mappedFile_getUInt32(file, &dirCount);
-    QI_ASSERT(success && "dirCount");
-    success &= mappedFile_getUInt32(file, &fileCount);
-    QI_ASSERT(success && "fileCount");
+/* Unpacks a pack to all targets that are still ok. Returns false if there are none left after that.
+   With a journal (one target only) it starts at journalState's checkpoint and keeps it up to date.
+   Files that are there already are only refreshed (see mercypak_ExistingFiles) with one target.
+   With drivers (one target only) only the files of the drivers it picked are unpacked. */
+static bool inst_copyFiles(MappedFile *file, inst_Targets *targets, const char *filePromptString, verify_Manifest *manifest,
+    mercypak_ExistingFiles existing, const drivers_Selection *drivers, journal_Journal *journal, journal_State *journalState) {
+    const char *installPaths[UNATTEND_MAX_PARTITIONS];
+    size_t targetIndex[UNATTEND_MAX_PARTITIONS];
+    bool targetOk[UNATTEND_MAX_PARTITIONS];
+    size_t count = 0;
+
+    QI_ASSERT(inst_stats.packCount < INST_MAX_PACKS);
+
+    for (size_t i = 0; i < targets->count; i++) {
+        if (targets->ok[i]) {
+            installPaths[count] = targets->parts[i]->mountPath;
+            targetIndex[count++] = i;
+        }
+    }
 
-    /* printf("File header: %s, dirs %d files: %d\n", fileHeader, (int) dirCount, (int) fileCount); */
+    QI_ASSERT(count > 0 && ((journal == NULL && drivers == NULL) || count == 1));
+
+    inst_PackStats *packStats = &inst_stats.packs[inst_stats.packCount++];
+    inst_CopyProgress progress = { 0 };
+    const mercypak_Callbacks callbacks = {
+        inst_copyPhaseBegin,
+        inst_copyProgress,
+        inst_copyPhaseEnd,
+        manifest ? inst_copyFileWritten : NULL,
+        journal ? inst_copyCheckpoint : NULL,
+        drivers ? inst_copyWantFile : NULL,
+        &progress
+    };
 
-    /* Check if we're unpacking a V2 file, which does redundancy stuff. */
+    uint64_t start = util_getMicroseconds();
+    bool success;
 
-    if (util_stringEquals(fileHeader, MERCYPAK_V1_MAGIC)) {
-        mercypakV2 = false;
-    } else if (util_stringEquals(fileHeader, MERCYPAK_V2_MAGIC)) {
-        mercypakV2 = true;
+    packStats->name = filePromptString;
+    progress.filePromptString = filePromptString;
+    progress.stats = &packStats->pak;
+    progress.manifest = manifest;
+    progress.journal = journal;
+    progress.journalState = journalState;
+    progress.drivers = drivers;
+
+    if (count == 1 && (journal != NULL || existing != MERCYPAK_EXISTING_OVERWRITE || drivers != NULL)) {
+        mercypak_Checkpoint from = { 0, 0 };
+
+        // Right away, that makes the packs before this one done
+        if (journal != NULL) {
+            from = journalState->checkpoint;
+            inst_writeJournal(&progress);
+        }
+
+        success = mercypak_extractFrom(file, installPaths[0], &from, existing, &callbacks, &packStats->pak);
+        targetOk[0] = success;
     } else {
-        QI_ASSERT(false && "Cabeçalho do arquivo incorreto");
-        free(destPath);
+        size_t bufferSize = MIN(util_getProcSafeFreeMemory() / 4, INST_FANOUT_BUFFER_MAX);
+        success = mercypak_extractToTargets(file, installPaths, count, bufferSize, &callbacks, &packStats->pak, targetOk);
+    }
+
+    packStats->microseconds = util_getMicroseconds() - start;
+    mappedFile_getStats(file, &packStats->file);
+    trace_span(TRACE_TRACK_MAIN, "unpack", start, success, filePromptString);
+
+    for (size_t i = 0; i < count; i++) {
+        if (targetOk[i])
+            continue;
+
+        targets->ok[targetIndex[i]] = false;
+
+        if (targets->count > 1)
+            inst_messageBox("Erro", "Ocorreu um erro ao gravar '%s' em %s.", filePromptString, targets->parts[targetIndex[i]]->device);
+    }
+
+    return inst_targetsLeft(targets) > 0;
+}
+
+/* Opens the golden image of the variant (see golden.h) if there is one, it has what was picked and it can go on all
+   targets. layouts gets what to format them with. Returns NULL if the packs have to be unpacked as usual. */
+static MappedFile *inst_openGoldenImage(size_t osVariantIndex, const char *registryFile, bool installDrivers, const inst_Targets *targets,
+    size_t readahead, golden_Header *header, format_Layout *layouts) {
+    // sysprep puts the fast hardware detection in it, and the drivers if there are any
+    bool haveDrivers = util_fileExists(inst_getCDFilePath(osVariantIndex, INST_DRIVER_FILE));
+
+    if (strcmp(registryFile, INST_FASTPNP_FILE) != 0 || installDrivers != haveDrivers)
+        return NULL;
+
+    if (!util_fileExists(inst_getCDFilePath(osVariantIndex, INST_GOLDEN_FILE)))
+        return NULL;
+
+    MappedFile *file = inst_openSourceFile(osVariantIndex, INST_GOLDEN_FILE, readahead);
+    bool usable = file != NULL && golden_readHeader(file, header);
+
+    // A cluster size from the answer file has to be the one of the image
+    if (usable && inst_unattended && inst_unattended->clusterSize != 0)
+        usable = (inst_unattended->clusterSize == header->sectorsPerCluster * header->sectorSize);
+
+    for (size_t i = 0; i < targets->count && usable; i++)
+        usable = golden_planLayout(targets->parts[i], header, &layouts[i]);
+
+    if (!usable && file != NULL) {
+        mappedFile_close(file);
+        file = NULL;
+    }
+
+    return file;
+}
+
+/* Formats the targets for the golden image and writes it to them. Returns false if there are none left after that. */
+static bool inst_installGoldenImage(MappedFile *file, const golden_Header *header, const format_Layout *layouts, inst_Targets *targets) {
+    bool targetOk[UNATTEND_MAX_PARTITIONS];
+    uint64_t start = util_getMicroseconds();
+
+    QI_ASSERT(inst_stats.packCount < INST_MAX_PACKS);
+
+    for (size_t i = 0; i < targets->count; i++) {
+        if (targets->ok[i] && !inst_formatWithLayout(targets->parts[i], &layouts[i])) {
+            inst_showFailedFormat(targets->parts[i]);
+            targets->ok[i] = false;
+        }
+
+        targetOk[i] = targets->ok[i];
+    }
+
+    inst_stats.formatMicroseconds = util_getMicroseconds() - start;
+    trace_span(TRACE_TRACK_MAIN, "format", start, inst_targetsLeft(targets), NULL);
+
+    if (inst_targetsLeft(targets) == 0)
         return false;
+
+    inst_PackStats *packStats = &inst_stats.packs[inst_stats.packCount++];
+    inst_FormatProgress progress = { NULL, util_getMicroseconds() };
+    const golden_Callbacks callbacks = { inst_formatProgress, &progress };
+
+    packStats->name = "Imagem do sistema";
+
+    if (inst_unattended) {
+        printf("Gravando a imagem do sistema em %s...\n", inst_getTargetList(targets, true));
+        fflush(stdout);
+    } else {
+        progress.pbox = ad_progressBoxCreate("Instalador do Windows 9x", 1000, "Gravando a imagem do sistema em %s...", inst_getTargetList(targets, true));
+        QI_ASSERT(progress.pbox);
+    }
+
+    start = util_getMicroseconds();
+    golden_write(file, header, targets->parts, layouts, targets->count, &callbacks, &packStats->pak, targetOk);
+    packStats->microseconds = util_getMicroseconds() - start;
+    mappedFile_getStats(file, &packStats->file);
+    trace_span(TRACE_TRACK_MAIN, "golden image", start, inst_targetsLeft(targets), NULL);
+
+    if (!inst_unattended) {
+        ad_progressBoxDestroy(progress.pbox);
     }
 
-    ad_ProgressBox *pbox = ad_progressBoxCreate("Instalador do Windows 9x", dirCount, "Criando Diretórios (%s)...", filePromptString);
+    for (size_t i = 0; i < targets->count; i++) {
+        if (targetOk[i] || !targets->ok[i])
+            continue;
+
+        targets->ok[i] = false;
+
+        if (targets->count > 1)
+            inst_messageBox("Erro", "Ocorreu um erro ao gravar a imagem do sistema em %s.", targets->parts[i]->device);
+    }
+
+    return inst_targetsLeft(targets) > 0;
+}
+
+/* Final flush. sync() runs in a thread so we can show how much data is still waiting to be written. */
+static volatile bool inst_syncDone = false;
+
+/* Back to the normal mount options first, the remount itself already writes out most of the data */
+static void inst_finalFlush(const inst_Targets *targets) {
+    for (size_t i = 0; i < targets->count; i++) {
+        if (targets->ok[i])
+            util_remountPartition(targets->parts[i], UTIL_MOUNT_NORMAL);
+    }
+
+    sync();
+}
+
+static void *inst_syncThreadFunc(void *param) {
+    inst_finalFlush((const inst_Targets *) param);
+    inst_syncDone = true;
+    return NULL;
+}
+
+/* Dirty + Writeback from /proc/meminfo, in kB */
+static inline uint64_t inst_getUnwrittenKb(void) {
+    return util_getProcMeminfoValue("Dirty") + util_getProcMeminfoValue("Writeback");
+}
+
+static void inst_syncWithProgress(inst_Targets *targets) {
+    pthread_t syncThread;
+    uint64_t unwrittenAtStart = inst_getUnwrittenKb();
+
+    inst_syncDone = false;
+
+    if (inst_unattended) {
+        printf("Gravando dados no disco (%llu kB)...\n", (unsigned long long) unwrittenAtStart);
+        fflush(stdout);
+        inst_finalFlush(targets);
+        return;
+    }
+
+    if (pthread_create(&syncThread, NULL, inst_syncThreadFunc, targets) != 0) {
+        // Can't show progress then, just do it.
+        ad_setFooterText("Gravando dados no disco...");
+        inst_finalFlush(targets);
+        ad_clearFooter();
+        return;
+    }
+
+    ad_ProgressBox *pbox = ad_progressBoxCreate("Instalador do Windows 9x", MAX(unwrittenAtStart, 1), "Gravando dados no disco...");
+    inst_RateMeter rate;
 
     QI_ASSERT(pbox);
 
-    for (uint32_t d = 0; d < dirCount; d++) {
-        uint8_t dirFlags;
+    inst_rateMeterStart(&rate, util_getMicroseconds(), 0);
+
+    while (!inst_syncDone) {
+        char footer[96];
+        char eta[16];
+        char byteRate[24];
+        uint64_t unwritten = MIN(inst_getUnwrittenKb(), unwrittenAtStart);
+        uint64_t written = unwrittenAtStart - unwritten;
+
+        inst_rateMeterUpdate(&rate, util_getMicroseconds(), written);
+        inst_formatEta(eta, sizeof(eta), unwritten, rate.rate);
+        inst_formatByteRate(byteRate, sizeof(byteRate), rate.rate * 1024);
+        snprintf(footer, sizeof(footer), "%s | Faltam %llu kB | Restante: %s", byteRate, (unsigned long long) unwritten, eta);
 
-        ad_progressBoxUpdate(pbox, d);
+        ad_progressBoxUpdate(pbox, written);
+        ad_setFooterText(footer);
 
-        success &= mappedFile_getUInt8(file, &dirFlags);
-        success &= inst_getMercyPakString(file, destPathAppend);
-        util_stringReplaceChar(destPathAppend, '\\', '/'); // DOS paths innit
-        success &= (mkdir(destPath, dirFlags) == 0 || (errno == EEXIST));    // An error value is ok if the directory already exists. It means we can write to it. IT'S FINE.
+        usleep(INST_PROGRESS_INTERVAL_US);
     }
 
+    pthread_join(syncThread, NULL);
+
+    ad_progressBoxUpdate(pbox, MAX(unwrittenAtStart, 1));
     ad_progressBoxDestroy(pbox);
+    ad_clearFooter();
+}
 
-    /*
-     *  Extract and copy files from mercypak files
-     */
+/* Helpers for the statistics file, these return tenths (print with INST_TENTHS) */
+#define INST_TENTHS(x) (unsigned long long) ((x) / 10), (unsigned long long) ((x) % 10)
 
-    success = true;
+static inline uint64_t inst_seconds(uint64_t microseconds) {
+    return microseconds / 100000ULL;
+}
 
-    pbox = ad_progressBoxCreate("Instalador do Windows 9x", mappedFile_getFileSize(file), "Copiando Arquivos (%s)...", filePromptString);
+static inline uint64_t inst_megabytes(uint64_t bytes) {
+    return bytes * 10ULL / (1024ULL * 1024ULL);
+}
 
-    QI_ASSERT(pbox);
+static inline uint64_t inst_megabytesPerSecond(uint64_t bytes, uint64_t microseconds) {
+    return microseconds ? bytes * 1000000ULL / microseconds * 10ULL / (1024ULL * 1024ULL) : 0;
+}
 
-    if (mercypakV2) {
-        /* Handle mercypak v2 pack file with redundant files optimized out */
+static inline uint64_t inst_perSecond(uint64_t count, uint64_t microseconds) {
+    return microseconds ? count * 10000000ULL / microseconds : 0;
+}
 
-        inst_MercyPakFileDescriptor *filesToWrite = calloc(MERCYPAK_V2_MAX_IDENTICAL_FILES, sizeof(inst_MercyPakFileDescriptor));
-        int *fileDescriptorsToWrite = calloc(MERCYPAK_V2_MAX_IDENTICAL_FILES, sizeof(int));
-        uint8_t identicalFileCount = 0;
+// This one is a whole number
+static inline unsigned long long inst_percent(uint64_t part, uint64_t total) {
+    return total ? (unsigned long long) (part * 100ULL / total) : 0ULL;
+}
 
-        QI_ASSERT(filesToWrite != NULL);
+/* Writes the install statistics to INST_STATS_FILE. Returns false if that didn't work. */
+static bool inst_writeStats(bool installSuccess) {
+    FILE *f = fopen(INST_STATS_FILE, "w");
+    uint64_t totalBytes = 0, totalFiles = 0, totalExtract = 0;
+    uint64_t totalWait = 0, totalDest = 0, peakBuffered = 0;
 
-        for (uint32_t f = 0; f < fileCount;) {
+    if (f == NULL)
+        return false;
 
-            uint32_t fileSize;
+    fprintf(f, "Estatísticas da instalação (%s)\n\n", installSuccess ? "sucesso" : "falhou");
+
+    // The writer threads of the targets run at the same time, so their times add up to more than the real time
+    if (inst_stats.targetCount > 1)
+        fprintf(f, "%zu destinos ao mesmo tempo, os números e os tempos de gravação são a soma de todos eles.\n\n", inst_stats.targetCount);
+
+    for (size_t i = 0; i < inst_stats.packCount; i++) {
+        const inst_PackStats *p = &inst_stats.packs[i];
+        uint64_t openClose = p->pak.openMicroseconds + p->pak.closeMicroseconds;
+        uint64_t writes = p->file.writeMicroseconds + p->pak.writeMicroseconds;
+        uint64_t destination = writes + p->pak.mkdirMicroseconds + openClose + p->pak.metadataMicroseconds;
+
+        // With several targets the only time the unpacking spends on them is waiting for the slowest one
+        if (inst_stats.targetCount > 1)
+            destination = p->pak.queueWaitMicroseconds;
+
+        fprintf(f, "%s:\n", p->name);
+        fprintf(f, "  %llu arquivos, %llu diretórios, %llu.%llu MB em %llu.%llu s (%llu.%llu MB/s, %llu.%llu arquivos/s)\n",
+            (unsigned long long) p->pak.files, (unsigned long long) p->pak.dirs,
+            INST_TENTHS(inst_megabytes(p->pak.bytesWritten)), INST_TENTHS(inst_seconds(p->microseconds)),
+            INST_TENTHS(inst_megabytesPerSecond(p->pak.bytesWritten, p->microseconds)),
+            INST_TENTHS(inst_perSecond(p->pak.files, p->microseconds)));
+        fprintf(f, "  Esperando pela origem: %4llu.%llu s (%2llu%%, %llu vezes)\n",
+            INST_TENTHS(inst_seconds(p->file.waitMicroseconds)), inst_percent(p->file.waitMicroseconds, p->microseconds),
+            (unsigned long long) p->file.waits);
+        fprintf(f, "  write():               %4llu.%llu s (%2llu%%, %llu chamadas)\n",
+            INST_TENTHS(inst_seconds(writes)), inst_percent(writes, p->microseconds),
+            (unsigned long long) (p->file.writeCalls + p->pak.writeCalls));
+        fprintf(f, "  mkdir():               %4llu.%llu s (%2llu%%)\n",
+            INST_TENTHS(inst_seconds(p->pak.mkdirMicroseconds)), inst_percent(p->pak.mkdirMicroseconds, p->microseconds));
+        fprintf(f, "  open() / close():      %4llu.%llu s (%2llu%%)\n",
+            INST_TENTHS(inst_seconds(openClose)), inst_percent(openClose, p->microseconds));
+        fprintf(f, "  Data / atributos:      %4llu.%llu s (%2llu%%)\n",
+            INST_TENTHS(inst_seconds(p->pak.metadataMicroseconds)), inst_percent(p->pak.metadataMicroseconds, p->microseconds));
+        if (inst_stats.targetCount > 1)
+            fprintf(f, "  Esperando pelo destino mais lento: %llu.%llu s (%llu%%, %llu vezes)\n",
+                INST_TENTHS(inst_seconds(p->pak.queueWaitMicroseconds)), inst_percent(p->pak.queueWaitMicroseconds, p->microseconds),
+                (unsigned long long) p->pak.queueWaits);
+        if (p->pak.filesUnchanged)
+            fprintf(f, "  Já estavam iguais:     %llu arquivos, %llu.%llu MB não gravados\n",
+                (unsigned long long) p->pak.filesUnchanged, INST_TENTHS(inst_megabytes(p->pak.bytesUnchanged)));
+        if (p->pak.filesLeftOut)
+            fprintf(f, "  Deixados de fora:      %llu arquivos, %llu.%llu MB (drivers para outro hardware)\n",
+                (unsigned long long) p->pak.filesLeftOut, INST_TENTHS(inst_megabytes(p->pak.bytesLeftOut)));
+        fprintf(f, "  Lido da origem: %llu.%llu MB em %llu leituras\n",
+            INST_TENTHS(inst_megabytes(p->file.bytesRead)), (unsigned long long) p->file.readCalls);
+
+        // With the mmap backend the source is read by page faults inside write(), so source stalls show up there
+        if (p->file.readCalls == 0)
+            fprintf(f, "  (mmap: o tempo de leitura da origem está incluído no write())\n");
+
+        fprintf(f, "\n");
+
+        totalBytes += p->pak.bytesWritten;
+        totalFiles += p->pak.files;
+        totalExtract += p->microseconds;
+        totalWait += p->file.waitMicroseconds;
+        totalDest += destination;
+        peakBuffered = MAX(peakBuffered, p->file.peakBuffered);
+    }
 
-            ad_progressBoxUpdate(pbox, mappedFile_getPosition(file));
+    fprintf(f, "Formatação:         %4llu.%llu s", INST_TENTHS(inst_seconds(inst_stats.formatMicroseconds)));
+    if (inst_stats.clusterBytes)
+        fprintf(f, " (clusters de %lu bytes)", (unsigned long) inst_stats.clusterBytes);
+    fputc('\n', f);
+    fprintf(f, "Montar/desmontar:   %4llu.%llu s\n", INST_TENTHS(inst_seconds(inst_stats.mountMicroseconds)));
+    fprintf(f, "Descompactação:     %4llu.%llu s (%llu.%llu MB, %llu arquivos, %llu.%llu MB/s)\n",
+        INST_TENTHS(inst_seconds(totalExtract)), INST_TENTHS(inst_megabytes(totalBytes)), (unsigned long long) totalFiles,
+        INST_TENTHS(inst_megabytesPerSecond(totalBytes, totalExtract)));
+    fprintf(f, "sync() final:       %4llu.%llu s\n", INST_TENTHS(inst_seconds(inst_stats.syncMicroseconds)));
+    if (inst_stats.journalWrites)
+        fprintf(f, "Diário de retomada: %4llu.%llu s (%llu atualizações)\n", INST_TENTHS(inst_seconds(inst_stats.journalMicroseconds)),
+            (unsigned long long) inst_stats.journalWrites);
+    if (inst_stats.resumedPack)
+        fprintf(f, "Continuada a partir de %s, %llu.%llu MB pulados\n", inst_stats.resumedPack, INST_TENTHS(inst_megabytes(inst_stats.resumedOffset)));
+    if (inst_stats.verifyMicroseconds)
+        fprintf(f, "Verificação:        %4llu.%llu s\n", INST_TENTHS(inst_seconds(inst_stats.verifyMicroseconds)));
+    fprintf(f, "Setor de boot/MBR:  %4llu.%llu s\n", INST_TENTHS(inst_seconds(inst_stats.bootSectorMicroseconds)));
+    fprintf(f, "Total:              %4llu.%llu s\n\n", INST_TENTHS(inst_seconds(util_getMicroseconds() - inst_stats.startTime)));
+
+    fprintf(f, "Memória: pico do processo %llu kB, pico do buffer de leitura %llu kB, disponível %llu kB\n",
+        (unsigned long long) util_getProcSelfStatusValue("VmHWM"),
+        (unsigned long long) (peakBuffered / 1024ULL),
+        (unsigned long long) util_getProcMeminfoValue("MemAvailable"));
+
+    // Whatever takes up most of the unpacking time is what limits this machine.
+    // Destination time that isn't spent in syscalls is CPU (copying, the UI etc.)
+    if (totalExtract > 0) {
+        uint64_t other = totalExtract > totalWait + totalDest ? totalExtract - totalWait - totalDest : 0;
+        const char *bottleneck = "CPU";
+
+        if (totalWait >= totalDest && totalWait >= other) {
+            bottleneck = "mídia de origem";
+        } else if (totalDest >= other) {
+            bottleneck = "disco de destino";
+        }
 
-            success &= mappedFile_getUInt8(file, &identicalFileCount);
+        fprintf(f, "Gargalo provável: %s (origem %llu%%, destino %llu%%, CPU/outros %llu%%)\n", bottleneck,
+            inst_percent(totalWait, totalExtract), inst_percent(totalDest, totalExtract), inst_percent(other, totalExtract));
+    }
 
-            QI_ASSERT(identicalFileCount <= MERCYPAK_V2_MAX_IDENTICAL_FILES);
+    fclose(f);
+    return true;
+}
 
-            for (uint32_t subFile = 0; subFile < identicalFileCount; subFile++) {
-                success &= inst_getMercyPakString(file, destPathAppend);
-                util_stringReplaceChar(destPathAppend, '\\', '/');
+/* Reads every installed file back from the targets and compares it with what was unpacked, the results go to
+   INST_VERIFY_FILE. Targets with files that don't match aren't ok anymore. Returns false if there were any.
+   An install that was picked up only has the files from the one that was interrupted on. */
+static bool inst_verifyInstall(const verify_Manifest *manifest, inst_Targets *targets, const journal_State *resumed) {
+    FILE *f = fopen(INST_VERIFY_FILE, "w");
+    uint64_t start = util_getMicroseconds();
+    bool allOk = true;
 
-                fileDescriptorsToWrite[subFile] = open(destPath,  O_WRONLY | O_CREAT | O_TRUNC);
-                QI_ASSERT(fileDescriptorsToWrite[subFile] >= 0);
+    QI_ASSERT(f);
 
-                success &= mappedFile_read(file, &filesToWrite[subFile], MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
-            }
+    fprintf(f, "Verificação da instalação: %zu arquivos\n\n", verify_manifestCount(manifest));
 
-            success &= mappedFile_getUInt32(file, &fileSize);
+    if (resumed != NULL)
+        fprintf(f, "Instalação continuada: o que ficou pronto antes (os pacotes anteriores e %llu arquivos de '%s') não foi verificado.\n\n",
+            (unsigned long long) resumed->checkpoint.filesDone, resumed->packFile);
 
-            success &= mappedFile_copyToFiles(file, identicalFileCount, fileDescriptorsToWrite, fileSize);
+    for (size_t i = 0; i < targets->count; i++) {
+        util_Partition *part = targets->parts[i];
+        size_t threads = verify_isRotational(part->parent) ? 1 : VERIFY_MAX_THREADS;
+        inst_FormatProgress progress = { NULL, util_getMicroseconds() };
+        const verify_Callbacks callbacks = { inst_formatProgress, &progress };
+        verify_Result result;
 
-            for (uint32_t subFile = 0; subFile < identicalFileCount; subFile++) {
-                success &= util_setDosFileTime(fileDescriptorsToWrite[subFile], filesToWrite[subFile].fileDate, filesToWrite[subFile].fileTime);
-                success &= util_setDosFileAttributes(fileDescriptorsToWrite[subFile], filesToWrite[subFile].fileFlags);
-                close(fileDescriptorsToWrite[subFile]);
-            }
+        if (!targets->ok[i])
+            continue;
 
-            f += identicalFileCount;
+        if (inst_unattended) {
+            printf("Verificando os arquivos em %s...\n", part->device);
+            fflush(stdout);
+        } else {
+            progress.pbox = ad_progressBoxCreate("Instalador do Windows 9x", 1000, "Verificando os arquivos em %s...", part->device);
+            QI_ASSERT(progress.pbox);
         }
 
-        free(filesToWrite);
-        free(fileDescriptorsToWrite);
+        bool ok = verify_run(manifest, part->mountPath, threads, &callbacks, &result);
+
+        if (!inst_unattended)
+            ad_progressBoxDestroy(progress.pbox);
+
+        fprintf(f, "%s: %llu arquivos, %llu.%llu MB lidos (%zu %s), %s\n", part->device,
+            (unsigned long long) result.files, INST_TENTHS(inst_megabytes(result.bytesRead)),
+            threads, threads == 1 ? "thread" : "threads", ok ? "tudo OK" : "DIFERENÇAS ENCONTRADAS");
+
+        for (size_t m = 0; m < MIN(result.mismatchCount, (size_t) VERIFY_MAX_MISMATCHES); m++)
+            fprintf(f, "  %s: %s\n", result.mismatches[m].path, verify_mismatchTypeToString(result.mismatches[m].type));
+
+        if (result.mismatchCount > VERIFY_MAX_MISMATCHES)
+            fprintf(f, "  ... e mais %zu\n", result.mismatchCount - VERIFY_MAX_MISMATCHES);
+
+        if (!ok) {
+            targets->ok[i] = false;
+            allOk = false;
+        }
+    }
+
+    fclose(f);
+
+    inst_stats.verifyMicroseconds = util_getMicroseconds() - start;
+    trace_span(TRACE_TRACK_MAIN, "verify", start, allOk, NULL);
+
+    if (allOk) {
+        return true;
+    } else if (inst_unattended) {
+        printf("A verificação encontrou arquivos diferentes, veja %s\n", INST_VERIFY_FILE);
     } else {
+        ad_textFileBox("Verificação da instalação", INST_VERIFY_FILE);
+    }
 
-        inst_MercyPakFileDescriptor fileToWrite;
+    return false;
+}
 
-        for (uint32_t f = 0; f < fileCount; f++) {
+/*
+ * Media test: reads every pack of the variant the way an install would, without writing anything, and checks it
+ * against the checksums sysprep wrote. Tells the user how fast the media is and where it couldn't be read.
+ */
 
-            ad_progressBoxUpdate(pbox, mappedFile_getPosition(file));
+/* Looks up the size and CRC32 of a pack in INST_CHECKSUM_FILE. Returns false if it isn't in there. */
+static bool inst_getPackChecksum(size_t osVariantIndex, const char *packName, uint64_t *size, uint32_t *crc32) {
+    FILE *f = fopen(inst_getCDFilePath(osVariantIndex, INST_CHECKSUM_FILE), "r");
+    char name[64];
+    unsigned long long fileSize;
+    unsigned int fileCrc;
+    bool found = false;
 
-            /* Mercypak file metadata (see mercypak.txt) */
+    if (f == NULL)
+        return false;
 
-            success &= inst_getMercyPakString(file, destPathAppend);    // First, filename string
-            util_stringReplaceChar(destPathAppend, '\\', '/');          // DOS paths innit
+    while (!found && fscanf(f, "%63s %llu %x", name, &fileSize, &fileCrc) == 3) {
+        found = util_stringEquals(name, packName);
+    }
 
-            success &= mappedFile_read(file, &fileToWrite, MERCYPAK_FILE_DESCRIPTOR_SIZE);
+    fclose(f);
 
-            int outfd = open(destPath,  O_WRONLY | O_CREAT | O_TRUNC);
-            QI_ASSERT(outfd >= 0);
+    *size = found ? (uint64_t) fileSize : 0;
+    *crc32 = found ? (uint32_t) fileCrc : 0;
+    return found;
+}
 
-            success &= mappedFile_copyToFiles(file, 1, &outfd, fileToWrite.fileSize);
+/* The golden image isn't a pack, it only gets read and checksummed */
+static bool inst_checksumFile(MappedFile *file, const mercypak_Callbacks *callbacks, uint32_t *crc32) {
+    size_t size = mappedFile_getFileSize(file);
+    uint8_t *buffer = malloc(INST_CDROM_IO_SIZE);
+    bool readOk = true;
 
-            success &= util_setDosFileTime(outfd, fileToWrite.fileDate, fileToWrite.fileTime);
-            success &= util_setDosFileAttributes(outfd, fileToWrite.fileFlags);
+    QI_ASSERT(buffer);
 
-            close(outfd);
+    *crc32 = 0;
+    callbacks->phaseBegin(callbacks->userData, MERCYPAK_PHASE_VERIFY, size);
 
-        }
+    for (size_t pos = 0; pos < size; pos = mappedFile_getPosition(file)) {
+        size_t length = MIN(size - pos, (size_t) INST_CDROM_IO_SIZE);
+        readOk &= mappedFile_read(file, buffer, length);
+        *crc32 = util_crc32(*crc32, buffer, length);
+        callbacks->progress(callbacks->userData, MERCYPAK_PHASE_VERIFY, pos + length);
+    }
+
+    callbacks->phaseEnd(callbacks->userData, MERCYPAK_PHASE_VERIFY);
+
+    free(buffer);
+    return readOk;
+}
+
+/* Tests one pack and writes what came out of it to f. Returns false if anything was wrong with it. */
+static bool inst_testMediaFile(FILE *f, size_t osVariantIndex, const char *packName, size_t readahead) {
+    mercypak_Stats pakStats = { 0 };
+    mercypak_VerifyResult result = { 0 };
+    mappedFile_Stats fileStats;
+    mappedFile_ReadProblem problems[MAPPEDFILE_MAX_READ_PROBLEMS];
+    uint64_t expectedSize = 0;
+    uint32_t expectedCrc = 0;
+    inst_CopyProgress progress = { 0 };
+    mercypak_Callbacks callbacks = {
+        inst_copyPhaseBegin,
+        inst_copyProgress,
+        inst_copyPhaseEnd,
+        NULL,
+        NULL,
+        NULL,
+        &progress
+    };
+
+    MappedFile *file = inst_openSourceFile(osVariantIndex, packName, readahead);
 
+    if (file == NULL) {
+        fprintf(f, "%s:\n  Não pôde ser aberto (%s)\n\n", packName, strerror(errno));
+        return false;
     }
 
-    /*
-        TODO: ERROR HANDLING
-     */
+    progress.filePromptString = packName;
+    progress.stats = &pakStats;
 
-    ad_progressBoxDestroy(pbox);
+    bool isPack = !util_stringEquals(packName, INST_GOLDEN_FILE);
+    uint64_t start = util_getMicroseconds();
 
-    free(destPath);
-    return success;
+    if (isPack) {
+        mercypak_verify(file, &callbacks, &pakStats, &result);
+    } else {
+        result.structureOk = true;
+        result.readOk = inst_checksumFile(file, &callbacks, &result.crc32);
+    }
+
+    uint64_t microseconds = util_getMicroseconds() - start;
+    uint64_t size = mappedFile_getFileSize(file);
+    size_t problemCount = mappedFile_getReadProblems(file, problems, MAPPEDFILE_MAX_READ_PROBLEMS);
+    bool haveChecksum = inst_getPackChecksum(osVariantIndex, packName, &expectedSize, &expectedCrc);
+    bool checksumOk = haveChecksum && expectedSize == size && expectedCrc == result.crc32;
+
+    mappedFile_getStats(file, &fileStats);
+    mappedFile_close(file);
+
+    fprintf(f, "%s:\n", packName);
+    fprintf(f, "  %llu.%llu MB em %llu.%llu s (%llu.%llu MB/s)\n",
+        INST_TENTHS(inst_megabytes(size)), INST_TENTHS(inst_seconds(microseconds)), INST_TENTHS(inst_megabytesPerSecond(size, microseconds)));
+
+    if (!isPack) {
+        fprintf(f, "  Estrutura: (imagem, só o checksum é verificado)\n");
+    } else if (result.structureOk) {
+        fprintf(f, "  Estrutura: OK (%llu arquivos, %llu diretórios)\n", (unsigned long long) pakStats.files, (unsigned long long) pakStats.dirs);
+    } else {
+        fprintf(f, "  Estrutura: ERRO na posição %zu (0x%zx)\n", result.errorOffset, result.errorOffset);
+    }
+
+    if (checksumOk) {
+        fprintf(f, "  Checksum:  OK (%08x)\n", (unsigned int) result.crc32);
+    } else if (haveChecksum) {
+        fprintf(f, "  Checksum:  DIFERENTE (lido %08x, %llu bytes / esperado %08x, %llu bytes)\n",
+            (unsigned int) result.crc32, (unsigned long long) size, (unsigned int) expectedCrc, (unsigned long long) expectedSize);
+    } else {
+        fprintf(f, "  Checksum:  %08x (não está em %s)\n", (unsigned int) result.crc32, INST_CHECKSUM_FILE);
+    }
+
+    fprintf(f, "  Leituras repetidas: %llu, erros de leitura: %llu\n",
+        (unsigned long long) fileStats.readRetries, (unsigned long long) fileStats.readErrors);
+
+    for (size_t i = 0; i < MIN(problemCount, (size_t) MAPPEDFILE_MAX_READ_PROBLEMS); i++) {
+        fprintf(f, "    Posição %llu (0x%llx), %lu bytes: %s após %lu tentativas\n",
+            (unsigned long long) problems[i].offset, (unsigned long long) problems[i].offset, (unsigned long) problems[i].length,
+            problems[i].failed ? "FALHOU" : "ok", (unsigned long) problems[i].attempts);
+    }
+
+    if (problemCount > MAPPEDFILE_MAX_READ_PROBLEMS)
+        fprintf(f, "    ... e mais %zu\n", problemCount - MAPPEDFILE_MAX_READ_PROBLEMS);
+
+    // With mmap a read error kills the installer (SIGBUS), so there's nothing to list
+    if (fileStats.readCalls == 0)
+        fprintf(f, "  (mmap: erros de leitura não podem ser repetidos nem listados)\n");
+
+    fprintf(f, "\n");
+
+    return result.structureOk && result.readOk && (checksumOk || !haveChecksum);
+}
+
+/* Tests all packs of a variant and shows the results */
+static void inst_testMedia(size_t osVariantIndex, size_t readahead) {
+    static const char *packNames[] = { INST_SYSROOT_FILE, INST_DRIVER_FILE, INST_FASTPNP_FILE, INST_SLOWPNP_FILE, INST_GOLDEN_FILE };
+    FILE *f = fopen(INST_MEDIA_TEST_FILE, "w");
+    bool allOk = true;
+
+    if (f == NULL) {
+        inst_messageBox("Erro", "Não foi possível criar '%s'.\n(%d: %s)", INST_MEDIA_TEST_FILE, errno, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "Teste da mídia de instalação (%s)\n\n", cdromdev);
+
+    for (size_t i = 0; i < sizeof(packNames) / sizeof(packNames[0]); i++) {
+        if (util_fileExists(inst_getCDFilePath(osVariantIndex, packNames[i])))
+            allOk &= inst_testMediaFile(f, osVariantIndex, packNames[i], readahead);
+    }
+
+    fprintf(f, "Resultado: %s\n", allOk ? "a mídia está OK." : "PROBLEMAS ENCONTRADOS, a instalação pode falhar!");
+    fclose(f);
+
+    ad_textFileBox("Teste da mídia", INST_MEDIA_TEST_FILE);
 }
 
 /* Inform user and setup boot sector and MBR. */
 static bool inst_setupBootSectorAndMBR(util_Partition *part, bool setActiveAndDoMBR) {
-    bool success = true;
     // TODO: ui_showInfoBox("Setting up Master Boot Record and Boot sector...");
-    success &= util_writeWin98BootSectorToPartition(part);
-    if (setActiveAndDoMBR) {
-        success &= util_writeWin98MBRToDrive(part->parent);
-        char activateCmd[UTIL_MAX_CMD_LENGTH];
-        snprintf(activateCmd, UTIL_MAX_CMD_LENGTH, "sfdisk --activate %s %zu", part->parent->device, part->indexOnParent);
-        success &= (0 == ad_runCommandBox("Ativando partição...", activateCmd));
+    // The boot flag only exists for the partitions in the MBR, a logical one would leave the disk without any
+    if (setActiveAndDoMBR && !util_isPrimaryPartition(part)) {
+        inst_messageBox("Erro", "A partição '%s' é lógica e não pode ser marcada como ativa.\n"
+            "Instale em uma partição primária ou não atualize o MBR.", part->device);
+        return false;
     }
-    return success;
+
+    // Boot sector, FAT32 backup, MBR code and boot flag all go out together with one flush
+    return util_writeWin98BootRecords(part, setActiveAndDoMBR);
 }
 
 /* Show success screen. Ask user if he wants to reboot */
 static inline bool inst_showSuccessAndAskForReboot() {
     // Returns TRUE (meaning reboot = true) if YES (0) happens. sorry for the confusion.
-    ad_Menu *menu = ad_menuCreate("Instalador do Windows 9x: Sucesso", 
-        "A instalação foi bem-sucedida.\n"
-        "Você gostaria de reiniciar ou sair para o shell?", 
-        false);
+    bool haveStats = util_fileExists(INST_STATS_FILE);
+    int menuResult;
 
-    QI_ASSERT(menu);
+    while (true) {
+        ad_Menu *menu = ad_menuCreate("Instalador do Windows 9x: Sucesso", 
+            "A instalação foi bem-sucedida.\n"
+            "Você gostaria de reiniciar ou sair para o shell?", 
+            false);
 
-    ad_menuAddItemFormatted(menu, "Reiniciar");
-    ad_menuAddItemFormatted(menu, "Sair para o shell");
+        QI_ASSERT(menu);
 
-    int menuResult = ad_menuExecute(menu);
+        ad_menuAddItemFormatted(menu, "Reiniciar");
+        ad_menuAddItemFormatted(menu, "Sair para o shell");
 
-    ad_menuDestroy(menu);
+        if (haveStats)
+            ad_menuAddItemFormatted(menu, "Mostrar estatísticas da instalação");
+
+        menuResult = ad_menuExecute(menu);
+
+        ad_menuDestroy(menu);
+
+        if (menuResult != 2)
+            break;
+
+        ad_textFileBox("Estatísticas da instalação", INST_STATS_FILE);
+    }
 
     return menuResult == 0;
 }
 
 /* Show failure screen :( */
 static inline void inst_showFailMessage() {
-    ad_okBox("Erro!", false,
+    inst_messageBox("Erro!",
         "Houve um problema durante a instalação! :(\n"
         "Você pode pressionar ENTER para acessar o shell e inspecionar o problema.");
 }
@@ -638,17 +1583,131 @@ static const char *inst_askUserForRegistryVariant(void) {
     return optionFiles[menuResult];
 }
 
+/* Checks if an OS variant exists on the install media (for unattended installs) */
+static bool inst_osVariantExists(size_t osVariantIndex) {
+    if (util_fileExists(inst_getCDFilePath(osVariantIndex, "win98qi.inf")))
+        return true;
+
+    inst_messageBox("Erro", "A variante do sistema operacional %zu não existe nesta mídia de instalação.", osVariantIndex);
+    return false;
+}
+
+/* Finds the destination partition of an unattended install and checks if it can be used. Returns NULL if not. */
+static util_Partition *inst_getUnattendedPartition(util_HardDiskArray *hdds, const char *device) {
+    util_Partition *result = util_getPartitionFromDevicestring(hdds, device);
+
+    if (result == NULL) {
+        inst_messageBox("Erro", "A partição '%s' não foi encontrada.", device);
+        return NULL;
+    }
+
+    if (inst_isInstallationSourcePartition(result)) {
+        inst_showInstallationSourcePartitionError();
+        return NULL;
+    }
+
+    if (result->fileSystem == fs_unsupported || result->fileSystem == fs_none) {
+        inst_showUnsupportedFileSystemError();
+        return NULL;
+    }
+
+    return result;
+}
+
+/* Finds all destination partitions of an unattended install. Returns false if any of them can't be used. */
+static bool inst_getUnattendedTargets(util_HardDiskArray *hdds, const unattend_Options *opt, inst_Targets *targets) {
+    targets->count = 0;
+
+    for (size_t i = 0; i < opt->partitionCount; i++) {
+        util_Partition *part = inst_getUnattendedPartition(hdds, opt->partitions[i]);
+
+        if (part == NULL)
+            return false;
+
+        // Two on one disk would fight over the boot flag, and seek a lot
+        for (size_t j = 0; j < targets->count; j++) {
+            if (targets->parts[j]->parent == part->parent) {
+                inst_messageBox("Erro", "As partições %s e %s estão no mesmo disco. Só é possível instalar em uma partição por disco.",
+                    targets->parts[j]->device, part->device);
+                return false;
+            }
+        }
+
+        targets->parts[targets->count] = part;
+        targets->ok[targets->count] = true;
+        targets->count++;
+    }
+
+    return targets->count > 0;
+}
+
+/* The packs in install order, files in later ones replace the ones from earlier ones. Packs that aren't
+   installed are NULL. */
+static void inst_getPacks(const char *registryFile, bool installDrivers, const char **packs, const char **names) {
+    packs[0] = INST_SYSROOT_FILE;
+    packs[1] = installDrivers ? INST_DRIVER_FILE : NULL;
+    packs[2] = registryFile;
+    names[0] = "Sistema Operacional";
+    names[1] = "Biblioteca de Drivers";
+    names[2] = "Registro";
+}
+
+/* Looks for the journal of an install of this variant that was cut short on a partition (see journal.h). Returns
+   false if there is none or it doesn't fit the install source anymore. */
+static bool inst_findInterruptedInstall(util_Partition *part, size_t osVariantIndex, journal_State *state) {
+    const char *packs[INST_MAX_PACKS];
+    const char *names[INST_MAX_PACKS];
+    bool wasMounted = util_isPartitionMounted(part);
+    bool found = false;
+    struct stat st;
+
+    if (!wasMounted && !util_mountPartition(part, UTIL_MOUNT_NORMAL))
+        return false;
+
+    found = journal_read(part->mountPath, state);
+
+    if (!wasMounted)
+        util_unmountPartition(part);
+
+    if (!found || state->variantIndex != osVariantIndex)
+        return false;
+
+    if (!util_stringEquals(state->registryFile, INST_FASTPNP_FILE) && !util_stringEquals(state->registryFile, INST_SLOWPNP_FILE))
+        return false;
+
+    inst_getPacks(state->registryFile, state->installDrivers, packs, names);
+
+    // It has to be one of the packs that install would have, and still the same one
+    for (size_t i = 0; i < INST_MAX_PACKS; i++) {
+        if (packs[i] != NULL && util_stringEquals(packs[i], state->packFile)) {
+            return stat(inst_getCDFilePath(osVariantIndex, packs[i]), &st) == 0
+                && (uint64_t) st.st_size == state->packSize
+                && state->checkpoint.offset <= state->packSize;
+        }
+    }
+
+    return false;
+}
+
 /* Main installer process. Assumes the CDROM environment variable is set to a path with valid install.txt, FULL.866 and DRIVER.866 files. */
-bool inst_main() {
+bool inst_main(const unattend_Options *unattended) {
     MappedFile *sourceFile = NULL;
     size_t readahead = util_getProcSafeFreeMemory() * 6 / 10;
     util_HardDiskArray *hda = NULL;
+    verify_Manifest *manifest = NULL;              // CRC32s of the installed files, if they are verified
+    journal_State resumeState;                     // Where the install that is picked up stopped, if resumeInstall
+    drivers_Selection *driverSelection = NULL;     // The drivers for this machine's hardware, if detectDrivers
     const char *registryUnpackFile = NULL;
-    util_Partition *destinationPartition = NULL;
+    util_Partition *destinationPartition = NULL;   // The first (in interactive installs the only) one of targets
+    inst_Targets targets = { 0 };
     inst_InstallStep currentStep = INSTALL_WELCOME;
     size_t osVariantIndex = 0;
+    mercypak_ExistingFiles existingFiles = MERCYPAK_EXISTING_OVERWRITE;    // Only matters without formatting
 
     bool installDrivers = false;
+    bool detectDrivers = false;
+    bool verifyInstall = false;
+    bool resumeInstall = false;
     bool formatPartition = false;
     bool setActiveAndDoMBR = false;
     bool quit = false;
@@ -656,7 +1715,13 @@ bool inst_main() {
     bool installSuccess = true;
     bool goToNext = false;
 
-    ad_init(LUNMERCY_BACKTITLE);
+    // LUNMERCY_TRACE=1 records an event trace of the install, see trace.h
+    trace_initFromEnvironment();
+
+    inst_unattended = unattended;
+
+    if (!unattended)
+        ad_init(LUNMERCY_BACKTITLE);
 
     setlocale(LC_ALL, "C.UTF-8");
 
@@ -666,8 +1731,8 @@ bool inst_main() {
     QI_ASSERT(cdrompath);
     QI_ASSERT(cdromdev);
 
- 
-    inst_showDisclaimer();
+    if (!unattended)
+        inst_showDisclaimer();
 
     while (!quit) {
 
@@ -678,7 +1743,8 @@ bool inst_main() {
 
         switch (currentStep) {
             case INSTALL_WELCOME:
-                inst_showWelcomeScreen();
+                if (!unattended)
+                    inst_showWelcomeScreen();
                 goToNext = true;
                 break;
 
@@ -686,7 +1752,19 @@ bool inst_main() {
                 bool previousGoToNext = goToNext;
                 size_t osVariantCount = 0;
 
-                goToNext = inst_showOSVariantSelect(&osVariantIndex, &osVariantCount);
+                if (unattended) {
+                    osVariantIndex = unattended->variantIndex;
+                    osVariantCount = 1;
+                    goToNext = inst_osVariantExists(osVariantIndex);
+
+                    if (!goToNext) {
+                        installSuccess = false;
+                        quit = true;
+                        continue;
+                    }
+                } else {
+                    goToNext = inst_showOSVariantSelect(&osVariantIndex, &osVariantCount);
+                }
 
                 if (osVariantCount == 1 && previousGoToNext == false) {
                     // If there's only one OS variant the variant select will just return "true"
@@ -703,6 +1781,12 @@ bool inst_main() {
 
                     if (sourceFile == NULL) {
                         inst_showFileError();
+
+                        if (unattended) {
+                            installSuccess = false;
+                            quit = true;
+                        }
+
                         continue;
                     }
                 }
@@ -713,6 +1797,18 @@ bool inst_main() {
             /* Main Menu:
              * Select Setup Action to execute */
             case INSTALL_MAIN_MENU: {
+                // Unattended installs go straight to the install, they only come back here if something went wrong.
+                if (unattended) {
+                    if (destinationPartition != NULL || hda != NULL) {
+                        installSuccess = false;
+                        quit = true;
+                    } else {
+                        currentStep = INSTALL_SELECT_DESTINATION_PARTITION;
+                    }
+
+                    continue;
+                }
+
                 switch (inst_showMainMenu()) {
                     case SETUP_ACTION_INSTALL:
                         currentStep = INSTALL_SELECT_DESTINATION_PARTITION;
@@ -722,6 +1818,21 @@ bool inst_main() {
                         currentStep = INSTALL_PARTITION_WIZARD;
                         continue;
 
+                    case SETUP_ACTION_MEDIA_TEST:
+                        // The test reads the packs from the start too, no need to hold on to the read ahead data twice
+                        if (sourceFile != NULL)
+                            mappedFile_close(sourceFile);
+
+                        inst_testMedia(osVariantIndex, readahead);
+                        sourceFile = inst_openSourceFile(osVariantIndex, INST_SYSROOT_FILE, readahead);
+
+                        if (sourceFile == NULL) {
+                            inst_showFileError();
+                            currentStep = INSTALL_OSROOT_VARIANT_SELECT;
+                        }
+
+                        continue;
+
                     case SETUP_ACTION_EXIT_TO_SHELL:
                         doReboot = false;
                         quit = true;
@@ -742,8 +1853,7 @@ bool inst_main() {
                 currentStep = INSTALL_MAIN_MENU;
                 goToNext = false;
 
-                util_hardDiskArrayDestroy(hda);
-                hda = inst_getSystemHardDisks();
+                hda = inst_updateSystemHardDisks(hda);
 
                 QI_ASSERT(hda != NULL);
 
@@ -755,12 +1865,18 @@ bool inst_main() {
              * Start installation.
              * Select the destination partition */
             case INSTALL_SELECT_DESTINATION_PARTITION: {
-                util_hardDiskArrayDestroy(hda);
-                hda = inst_getSystemHardDisks();
+                hda = inst_updateSystemHardDisks(hda);
 
                 QI_ASSERT(hda != NULL);
 
-                destinationPartition = inst_showPartitionSelector(hda);
+                if (unattended) {
+                    destinationPartition = inst_getUnattendedTargets(hda, unattended, &targets) ? targets.parts[0] : NULL;
+                } else {
+                    destinationPartition = inst_showPartitionSelector(hda);
+                    targets.count = 1;
+                    targets.parts[0] = destinationPartition;
+                    targets.ok[0] = true;
+                }
 
                 if (destinationPartition == NULL) {
                     // There was an error, the user canceled or we have no hard disks.
@@ -776,15 +1892,67 @@ bool inst_main() {
             /* Menu prompt:
              * Does user want to format the hard disk? */
             case INSTALL_FORMAT_PARTITION_PROMPT: {
+                // An install that was cut short can be picked up, with what was chosen for it back then
+                resumeInstall = targets.count == 1 && (!unattended || unattended->resume)
+                    && inst_findInterruptedInstall(destinationPartition, osVariantIndex, &resumeState);
+
+                if (resumeInstall && !unattended) {
+                    int answer = inst_showResumePrompt(destinationPartition, &resumeState);
+
+                    if (answer == AD_CANCELED) {
+                        goToNext = false;
+                        break;
+                    }
+
+                    resumeInstall = (answer == AD_YESNO_YES);
+                }
+
+                if (resumeInstall) {
+                    formatPartition = false;
+                    existingFiles = MERCYPAK_EXISTING_OVERWRITE;
+                    setActiveAndDoMBR = resumeState.setActiveAndDoMBR;
+                    registryUnpackFile = util_stringEquals(resumeState.registryFile, INST_SLOWPNP_FILE) ? INST_SLOWPNP_FILE : INST_FASTPNP_FILE;
+                    installDrivers = resumeState.installDrivers;
+                    detectDrivers = resumeState.detectDrivers;
+                    drivers_destroy(driverSelection);
+                    driverSelection = NULL;
+                    verifyInstall = unattended ? unattended->verify : resumeState.verify;
+                    currentStep = INSTALL_DO_INSTALL;
+                    continue;
+                }
+
+                if (unattended) {
+                    static const mercypak_ExistingFiles refreshModes[] = {
+                        MERCYPAK_EXISTING_OVERWRITE, MERCYPAK_EXISTING_REFRESH, MERCYPAK_EXISTING_COMPARE
+                    };
+
+                    formatPartition = unattended->formatPartition;
+                    existingFiles = formatPartition ? MERCYPAK_EXISTING_OVERWRITE : refreshModes[unattended->refresh];
+                    goToNext = true;
+                    break;
+                }
+
                 int answer = inst_formatPartitionDialog(destinationPartition);
                 formatPartition = (answer == AD_YESNO_YES);
                 goToNext = (answer != AD_CANCELED);
+                existingFiles = MERCYPAK_EXISTING_OVERWRITE;
+
+                // Canceling this one asks about formatting again
+                if (answer == AD_YESNO_NO && !inst_askUserForExistingFiles(&existingFiles))
+                    continue;
+
                 break;
             }
 
             /* Menu prompt:
              * Does user want to update MBR and set the partition active? */
             case INSTALL_MBR_ACTIVE_BOOT_PROMPT: {
+                if (unattended) {
+                    setActiveAndDoMBR = unattended->setActiveAndDoMBR;
+                    goToNext = true;
+                    break;
+                }
+
                 int answer = inst_askUserToOverwriteMBRAndSetActive(destinationPartition);
                 setActiveAndDoMBR = (answer == AD_YESNO_YES);
                 goToNext = (answer != AD_CANCELED);
@@ -795,7 +1963,11 @@ bool inst_main() {
             /* Menu prompt:
              * Fast / Slow non-PNP HW detection? */
             case INSTALL_REGISTRY_VARIANT_PROMPT: {
-                registryUnpackFile = inst_askUserForRegistryVariant();
+                if (unattended) {
+                    registryUnpackFile = (unattended->registryVariant == UNATTEND_REGISTRY_SLOW) ? INST_SLOWPNP_FILE : INST_FASTPNP_FILE;
+                } else {
+                    registryUnpackFile = inst_askUserForRegistryVariant();
+                }
                 goToNext = (registryUnpackFile != NULL);
                 break;
             }
@@ -803,13 +1975,49 @@ bool inst_main() {
             /* Menu prompt:
              * Does the user want to install the base driver package? */
             case INSTALL_INTEGRATED_DRIVERS_PROMPT: {
+                drivers_destroy(driverSelection);
+                driverSelection = NULL;
+                detectDrivers = false;
+
                 // It's optional, if the file doesn't exist, we don't have to ask
-                if (util_fileExists(inst_getCDFilePath(osVariantIndex, INST_DRIVER_FILE))) {
+                if (!util_fileExists(inst_getCDFilePath(osVariantIndex, INST_DRIVER_FILE))) {
+                    installDrivers = false;
+                    break;
+                }
+
+                // Only the drivers for the hardware of this machine, if sysprep made an index of them. The disks of
+                // an install to several partitions go into other machines, they get all of them.
+                if (targets.count == 1 && (!unattended || unattended->detectDrivers))
+                    driverSelection = drivers_select(inst_getCDFilePath(osVariantIndex, INST_DRIVER_INDEX_FILE), DRIVERS_PCI_DEVICES_PATH);
+
+                if (unattended) {
+                    installDrivers = unattended->installDrivers;
+                    detectDrivers = installDrivers && driverSelection != NULL;
+                } else if (driverSelection != NULL) {
+                    goToNext = inst_askUserForDrivers(driverSelection, &installDrivers, &detectDrivers);
+                } else {
                     int response = inst_showDriverPrompt();
                     installDrivers = (response == AD_YESNO_YES);
                     goToNext = (response != AD_CANCELED);
+                }
+
+                if (!detectDrivers) {
+                    drivers_destroy(driverSelection);
+                    driverSelection = NULL;
+                }
+
+                break;
+            }
+
+            /* Menu prompt:
+             * Read everything back after installing? */
+            case INSTALL_VERIFY_PROMPT: {
+                if (unattended) {
+                    verifyInstall = unattended->verify;
                 } else {
-                    installDrivers = false;
+                    int response = inst_showVerifyPrompt();
+                    verifyInstall = (response == AD_YESNO_YES);
+                    goToNext = (response != AD_CANCELED);
                 }
 
                 break;
@@ -818,71 +2026,219 @@ bool inst_main() {
 
             /* Do the actual install */
             case INSTALL_DO_INSTALL: {
-                // Format partition
-                if (formatPartition)
-                    installSuccess = inst_formatPartition(destinationPartition);
+                uint64_t phaseStart = util_getMicroseconds();
+                format_Layout goldenLayouts[UNATTEND_MAX_PARTITIONS];
+                golden_Header goldenHeader;
+                MappedFile *goldenFile = NULL;
 
-                if (!installSuccess) {
-                    inst_showFailedFormat(destinationPartition);
-                    currentStep = INSTALL_MAIN_MENU;
-                    continue;
-                }
+                memset(&inst_stats, 0, sizeof(inst_stats));
+                inst_stats.startTime = phaseStart;
+                inst_stats.targetCount = targets.count;
 
-                installSuccess = util_mountPartition(destinationPartition);
-                // If mounting failed, we will display a message and go back after.
+                verify_manifestDestroy(manifest);
+                manifest = verifyInstall ? verify_manifestCreate() : NULL;
 
-                if (!installSuccess) {
-                    inst_showFailedMount(destinationPartition);
-                    currentStep = INSTALL_MAIN_MENU;
-                    continue;
-                }
+                // An install that is picked up didn't come past the drivers prompt. If the index is gone now, all of them.
+                if (detectDrivers && driverSelection == NULL)
+                    driverSelection = drivers_select(inst_getCDFilePath(osVariantIndex, INST_DRIVER_INDEX_FILE), DRIVERS_PCI_DEVICES_PATH);
 
-                // sourceFile is already opened at this point for readahead prebuffering
-                installSuccess = inst_copyFiles(sourceFile, destinationPartition->mountPath, "Sistema Operacional");
-                mappedFile_close(sourceFile);
+                detectDrivers = detectDrivers && driverSelection != NULL;
 
-                if (!installSuccess) {
-                    inst_showFailedCopy(INST_DRIVER_FILE);
-                    currentStep = INSTALL_MAIN_MENU;
-                    continue;
-                }
+                if (unattended) {
+                    printf("Instalando a variante %zu em %s (formatar: %s, MBR: %s, registro: %s, drivers: %s)\n",
+                        osVariantIndex, inst_getTargetList(&targets, true),
+                        formatPartition ? "sim" : "não", setActiveAndDoMBR ? "sim" : "não",
+                        registryUnpackFile, installDrivers ? (detectDrivers ? "deste PC" : "sim") : "não");
 
-                // If the main data copy was successful, we move on to the driver file
-                if (installSuccess && installDrivers) {
-                    sourceFile = inst_openSourceFile(osVariantIndex, INST_DRIVER_FILE, readahead);
-                    QI_ASSERT(sourceFile && "Falha ao abrir o arquivo de driver");
-                    installSuccess = inst_copyFiles(sourceFile, destinationPartition->mountPath, "Biblioteca de Drivers");
-                    mappedFile_close(sourceFile);
-                }
+                    if (resumeInstall)
+                        printf("Continuando a instalação interrompida em %s (%llu arquivos prontos)\n",
+                            resumeState.packFile, (unsigned long long) resumeState.checkpoint.filesDone);
 
-                if (!installSuccess) {
-                    inst_showFailedCopy(INST_DRIVER_FILE);
-                    currentStep = INSTALL_MAIN_MENU;
-                    continue;
+                    fflush(stdout);
                 }
 
-                // If driver data copy was successful, install registry for selceted hardware detection variant
-                if (installSuccess) {
-                    sourceFile = inst_openSourceFile(osVariantIndex, registryUnpackFile, readahead);
-                    QI_ASSERT(sourceFile && "Falha ao abrir o arquivo de registro");
-                    installSuccess = inst_copyFiles(sourceFile, destinationPartition->mountPath, "Registro");
-                    mappedFile_close(sourceFile);
+                // The golden image has the whole driver library
+                goldenFile = (formatPartition && !detectDrivers)
+                    ? inst_openGoldenImage(osVariantIndex, registryUnpackFile, installDrivers, &targets, readahead, &goldenHeader, goldenLayouts)
+                    : NULL;
+
+                if (goldenFile != NULL) {
+                    // Takes the place of formatting and unpacking, the packs aren't needed at all
+                    if (sourceFile != NULL)
+                        mappedFile_close(sourceFile);
+
+                    sourceFile = NULL;
+
+                    // There are no files to check one by one here
+                    verify_manifestDestroy(manifest);
+                    manifest = NULL;
+
+                    installSuccess = inst_installGoldenImage(goldenFile, &goldenHeader, goldenLayouts, &targets);
+                    mappedFile_close(goldenFile);
+
+                    if (!installSuccess) {
+                        inst_writeStats(false);
+                        inst_showFailedCopy(INST_GOLDEN_FILE);
+                        currentStep = INSTALL_MAIN_MENU;
+                        continue;
+                    }
+                } else {
+                    // Format partitions
+                    for (size_t i = 0; i < targets.count && formatPartition; i++) {
+                        util_Partition *part = targets.parts[i];
+
+                        if (!inst_formatPartition(part, inst_getSectorsPerCluster(part, osVariantIndex, registryUnpackFile, installDrivers))) {
+                            inst_showFailedFormat(part);
+                            targets.ok[i] = false;
+                        }
+                    }
+
+                    inst_stats.formatMicroseconds = util_getMicroseconds() - phaseStart;
+                    trace_span(TRACE_TRACK_MAIN, "format", phaseStart, formatPartition, NULL);
+
+                    if (inst_targetsLeft(&targets) == 0) {
+                        installSuccess = false;
+                        currentStep = INSTALL_MAIN_MENU;
+                        continue;
+                    }
+
+                    phaseStart = util_getMicroseconds();
+
+                    for (size_t i = 0; i < targets.count; i++) {
+                        if (targets.ok[i] && !util_mountPartition(targets.parts[i], UTIL_MOUNT_BULK_INSTALL)) {
+                            inst_showFailedMount(targets.parts[i]);
+                            targets.ok[i] = false;
+                        }
+                    }
+
+                    inst_stats.mountMicroseconds = util_getMicroseconds() - phaseStart;
+                    trace_span(TRACE_TRACK_MAIN, "mount", phaseStart, inst_targetsLeft(&targets), NULL);
+                    // If mounting failed, we will display a message and go back after.
+
+                    if (inst_targetsLeft(&targets) == 0) {
+                        installSuccess = false;
+                        currentStep = INSTALL_MAIN_MENU;
+                        continue;
+                    }
+
+                    const char *packs[INST_MAX_PACKS];
+                    const char *packNames[INST_MAX_PACKS];
+                    const char *failedPack = NULL;
+                    journal_State journalState = { 0 };
+                    bool skipPacks = resumeInstall;
+
+                    inst_getPacks(registryUnpackFile, installDrivers, packs, packNames);
+
+                    if (resumeInstall) {
+                        journalState = resumeState;
+                    } else {
+                        journalState.variantIndex = (uint32_t) osVariantIndex;
+                        journalState.installDrivers = installDrivers;
+                        journalState.detectDrivers = detectDrivers;
+                        journalState.setActiveAndDoMBR = setActiveAndDoMBR;
+                        journalState.verify = verifyInstall;
+                        strncpy(journalState.registryFile, registryUnpackFile, JOURNAL_NAME_LENGTH - 1);
+                    }
+
+                    // Only with one target, with several there is no point where they're all done with the same file
+                    journal_Journal *journal = (targets.count == 1) ? journal_create(targets.parts[0]->mountPath) : NULL;
+
+                    for (size_t p = 0; p < INST_MAX_PACKS && installSuccess; p++) {
+                        if (packs[p] == NULL)
+                            continue;
+
+                        // The ones before the one the interrupted install stopped in are done
+                        if (skipPacks && !util_stringEquals(packs[p], journalState.packFile)) {
+                            if (sourceFile != NULL)
+                                mappedFile_close(sourceFile);
+
+                            sourceFile = NULL;
+                            continue;
+                        }
+
+                        if (skipPacks) {
+                            inst_stats.resumedPack = packs[p];
+                            inst_stats.resumedOffset = journalState.checkpoint.offset;
+                            skipPacks = false;
+                        } else {
+                            journalState.checkpoint.offset = 0;
+                            journalState.checkpoint.filesDone = 0;
+                        }
+
+                        // The first one is already opened at this point for readahead prebuffering
+                        if (sourceFile == NULL)
+                            sourceFile = inst_openSourceFile(osVariantIndex, packs[p], readahead);
+
+                        if (sourceFile != NULL) {
+                            strncpy(journalState.packFile, packs[p], JOURNAL_NAME_LENGTH - 1);
+                            journalState.packSize = (uint32_t) mappedFile_getFileSize(sourceFile);
+                            const drivers_Selection *drivers = util_stringEquals(packs[p], INST_DRIVER_FILE) ? driverSelection : NULL;
+                            installSuccess = inst_copyFiles(sourceFile, &targets, packNames[p], manifest, existingFiles, drivers, journal, &journalState);
+                            mappedFile_close(sourceFile);
+                            sourceFile = NULL;
+                        } else {
+                            installSuccess = false;
+                        }
+
+                        failedPack = packs[p];
+                    }
+
+                    // It stays on the disk if this didn't work out, the next run can pick up from there
+                    journal_close(journal, installSuccess);
+
+                    if (!installSuccess) {
+                        inst_writeStats(false);
+                        inst_showFailedCopy(failedPack);
+                        currentStep = INSTALL_MAIN_MENU;
+                        continue;
+                    }
                 }
 
-                if (!installSuccess) {
-                    inst_showFailedCopy(registryUnpackFile);
-                    currentStep = INSTALL_MAIN_MENU;
-                    continue;
+                // Flush everything to disk now, so we know how long that takes
+                phaseStart = util_getMicroseconds();
+                inst_syncWithProgress(&targets);
+                inst_stats.syncMicroseconds = util_getMicroseconds() - phaseStart;
+                trace_span(TRACE_TRACK_MAIN, "sync", phaseStart, 0, NULL);
+
+                if (manifest != NULL)
+                    inst_verifyInstall(manifest, &targets, resumeInstall ? &resumeState : NULL);
+
+                // Failed ones too, if they got that far
+                phaseStart = util_getMicroseconds();
+
+                for (size_t i = 0; i < targets.count; i++) {
+                    if (util_isPartitionMounted(targets.parts[i]))
+                        util_unmountPartition(targets.parts[i]);
                 }
 
-                util_unmountPartition(destinationPartition);
+                inst_stats.mountMicroseconds += util_getMicroseconds() - phaseStart;
+                trace_span(TRACE_TRACK_MAIN, "unmount", phaseStart, 0, NULL);
 
                 // Final step: update MBR, boot sector and boot flag.
-                if (installSuccess && setActiveAndDoMBR) {
-                    installSuccess = inst_setupBootSectorAndMBR(destinationPartition, setActiveAndDoMBR);
+                if (setActiveAndDoMBR) {
+                    phaseStart = util_getMicroseconds();
+
+                    for (size_t i = 0; i < targets.count; i++) {
+                        if (targets.ok[i] && !inst_setupBootSectorAndMBR(targets.parts[i], setActiveAndDoMBR))
+                            targets.ok[i] = false;
+                    }
+
+                    inst_stats.bootSectorMicroseconds = util_getMicroseconds() - phaseStart;
+                    trace_span(TRACE_TRACK_MAIN, "boot sector / MBR", phaseStart, inst_targetsLeft(&targets), NULL);
                 }
 
-                if (installSuccess) {                    
+                installSuccess = (inst_targetsLeft(&targets) == targets.count);
+
+                if (!installSuccess && targets.count > 1) {
+                    inst_messageBox("Erro", "A instalação falhou em: %s", inst_getTargetList(&targets, false));
+                }
+
+                inst_writeStats(installSuccess);
+
+                if (installSuccess && unattended) {
+                    printf("A instalação foi bem-sucedida. Estatísticas em %s\n", INST_STATS_FILE);
+                    doReboot = unattended->reboot;
+                } else if (installSuccess) {                    
                     doReboot = inst_showSuccessAndAskForReboot();
                 } else {
                     inst_showFailMessage();
@@ -899,17 +2255,23 @@ bool inst_main() {
 
     // Flush filesystem writes clear screen yadayada...
 
+    trace_dump(INST_TRACE_FILE);
+
     sync();
 
     util_hardDiskArrayDestroy(hda);
+    verify_manifestDestroy(manifest);
+    drivers_destroy(driverSelection);
 
-    system("clear");
+    if (!unattended)
+        system("clear");
 
     if (doReboot) {
         reboot(RB_AUTOBOOT);
     }
 
-    ad_deinit();
+    if (!unattended)
+        ad_deinit();
 
     return installSuccess;
 }
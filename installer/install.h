@@ -8,6 +8,9 @@
 
 #include <stdbool.h>
 
-bool inst_main();
+#include "unattend.h"
+
+// Runs the installer. If 'unattended' is not NULL, it installs with these settings without any UI.
+bool inst_main(const unattend_Options *unattended);
 
 #endif
\ No newline at end of file
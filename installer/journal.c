@@ -0,0 +1,160 @@
+/*
+ * LUNMERCY - Resume journal
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "qi_assert.h"
+#include "trace.h"
+#include "util.h"
+
+#define JOURNAL_MAGIC "QIRESUM1"
+
+/*
+ * The record, little endian. It's rewritten in place and smaller than a sector, so it's either the old one or the new one.
+ * The CRC32 is there in case the disk thinks otherwise.
+ *
+ *    0  Magic
+ *    8  Variant index
+ *   12  Flags (JOURNAL_FLAG_*)
+ *   16  Registry pack file name
+ *   32  Pack file name
+ *   48  Pack size
+ *   52  Checkpoint offset
+ *   56  Checkpoint files done
+ *   60  CRC32 of everything before it
+ */
+#define JOURNAL_RECORD_SIZE (64)
+#define JOURNAL_FLAG_DRIVERS (1 << 0)
+#define JOURNAL_FLAG_MBR (1 << 1)
+#define JOURNAL_FLAG_DETECT_DRIVERS (1 << 2)
+#define JOURNAL_FLAG_VERIFY (1 << 3)
+
+struct journal_Journal {
+    int fd;
+    char *path;
+};
+
+static void journal_putUInt32(uint8_t *buf, size_t offset, uint32_t value) {
+    buf[offset] = (uint8_t) value;
+    buf[offset + 1] = (uint8_t) (value >> 8);
+    buf[offset + 2] = (uint8_t) (value >> 16);
+    buf[offset + 3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t journal_getUInt32(const uint8_t *buf, size_t offset) {
+    return (uint32_t) buf[offset] | ((uint32_t) buf[offset + 1] << 8) | ((uint32_t) buf[offset + 2] << 16) | ((uint32_t) buf[offset + 3] << 24);
+}
+
+static char *journal_getPath(const char *installPath) {
+    char *path = malloc(strlen(installPath) + sizeof(JOURNAL_FILE_NAME) + 1);
+    QI_ASSERT(path);
+    sprintf(path, "%s/%s", installPath, JOURNAL_FILE_NAME);
+    return path;
+}
+
+bool journal_read(const char *installPath, journal_State *state) {
+    QI_ASSERT(installPath != NULL && state != NULL);
+
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    char *path = journal_getPath(installPath);
+    int fd = open(path, O_RDONLY);
+    bool success = fd >= 0 && read(fd, record, sizeof(record)) == (ssize_t) sizeof(record);
+
+    if (fd >= 0)
+        close(fd);
+
+    free(path);
+
+    success = success && memcmp(record, JOURNAL_MAGIC, 8) == 0
+                      && journal_getUInt32(record, 60) == util_crc32(0, record, 60)
+                      && record[16 + JOURNAL_NAME_LENGTH - 1] == 0x00
+                      && record[32 + JOURNAL_NAME_LENGTH - 1] == 0x00;
+
+    if (!success)
+        return false;
+
+    uint32_t flags = journal_getUInt32(record, 12);
+
+    memset(state, 0, sizeof(journal_State));
+    state->variantIndex = journal_getUInt32(record, 8);
+    state->installDrivers = (flags & JOURNAL_FLAG_DRIVERS) != 0;
+    state->detectDrivers = (flags & JOURNAL_FLAG_DETECT_DRIVERS) != 0;
+    state->setActiveAndDoMBR = (flags & JOURNAL_FLAG_MBR) != 0;
+    state->verify = (flags & JOURNAL_FLAG_VERIFY) != 0;
+    memcpy(state->registryFile, record + 16, JOURNAL_NAME_LENGTH);
+    memcpy(state->packFile, record + 32, JOURNAL_NAME_LENGTH);
+    state->packSize = journal_getUInt32(record, 48);
+    state->checkpoint.offset = journal_getUInt32(record, 52);
+    state->checkpoint.filesDone = journal_getUInt32(record, 56);
+
+    return true;
+}
+
+journal_Journal *journal_create(const char *installPath) {
+    QI_ASSERT(installPath != NULL);
+
+    journal_Journal *journal = calloc(1, sizeof(journal_Journal));
+    QI_ASSERT(journal);
+
+    // Not truncated, an old record stays good until journal_write replaces it
+    journal->path = journal_getPath(installPath);
+    journal->fd = open(journal->path, O_WRONLY | O_CREAT, 0666);
+
+    if (journal->fd < 0) {
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+
+    return journal;
+}
+
+bool journal_write(journal_Journal *journal, const journal_State *state) {
+    QI_ASSERT(journal != NULL && state != NULL);
+
+    uint8_t record[JOURNAL_RECORD_SIZE] = {0};
+    uint64_t start = trace_timestamp();
+
+    memcpy(record, JOURNAL_MAGIC, 8);
+    journal_putUInt32(record, 8, state->variantIndex);
+    journal_putUInt32(record, 12, (state->installDrivers ? JOURNAL_FLAG_DRIVERS : 0) | (state->setActiveAndDoMBR ? JOURNAL_FLAG_MBR : 0)
+                                | (state->detectDrivers ? JOURNAL_FLAG_DETECT_DRIVERS : 0) | (state->verify ? JOURNAL_FLAG_VERIFY : 0));
+    // The record is zeroed, so the names stay terminated
+    memcpy(record + 16, state->registryFile, strnlen(state->registryFile, JOURNAL_NAME_LENGTH - 1));
+    memcpy(record + 32, state->packFile, strnlen(state->packFile, JOURNAL_NAME_LENGTH - 1));
+    journal_putUInt32(record, 48, state->packSize);
+    journal_putUInt32(record, 52, (uint32_t) state->checkpoint.offset);
+    journal_putUInt32(record, 56, state->checkpoint.filesDone);
+    journal_putUInt32(record, 60, util_crc32(0, record, 60));
+
+    // The files first, the record must never be ahead of them
+    bool success = syncfs(journal->fd) == 0;
+    success = success && pwrite(journal->fd, record, sizeof(record), 0) == (ssize_t) sizeof(record);
+    success = success && fdatasync(journal->fd) == 0;
+
+    trace_span(TRACE_TRACK_MAIN, "journal", start, (int64_t) state->checkpoint.offset, state->packFile);
+    return success;
+}
+
+void journal_close(journal_Journal *journal, bool remove) {
+    if (journal == NULL)
+        return;
+
+    close(journal->fd);
+
+    if (remove)
+        unlink(journal->path);
+
+    free(journal->path);
+    free(journal);
+}
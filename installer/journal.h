@@ -0,0 +1,49 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * LUNMERCY - Resume journal
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * While the packs are unpacked to a single partition, a small record of how far that got is kept in a file in its
+ * root directory. Before the record is updated everything written to the partition so far is flushed, so whatever
+ * it says is done really is on the disk.
+ *
+ * If the install is cut short (the CD drive gives up, the power goes), the next run finds the record and can pick up
+ * at the last checkpoint instead of unpacking gigabytes again. The file that was being written then is unpacked
+ * again from its start. Once everything is unpacked the record is deleted.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mercypak.h"
+
+#define JOURNAL_FILE_NAME "QIRESUME.DAT"
+#define JOURNAL_NAME_LENGTH (16)    // Pack file names are 8.3
+
+typedef struct {
+    uint32_t variantIndex;
+    bool installDrivers;
+    bool detectDrivers;                     // Only the drivers for this machine's hardware (see drivers.h)
+    bool setActiveAndDoMBR;
+    bool verify;                            // Read the files back afterwards (see verify.h)
+    char registryFile[JOURNAL_NAME_LENGTH];
+    char packFile[JOURNAL_NAME_LENGTH];     // The pack being unpacked, the ones that go before it are done
+    uint32_t packSize;                      // To tell if it's still the same pack
+    mercypak_Checkpoint checkpoint;         // Of packFile, { 0, 0 } if it wasn't started yet
+} journal_State;
+
+typedef struct journal_Journal journal_Journal;
+
+// Reads the journal in installPath. Returns false if there isn't one or it's broken.
+bool journal_read(const char *installPath, journal_State *state);
+// Opens the journal in installPath for writing, creating it if needed. Returns NULL if that didn't work.
+journal_Journal *journal_create(const char *installPath);
+// Flushes everything written to the partition so far and then records state. Returns false if that didn't work.
+bool journal_write(journal_Journal *journal, const journal_State *state);
+// Closes the journal. If the install is done it is deleted, otherwise the next run can pick up from it.
+void journal_close(journal_Journal *journal, bool remove);
+
+#endif
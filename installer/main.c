@@ -10,11 +10,16 @@
    just a main function that calls the installer. I should rework this sometime */
 
 #include "install.h"
+#include "unattend.h"
 
 int main(int argc, char *argv[]) {
-    bool ret = inst_main();
+    unattend_Options unattended;
+
+    // Any arguments mean unattended install (see unattend.h)
+    if (!unattend_parseArguments(argc, argv, &unattended))
+        return -1;
+
+    bool ret = inst_main(unattended.enabled ? &unattended : NULL);
 
-    (void) argc;
-    (void) argv;
     return ret ? 0 : -1;
 }
\ No newline at end of file
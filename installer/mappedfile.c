@@ -11,6 +11,8 @@
  */
 
 #include "mappedfile.h"
+#include "trace.h"
+#include "util.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,6 +34,9 @@ typedef struct MappedFile {
     size_t size;
     size_t pos;
     uint8_t *mem;
+    mappedFile_Stats stats;
+    bool checksumming;
+    uint32_t crc32;
 } MappedFile;
 
 static inline void mappedFile_advancePosAndReadAhead(MappedFile *file, size_t len) {
@@ -42,6 +47,8 @@ static inline void mappedFile_advancePosAndReadAhead(MappedFile *file, size_t le
     file->pos += len;
 
     if ((oldPage != newPage) && ((file->pos + adviseLen ) <= file->size)) {
+        file->stats.adviseCalls++;
+        trace_instant(TRACE_TRACK_MAIN, "madvise", (int64_t) adviseLen);
         if (madvise(file->mem + newPage, adviseLen, MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
             perror(__func__);
             assert(false && "madvise failed");
@@ -75,6 +82,7 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead) {
     assert (file->mem);
 
     if (file->size > MEM_PAGE_SIZE) {
+        file->stats.adviseCalls++;
         if (madvise(file->mem, MIN(readahead, file->size), MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
             perror(__func__);
             assert(false && "madvise failed");
@@ -96,6 +104,8 @@ void mappedFile_close(MappedFile *file) {
 }
 
 bool mappedFile_copyToFiles(MappedFile *file, size_t FileCount, int *outfds, size_t len) {
+    uint64_t writeStart = util_getMicroseconds();
+
     for (size_t i = 0; i < FileCount; i++) {
         ssize_t written = write(outfds[i], file->mem+file->pos, len);
 
@@ -108,6 +118,17 @@ bool mappedFile_copyToFiles(MappedFile *file, size_t FileCount, int *outfds, siz
 
     }
 
+    if (file->checksumming) {
+        file->crc32 = util_crc32(file->crc32, file->mem + file->pos, len);
+    }
+
+    // Page faults instead of read() calls, so the data taken from the mapping counts as read
+    file->stats.writeMicroseconds += util_getMicroseconds() - writeStart;
+    trace_span(TRACE_TRACK_MAIN, "write", writeStart, (int64_t) len * (int64_t) FileCount, NULL);
+    file->stats.writeCalls += FileCount;
+    file->stats.bytesWritten += (uint64_t) len * FileCount;
+    file->stats.bytesRead += len;
+
     mappedFile_advancePosAndReadAhead(file, len);
 
     return true;
@@ -120,6 +141,10 @@ static __INLINE__ size_t mappedFile_available(MappedFile *file) {
 bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
     if (mappedFile_available(file) >= len) {
         memcpy(dst, file->mem+file->pos, len);
+        if (file->checksumming) {
+            file->crc32 = util_crc32(file->crc32, dst, len);
+        }
+        file->stats.bytesRead += len;
         mappedFile_advancePosAndReadAhead(file, len);
         return true;
     } else {
@@ -139,9 +164,35 @@ __INLINE__ bool mappedFile_getUInt16(MappedFile *file, uint16_t *dst) {
 __INLINE__ bool mappedFile_getUInt32(MappedFile *file, uint32_t *dst) {
     return mappedFile_read(file, dst, sizeof(uint32_t)); 
 }
+bool mappedFile_skip(MappedFile *file, size_t len) {
+    if (mappedFile_available(file) < len) {
+        return false;
+    }
+    // Pages that aren't touched are never read, and the read ahead picks up again with the next read
+    file->pos += len;
+    return true;
+}
+void mappedFile_checksumBegin(MappedFile *file) {
+    file->checksumming = true;
+    file->crc32 = 0;
+}
+uint32_t mappedFile_checksumEnd(MappedFile *file) {
+    file->checksumming = false;
+    return file->crc32;
+}
 __INLINE__ size_t mappedFile_getFileSize(MappedFile *file) {
     return file->size;
 }
 __INLINE__ size_t mappedFile_getPosition(MappedFile *file) {
     return file->pos;
 }
+void mappedFile_getStats(MappedFile *file, mappedFile_Stats *stats) {
+    *stats = file->stats;
+}
+size_t mappedFile_getReadProblems(MappedFile *file, mappedFile_ReadProblem *problems, size_t max) {
+    // Read errors on a mapping are a SIGBUS, there's nothing to retry or report here
+    (void) file;
+    (void) problems;
+    (void) max;
+    return 0;
+}
@@ -23,6 +23,31 @@
 
 typedef struct MappedFile MappedFile;
 
+// I/O counters of a mapped file, used for benchmarking (see bench.c)
+typedef struct {
+    uint64_t readCalls;         // read() calls on the source file
+    uint64_t bytesRead;         // Bytes read from the source file
+    uint64_t adviseCalls;       // madvise() calls on the mapping
+    uint64_t writeCalls;        // write() calls to output files
+    uint64_t bytesWritten;      // Bytes written to output files
+    uint64_t waits;             // How often the consumer had to wait for data that wasn't read yet
+    uint64_t waitMicroseconds;  // Time the consumer spent waiting for data
+    uint64_t writeMicroseconds; // Time spent in write() calls to output files (with mmap this includes page faults on the source!)
+    uint64_t peakBuffered;      // Most bytes held in memory at once
+    uint64_t readRetries;       // Reads of the source file that had to be tried again
+    uint64_t readErrors;        // Reads of the source file that didn't work even after that
+} mappedFile_Stats;
+
+#define MAPPEDFILE_MAX_READ_PROBLEMS (16)
+
+// A read of the source file that had to be retried or that failed for good (the data there reads as zeroes then)
+typedef struct {
+    uint64_t offset;            // Where in the file the read went wrong
+    uint32_t length;            // How much was left to read there
+    uint32_t attempts;          // How often it was tried
+    bool failed;                // false if one of the retries worked
+} mappedFile_ReadProblem;
+
 // Open the mapped File. Readahead is a parameter indicating how much RAM the system can spare to read ahead.
 MappedFile *mappedFile_open(const char *filename, size_t readahead);
 // Closes the file and releases all resources associated with it
@@ -30,6 +55,10 @@ void        mappedFile_close(MappedFile *file);
 
 // File read operations - these all advance the internal read position.
 
+// A read at the end of the file returns false and leaves the read position where it was.
+// With the multi threaded backend, a block that couldn't be read from the source file (see mappedFile_ReadProblem)
+// reads as zeroes. That returns false too, but the zeroes were handed out, so the position is past them.
+
 // Copy data from the file at the current read position to a set of open file descriptors, pointed to by fileCount and outfds.
 bool        mappedFile_copyToFiles(MappedFile *file, size_t fileCount, int *outfds, size_t len);
 // Reads data of arbitrary length and copies it to dst.
@@ -40,10 +69,22 @@ bool        mappedFile_getUInt8(MappedFile *file, uint8_t *dst);
 bool        mappedFile_getUInt16(MappedFile *file, uint16_t *dst);
 // Reads an uint32_t and copies it to dst.
 bool        mappedFile_getUInt32(MappedFile *file, uint32_t *dst);
+// Skips len bytes. Data that was read ahead already is thrown away, anything after that isn't read at all.
+// Returns false if the file isn't that long.
+bool        mappedFile_skip(MappedFile *file, size_t len);
+
+// Starts a CRC32 (see util_crc32) over the data read or copied from now on
+void        mappedFile_checksumBegin(MappedFile *file);
+// Stops the CRC32 and gets it
+uint32_t    mappedFile_checksumEnd(MappedFile *file);
 
 // Obtains the size of the opened file
 size_t      mappedFile_getFileSize(MappedFile *file);
 // Obtains the current read position of the opened file
 size_t      mappedFile_getPosition(MappedFile *file);
+// Gets the I/O counters of the opened file
+void        mappedFile_getStats(MappedFile *file, mappedFile_Stats *stats);
+// Gets up to max of the read problems so far (the first MAPPEDFILE_MAX_READ_PROBLEMS are kept). Returns how many there were.
+size_t      mappedFile_getReadProblems(MappedFile *file, mappedFile_ReadProblem *problems, size_t max);
 
 #endif
\ No newline at end of file
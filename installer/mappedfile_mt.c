@@ -14,6 +14,8 @@
  */
 
 #include "mappedfile.h"
+#include "trace.h"
+#include "util.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,12 +28,21 @@
 #include <pthread.h>
 #include <errno.h>
 
+// Can be overridden at build time to compare block sizes (see build_bench.sh)
+#ifdef MAPPEDFILE_BLOCK_SIZE
+#define MEM_BLOCK_SIZE (MAPPEDFILE_BLOCK_SIZE)
+#else
 #define MEM_BLOCK_SIZE (1 * 1024 * 1024)
+#endif
+
+#define MAPPEDFILE_READ_ATTEMPTS (3)
+#define MAPPEDFILE_READ_RETRY_DELAY (100000)   // Microseconds, gives a CD drive a moment to recalibrate
 
 #define __INLINE__ inline __attribute__((always_inline))
 
 typedef struct mappedFile_MemBlock {
     uint8_t mem[MEM_BLOCK_SIZE];
+    bool failed;    // Couldn't be read
     struct mappedFile_MemBlock *next;
 } mappedFile_MemBlock;
 
@@ -45,11 +56,21 @@ typedef struct MappedFile {
     
     bool closing;
     bool readaheadComplete;
+    bool seekPending;       // The reader thread has to continue at seekTo (mappedFile_skip)
+    size_t seekTo;
     
     size_t blockCount;
     size_t maxBlocks;
     mappedFile_MemBlock *memFirst;
     mappedFile_MemBlock *memLast;
+
+    mappedFile_Stats stats;
+
+    size_t problemCount;
+    mappedFile_ReadProblem problems[MAPPEDFILE_MAX_READ_PROBLEMS];
+
+    bool checksumming;
+    uint32_t crc32;
 } MappedFile;
 
 static __INLINE__ void mappedFile_lock(MappedFile *mf) {
@@ -75,6 +96,8 @@ static __INLINE__ void mappedFile_disposeBlock(MappedFile *mf) {
         mf->memLast = NULL;
     }
     mappedFile_unlock(mf);
+
+    trace_instant(TRACE_TRACK_MAIN, "dispose block", (int64_t) mf->blockCount);
 }
 
 static __INLINE__ mappedFile_MemBlock *mappedFile_getCurrentBlock(MappedFile *file) {
@@ -91,12 +114,77 @@ static __INLINE__ mappedFile_MemBlock *mappedFile_waitForValidBlockAndGet(Mapped
 
     size_t blockThreshold = MIN(file->maxBlocks / 2, 8);
 
+    uint64_t waitStart = util_getMicroseconds();
+    file->stats.waits++;
+
     while (file->blockCount < blockThreshold && file->readaheadComplete == false) {
         sched_yield();
     }
+
+    file->stats.waitMicroseconds += util_getMicroseconds() - waitStart;
+    trace_span(TRACE_TRACK_MAIN, "wait for data", waitStart, (int64_t) file->blockCount, NULL);
     return mappedFile_getCurrentBlock(file);
 }
 
+static void mappedFile_addReadProblem(MappedFile *mf, uint64_t offset, size_t length, uint32_t attempts, bool failed) {
+    mappedFile_lock(mf);
+
+    if (mf->problemCount < MAPPEDFILE_MAX_READ_PROBLEMS) {
+        mappedFile_ReadProblem *problem = &mf->problems[mf->problemCount];
+        problem->offset = offset;
+        problem->length = (uint32_t) length;
+        problem->attempts = attempts;
+        problem->failed = failed;
+    }
+
+    mf->problemCount++;
+    mf->stats.readRetries += attempts - 1;
+    mf->stats.readErrors += failed ? 1 : 0;
+    mappedFile_unlock(mf);
+
+    trace_instant(TRACE_TRACK_READER, failed ? "read error" : "read retry", (int64_t) offset);
+}
+
+// Reads toRead bytes at offset, trying again a few times if the medium acts up. Returns false if that didn't help.
+static bool mappedFile_readRetrying(MappedFile *mf, uint8_t *dst, size_t toRead, uint64_t offset) {
+    uint32_t attempts = 1;
+    uint64_t problemOffset = 0;
+    size_t problemLength = 0;
+
+    while (toRead) {
+        ssize_t bytesRead = pread(mf->fd, dst, toRead, (off_t) offset);
+
+        if (bytesRead > 0) {
+            dst += bytesRead;
+            toRead -= (size_t) bytesRead;
+            offset += (uint64_t) bytesRead;
+            continue;
+        }
+
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+
+        // An error, or the file ended early (it was given to us with a size!)
+        if (attempts == 1) {
+            problemOffset = offset;
+            problemLength = toRead;
+        }
+
+        if (attempts == MAPPEDFILE_READ_ATTEMPTS) {
+            mappedFile_addReadProblem(mf, problemOffset, problemLength, attempts, true);
+            return false;
+        }
+
+        attempts++;
+        usleep(MAPPEDFILE_READ_RETRY_DELAY);
+    }
+
+    if (attempts > 1)
+        mappedFile_addReadProblem(mf, problemOffset, problemLength, attempts, false);
+
+    return true;
+}
+
 static __INLINE__ void mappedFile_readAhead1Block(MappedFile *mf) {
     size_t toRead = mf->size - mf->readaheadPos;
     toRead = MIN(toRead, MEM_BLOCK_SIZE);
@@ -104,20 +192,46 @@ static __INLINE__ void mappedFile_readAhead1Block(MappedFile *mf) {
     mappedFile_MemBlock *block = malloc(sizeof(mappedFile_MemBlock));
     block->next = NULL;
 
-    ssize_t bytesRead = read(mf->fd, block->mem, toRead);
+    uint64_t readStart = trace_timestamp();
+    block->failed = !mappedFile_readRetrying(mf, block->mem, toRead, mf->readaheadPos);
+    trace_span(TRACE_TRACK_READER, "read block", readStart, (int64_t) toRead, NULL);
 
-    if (bytesRead < 0 || (size_t)bytesRead != toRead) {
-        printf("Read error!\n");
-        assert(false);
+    // The consumer finds out when it gets to this block, until then it's zeroes
+    if (block->failed) {
+        memset(block->mem, 0, toRead);
     }
 
     mappedFile_lock(mf);
     mf->readaheadPos += toRead;
     mf->blockCount += 1;
+    mf->stats.readCalls += 1;
+    mf->stats.bytesRead += toRead;
+    mf->stats.peakBuffered = MAX(mf->stats.peakBuffered, (uint64_t) mf->blockCount * MEM_BLOCK_SIZE);
     if (mf->memFirst == NULL) mf->memFirst = block;
     if (mf->memLast != NULL) mf->memLast->next = block;
     mf->memLast = block;
     mappedFile_unlock(mf);
+
+    trace_counter("buffered blocks", (int64_t) mf->blockCount);
+}
+
+// Throws away everything read ahead and continues reading at seekTo
+static void mappedFile_seekReader(MappedFile *mf) {
+    mappedFile_lock(mf);
+
+    while (mf->memFirst != NULL) {
+        mappedFile_MemBlock *toDispose = mf->memFirst;
+        mf->memFirst = toDispose->next;
+        free(toDispose);
+    }
+
+    mf->memLast = NULL;
+    mf->blockCount = 0;
+    mf->readaheadPos = mf->seekTo;
+    mf->seekPending = false;
+    mappedFile_unlock(mf);
+
+    trace_instant(TRACE_TRACK_READER, "seek", (int64_t) mf->seekTo);
 }
 
 static void *mappedFile_threadFunc(void *param) {
@@ -125,6 +239,10 @@ static void *mappedFile_threadFunc(void *param) {
     
     while (mf->closing == false && mf->readaheadPos < mf->size) {
         sched_yield();
+        if (mf->seekPending) {
+            mappedFile_seekReader(mf);
+            continue;
+        }
         if (mf->blockCount == mf->maxBlocks) {
             continue;
         }
@@ -176,6 +294,9 @@ void mappedFile_close(MappedFile *file) {
 }
 
 bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
+    uint8_t *out = (uint8_t *) dst;
+    bool success = true;
+
     if (file->pos >= file->size) {
         return false;
     }
@@ -188,8 +309,14 @@ bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
         size_t toCopy = MIN(len, maxIterationSize);
 
         mappedFile_MemBlock *currentBlock = mappedFile_waitForValidBlockAndGet(file);
-        memcpy(dst, currentBlock->mem + positionInBlock, toCopy);
+        memcpy(out, currentBlock->mem + positionInBlock, toCopy);
+        success &= !currentBlock->failed;
+
+        if (file->checksumming) {
+            file->crc32 = util_crc32(file->crc32, out, toCopy);
+        }
 
+        out += toCopy;
         leftInBlock -= toCopy;
         len -= toCopy;
         file->pos += toCopy;
@@ -199,11 +326,13 @@ bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
         }
     }
 
-    return true;
+    return success;
 }
 
 // This code is very duplicated but IDK how to make this universal without costing some performance... :(
 bool mappedFile_copyToFiles(MappedFile *file, size_t fileCount, int *outfds, size_t len) {
+    bool success = true;
+
     if (file->pos >= file->size) {
         return false;
     }
@@ -216,6 +345,12 @@ bool mappedFile_copyToFiles(MappedFile *file, size_t fileCount, int *outfds, siz
         size_t toCopy = MIN(len, maxIterationSize);
 
         mappedFile_MemBlock *currentBlock = mappedFile_waitForValidBlockAndGet(file);
+        uint64_t writeStart = util_getMicroseconds();
+        success &= !currentBlock->failed;
+
+        if (file->checksumming) {
+            file->crc32 = util_crc32(file->crc32, currentBlock->mem + positionInBlock, toCopy);
+        }
 
         for (size_t i = 0; i < fileCount; i++) {
             ssize_t written = write(outfds[i], currentBlock->mem + positionInBlock, toCopy);
@@ -228,6 +363,11 @@ bool mappedFile_copyToFiles(MappedFile *file, size_t fileCount, int *outfds, siz
             }
         }
 
+        file->stats.writeMicroseconds += util_getMicroseconds() - writeStart;
+        trace_span(TRACE_TRACK_MAIN, "write", writeStart, (int64_t) toCopy * (int64_t) fileCount, NULL);
+        file->stats.writeCalls += fileCount;
+        file->stats.bytesWritten += (uint64_t) toCopy * fileCount;
+
         leftInBlock -= toCopy;
         len -= toCopy;
         file->pos += toCopy;
@@ -237,6 +377,42 @@ bool mappedFile_copyToFiles(MappedFile *file, size_t fileCount, int *outfds, siz
         }
     }
 
+    return success;
+}
+
+bool mappedFile_skip(MappedFile *file, size_t len) {
+    if (len > file->size - file->pos) {
+        return false;
+    }
+
+    size_t target = file->pos + len;
+    size_t targetBlockStart = target - target % MEM_BLOCK_SIZE;
+    size_t blockStart = file->pos - file->pos % MEM_BLOCK_SIZE;
+
+    mappedFile_lock(file);
+    bool seek = targetBlockStart > file->readaheadPos && targetBlockStart < file->size;
+
+    if (seek) {
+        file->seekTo = targetBlockStart;
+        file->seekPending = true;
+    }
+
+    mappedFile_unlock(file);
+
+    if (seek) {
+        // The reader only looks at this between blocks, so this can take as long as reading one
+        while (file->seekPending) {
+            sched_yield();
+        }
+    } else {
+        // It's (about to be) read already, fast forward through it
+        for (; blockStart < targetBlockStart; blockStart += MEM_BLOCK_SIZE) {
+            mappedFile_waitForValidBlockAndGet(file);
+            mappedFile_disposeBlock(file);
+        }
+    }
+
+    file->pos = target;
     return true;
 }
 
@@ -249,9 +425,29 @@ __INLINE__ bool mappedFile_getUInt16(MappedFile *file, uint16_t *dst) {
 __INLINE__ bool mappedFile_getUInt32(MappedFile *file, uint32_t *dst) {
     return mappedFile_read(file, dst, sizeof(uint32_t)); 
 }
+void mappedFile_checksumBegin(MappedFile *file) {
+    file->checksumming = true;
+    file->crc32 = 0;
+}
+uint32_t mappedFile_checksumEnd(MappedFile *file) {
+    file->checksumming = false;
+    return file->crc32;
+}
 __INLINE__ size_t mappedFile_getFileSize(MappedFile *file) {
     return file->size;
 }
 __INLINE__ size_t mappedFile_getPosition(MappedFile *file) {
     return file->pos;
 }
+void mappedFile_getStats(MappedFile *file, mappedFile_Stats *stats) {
+    mappedFile_lock(file);
+    *stats = file->stats;
+    mappedFile_unlock(file);
+}
+size_t mappedFile_getReadProblems(MappedFile *file, mappedFile_ReadProblem *problems, size_t max) {
+    mappedFile_lock(file);
+    size_t count = file->problemCount;
+    memcpy(problems, file->problems, MIN(max, MIN(count, MAPPEDFILE_MAX_READ_PROBLEMS)) * sizeof(mappedFile_ReadProblem));
+    mappedFile_unlock(file);
+    return count;
+}
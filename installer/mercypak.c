@@ -0,0 +1,752 @@
+/*
+ * LUNMERCY - MercyPak extraction engine
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "mercypak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/msdos_fs.h>
+
+#include "fanout.h"
+#include "qi_assert.h"
+#include "trace.h"
+#include "util.h"
+
+#pragma pack(1)
+
+typedef struct {
+    uint8_t fileFlags;
+    uint16_t fileDate;
+    uint16_t fileTime;
+    uint32_t fileSize;
+    int32_t fileno;
+} mercypak_FileDescriptor;
+
+#pragma pack()
+
+// -sizeof(int) because the fileno is not part of the descriptor read from the mercypak file
+#define MERCYPAK_FILE_DESCRIPTOR_SIZE (sizeof(mercypak_FileDescriptor) - sizeof(int))
+// -sizeof(uint32_t) because the filesize is not part of the descriptor read from the mercypak v2 file
+#define MERCYPAK_V2_FILE_DESCRIPTOR_SIZE ((MERCYPAK_FILE_DESCRIPTOR_SIZE) - sizeof(uint32_t))
+
+#define MERCYPAK_V2_MAX_IDENTICAL_FILES (16)
+
+#define MERCYPAK_VERIFY_CHUNK_SIZE (64 * 1024)
+#define MERCYPAK_REFRESH_CHUNK_SIZE (64 * 1024)
+
+#define MERCYPAK_V1_MAGIC "ZIEG"
+#define MERCYPAK_V2_MAGIC "MRCY"
+
+static inline void mercypak_phaseBegin(const mercypak_Callbacks *cb, mercypak_Phase phase, size_t total) {
+    if (cb && cb->phaseBegin) cb->phaseBegin(cb->userData, phase, total);
+}
+
+static inline void mercypak_progress(const mercypak_Callbacks *cb, mercypak_Phase phase, size_t current) {
+    if (cb && cb->progress) cb->progress(cb->userData, phase, current);
+}
+
+static inline void mercypak_phaseEnd(const mercypak_Callbacks *cb, mercypak_Phase phase) {
+    if (cb && cb->phaseEnd) cb->phaseEnd(cb->userData, phase);
+}
+
+static inline bool mercypak_wantsChecksums(const mercypak_Callbacks *cb) {
+    return cb && cb->fileWritten;
+}
+
+/* Call before reading the data of a file, mercypak_checksumEnd gets its CRC32 afterwards */
+static inline void mercypak_checksumBegin(const mercypak_Callbacks *cb, MappedFile *file) {
+    if (mercypak_wantsChecksums(cb)) mappedFile_checksumBegin(file);
+}
+
+static inline uint32_t mercypak_checksumEnd(const mercypak_Callbacks *cb, MappedFile *file) {
+    return mercypak_wantsChecksums(cb) ? mappedFile_checksumEnd(file) : 0;
+}
+
+static inline void mercypak_fileWritten(const mercypak_Callbacks *cb, const char *path, uint32_t size, uint32_t crc32) {
+    if (mercypak_wantsChecksums(cb)) cb->fileWritten(cb->userData, path, size, crc32);
+}
+
+static inline void mercypak_checkpoint(const mercypak_Callbacks *cb, MappedFile *file, uint32_t filesDone) {
+    if (cb && cb->checkpoint) {
+        mercypak_Checkpoint checkpoint = { mappedFile_getPosition(file), filesDone };
+        cb->checkpoint(cb->userData, &checkpoint);
+    }
+}
+
+/* Gets a MercyPak string (8 bit length + n chars) into dst. Must be a buffer of >= 256 bytes size. */
+static inline bool mercypak_getString(MappedFile *file, char *dst) {
+    bool success;
+    uint8_t count;
+    success = mappedFile_getUInt8(file, &count);
+    success &= mappedFile_read(file, (uint8_t*) dst, (size_t) (count));
+    dst[(size_t) count] = 0x00;
+    return success;
+}
+
+/* Opens a destination file for writing. Returns -1 on error. */
+static inline int mercypak_openOutputFile(const char *path, mercypak_Stats *stats) {
+    uint64_t start = util_getMicroseconds();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    stats->openMicroseconds += util_getMicroseconds() - start;
+    trace_span(TRACE_TRACK_MAIN, "open", start, fd, path);
+    stats->openCalls++;
+    return fd;
+}
+
+/* Applies DOS time stamp and attributes and closes a destination file */
+static inline bool mercypak_finishOutputFile(int fd, const mercypak_FileDescriptor *desc, mercypak_Stats *stats) {
+    bool success = true;
+    uint64_t start = util_getMicroseconds();
+    success &= util_setDosFileTime(fd, desc->fileDate, desc->fileTime);
+    success &= util_setDosFileAttributes(fd, desc->fileFlags);
+    uint64_t metadataDone = util_getMicroseconds();
+    trace_span(TRACE_TRACK_MAIN, "metadata", start, fd, NULL);
+    close(fd);
+    stats->metadataMicroseconds += metadataDone - start;
+    stats->closeMicroseconds += util_getMicroseconds() - metadataDone;
+    trace_span(TRACE_TRACK_MAIN, "close", metadataDone, fd, NULL);
+    stats->metadataCalls += 2;
+    stats->closeCalls++;
+    return success;
+}
+
+/* For picking which copies of a file are written, there is none when all of them just are */
+typedef struct {
+    mercypak_ExistingFiles existing;
+    uint8_t *packData;          // Buffers for comparing with the files that are there already
+    uint8_t *fileData;
+} mercypak_Selector;
+
+typedef enum {
+    MERCYPAK_COPY_SKIP = 0,     // Same size and time stamp, left alone
+    MERCYPAK_COPY_COMPARE,      // Same size and time stamp, the contents are compared
+    MERCYPAK_COPY_WRITE,        // Different, written from the pack (from where it started being different)
+    MERCYPAK_COPY_LEAVE_OUT,    // Not wanted, not touched and not reported
+} mercypak_CopyState;
+
+/* Checks if the file on the disk has the size and DOS time stamp of the one in the pack */
+static bool mercypak_isUnchanged(const char *path, uint32_t fileSize, const mercypak_FileDescriptor *desc, mercypak_Stats *stats) {
+    struct stat st;
+    uint64_t start = util_getMicroseconds();
+    bool unchanged = stat(path, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t) st.st_size == fileSize
+                  && st.st_mtime == util_dosTimeToUnixTime(desc->fileDate, desc->fileTime);
+    stats->metadataMicroseconds += util_getMicroseconds() - start;
+    trace_span(TRACE_TRACK_MAIN, "stat", start, unchanged, path);
+    stats->metadataCalls++;
+    return unchanged;
+}
+
+/* Sets the attributes of a file that is left alone again, if they aren't the ones from the pack anymore */
+static bool mercypak_refreshAttributes(int fd, const mercypak_FileDescriptor *desc, mercypak_Stats *stats) {
+    const uint32_t mask = ATTR_RO | ATTR_HIDDEN | ATTR_SYS | ATTR_ARCH;
+    uint32_t attributes = 0;
+    uint64_t start = util_getMicroseconds();
+    bool success = util_getDosFileAttributes(fd, &attributes);
+
+    stats->metadataCalls++;
+
+    if (success && (attributes & mask) != (desc->fileFlags & mask)) {
+        success = util_setDosFileAttributes(fd, desc->fileFlags);
+        stats->metadataCalls++;
+    }
+
+    stats->metadataMicroseconds += util_getMicroseconds() - start;
+    trace_span(TRACE_TRACK_MAIN, "metadata", start, fd, NULL);
+    return success;
+}
+
+static bool mercypak_writeAt(int fd, const uint8_t *data, size_t length, uint64_t offset, mercypak_Stats *stats) {
+    uint64_t start = util_getMicroseconds();
+    bool success = pwrite(fd, data, length, (off_t) offset) == (ssize_t) length;
+    stats->writeMicroseconds += util_getMicroseconds() - start;
+    stats->writeCalls++;
+    return success;
+}
+
+/* Writes the copies of a file (one, or the identical ones in a v2 pack) with the names relative to destPath, the
+   data is next in the pack. Copies that aren't wanted or are the same on the disk already are left alone, if none
+   of them need the data it is skipped. Returns false if it can't go on, success is cleared for errors that are only
+   about one file. */
+static bool mercypak_writeSelected(MappedFile *file, char *destPath, char *destPathAppend, char (*names)[256],
+                                   const mercypak_FileDescriptor *descs, uint32_t count, uint32_t fileSize,
+                                   const mercypak_Selector *selector, const mercypak_Callbacks *cb, mercypak_Stats *stats, bool *success) {
+    int fds[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    int writeFds[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    mercypak_CopyState states[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    uint32_t writing = 0;
+    uint32_t comparing = 0;
+    uint32_t leftOut = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        strcpy(destPathAppend, names[i]);
+        states[i] = MERCYPAK_COPY_WRITE;
+        fds[i] = -1;
+
+        if (cb && cb->wantFile && !cb->wantFile(cb->userData, names[i])) {
+            states[i] = MERCYPAK_COPY_LEAVE_OUT;
+        } else if (selector->existing != MERCYPAK_EXISTING_OVERWRITE && mercypak_isUnchanged(destPath, fileSize, &descs[i], stats)) {
+            states[i] = (selector->existing == MERCYPAK_EXISTING_COMPARE) ? MERCYPAK_COPY_COMPARE : MERCYPAK_COPY_SKIP;
+        }
+
+        if (states[i] == MERCYPAK_COPY_WRITE) {
+            fds[i] = mercypak_openOutputFile(destPath, stats);
+        } else if (states[i] == MERCYPAK_COPY_COMPARE) {
+            fds[i] = open(destPath, O_RDWR);
+        } else if (states[i] == MERCYPAK_COPY_SKIP) {
+            fds[i] = open(destPath, O_RDONLY);     // Only for the attributes, the data stays as it is
+        }
+
+        if (states[i] != MERCYPAK_COPY_LEAVE_OUT && fds[i] < 0) {
+            for (uint32_t opened = 0; opened < i; opened++) {
+                if (fds[opened] >= 0) close(fds[opened]);
+            }
+            return false;
+        }
+
+        if (states[i] == MERCYPAK_COPY_WRITE)
+            writeFds[writing++] = fds[i];
+
+        comparing += (states[i] == MERCYPAK_COPY_COMPARE) ? 1 : 0;
+        leftOut += (states[i] == MERCYPAK_COPY_LEAVE_OUT) ? 1 : 0;
+    }
+
+    // Copies that were left out aren't reported, so they don't need a checksum
+    bool checksum = mercypak_wantsChecksums(cb) && leftOut < count;
+
+    if (checksum)
+        mappedFile_checksumBegin(file);
+
+    if (comparing == 0 && writing > 0) {
+        // Nothing to compare, the usual way
+        *success &= mappedFile_copyToFiles(file, writing, writeFds, fileSize);
+    } else if (comparing == 0 && !checksum) {
+        // The data isn't needed at all
+        *success &= mappedFile_skip(file, fileSize);
+    } else {
+        for (uint32_t offset = 0; offset < fileSize; ) {
+            size_t length = MIN((size_t) (fileSize - offset), (size_t) MERCYPAK_REFRESH_CHUNK_SIZE);
+
+            *success &= mappedFile_read(file, selector->packData, length);
+
+            for (uint32_t i = 0; i < count; i++) {
+                if (states[i] == MERCYPAK_COPY_COMPARE && (pread(fds[i], selector->fileData, length, (off_t) offset) != (ssize_t) length
+                                                        || memcmp(selector->packData, selector->fileData, length) != 0)) {
+                    states[i] = MERCYPAK_COPY_WRITE;
+                }
+
+                if (states[i] == MERCYPAK_COPY_WRITE)
+                    *success &= mercypak_writeAt(fds[i], selector->packData, length, offset, stats);
+            }
+
+            offset += (uint32_t) length;
+        }
+    }
+
+    uint32_t crc32 = checksum ? mappedFile_checksumEnd(file) : 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (states[i] == MERCYPAK_COPY_LEAVE_OUT) {
+            stats->filesLeftOut++;
+            stats->bytesLeftOut += fileSize;
+            continue;
+        }
+
+        if (states[i] == MERCYPAK_COPY_WRITE) {
+            *success &= mercypak_finishOutputFile(fds[i], &descs[i], stats);
+            stats->files++;
+            stats->bytesWritten += fileSize;
+        } else {
+            // Same data, but the read-only, hidden or system bits may have changed since
+            *success &= mercypak_refreshAttributes(fds[i], &descs[i], stats);
+            close(fds[i]);
+            stats->filesUnchanged++;
+            stats->bytesUnchanged += fileSize;
+        }
+
+        mercypak_fileWritten(cb, names[i], fileSize, crc32);
+    }
+
+    return true;
+}
+
+static bool mercypak_extractDirs(MappedFile *file, char *destPath, char *destPathAppend, uint32_t dirCount,
+                                 fanout_Writer *fanout, const mercypak_Callbacks *cb, mercypak_Stats *stats) {
+    bool success = true;
+
+    mercypak_phaseBegin(cb, MERCYPAK_PHASE_DIRS, dirCount);
+
+    for (uint32_t d = 0; d < dirCount; d++) {
+        uint8_t dirFlags;
+
+        mercypak_progress(cb, MERCYPAK_PHASE_DIRS, d);
+
+        success &= mappedFile_getUInt8(file, &dirFlags);
+        success &= mercypak_getString(file, destPathAppend);
+        util_stringReplaceChar(destPathAppend, '\\', '/'); // DOS paths innit
+
+        // With several targets their writer threads do the work (and count it)
+        if (fanout) {
+            success &= fanout_mkdir(fanout, destPathAppend, dirFlags);
+            continue;
+        }
+
+        uint64_t start = util_getMicroseconds();
+        success &= (mkdir(destPath, dirFlags) == 0 || (errno == EEXIST));    // An error value is ok if the directory already exists. It means we can write to it. IT'S FINE.
+        stats->mkdirMicroseconds += util_getMicroseconds() - start;
+        trace_span(TRACE_TRACK_MAIN, "mkdir", start, d, destPath);
+
+        stats->mkdirCalls++;
+        stats->dirs++;
+    }
+
+    mercypak_phaseEnd(cb, MERCYPAK_PHASE_DIRS);
+
+    return success;
+}
+
+/* Handle mercypak v2 pack file with redundant files optimized out */
+static bool mercypak_extractFilesV2(MappedFile *file, char *destPath, char *destPathAppend, uint32_t firstFile, uint32_t fileCount,
+                                    fanout_Writer *fanout, const mercypak_Selector *selector, const mercypak_Callbacks *cb, mercypak_Stats *stats) {
+    mercypak_FileDescriptor filesToWrite[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    int fileDescriptorsToWrite[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    char fileNames[MERCYPAK_V2_MAX_IDENTICAL_FILES][256];  // For the fileWritten callback and selecting, once the size is known
+    uint8_t identicalFileCount = 0;
+    bool success = true;
+
+    for (uint32_t f = firstFile; f < fileCount;) {
+        uint32_t fileSize;
+        uint32_t opened = 0;
+        bool headerOk = true;   // If the pack or a destination file is broken we can't go on, unlike with metadata errors
+        uint64_t fileStart = trace_timestamp();
+
+        mercypak_progress(cb, MERCYPAK_PHASE_FILES, mappedFile_getPosition(file));
+
+        headerOk &= mappedFile_getUInt8(file, &identicalFileCount);
+
+        QI_ASSERT(identicalFileCount <= MERCYPAK_V2_MAX_IDENTICAL_FILES);
+
+        for (uint32_t subFile = 0; subFile < identicalFileCount; subFile++) {
+            headerOk &= mercypak_getString(file, destPathAppend);
+            util_stringReplaceChar(destPathAppend, '\\', '/');
+
+            if (mercypak_wantsChecksums(cb) || selector)
+                strcpy(fileNames[subFile], destPathAppend);
+
+            if (fanout) {
+                headerOk &= mappedFile_read(file, &filesToWrite[subFile], MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
+                headerOk &= fanout_openFile(fanout, destPathAppend, filesToWrite[subFile].fileFlags,
+                                            filesToWrite[subFile].fileDate, filesToWrite[subFile].fileTime);
+                continue;
+            }
+
+            // Whether they're opened at all depends on the size, which comes after the names
+            if (selector) {
+                headerOk &= mappedFile_read(file, &filesToWrite[subFile], MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
+                continue;
+            }
+
+            fileDescriptorsToWrite[opened] = mercypak_openOutputFile(destPath, stats);
+            headerOk &= mappedFile_read(file, &filesToWrite[opened], MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
+
+            if (fileDescriptorsToWrite[opened] < 0) {
+                headerOk = false;
+                continue;
+            }
+
+            opened++;
+        }
+
+        headerOk &= mappedFile_getUInt32(file, &fileSize);
+
+        if (fanout) {
+            mercypak_checksumBegin(cb, file);
+
+            if (!headerOk || !fanout_write(fanout, file, fileSize) || !fanout_closeFiles(fanout))
+                return false;
+
+            uint32_t crc32 = mercypak_checksumEnd(cb, file);
+
+            for (uint32_t subFile = 0; subFile < identicalFileCount; subFile++) {
+                mercypak_fileWritten(cb, fileNames[subFile], fileSize, crc32);
+            }
+
+            trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileSize, destPath);
+            f += identicalFileCount;
+            continue;
+        }
+
+        if (selector) {
+            if (!headerOk || !mercypak_writeSelected(file, destPath, destPathAppend, fileNames, filesToWrite, identicalFileCount,
+                                                      fileSize, selector, cb, stats, &success))
+                return false;
+
+            trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileSize, destPath);
+            f += identicalFileCount;
+            mercypak_checkpoint(cb, file, f);
+            continue;
+        }
+
+        if (!headerOk) {
+            for (uint32_t subFile = 0; subFile < opened; subFile++) {
+                close(fileDescriptorsToWrite[subFile]);
+            }
+            return false;
+        }
+
+        mercypak_checksumBegin(cb, file);
+        success &= mappedFile_copyToFiles(file, identicalFileCount, fileDescriptorsToWrite, fileSize);
+        uint32_t crc32 = mercypak_checksumEnd(cb, file);
+
+        for (uint32_t subFile = 0; subFile < identicalFileCount; subFile++) {
+            success &= mercypak_finishOutputFile(fileDescriptorsToWrite[subFile], &filesToWrite[subFile], stats);
+            mercypak_fileWritten(cb, fileNames[subFile], fileSize, crc32);
+        }
+
+        stats->files += identicalFileCount;
+        stats->bytesWritten += (uint64_t) fileSize * identicalFileCount;
+
+        trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileSize, destPath);
+
+        f += identicalFileCount;
+        mercypak_checkpoint(cb, file, f);
+    }
+
+    return success;
+}
+
+static bool mercypak_extractFilesV1(MappedFile *file, char *destPath, char *destPathAppend, uint32_t firstFile, uint32_t fileCount,
+                                    fanout_Writer *fanout, const mercypak_Selector *selector, const mercypak_Callbacks *cb, mercypak_Stats *stats) {
+    mercypak_FileDescriptor fileToWrite;
+    bool success = true;
+
+    for (uint32_t f = firstFile; f < fileCount; f++) {
+        uint64_t fileStart = trace_timestamp();
+
+        mercypak_progress(cb, MERCYPAK_PHASE_FILES, mappedFile_getPosition(file));
+
+        /* Mercypak file metadata (see mercypak.txt) */
+
+        bool headerOk = mercypak_getString(file, destPathAppend);  // First, filename string
+        util_stringReplaceChar(destPathAppend, '\\', '/');          // DOS paths innit
+
+        headerOk &= mappedFile_read(file, &fileToWrite, MERCYPAK_FILE_DESCRIPTOR_SIZE);
+
+        if (fanout) {
+            if (!headerOk || !fanout_openFile(fanout, destPathAppend, fileToWrite.fileFlags, fileToWrite.fileDate, fileToWrite.fileTime))
+                return false;
+
+            mercypak_checksumBegin(cb, file);
+
+            if (!fanout_write(fanout, file, fileToWrite.fileSize) || !fanout_closeFiles(fanout))
+                return false;
+
+            mercypak_fileWritten(cb, destPathAppend, fileToWrite.fileSize, mercypak_checksumEnd(cb, file));
+
+            trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileToWrite.fileSize, destPath);
+            continue;
+        }
+
+        if (selector) {
+            char fileName[1][256];
+            strcpy(fileName[0], destPathAppend);
+
+            if (!headerOk || !mercypak_writeSelected(file, destPath, destPathAppend, fileName, &fileToWrite, 1,
+                                                      fileToWrite.fileSize, selector, cb, stats, &success))
+                return false;
+
+            trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileToWrite.fileSize, destPath);
+            mercypak_checkpoint(cb, file, f + 1);
+            continue;
+        }
+
+        int outfd = mercypak_openOutputFile(destPath, stats);
+
+        if (!headerOk || outfd < 0) {
+            if (outfd >= 0) close(outfd);
+            return false;
+        }
+
+        mercypak_checksumBegin(cb, file);
+        success &= mappedFile_copyToFiles(file, 1, &outfd, fileToWrite.fileSize);
+        success &= mercypak_finishOutputFile(outfd, &fileToWrite, stats);
+        mercypak_fileWritten(cb, destPathAppend, fileToWrite.fileSize, mercypak_checksumEnd(cb, file));
+
+        stats->files++;
+        stats->bytesWritten += fileToWrite.fileSize;
+
+        trace_span(TRACE_TRACK_MAIN, "file", fileStart, fileToWrite.fileSize, destPath);
+        mercypak_checkpoint(cb, file, f + 1);
+    }
+
+    return success;
+}
+
+/* Does the extracting. fanout is NULL when writing to installPath directly, from is NULL to start at the beginning. */
+static bool mercypak_extractPack(MappedFile *file, const char *installPath, fanout_Writer *fanout, const mercypak_Checkpoint *from,
+                                 mercypak_ExistingFiles existing, const mercypak_Callbacks *callbacks, mercypak_Stats *stats) {
+    char fileHeader[5] = {0};
+    char *destPath = malloc(strlen(installPath) + 256 + 1);   // Full path of destination dir/file, the +256 is because mercypak strings can only be 255 chars max
+    char *destPathAppend = destPath + strlen(installPath) + 1;  // Pointer to first char after the base install path in the destination path + 1 for the extra "/" we're gonna append
+    bool mercypakV2 = false;
+
+    QI_ASSERT(destPath);
+
+    sprintf(destPath, "%s/", installPath);
+
+    uint32_t dirCount;
+    uint32_t fileCount;
+    uint32_t firstFile = 0;
+    bool success = true;
+
+    success &= mappedFile_read(file, (uint8_t*) fileHeader, 4);
+    success &= mappedFile_getUInt32(file, &dirCount);
+    success &= mappedFile_getUInt32(file, &fileCount);
+
+    /* Check if we're unpacking a V2 file, which does redundancy stuff. */
+
+    if (success && util_stringEquals(fileHeader, MERCYPAK_V1_MAGIC)) {
+        mercypakV2 = false;
+    } else if (success && util_stringEquals(fileHeader, MERCYPAK_V2_MAGIC)) {
+        mercypakV2 = true;
+    } else {
+        free(destPath);
+        return false;
+    }
+
+    success = mercypak_extractDirs(file, destPath, destPathAppend, dirCount, fanout, callbacks, stats);
+
+    // The checkpoint has to be somewhere in the files part of this pack, if it's off the headers there won't make sense
+    if (from != NULL && from->offset != 0) {
+        size_t pos = mappedFile_getPosition(file);
+
+        if (from->offset < pos || from->filesDone > fileCount || !mappedFile_skip(file, from->offset - pos)) {
+            free(destPath);
+            return false;
+        }
+
+        firstFile = from->filesDone;
+    }
+
+    /*
+     *  Extract and copy files from mercypak files
+     */
+
+    // The fan-out writers only ever write everything
+    mercypak_Selector selector = { existing, NULL, NULL };
+    bool selecting = (existing != MERCYPAK_EXISTING_OVERWRITE || (callbacks && callbacks->wantFile)) && fanout == NULL;
+
+    if (selecting) {
+        selector.packData = malloc(MERCYPAK_REFRESH_CHUNK_SIZE);
+        selector.fileData = malloc(MERCYPAK_REFRESH_CHUNK_SIZE);
+        QI_ASSERT(selector.packData && selector.fileData);
+    }
+
+    mercypak_phaseBegin(callbacks, MERCYPAK_PHASE_FILES, mappedFile_getFileSize(file));
+
+    if (mercypakV2) {
+        success &= mercypak_extractFilesV2(file, destPath, destPathAppend, firstFile, fileCount, fanout, selecting ? &selector : NULL, callbacks, stats);
+    } else {
+        success &= mercypak_extractFilesV1(file, destPath, destPathAppend, firstFile, fileCount, fanout, selecting ? &selector : NULL, callbacks, stats);
+    }
+
+    mercypak_phaseEnd(callbacks, MERCYPAK_PHASE_FILES);
+
+    free(selector.packData);
+    free(selector.fileData);
+    free(destPath);
+    return success;
+}
+
+bool mercypak_extract(MappedFile *file, const char *installPath, const mercypak_Callbacks *callbacks, mercypak_Stats *stats) {
+    return mercypak_extractFrom(file, installPath, NULL, MERCYPAK_EXISTING_OVERWRITE, callbacks, stats);
+}
+
+bool mercypak_extractFrom(MappedFile *file, const char *installPath, const mercypak_Checkpoint *from, mercypak_ExistingFiles existing,
+                          const mercypak_Callbacks *callbacks, mercypak_Stats *stats) {
+    mercypak_Stats dummyStats = {0};
+
+    if (stats == NULL) {
+        stats = &dummyStats;
+    }
+
+    return mercypak_extractPack(file, installPath, NULL, from, existing, callbacks, stats);
+}
+
+bool mercypak_extractToTargets(MappedFile *file, const char *const *installPaths, size_t targetCount, size_t bufferSize,
+                               const mercypak_Callbacks *callbacks, mercypak_Stats *stats, bool *targetOk) {
+    mercypak_Stats dummyStats = {0};
+    bool packOk;
+    bool targetsOk;
+
+    QI_ASSERT(targetCount > 0 && targetCount <= FANOUT_MAX_TARGETS);
+
+    if (stats == NULL) {
+        stats = &dummyStats;
+    }
+
+    // No need for any threads with just one
+    if (targetCount == 1) {
+        packOk = mercypak_extractPack(file, installPaths[0], NULL, NULL, MERCYPAK_EXISTING_OVERWRITE, callbacks, stats);
+
+        if (targetOk != NULL)
+            targetOk[0] = packOk;
+
+        return packOk;
+    }
+
+    fanout_Writer *fanout = fanout_create(installPaths, targetCount, bufferSize);
+
+    if (fanout == NULL) {
+        if (targetOk != NULL)
+            memset(targetOk, 0, targetCount * sizeof(bool));
+
+        return false;
+    }
+
+    // The writer gets paths relative to the install paths, so this one is empty
+    packOk = mercypak_extractPack(file, "", fanout, NULL, MERCYPAK_EXISTING_OVERWRITE, callbacks, stats);
+    targetsOk = fanout_finish(fanout, stats, targetOk);
+
+    // A broken pack is broken for all of them
+    if (!packOk && targetOk != NULL)
+        memset(targetOk, 0, targetCount * sizeof(bool));
+
+    return packOk && targetsOk;
+}
+
+/* Reads through a pack for mercypak_verify, everything read goes into the checksum */
+typedef struct {
+    MappedFile *file;
+    const mercypak_Callbacks *callbacks;
+    uint8_t *buffer;
+    uint32_t crc32;
+    bool readOk;
+} mercypak_Verifier;
+
+/* Returns false if the pack ends before len bytes. Read errors only clear readOk, the data is skipped anyway. */
+static bool mercypak_verifyRead(mercypak_Verifier *v, void *dst, size_t len) {
+    if (len > mappedFile_getFileSize(v->file) - mappedFile_getPosition(v->file))
+        return false;
+
+    if (len == 0)
+        return true;
+
+    v->readOk &= mappedFile_read(v->file, dst, len);
+    v->crc32 = util_crc32(v->crc32, dst, len);
+    return true;
+}
+
+static bool mercypak_verifySkip(mercypak_Verifier *v, size_t len) {
+    while (len) {
+        size_t chunk = MIN(len, (size_t) MERCYPAK_VERIFY_CHUNK_SIZE);
+
+        if (!mercypak_verifyRead(v, v->buffer, chunk))
+            return false;
+
+        len -= chunk;
+        mercypak_progress(v->callbacks, MERCYPAK_PHASE_VERIFY, mappedFile_getPosition(v->file));
+    }
+
+    return true;
+}
+
+/* A name can't be empty, the installer would write to the install path itself */
+static bool mercypak_verifyString(mercypak_Verifier *v) {
+    uint8_t length;
+    return mercypak_verifyRead(v, &length, 1) && length > 0 && mercypak_verifyRead(v, v->buffer, length);
+}
+
+static bool mercypak_verifyEntries(mercypak_Verifier *v, mercypak_Stats *stats) {
+    char magic[5] = {0};
+    uint32_t dirCount;
+    uint32_t fileCount;
+    bool mercypakV2;
+
+    if (!mercypak_verifyRead(v, magic, 4) || !mercypak_verifyRead(v, &dirCount, 4) || !mercypak_verifyRead(v, &fileCount, 4))
+        return false;
+
+    if (util_stringEquals(magic, MERCYPAK_V1_MAGIC)) {
+        mercypakV2 = false;
+    } else if (util_stringEquals(magic, MERCYPAK_V2_MAGIC)) {
+        mercypakV2 = true;
+    } else {
+        return false;
+    }
+
+    for (uint32_t d = 0; d < dirCount; d++) {
+        uint8_t dirFlags;
+
+        if (!mercypak_verifyRead(v, &dirFlags, 1) || !mercypak_verifyString(v))
+            return false;
+
+        stats->dirs++;
+    }
+
+    for (uint32_t f = 0; f < fileCount;) {
+        mercypak_FileDescriptor desc;
+        uint8_t identicalFileCount = 1;
+
+        mercypak_progress(v->callbacks, MERCYPAK_PHASE_VERIFY, mappedFile_getPosition(v->file));
+
+        if (mercypakV2) {
+            if (!mercypak_verifyRead(v, &identicalFileCount, 1)
+             || identicalFileCount == 0 || identicalFileCount > MERCYPAK_V2_MAX_IDENTICAL_FILES)
+                return false;
+
+            for (uint8_t subFile = 0; subFile < identicalFileCount; subFile++) {
+                if (!mercypak_verifyString(v) || !mercypak_verifyRead(v, &desc, MERCYPAK_V2_FILE_DESCRIPTOR_SIZE))
+                    return false;
+            }
+
+            if (!mercypak_verifyRead(v, &desc.fileSize, sizeof(uint32_t)))
+                return false;
+        } else if (!mercypak_verifyString(v) || !mercypak_verifyRead(v, &desc, MERCYPAK_FILE_DESCRIPTOR_SIZE)) {
+            return false;
+        }
+
+        if (!mercypak_verifySkip(v, desc.fileSize))
+            return false;
+
+        stats->files += identicalFileCount;
+        f += identicalFileCount;
+    }
+
+    return true;
+}
+
+bool mercypak_verify(MappedFile *file, const mercypak_Callbacks *callbacks, mercypak_Stats *stats, mercypak_VerifyResult *result) {
+    mercypak_Stats dummyStats = {0};
+    mercypak_Verifier v = { file, callbacks, malloc(MERCYPAK_VERIFY_CHUNK_SIZE), 0, true };
+
+    QI_ASSERT(v.buffer != NULL && result != NULL);
+
+    if (stats == NULL) {
+        stats = &dummyStats;
+    }
+
+    memset(result, 0, sizeof(mercypak_VerifyResult));
+
+    mercypak_phaseBegin(callbacks, MERCYPAK_PHASE_VERIFY, mappedFile_getFileSize(file));
+
+    result->structureOk = mercypak_verifyEntries(&v, stats) && mappedFile_getPosition(file) == mappedFile_getFileSize(file);
+    result->errorOffset = result->structureOk ? 0 : mappedFile_getPosition(file);
+
+    // Whatever is left still counts for the checksum and for read errors
+    mercypak_verifySkip(&v, mappedFile_getFileSize(file) - mappedFile_getPosition(file));
+
+    mercypak_phaseEnd(callbacks, MERCYPAK_PHASE_VERIFY);
+
+    result->crc32 = v.crc32;
+    result->readOk = v.readOk;
+
+    free(v.buffer);
+    return result->structureOk && result->readOk;
+}
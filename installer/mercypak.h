@@ -0,0 +1,106 @@
+#ifndef MERCYPAK_H
+#define MERCYPAK_H
+
+/*
+ * LUNMERCY - MercyPak extraction engine
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ *
+ * This is the part of the installer that actually unpacks a MercyPak file (see mercypak.txt)
+ * to a directory. It doesn't know anything about the UI, progress is reported through callbacks,
+ * so it can also be used by the benchmark (bench.c).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mappedfile.h"
+
+typedef enum {
+    MERCYPAK_PHASE_DIRS = 0,    // Creating directories
+    MERCYPAK_PHASE_FILES,       // Extracting files
+    MERCYPAK_PHASE_VERIFY,      // Reading the whole pack without extracting it (mercypak_verify)
+} mercypak_Phase;
+
+// What mercypak_extractFrom does with files that are on the disk already
+typedef enum {
+    MERCYPAK_EXISTING_OVERWRITE = 0,    // They're written again, like everything else
+    MERCYPAK_EXISTING_REFRESH,          // Left alone if size and DOS time stamp are the same, their data is skipped in the pack.
+                                        // Attributes that differ are set again.
+    MERCYPAK_EXISTING_COMPARE,          // Same, but their contents are compared too. Only what differs is written.
+} mercypak_ExistingFiles;
+
+// A point in a pack that extracting can be picked up again from (mercypak_extractFrom)
+typedef struct {
+    size_t offset;              // Where the next file (in v2 packs: group of identical files) starts in the pack
+    uint32_t filesDone;         // Files before that, identical files in v2 packs count once for every copy
+} mercypak_Checkpoint;
+
+typedef struct {
+    // Called when a phase starts. 'total' is the number of directories or the size of the pack file in bytes.
+    void (*phaseBegin)(void *userData, mercypak_Phase phase, size_t total);
+    // Called for every directory / file with the number of directories done or the current position in the pack file.
+    void (*progress)(void *userData, mercypak_Phase phase, size_t current);
+    // Called when a phase is finished.
+    void (*phaseEnd)(void *userData, mercypak_Phase phase);
+    // Called for every file extracted with its path (relative to the install path), size and the CRC32 of its data.
+    // Can be NULL, the CRC32s are only calculated if it isn't.
+    void (*fileWritten)(void *userData, const char *path, uint32_t size, uint32_t crc32);
+    // Called whenever a file (group of identical files) is closed, everything before the checkpoint is written then.
+    // Only when extracting to one install path, the fan-out writers are behind. Can be NULL.
+    void (*checkpoint)(void *userData, const mercypak_Checkpoint *checkpoint);
+    // Called before a file is extracted with its path (relative to the install path). If it returns false the file is
+    // left out and its data is skipped in the pack. Only when extracting to one install path. Can be NULL, then
+    // every file is extracted.
+    bool (*wantFile)(void *userData, const char *path);
+    void *userData;
+} mercypak_Callbacks;
+
+// Counters of what the engine did, all of them are added to (so they can be accumulated over multiple packs)
+typedef struct {
+    uint64_t dirs;              // Directories created
+    uint64_t files;             // Files written (identical files in v2 packs count once for every copy, and on every target)
+    uint64_t bytesWritten;      // File data bytes written (same as above)
+    uint64_t mkdirCalls;
+    uint64_t openCalls;
+    uint64_t closeCalls;
+    uint64_t metadataCalls;     // Setting DOS time stamps and attributes
+    uint64_t mkdirMicroseconds; // Time spent in the syscalls above
+    uint64_t openMicroseconds;
+    uint64_t closeMicroseconds;
+    uint64_t metadataMicroseconds;
+    uint64_t writeCalls;        // write() calls done by the fan-out writer threads (see fanout.h) or when refreshing,
+    uint64_t writeMicroseconds; // the MappedFile counters only have the ones done directly
+    uint64_t queueWaits;        // How often extracting had to wait for the slowest target
+    uint64_t queueWaitMicroseconds;
+    uint64_t filesUnchanged;    // Files that were left alone because they were the same already (see mercypak_ExistingFiles)
+    uint64_t bytesUnchanged;
+    uint64_t filesLeftOut;      // Files that weren't wanted (see mercypak_Callbacks.wantFile)
+    uint64_t bytesLeftOut;
+} mercypak_Stats;
+
+// What mercypak_verify found out about a pack
+typedef struct {
+    uint32_t crc32;             // Of the whole pack file, same as zlib's (sysprep writes these to checksums.txt)
+    bool structureOk;           // All headers make sense and the last file ends where the pack ends
+    bool readOk;                // All of it could be read (see mappedFile_getReadProblems for where it couldn't)
+    size_t errorOffset;         // Where the structure stopped making sense, if it did
+} mercypak_VerifyResult;
+
+// Extracts a MercyPak file (v1 or v2) to installPath. callbacks and stats can be NULL. Returns false if there were any errors.
+bool mercypak_extract(MappedFile *file, const char *installPath, const mercypak_Callbacks *callbacks, mercypak_Stats *stats);
+// Same as mercypak_extract, but picks up at a checkpoint from a previous run (the directories are created again, the
+// files before it are skipped in the pack). from can be NULL to start at the beginning. existing is what to do with
+// files that are there already.
+bool mercypak_extractFrom(MappedFile *file, const char *installPath, const mercypak_Checkpoint *from, mercypak_ExistingFiles existing,
+                          const mercypak_Callbacks *callbacks, mercypak_Stats *stats);
+// Extracts a MercyPak file to several install paths at once, reading it only once (see fanout.h). bufferSize is how many
+// bytes the slowest target may fall behind before extracting waits for it. targetOk (can be NULL) gets which targets
+// were written without errors. Returns false if there were any errors.
+bool mercypak_extractToTargets(MappedFile *file, const char *const *installPaths, size_t targetCount, size_t bufferSize,
+                               const mercypak_Callbacks *callbacks, mercypak_Stats *stats, bool *targetOk);
+// Reads a whole MercyPak file the way extracting does, but without writing anything. Directories and files seen are
+// counted in stats. callbacks and stats can be NULL. Returns false if the pack is broken or couldn't be read.
+bool mercypak_verify(MappedFile *file, const mercypak_Callbacks *callbacks, mercypak_Stats *stats, mercypak_VerifyResult *result);
+
+#endif
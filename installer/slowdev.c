@@ -0,0 +1,575 @@
+/*
+ * LUNMERCY - Slow device simulator (slowdev.so)
+ *
+ * An LD_PRELOAD shim for the build host that makes the install source and destination behave like
+ * the drives the installer really runs on: a 4x CD-ROM, a PIO mode hard disk and so on.
+ * It's meant for lunmercy_bench (see bench.c and build_bench.sh), so readahead, block size and
+ * pipelining changes can be compared against realistic devices without booting old hardware.
+ *
+ * Every device is modeled as a single queue: a request costs
+ *
+ *      latency + (seek, if it doesn't continue where the previous request ended) + size / bandwidth
+ *
+ * and requests from all threads are served one after the other, like a real drive would.
+ * The calling thread sleeps until its request would have been finished.
+ *
+ * What is throttled:
+ *  - read() / pread() on files below the source path, write() / pwrite() on files below the target path
+ *  - Data of mmap()ed source files, the first time it is written out with write() (page faults)
+ *  - mkdir() and creating files below the target path count as one seek + one sector (directory update)
+ *
+ * Configuration (environment variables):
+ *
+ *   SLOWDEV_SOURCE=<path prefix>          SLOWDEV_SOURCE_PROFILE=<profile>
+ *   SLOWDEV_TARGET=<path prefix>          SLOWDEV_TARGET_PROFILE=<profile>
+ *
+ * <profile> is one of the names in slowdev_profiles or "<KB/s>,<latency us>,<seek us>".
+ * Statistics are printed to stderr when the process exits.
+ *
+ * The simulated time is added on top of the real time, so keep the source in the page cache
+ * (don't drop caches) and use a tmpfs target to get the most accurate numbers.
+ *
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#define SLOWDEV_MAX_FDS         (4096)
+#define SLOWDEV_MAX_MAPPINGS    (16)
+#define SLOWDEV_SECTOR_SIZE     (512)
+
+typedef struct {
+    const char *name;
+    uint32_t kbPerSecond;
+    uint32_t latencyUs;         // Command overhead, every request
+    uint32_t seekUs;            // Average seek (+ rotational delay), non-contiguous requests only
+} slowdev_Profile;
+
+// Rough numbers for drives from around 1998
+static const slowdev_Profile slowdev_profiles[] = {
+    { "cd1x",       150,    1000,   400000 },
+    { "cd2x",       300,    1000,   250000 },
+    { "cd4x",       600,    1000,   150000 },
+    { "cd8x",       1200,   1000,   110000 },
+    { "cd16x",      2400,   1000,   100000 },
+    { "cd24x",      3600,   1000,   90000 },
+    { "hdd-pio0",   3300,   500,    18000 },
+    { "hdd-pio2",   8300,   500,    16000 },
+    { "hdd-pio4",   11000,  300,    14000 },   // The platters are slower than PIO 4 on most drives of the time
+    { "hdd-udma2",  14000,  200,    12000 },
+    { "cf-pio0",    3000,   1000,   0 },
+};
+
+typedef enum {
+    SLOWDEV_NONE = 0,
+    SLOWDEV_SOURCE,
+    SLOWDEV_TARGET,
+    SLOWDEV_DEVICE_COUNT
+} slowdev_DeviceIndex;
+
+typedef struct {
+    const char *label;
+    bool enabled;
+    slowdev_Profile profile;
+    char prefix[PATH_MAX];
+    char absolutePrefix[PATH_MAX];
+
+    pthread_mutex_t lock;
+    uint64_t busyUntil;         // Nanoseconds, CLOCK_MONOTONIC
+    ino_t lastInode;
+    uint64_t lastEnd;
+
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t seeks;
+    uint64_t metadataOps;
+    uint64_t busyNanoseconds;
+} slowdev_Device;
+
+typedef struct {
+    const uint8_t *start;
+    size_t length;
+    uint64_t fileOffset;
+    ino_t inode;
+    size_t charged;             // Everything below this offset in the mapping has been paid for already
+} slowdev_Mapping;
+
+typedef struct {
+    uint8_t device;
+    ino_t inode;
+} slowdev_Fd;
+
+static slowdev_Device slowdev_devices[SLOWDEV_DEVICE_COUNT] = {
+    [SLOWDEV_SOURCE] = { .label = "source", .lock = PTHREAD_MUTEX_INITIALIZER },
+    [SLOWDEV_TARGET] = { .label = "target", .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static slowdev_Fd slowdev_fds[SLOWDEV_MAX_FDS];
+static slowdev_Mapping slowdev_mappings[SLOWDEV_MAX_MAPPINGS];
+static pthread_mutex_t slowdev_mappingLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slowdev_initOnce = PTHREAD_ONCE_INIT;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_openat64)(int, const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_pread64)(int, void *, size_t, off64_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static ssize_t (*real_pwrite64)(int, const void *, size_t, off64_t);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static void *(*real_mmap64)(void *, size_t, int, int, int, off64_t);
+static int (*real_munmap)(void *, size_t);
+static int (*real_mkdir)(const char *, mode_t);
+
+static inline uint64_t slowdev_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static bool slowdev_parseProfile(const char *str, slowdev_Profile *profile) {
+    unsigned kbPerSecond, latencyUs, seekUs;
+
+    for (size_t i = 0; i < sizeof(slowdev_profiles) / sizeof(slowdev_profiles[0]); i++) {
+        if (strcmp(str, slowdev_profiles[i].name) == 0) {
+            *profile = slowdev_profiles[i];
+            return true;
+        }
+    }
+
+    if (sscanf(str, "%u,%u,%u", &kbPerSecond, &latencyUs, &seekUs) != 3 || kbPerSecond == 0)
+        return false;
+
+    profile->name = "custom";
+    profile->kbPerSecond = kbPerSecond;
+    profile->latencyUs = latencyUs;
+    profile->seekUs = seekUs;
+    return true;
+}
+
+static void slowdev_initDevice(slowdev_Device *dev, const char *pathVariable, const char *profileVariable) {
+    const char *path = getenv(pathVariable);
+    const char *profile = getenv(profileVariable);
+
+    if (path == NULL || profile == NULL || *path == 0x00)
+        return;
+
+    if (!slowdev_parseProfile(profile, &dev->profile)) {
+        fprintf(stderr, "slowdev: unknown profile '%s' in %s, %s is not throttled\n", profile, profileVariable, dev->label);
+        return;
+    }
+
+    snprintf(dev->prefix, sizeof(dev->prefix), "%s", path);
+
+    if (realpath(path, dev->absolutePrefix) == NULL)
+        snprintf(dev->absolutePrefix, sizeof(dev->absolutePrefix), "%s", path);
+
+    dev->enabled = true;
+
+    fprintf(stderr, "slowdev: %s '%s' is a %s (%u KB/s, latency %u us, seek %u us)\n", dev->label, dev->prefix,
+        dev->profile.name, dev->profile.kbPerSecond, dev->profile.latencyUs, dev->profile.seekUs);
+}
+
+// POSIX way of getting a function pointer out of dlsym
+#define SLOWDEV_RESOLVE(function) (*(void **) &real_##function = dlsym(RTLD_NEXT, #function))
+
+static void slowdev_init(void) {
+    SLOWDEV_RESOLVE(open);
+    SLOWDEV_RESOLVE(open64);
+    SLOWDEV_RESOLVE(openat);
+    SLOWDEV_RESOLVE(openat64);
+    SLOWDEV_RESOLVE(close);
+    SLOWDEV_RESOLVE(read);
+    SLOWDEV_RESOLVE(pread);
+    SLOWDEV_RESOLVE(pread64);
+    SLOWDEV_RESOLVE(write);
+    SLOWDEV_RESOLVE(pwrite);
+    SLOWDEV_RESOLVE(pwrite64);
+    SLOWDEV_RESOLVE(mmap);
+    SLOWDEV_RESOLVE(mmap64);
+    SLOWDEV_RESOLVE(munmap);
+    SLOWDEV_RESOLVE(mkdir);
+
+    slowdev_initDevice(&slowdev_devices[SLOWDEV_SOURCE], "SLOWDEV_SOURCE", "SLOWDEV_SOURCE_PROFILE");
+    slowdev_initDevice(&slowdev_devices[SLOWDEV_TARGET], "SLOWDEV_TARGET", "SLOWDEV_TARGET_PROFILE");
+}
+
+static inline void slowdev_ensureInit(void) {
+    pthread_once(&slowdev_initOnce, slowdev_init);
+}
+
+static bool slowdev_pathIsBelow(const char *path, const char *prefix) {
+    size_t len = strlen(prefix);
+    return strncmp(path, prefix, len) == 0 && (path[len] == 0x00 || path[len] == '/' || prefix[len - 1] == '/');
+}
+
+/* Finds out which simulated device a path is on */
+static slowdev_DeviceIndex slowdev_getDeviceForPath(int dirfd, const char *path) {
+    char absolute[PATH_MAX];
+
+    if (path == NULL)
+        return SLOWDEV_NONE;
+
+    // Relative to the working directory is good enough, nobody uses a directory fd with the installer code
+    if (path[0] != '/' && dirfd == AT_FDCWD && getcwd(absolute, sizeof(absolute)) != NULL) {
+        size_t len = strlen(absolute);
+        snprintf(absolute + len, sizeof(absolute) - len, "/%s", path);
+    } else {
+        snprintf(absolute, sizeof(absolute), "%s", path);
+    }
+
+    // The target directory may well be below the source directory (or the other way around), longest match wins
+    slowdev_DeviceIndex result = SLOWDEV_NONE;
+    size_t longestMatch = 0;
+
+    for (int i = SLOWDEV_SOURCE; i < SLOWDEV_DEVICE_COUNT; i++) {
+        slowdev_Device *dev = &slowdev_devices[i];
+        size_t matchLength = 0;
+
+        if (!dev->enabled)
+            continue;
+
+        if (slowdev_pathIsBelow(absolute, dev->absolutePrefix)) {
+            matchLength = strlen(dev->absolutePrefix);
+        } else if (slowdev_pathIsBelow(path, dev->prefix)) {
+            matchLength = strlen(dev->prefix);
+        }
+
+        if (matchLength > longestMatch) {
+            longestMatch = matchLength;
+            result = (slowdev_DeviceIndex) i;
+        }
+    }
+
+    return result;
+}
+
+/* Puts a request into the device queue and sleeps until it would be done. */
+static void slowdev_charge(slowdev_DeviceIndex index, ino_t inode, uint64_t offset, size_t bytes, bool metadata) {
+    slowdev_Device *dev = &slowdev_devices[index];
+    uint64_t now = slowdev_now();
+    uint64_t cost = (uint64_t) dev->profile.latencyUs * 1000ULL
+                  + (uint64_t) bytes * 1000000000ULL / ((uint64_t) dev->profile.kbPerSecond * 1024ULL);
+    bool seek = metadata || inode != dev->lastInode || offset != dev->lastEnd;
+    uint64_t done;
+    struct timespec ts;
+
+    if (seek)
+        cost += (uint64_t) dev->profile.seekUs * 1000ULL;
+
+    pthread_mutex_lock(&dev->lock);
+
+    done = (dev->busyUntil > now ? dev->busyUntil : now) + cost;
+    dev->busyUntil = done;
+    dev->lastInode = metadata ? 0 : inode;
+    dev->lastEnd = metadata ? 0 : offset + bytes;
+    dev->requests++;
+    dev->bytes += bytes;
+    dev->seeks += seek;
+    dev->metadataOps += metadata;
+    dev->busyNanoseconds += cost;
+
+    pthread_mutex_unlock(&dev->lock);
+
+    ts.tv_sec = (time_t) (done / 1000000000ULL);
+    ts.tv_nsec = (long) (done % 1000000000ULL);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // Interrupted, sleep again
+    }
+}
+
+/* Remembers which device an fd is on after it was opened */
+static int slowdev_trackOpen(int fd, int dirfd, const char *path, int flags) {
+    struct stat st;
+    slowdev_DeviceIndex index;
+
+    if (fd < 0 || fd >= SLOWDEV_MAX_FDS)
+        return fd;
+
+    index = slowdev_getDeviceForPath(dirfd, path);
+    slowdev_fds[fd].device = (uint8_t) index;
+    slowdev_fds[fd].inode = (fstat(fd, &st) == 0) ? st.st_ino : 0;
+
+    // Creating a file means updating a directory
+    if (index == SLOWDEV_TARGET && (flags & O_CREAT))
+        slowdev_charge(index, 0, 0, SLOWDEV_SECTOR_SIZE, true);
+
+    return fd;
+}
+
+/* Charges the source for mmap()ed data the first time it leaves the mapping (that's when it is faulted in) */
+static void slowdev_chargeMappedData(const void *buf, size_t len) {
+    const uint8_t *start = (const uint8_t *) buf;
+    size_t toCharge = 0;
+    uint64_t fileOffset = 0;
+    ino_t inode = 0;
+
+    pthread_mutex_lock(&slowdev_mappingLock);
+
+    for (size_t i = 0; i < SLOWDEV_MAX_MAPPINGS; i++) {
+        slowdev_Mapping *m = &slowdev_mappings[i];
+
+        if (m->start == NULL || start < m->start || start >= m->start + m->length)
+            continue;
+
+        size_t end = (size_t) (start - m->start) + len;
+        end = end < m->length ? end : m->length;
+
+        if (end > m->charged) {
+            toCharge = end - m->charged;
+            fileOffset = m->fileOffset + m->charged;
+            inode = m->inode;
+            m->charged = end;
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&slowdev_mappingLock);
+
+    if (toCharge > 0)
+        slowdev_charge(SLOWDEV_SOURCE, inode, fileOffset, toCharge, false);
+}
+
+static void slowdev_trackMapping(void *addr, size_t length, int fd, uint64_t offset) {
+    if (addr == MAP_FAILED || fd < 0 || fd >= SLOWDEV_MAX_FDS || slowdev_fds[fd].device != SLOWDEV_SOURCE)
+        return;
+
+    pthread_mutex_lock(&slowdev_mappingLock);
+
+    for (size_t i = 0; i < SLOWDEV_MAX_MAPPINGS; i++) {
+        if (slowdev_mappings[i].start == NULL) {
+            slowdev_mappings[i] = (slowdev_Mapping) { addr, length, offset, slowdev_fds[fd].inode, 0 };
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&slowdev_mappingLock);
+}
+
+static inline slowdev_DeviceIndex slowdev_getDeviceForFd(int fd) {
+    return (fd >= 0 && fd < SLOWDEV_MAX_FDS) ? (slowdev_DeviceIndex) slowdev_fds[fd].device : SLOWDEV_NONE;
+}
+
+/* Gets the file offset for a read() / write() that is about to happen */
+static inline uint64_t slowdev_currentOffset(int fd) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    return pos < 0 ? 0 : (uint64_t) pos;
+}
+
+static inline mode_t slowdev_getMode(int flags, va_list args) {
+    return (flags & (O_CREAT | O_TMPFILE)) ? (mode_t) va_arg(args, int) : 0;
+}
+
+/* The interposed functions */
+
+int open(const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = slowdev_getMode(flags, args);
+    va_end(args);
+
+    slowdev_ensureInit();
+    return slowdev_trackOpen(real_open(path, flags, mode), AT_FDCWD, path, flags);
+}
+
+int open64(const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = slowdev_getMode(flags, args);
+    va_end(args);
+
+    slowdev_ensureInit();
+    return slowdev_trackOpen(real_open64(path, flags, mode), AT_FDCWD, path, flags);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = slowdev_getMode(flags, args);
+    va_end(args);
+
+    slowdev_ensureInit();
+    return slowdev_trackOpen(real_openat(dirfd, path, flags, mode), dirfd, path, flags);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = slowdev_getMode(flags, args);
+    va_end(args);
+
+    slowdev_ensureInit();
+    return slowdev_trackOpen(real_openat64(dirfd, path, flags, mode), dirfd, path, flags);
+}
+
+int close(int fd) {
+    slowdev_ensureInit();
+
+    if (fd >= 0 && fd < SLOWDEV_MAX_FDS)
+        slowdev_fds[fd].device = SLOWDEV_NONE;
+
+    return real_close(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    slowdev_ensureInit();
+
+    if (slowdev_getDeviceForFd(fd) != SLOWDEV_SOURCE)
+        return real_read(fd, buf, count);
+
+    uint64_t offset = slowdev_currentOffset(fd);
+    ssize_t ret = real_read(fd, buf, count);
+
+    if (ret > 0)
+        slowdev_charge(SLOWDEV_SOURCE, slowdev_fds[fd].inode, offset, (size_t) ret, false);
+
+    return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    slowdev_ensureInit();
+
+    ssize_t ret = real_pread(fd, buf, count, offset);
+
+    if (ret > 0 && slowdev_getDeviceForFd(fd) == SLOWDEV_SOURCE)
+        slowdev_charge(SLOWDEV_SOURCE, slowdev_fds[fd].inode, (uint64_t) offset, (size_t) ret, false);
+
+    return ret;
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+    slowdev_ensureInit();
+
+    ssize_t ret = real_pread64(fd, buf, count, offset);
+
+    if (ret > 0 && slowdev_getDeviceForFd(fd) == SLOWDEV_SOURCE)
+        slowdev_charge(SLOWDEV_SOURCE, slowdev_fds[fd].inode, (uint64_t) offset, (size_t) ret, false);
+
+    return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    slowdev_ensureInit();
+
+    if (slowdev_devices[SLOWDEV_SOURCE].enabled)
+        slowdev_chargeMappedData(buf, count);
+
+    if (slowdev_getDeviceForFd(fd) != SLOWDEV_TARGET)
+        return real_write(fd, buf, count);
+
+    uint64_t offset = slowdev_currentOffset(fd);
+    ssize_t ret = real_write(fd, buf, count);
+
+    if (ret > 0)
+        slowdev_charge(SLOWDEV_TARGET, slowdev_fds[fd].inode, offset, (size_t) ret, false);
+
+    return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    slowdev_ensureInit();
+
+    if (slowdev_devices[SLOWDEV_SOURCE].enabled)
+        slowdev_chargeMappedData(buf, count);
+
+    ssize_t ret = real_pwrite(fd, buf, count, offset);
+
+    if (ret > 0 && slowdev_getDeviceForFd(fd) == SLOWDEV_TARGET)
+        slowdev_charge(SLOWDEV_TARGET, slowdev_fds[fd].inode, (uint64_t) offset, (size_t) ret, false);
+
+    return ret;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
+    slowdev_ensureInit();
+
+    if (slowdev_devices[SLOWDEV_SOURCE].enabled)
+        slowdev_chargeMappedData(buf, count);
+
+    ssize_t ret = real_pwrite64(fd, buf, count, offset);
+
+    if (ret > 0 && slowdev_getDeviceForFd(fd) == SLOWDEV_TARGET)
+        slowdev_charge(SLOWDEV_TARGET, slowdev_fds[fd].inode, (uint64_t) offset, (size_t) ret, false);
+
+    return ret;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    slowdev_ensureInit();
+    void *ret = real_mmap(addr, length, prot, flags, fd, offset);
+    slowdev_trackMapping(ret, length, fd, (uint64_t) offset);
+    return ret;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+    slowdev_ensureInit();
+    void *ret = real_mmap64(addr, length, prot, flags, fd, offset);
+    slowdev_trackMapping(ret, length, fd, (uint64_t) offset);
+    return ret;
+}
+
+int munmap(void *addr, size_t length) {
+    slowdev_ensureInit();
+
+    pthread_mutex_lock(&slowdev_mappingLock);
+
+    for (size_t i = 0; i < SLOWDEV_MAX_MAPPINGS; i++) {
+        if (slowdev_mappings[i].start == addr)
+            slowdev_mappings[i].start = NULL;
+    }
+
+    pthread_mutex_unlock(&slowdev_mappingLock);
+
+    return real_munmap(addr, length);
+}
+
+int mkdir(const char *path, mode_t mode) {
+    slowdev_ensureInit();
+
+    int ret = real_mkdir(path, mode);
+
+    if (ret == 0 && slowdev_getDeviceForPath(AT_FDCWD, path) == SLOWDEV_TARGET)
+        slowdev_charge(SLOWDEV_TARGET, 0, 0, SLOWDEV_SECTOR_SIZE, true);
+
+    return ret;
+}
+
+__attribute__((destructor)) static void slowdev_printStats(void) {
+    for (int i = SLOWDEV_SOURCE; i < SLOWDEV_DEVICE_COUNT; i++) {
+        const slowdev_Device *dev = &slowdev_devices[i];
+
+        if (!dev->enabled)
+            continue;
+
+        fprintf(stderr, "slowdev: %s (%s): %llu requests, %llu KB, %llu seeks, %llu metadata updates, %llu.%03llu s busy\n",
+            dev->label, dev->profile.name,
+            (unsigned long long) dev->requests,
+            (unsigned long long) (dev->bytes / 1024ULL),
+            (unsigned long long) dev->seeks,
+            (unsigned long long) dev->metadataOps,
+            (unsigned long long) (dev->busyNanoseconds / 1000000000ULL),
+            (unsigned long long) (dev->busyNanoseconds / 1000000ULL % 1000ULL));
+    }
+}
@@ -0,0 +1,206 @@
+/*
+ * LUNMERCY - Event trace recorder
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_DEFAULT_EVENT_COUNT (32768)
+
+typedef enum {
+    TRACE_EVENT_SPAN = 0,
+    TRACE_EVENT_INSTANT,
+    TRACE_EVENT_COUNTER,
+} trace_EventType;
+
+typedef struct {
+    uint64_t timestamp;     // Microseconds
+    uint32_t duration;      // Microseconds, spans only
+    uint8_t type;
+    uint8_t track;
+    const char *name;
+    int64_t value;
+    char detail[TRACE_DETAIL_LENGTH];
+} trace_Event;
+
+bool trace_enabled = false;
+
+static trace_Event *trace_events = NULL;
+static size_t trace_eventCount = 0;
+static uint32_t trace_nextEvent = 0;    // Only ever incremented atomically, the reader thread records events too
+static uint64_t trace_startTime = 0;
+
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+bool trace_init(size_t eventCount) {
+    trace_events = calloc(eventCount, sizeof(trace_Event));
+
+    if (trace_events == NULL)
+        return false;
+
+    trace_eventCount = eventCount;
+    trace_nextEvent = 0;
+    trace_startTime = trace_now();
+    trace_enabled = true;
+    return true;
+}
+
+bool trace_initFromEnvironment(void) {
+    const char *env = getenv("LUNMERCY_TRACE");
+    size_t eventCount;
+
+    if (env == NULL || *env == 0x00 || strcmp(env, "0") == 0)
+        return false;
+
+    eventCount = strtoul(env, NULL, 10);
+
+    // "1" (or anything that isn't a useful number) means default size
+    if (eventCount < 1024)
+        eventCount = TRACE_DEFAULT_EVENT_COUNT;
+
+    return trace_init(eventCount);
+}
+
+uint64_t trace_timestamp(void) {
+    return trace_enabled ? trace_now() : 0;
+}
+
+static inline trace_Event *trace_claimEvent(void) {
+    uint32_t index = __atomic_fetch_add(&trace_nextEvent, 1, __ATOMIC_RELAXED);
+    return &trace_events[index % trace_eventCount];
+}
+
+void trace_spanRecord(trace_Track track, const char *name, uint64_t start, int64_t value, const char *detail) {
+    uint64_t now = trace_now();
+    trace_Event *ev = trace_claimEvent();
+
+    ev->timestamp = start - trace_startTime;
+    ev->duration = (uint32_t) (now - start);
+    ev->type = TRACE_EVENT_SPAN;
+    ev->track = (uint8_t) track;
+    ev->name = name;
+    ev->value = value;
+
+    if (detail != NULL) {
+        // Keep the end of the string, for paths that is the interesting part
+        size_t len = strlen(detail);
+        if (len >= TRACE_DETAIL_LENGTH) detail += len - (TRACE_DETAIL_LENGTH - 1);
+        strncpy(ev->detail, detail, TRACE_DETAIL_LENGTH - 1);
+        ev->detail[TRACE_DETAIL_LENGTH - 1] = 0x00;
+    } else {
+        ev->detail[0] = 0x00;
+    }
+}
+
+void trace_instantRecord(trace_Track track, const char *name, int64_t value) {
+    trace_Event *ev = trace_claimEvent();
+    ev->timestamp = trace_now() - trace_startTime;
+    ev->duration = 0;
+    ev->type = TRACE_EVENT_INSTANT;
+    ev->track = (uint8_t) track;
+    ev->name = name;
+    ev->value = value;
+    ev->detail[0] = 0x00;
+}
+
+void trace_counterRecord(const char *name, int64_t value) {
+    trace_Event *ev = trace_claimEvent();
+    ev->timestamp = trace_now() - trace_startTime;
+    ev->duration = 0;
+    ev->type = TRACE_EVENT_COUNTER;
+    ev->track = TRACE_TRACK_MAIN;
+    ev->name = name;
+    ev->value = value;
+    ev->detail[0] = 0x00;
+}
+
+/* Writes a string with JSON escaping */
+static void trace_writeJsonString(FILE *f, const char *str) {
+    fputc('"', f);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char) *str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool trace_dump(const char *filename) {
+    if (!trace_enabled)
+        return false;
+
+    trace_enabled = false;
+
+    FILE *f = fopen(filename, "w");
+
+    if (f == NULL) {
+        free(trace_events);
+        trace_events = NULL;
+        return false;
+    }
+
+    uint32_t total = __atomic_load_n(&trace_nextEvent, __ATOMIC_RELAXED);
+    size_t count = total < trace_eventCount ? total : trace_eventCount;
+    size_t first = total < trace_eventCount ? 0 : total % trace_eventCount;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"recorded\":%lu,\"dropped\":%lu},\"traceEvents\":[\n",
+        (unsigned long) total, (unsigned long) (total - count));
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"lunmercy\"}},\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"main\"}},\n", TRACE_TRACK_MAIN);
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"reader\"}}", TRACE_TRACK_READER);
+
+    for (int i = 0; i < TRACE_TARGET_TRACKS; i++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"target %d\"}}", TRACE_TRACK_TARGET + i, i);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const trace_Event *ev = &trace_events[(first + i) % trace_eventCount];
+
+        fputs(",\n{\"name\":", f);
+        trace_writeJsonString(f, ev->name);
+        fprintf(f, ",\"pid\":1,\"tid\":%u,\"ts\":%llu", (unsigned) ev->track, (unsigned long long) ev->timestamp);
+
+        switch (ev->type) {
+            case TRACE_EVENT_SPAN:
+                fprintf(f, ",\"ph\":\"X\",\"dur\":%lu,\"args\":{\"value\":%lld", (unsigned long) ev->duration, (long long) ev->value);
+                if (ev->detail[0]) {
+                    fputs(",\"detail\":", f);
+                    trace_writeJsonString(f, ev->detail);
+                }
+                fputs("}}", f);
+                break;
+            case TRACE_EVENT_INSTANT:
+                fprintf(f, ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"value\":%lld}}", (long long) ev->value);
+                break;
+            default:
+                fputs(",\"ph\":\"C\",\"args\":{", f);
+                trace_writeJsonString(f, ev->name);
+                fprintf(f, ":%lld}}", (long long) ev->value);
+                break;
+        }
+    }
+
+    fputs("\n]}\n", f);
+
+    bool success = (ferror(f) == 0);
+    success &= (fclose(f) == 0);
+
+    free(trace_events);
+    trace_events = NULL;
+    return success;
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * LUNMERCY - Event trace recorder
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * Records timestamped events (reader block fills, block disposals, file open/write/close, progress...)
+ * into a fixed size ring buffer in memory, and dumps them as Chrome trace JSON at the end.
+ * The file can be loaded into chrome://tracing or https://ui.perfetto.dev to see how reads and writes overlap.
+ *
+ * Disabled by default, in which case every trace call is just a check of a global flag.
+ * When the buffer is full, the oldest events are overwritten.
+ * Any thread can record events, every one claims its slot atomically.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_DETAIL_LENGTH (24)
+
+// Tracks (shown as threads in the trace viewer)
+typedef enum {
+    TRACE_TRACK_MAIN = 1,   // Installer / consumer
+    TRACE_TRACK_READER,     // Reader thread of mappedfile_mt.c
+    TRACE_TRACK_TARGET,     // Writer threads of fanout.c, target n is TRACE_TRACK_TARGET + n
+} trace_Track;
+
+#define TRACE_TARGET_TRACKS (8)
+
+extern bool trace_enabled;
+
+// Enables tracing with a ring buffer of the given number of events. Returns false if there's not enough memory.
+bool trace_init(size_t eventCount);
+// Enables tracing if the environment variable LUNMERCY_TRACE is set (to "1" or a number of events)
+bool trace_initFromEnvironment(void);
+// Writes all recorded events to a file as Chrome trace JSON and frees the buffer.
+bool trace_dump(const char *filename);
+
+// Gets a timestamp for trace_span, 0 if tracing is disabled.
+uint64_t trace_timestamp(void);
+
+// Records a span (complete event) from 'start' until now. 'name' must be a string literal. 'detail' can be NULL.
+void trace_spanRecord(trace_Track track, const char *name, uint64_t start, int64_t value, const char *detail);
+// Records a single point in time.
+void trace_instantRecord(trace_Track track, const char *name, int64_t value);
+// Records the value of a counter (shown as a graph).
+void trace_counterRecord(const char *name, int64_t value);
+
+static inline void trace_span(trace_Track track, const char *name, uint64_t start, int64_t value, const char *detail) {
+    if (trace_enabled) trace_spanRecord(track, name, start, value, detail);
+}
+
+static inline void trace_instant(trace_Track track, const char *name, int64_t value) {
+    if (trace_enabled) trace_instantRecord(track, name, value);
+}
+
+static inline void trace_counter(const char *name, int64_t value) {
+    if (trace_enabled) trace_counterRecord(name, value);
+}
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * LUNMERCY - Unattended install settings
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "unattend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <getopt.h>
+
+#define UNATTEND_LINE_LENGTH (256)
+
+enum {
+    UNATTEND_OPT_FORMAT = 0x100,
+    UNATTEND_OPT_NO_FORMAT,
+    UNATTEND_OPT_MBR,
+    UNATTEND_OPT_NO_MBR,
+    UNATTEND_OPT_DRIVERS,
+    UNATTEND_OPT_NO_DRIVERS,
+    UNATTEND_OPT_DETECT_DRIVERS,
+    UNATTEND_OPT_REBOOT,
+    UNATTEND_OPT_NO_REBOOT,
+    UNATTEND_OPT_VERIFY,
+    UNATTEND_OPT_NO_VERIFY,
+    UNATTEND_OPT_RESUME,
+    UNATTEND_OPT_NO_RESUME,
+    UNATTEND_OPT_REFRESH,
+};
+
+static const struct option unattend_longOptions[] = {
+    { "answer",     required_argument, NULL, 'a' },
+    { "variant",    required_argument, NULL, 'v' },
+    { "partition",  required_argument, NULL, 'p' },
+    { "registry",   required_argument, NULL, 'r' },
+    { "cluster",    required_argument, NULL, 'c' },
+    { "format",     no_argument,       NULL, UNATTEND_OPT_FORMAT },
+    { "no-format",  no_argument,       NULL, UNATTEND_OPT_NO_FORMAT },
+    { "mbr",        no_argument,       NULL, UNATTEND_OPT_MBR },
+    { "no-mbr",     no_argument,       NULL, UNATTEND_OPT_NO_MBR },
+    { "drivers",    no_argument,       NULL, UNATTEND_OPT_DRIVERS },
+    { "no-drivers", no_argument,       NULL, UNATTEND_OPT_NO_DRIVERS },
+    { "detect-drivers", no_argument,   NULL, UNATTEND_OPT_DETECT_DRIVERS },
+    { "reboot",     no_argument,       NULL, UNATTEND_OPT_REBOOT },
+    { "no-reboot",  no_argument,       NULL, UNATTEND_OPT_NO_REBOOT },
+    { "verify",     no_argument,       NULL, UNATTEND_OPT_VERIFY },
+    { "no-verify",  no_argument,       NULL, UNATTEND_OPT_NO_VERIFY },
+    { "resume",     no_argument,       NULL, UNATTEND_OPT_RESUME },
+    { "no-resume",  no_argument,       NULL, UNATTEND_OPT_NO_RESUME },
+    { "refresh",    required_argument, NULL, UNATTEND_OPT_REFRESH },
+    { "help",       no_argument,       NULL, 'h' },
+    { NULL,         0,                 NULL, 0 }
+};
+
+static void unattend_setDefaults(unattend_Options *opt) {
+    memset(opt, 0, sizeof(unattend_Options));
+    opt->variantIndex = 1;
+    opt->formatPartition = true;
+    opt->setActiveAndDoMBR = true;
+    opt->registryVariant = UNATTEND_REGISTRY_FAST;
+    opt->installDrivers = true;
+    opt->reboot = false;
+    opt->verify = false;
+    opt->resume = true;
+    opt->refresh = UNATTEND_REFRESH_OFF;
+}
+
+static bool unattend_parseBool(const char *str, bool *out) {
+    if (!strcasecmp(str, "yes") || !strcasecmp(str, "true") || !strcmp(str, "1")) {
+        *out = true;
+        return true;
+    }
+
+    if (!strcasecmp(str, "no") || !strcasecmp(str, "false") || !strcmp(str, "0")) {
+        *out = false;
+        return true;
+    }
+
+    return false;
+}
+
+static bool unattend_parseVariant(const char *str, size_t *out) {
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+
+    if (*str == 0x00 || *end != 0x00 || value == 0)
+        return false;
+
+    *out = (size_t) value;
+    return true;
+}
+
+static bool unattend_parseRegistry(const char *str, unattend_RegistryVariant *out) {
+    if (!strcasecmp(str, "fast")) {
+        *out = UNATTEND_REGISTRY_FAST;
+    } else if (!strcasecmp(str, "slow")) {
+        *out = UNATTEND_REGISTRY_SLOW;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool unattend_parseDrivers(const char *str, unattend_Options *opt) {
+    if (!strcasecmp(str, "detect")) {
+        opt->installDrivers = true;
+        opt->detectDrivers = true;
+        return true;
+    }
+
+    opt->detectDrivers = false;
+    return unattend_parseBool(str, &opt->installDrivers);
+}
+
+static bool unattend_parseRefresh(const char *str, unattend_RefreshMode *out) {
+    if (!strcasecmp(str, "no")) {
+        *out = UNATTEND_REFRESH_OFF;
+    } else if (!strcasecmp(str, "yes")) {
+        *out = UNATTEND_REFRESH_ON;
+    } else if (!strcasecmp(str, "compare")) {
+        *out = UNATTEND_REFRESH_COMPARE;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* "auto" or a power of two from 512 to 32768 bytes, optionally with a 'k' suffix */
+static bool unattend_parseClusterSize(const char *str, uint32_t *out) {
+    char *end;
+
+    if (!strcasecmp(str, "auto")) {
+        *out = 0;
+        return true;
+    }
+
+    unsigned long value = strtoul(str, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    }
+
+    if (*str == 0x00 || *end != 0x00 || value < 512 || value > 32768 || (value & (value - 1)) != 0)
+        return false;
+
+    *out = (uint32_t) value;
+    return true;
+}
+
+/* Adds a comma separated list of partitions */
+static bool unattend_addPartitions(const char *str, unattend_Options *opt) {
+    while (true) {
+        const char *end = strchr(str, ',');
+        size_t len = end ? (size_t) (end - str) : strlen(str);
+
+        if (len == 0 || len >= UTIL_HDD_DEVICE_STRING_LENGTH || opt->partitionCount >= UNATTEND_MAX_PARTITIONS)
+            return false;
+
+        memcpy(opt->partitions[opt->partitionCount], str, len);
+        opt->partitions[opt->partitionCount][len] = 0x00;
+        opt->partitionCount++;
+
+        if (end == NULL)
+            return true;
+
+        str = end + 1;
+    }
+}
+
+static bool unattend_setPartitions(const char *str, unattend_Options *opt) {
+    opt->partitionCount = 0;
+    return unattend_addPartitions(str, opt);
+}
+
+/* Applies one key / value pair. Returns false if the key is unknown or the value is invalid. */
+static bool unattend_setValue(const char *key, const char *value, unattend_Options *opt) {
+    if (!strcasecmp(key, "variant"))    return unattend_parseVariant(value, &opt->variantIndex);
+    if (!strcasecmp(key, "partition"))  return unattend_setPartitions(value, opt);
+    if (!strcasecmp(key, "format"))     return unattend_parseBool(value, &opt->formatPartition);
+    if (!strcasecmp(key, "mbr"))        return unattend_parseBool(value, &opt->setActiveAndDoMBR);
+    if (!strcasecmp(key, "registry"))   return unattend_parseRegistry(value, &opt->registryVariant);
+    if (!strcasecmp(key, "drivers"))    return unattend_parseDrivers(value, opt);
+    if (!strcasecmp(key, "cluster"))    return unattend_parseClusterSize(value, &opt->clusterSize);
+    if (!strcasecmp(key, "reboot"))     return unattend_parseBool(value, &opt->reboot);
+    if (!strcasecmp(key, "verify"))     return unattend_parseBool(value, &opt->verify);
+    if (!strcasecmp(key, "resume"))     return unattend_parseBool(value, &opt->resume);
+    if (!strcasecmp(key, "refresh"))    return unattend_parseRefresh(value, &opt->refresh);
+    return false;
+}
+
+/* Removes leading and trailing white space, in place */
+static char *unattend_trim(char *str) {
+    while (isspace((unsigned char) *str))
+        str++;
+
+    char *end = util_endOfString(str);
+
+    while (end > str && isspace((unsigned char) end[-1]))
+        *--end = 0x00;
+
+    return str;
+}
+
+bool unattend_readAnswerFile(const char *filename, unattend_Options *opt) {
+    FILE *f = fopen(filename, "r");
+    char line[UNATTEND_LINE_LENGTH];
+    size_t lineNumber = 0;
+    bool success = true;
+
+    if (f == NULL) {
+        fprintf(stderr, "ERRO: Não foi possível abrir o arquivo de respostas '%s'\n", filename);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNumber++;
+
+        char *key = unattend_trim(line);
+
+        if (*key == 0x00 || *key == '#' || *key == ';')
+            continue;
+
+        char *value = strchr(key, '=');
+
+        if (value == NULL) {
+            fprintf(stderr, "ERRO: %s, linha %zu: esperado 'chave=valor'\n", filename, lineNumber);
+            success = false;
+            continue;
+        }
+
+        *value++ = 0x00;
+        key = unattend_trim(key);
+        value = unattend_trim(value);
+
+        if (!unattend_setValue(key, value, opt)) {
+            fprintf(stderr, "ERRO: %s, linha %zu: valor inválido para '%s': '%s'\n", filename, lineNumber, key, value);
+            success = false;
+        }
+    }
+
+    fclose(f);
+
+    opt->enabled = true;
+    return success;
+}
+
+void unattend_usage(const char *programName) {
+    fprintf(stderr,
+        "Uso: %s [opções]\n"
+        "Sem opções o instalador é interativo. Qualquer uma das opções abaixo inicia uma instalação automática:\n"
+        "  -a, --answer ARQUIVO          Ler as configurações de um arquivo de respostas (veja unattend.h)\n"
+        "  -v, --variant N               Variante do sistema operacional (padrão 1)\n"
+        "  -p, --partition DISPOSITIVO   Partição de destino, ex. /dev/sda1 (obrigatório). Repetida ou separada por\n"
+        "                                vírgulas instala em várias partições ao mesmo tempo (uma por disco)\n"
+        "  -r, --registry fast|slow      Detecção de hardware rápida ou completa (padrão fast)\n"
+        "      --format, --no-format     Formatar a partição (padrão sim)\n"
+        "      --mbr, --no-mbr           Gravar o MBR e ativar a partição (padrão sim)\n"
+        "      --drivers, --no-drivers   Instalar a biblioteca de drivers (padrão sim)\n"
+        "      --detect-drivers          Instalar só os drivers para o hardware PCI deste computador\n"
+        "  -c, --cluster auto|BYTES      Tamanho do cluster ao formatar, ex. 4096 ou 16k (padrão auto)\n"
+        "      --reboot, --no-reboot     Reiniciar após a instalação (padrão não)\n"
+        "      --verify, --no-verify     Ler de volta e verificar os arquivos instalados (padrão não)\n"
+        "      --resume, --no-resume     Continuar uma instalação interrompida na partição (padrão sim)\n"
+        "      --refresh no|yes|compare  Sem formatar: pular arquivos que já estão iguais (mesmo tamanho e data,\n"
+        "                                compare também lê e compara o conteúdo) (padrão no)\n"
+        "As opções da linha de comando têm prioridade sobre o arquivo de respostas.\n",
+        programName);
+}
+
+bool unattend_parseArguments(int argc, char *argv[], unattend_Options *opt) {
+    const char *answerFile = NULL;
+    bool partitionsGiven = false;
+    int c;
+
+    unattend_setDefaults(opt);
+
+    // The answer file is read first, no matter where it is on the command line, so the other arguments can override it.
+    while ((c = getopt_long(argc, argv, "a:v:p:r:c:h", unattend_longOptions, NULL)) != -1) {
+        if (c == 'h' || c == '?') {
+            unattend_usage(argv[0]);
+            return false;
+        }
+
+        if (c == 'a')
+            answerFile = optarg;
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "ERRO: Argumento inesperado '%s'\n", argv[optind]);
+        unattend_usage(argv[0]);
+        return false;
+    }
+
+    if (answerFile != NULL && !unattend_readAnswerFile(answerFile, opt))
+        return false;
+
+    optind = 1;
+
+    while ((c = getopt_long(argc, argv, "a:v:p:r:c:h", unattend_longOptions, NULL)) != -1) {
+        bool valid = true;
+
+        switch (c) {
+            case 'v':                       valid = unattend_parseVariant(optarg, &opt->variantIndex); break;
+            case 'p':
+                // The first one replaces the ones from the answer file, the others are added
+                valid = partitionsGiven ? unattend_addPartitions(optarg, opt) : unattend_setPartitions(optarg, opt);
+                partitionsGiven = true;
+                break;
+            case 'r':                       valid = unattend_parseRegistry(optarg, &opt->registryVariant); break;
+            case 'c':                       valid = unattend_parseClusterSize(optarg, &opt->clusterSize); break;
+            case UNATTEND_OPT_FORMAT:       opt->formatPartition = true; break;
+            case UNATTEND_OPT_NO_FORMAT:    opt->formatPartition = false; break;
+            case UNATTEND_OPT_MBR:          opt->setActiveAndDoMBR = true; break;
+            case UNATTEND_OPT_NO_MBR:       opt->setActiveAndDoMBR = false; break;
+            case UNATTEND_OPT_DRIVERS:      opt->installDrivers = true; opt->detectDrivers = false; break;
+            case UNATTEND_OPT_NO_DRIVERS:   opt->installDrivers = false; opt->detectDrivers = false; break;
+            case UNATTEND_OPT_DETECT_DRIVERS: opt->installDrivers = true; opt->detectDrivers = true; break;
+            case UNATTEND_OPT_REBOOT:       opt->reboot = true; break;
+            case UNATTEND_OPT_NO_REBOOT:    opt->reboot = false; break;
+            case UNATTEND_OPT_VERIFY:       opt->verify = true; break;
+            case UNATTEND_OPT_NO_VERIFY:    opt->verify = false; break;
+            case UNATTEND_OPT_RESUME:       opt->resume = true; break;
+            case UNATTEND_OPT_NO_RESUME:    opt->resume = false; break;
+            case UNATTEND_OPT_REFRESH:      valid = unattend_parseRefresh(optarg, &opt->refresh); break;
+            default: break;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "ERRO: Valor inválido '%s'\n", optarg);
+            return false;
+        }
+
+        opt->enabled = true;
+    }
+
+    if (opt->enabled && opt->partitionCount == 0) {
+        fprintf(stderr, "ERRO: Nenhuma partição de destino informada (--partition ou 'partition=' no arquivo de respostas)\n");
+        return false;
+    }
+
+    return true;
+}
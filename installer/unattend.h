@@ -0,0 +1,73 @@
+#ifndef UNATTEND_H
+#define UNATTEND_H
+
+/*
+ * LUNMERCY - Unattended install settings
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * Settings for installing without any user interaction, from command line arguments and/or an answer file.
+ * The answer file is a text file with one 'key=value' per line, '#' or ';' start a comment:
+ *
+ *   variant=1               OS variant index (osroots/<n>), default 1
+ *   partition=/dev/sda1     Destination partition, required. Several, separated by commas, get the same install
+ *                           at the same time (one partition per disk, at most UNATTEND_MAX_PARTITIONS)
+ *   format=yes              Format the partition before installing, default yes
+ *   mbr=yes                 Write the MBR and make the partition active, default yes
+ *   registry=fast           Hardware detection variant, 'fast' or 'slow', default fast
+ *   drivers=yes             Install the driver package (if the variant has one), default yes. 'detect' installs only
+ *                           the drivers for the PCI hardware of this machine (see drivers.h, only with one partition)
+ *   cluster=auto            Cluster size when formatting, in bytes (512 - 32768, a 'k' suffix works too), default auto
+ *   verify=no               Read all installed files back and check them (see verify.h), default no
+ *   resume=yes              Pick up an install that was cut short on the partition instead of starting over
+ *                           (see journal.h, only with one partition), default yes
+ *   refresh=no              Without formatting: leave files alone that are the same already. 'yes' compares size and
+ *                           DOS time stamp, 'compare' reads and compares the contents too (only with one partition)
+ *   reboot=no               Reboot after a successful install, default no (exit to shell)
+ *
+ * Command line arguments override what is in the answer file, see unattend_usage.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define UNATTEND_MAX_PARTITIONS (8)
+
+typedef enum {
+    UNATTEND_REGISTRY_FAST = 0,
+    UNATTEND_REGISTRY_SLOW,
+} unattend_RegistryVariant;
+
+typedef enum {
+    UNATTEND_REFRESH_OFF = 0,
+    UNATTEND_REFRESH_ON,
+    UNATTEND_REFRESH_COMPARE,
+} unattend_RefreshMode;
+
+typedef struct {
+    bool enabled;               // false = normal interactive install
+    size_t variantIndex;
+    char partitions[UNATTEND_MAX_PARTITIONS][UTIL_HDD_DEVICE_STRING_LENGTH];
+    size_t partitionCount;
+    bool formatPartition;
+    bool setActiveAndDoMBR;
+    unattend_RegistryVariant registryVariant;
+    bool installDrivers;
+    bool detectDrivers;         // Only the ones for this machine's hardware
+    uint32_t clusterSize;       // Bytes, 0 = picked by the installer from the pack file sizes
+    bool verify;
+    bool resume;
+    unattend_RefreshMode refresh;   // Only without formatting
+    bool reboot;
+} unattend_Options;
+
+// Parses the command line into opt. Prints an error (or the usage) and returns false if it is not valid.
+bool unattend_parseArguments(int argc, char *argv[], unattend_Options *opt);
+// Reads an answer file into opt. Prints an error and returns false if it can't be read or contains unknown keys.
+bool unattend_readAnswerFile(const char *filename, unattend_Options *opt);
+// Prints the command line help
+void unattend_usage(const char *programName);
+
+#endif
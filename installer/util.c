@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <linux/msdos_fs.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "qi_assert.h"
 
@@ -34,6 +35,32 @@ uint64_t util_getProcMeminfoValue(const char *key) {
     return (uint64_t) ret;
 }
 
+uint64_t util_getProcSelfStatusValue(const char *key) {
+    FILE *status = fopen("/proc/self/status", "r");
+    size_t keyLength = strlen(key);
+    unsigned long long ret = 0;
+    char line[256];
+
+    if (status == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, key, keyLength) == 0 && line[keyLength] == ':') {
+            sscanf(&line[keyLength + 1], "%llu", &ret);
+            break;
+        }
+    }
+
+    fclose(status);
+    return (uint64_t) ret;
+}
+
+uint64_t util_getMicroseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
 inline uint64_t util_getProcSafeFreeMemory() {
     uint64_t commitLimit = util_getProcMeminfoValue("CommitLimit") * 1024ULL;
     uint64_t memAvailable = util_getProcMeminfoValue("MemAvailable") * 1024ULL;
@@ -137,6 +164,34 @@ uint32_t util_getUInt32fromBuffer(const uint8_t *buf, size_t offset) {
     return *((uint32_t *) (buf + offset));
 }
 
+static uint32_t util_crc32Table[256];
+static pthread_once_t util_crc32TableOnce = PTHREAD_ONCE_INIT;
+
+static void util_crc32BuildTable(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t value = i;
+
+        for (size_t bit = 0; bit < 8; bit++)
+            value = (value & 1) ? (value >> 1) ^ 0xEDB88320UL : (value >> 1);
+
+        util_crc32Table[i] = value;
+    }
+}
+
+uint32_t util_crc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) data;
+
+    // The verify threads call this at the same time, whoever comes first builds the table
+    pthread_once(&util_crc32TableOnce, util_crc32BuildTable);
+
+    crc = ~crc;
+
+    while (len--)
+        crc = util_crc32Table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
 // Convet DOS time to Unix Time and return this in a time_t
 time_t util_dosTimeToUnixTime(uint16_t dosDate, uint16_t dosTime) {
     struct tm tmValue;
@@ -180,6 +235,11 @@ bool util_setDosFileAttributes(int fd, uint32_t attributes) {
     return ret == 0;
 }
 
+bool util_getDosFileAttributes(int fd, uint32_t *attributes) {
+    int ret = ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, attributes);
+    return ret == 0;
+}
+
 mode_t util_dosFileAttributeToUnixMode(uint8_t dosFlags) {
     mode_t ret = 0;
     if (dosFlags & ATTR_DIR)    // The file is a directory
@@ -26,6 +26,12 @@ typedef enum {
     FS_ENUM_SIZE
 } util_FileSystem;
 
+// How a partition is mounted
+typedef enum {
+    UTIL_MOUNT_NORMAL = 0,
+    UTIL_MOUNT_BULK_INSTALL,    // For unpacking lots of files: no access times, no flush when a file is closed
+} util_MountProfile;
+
 // this struct models a partition on a hard drive
 typedef struct {
     char device[UTIL_HDD_DEVICE_STRING_LENGTH];
@@ -34,6 +40,7 @@ typedef struct {
     util_FileSystem fileSystem;
     struct util_HardDisk *parent;
     size_t indexOnParent;
+    uint64_t offset;        // Start on the parent disk, in bytes
     char *mountPath;
 } util_Partition;
 
@@ -51,6 +58,8 @@ typedef struct util_HardDisk {
 typedef struct {
     size_t count;
     util_HardDisk *disks;    
+    uint32_t fingerprint;   // Of /proc/partitions at the time of the scan, to see if anything changed since
+    bool stale;             // Set by util_hardDiskArrayInvalidate
 } util_HardDiskArray;
 
 // This struct models a part of a boot sector that is to be overwritten with parts of data blocks
@@ -66,6 +75,21 @@ typedef struct {
     const util_BootSectorModifier *modifiers;
 } util_BootSectorModifierList;
 
+#define UTIL_SECTOR_SESSION_MAX_PENDING (16)
+
+typedef struct {
+    size_t sector;
+    uint8_t *data;
+} util_SectorSessionWrite;
+
+// A device held open for several sector reads and writes, see util_sectorSessionOpen
+typedef struct {
+    int fd;
+    uint32_t sectorSize;
+    size_t pendingCount;
+    util_SectorSessionWrite pending[UTIL_SECTOR_SESSION_MAX_PENDING];
+} util_SectorSession;
+
 typedef struct {
     size_t lineCount;
     int returnCode;
@@ -84,6 +108,11 @@ uint64_t util_getProcMeminfoValue(const char *key);
 
 // Gets safe free amount of memory the system has at current time in bytes. 
 uint64_t util_getProcSafeFreeMemory(void);
+// Get a value for a given key from /proc/self/status (e.g. VmHWM), in kB
+uint64_t util_getProcSelfStatusValue(const char *key);
+
+// Gets a monotonic time stamp in microseconds, for measuring how long things take
+uint64_t util_getMicroseconds(void);
 
 // Returns the stdout output of a command. Call commandOutputDestroy after use. Returns NULL in case of errors.
 util_CommandOutput *util_commandOutputCapture(const char *command);
@@ -94,6 +123,10 @@ void util_commandOutputDestroy(util_CommandOutput *co);
 util_HardDiskArray *util_getSystemHardDisks(void);
 // Deallocates a hard disk array including all internal data structures
 void util_hardDiskArrayDestroy(util_HardDiskArray *hdds);
+// Checks if a hard disk array still matches the system (no disks or partitions were added, removed or changed). NULL is never current.
+bool util_hardDiskArrayIsCurrent(const util_HardDiskArray *hdds);
+// Marks a hard disk array as outdated, e.g. after a partition table was changed
+void util_hardDiskArrayInvalidate(util_HardDiskArray *hdds);
 
 // Converts a MBR patition type byte to an util_FileSystem enum value
 util_FileSystem util_partitionTypeByteToUtilFilesystem(uint8_t partitionType);
@@ -102,13 +135,17 @@ const char *util_utilFilesystemToString(util_FileSystem fs);
 // Gets the short version of a device string (after the last /, so /dev/sda1 becomes sda1)
 const char *util_shortDeviceString(const char *str);
 
-// Mounts a partition.
-bool util_mountPartition(util_Partition *part);
+// Mounts a partition with the given profile. If it's mounted already, it is remounted with the profile.
+bool util_mountPartition(util_Partition *part, util_MountProfile profile);
+// Changes the mount options of a mounted partition. Remounting flushes everything that was written so far.
+bool util_remountPartition(util_Partition *part, util_MountProfile profile);
 // Unmounts a partition.
 bool util_unmountPartition(util_Partition *part);
 
 // Checks if a partition is currently mounted.
 bool util_isPartitionMounted(util_Partition *part);
+// Checks if a partition is one of the four in the MBR, only those can be marked active
+bool util_isPrimaryPartition(const util_Partition *part);
 
 // Gets the command to format a partition. Returns false if there was an error, such as unsupported filesystem.
 bool util_getFormatCommand(util_Partition *part, util_FileSystem fs, char *buf, size_t bufSize);
@@ -132,10 +169,24 @@ uint8_t *util_readSectorFromDiskAllocate(util_HardDisk *hdd, size_t sector);
 // Reads a sector from a partition on a disk into a newly allocated buffer
 uint8_t *util_readSectorFromPartitionAllocate(util_Partition *part, size_t sector);
 
+// Opens a disk for a series of sector reads and writes. Writes are queued and go out when the session is closed,
+// contiguous sectors with one pwritev each, followed by a single flush. Close the session even if this fails.
+bool util_sectorSessionOpen(util_SectorSession *session, util_HardDisk *hdd);
+// Translates a sector on a partition to a sector on the session's disk
+size_t util_sectorSessionPartitionSector(const util_SectorSession *session, const util_Partition *part, size_t sector);
+// Reads count contiguous sectors, including writes queued in this session
+bool util_sectorSessionRead(util_SectorSession *session, size_t sector, size_t count, uint8_t *buf);
+// Queues count contiguous sectors for writing
+bool util_sectorSessionWrite(util_SectorSession *session, size_t sector, size_t count, const uint8_t *buf);
+// Writes the queued sectors and flushes if commit is true, otherwise drops them. Closes the device.
+bool util_sectorSessionClose(util_SectorSession *session, bool commit);
+
 // Writes a Windows 98 MBR to a physical disk (FDISK /MBR equivalent)
 bool util_writeWin98MBRToDrive(util_HardDisk *hdd);
 // Writes a Windows 98 Boot Sector to a partition on a disk (SYS.COM equivalent, sans copying system files)
 bool util_writeWin98BootSectorToPartition(util_Partition *part);
+// Writes the boot sector and, if mbrAndActive is set, the MBR and boot flag in one session, with a single flush
+bool util_writeWin98BootRecords(util_Partition *part, bool mbrAndActive);
 
 /* File IO functions*/
 
@@ -143,6 +194,8 @@ bool util_writeWin98BootSectorToPartition(util_Partition *part);
 bool util_setDosFileTime(int fd, uint16_t dosDate, uint16_t dosTime);
 // Sets an open file's attributes
 bool util_setDosFileAttributes(int fd, uint32_t attributes);
+// Gets an open file's attributes
+bool util_getDosFileAttributes(int fd, uint32_t *attributes);
 // Checks if a file exists.
 bool util_fileExists(const char *filename);
 
@@ -167,6 +220,9 @@ uint16_t util_getUInt16fromBuffer(const uint8_t *buf, size_t offset);
 // Gets an unsigned 32 bit value from a raw buffer
 uint32_t util_getUInt32fromBuffer(const uint8_t *buf, size_t offset);
 
+// Continues a CRC32 (same as zlib's, start with 0) over a buffer
+uint32_t util_crc32(uint32_t crc, const void *data, size_t len);
+
 // Reads the first line of a file into a buffer.
 bool util_readFirstLineFromFileIntoBuffer(const char *filename, char *dest, size_t bufSize);
 
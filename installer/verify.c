@@ -0,0 +1,334 @@
+/*
+ * LUNMERCY - Reading an install back to check it
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "qi_assert.h"
+#include "trace.h"
+
+#define VERIFY_BUFFER_SIZE (256 * 1024)
+#define VERIFY_IDLE_SLEEP_US (10000)    // No futexes, the main thread polls the others
+#define VERIFY_MIN_BUCKETS (1024)
+
+typedef struct {
+    char *path;
+    uint32_t size;
+    uint32_t crc32;
+} verify_Entry;
+
+// The entries in the order they were added (which is about the order they are on the disk), plus a hash table
+// on the upper case path to find the ones that get replaced. FAT doesn't care about case.
+struct verify_Manifest {
+    verify_Entry *entries;
+    size_t count;
+    size_t capacity;
+    size_t *buckets;        // Entry index + 1, 0 = empty
+    size_t bucketCount;     // Power of two
+    uint64_t totalBytes;
+};
+
+typedef struct {
+    const verify_Manifest *manifest;
+    const char *installPath;
+    verify_Result *result;
+    pthread_mutex_t lock;
+    size_t next;            // Next entry to check
+    size_t running;         // Threads that aren't done yet
+    uint64_t bytesDone;     // Of the entries done, for the progress
+} verify_Run;
+
+typedef struct {
+    verify_Run *run;
+    trace_Track track;      // The fan-out writers are done by now, the threads get their tracks
+} verify_Worker;
+
+static uint32_t verify_hashPath(const char *path) {
+    uint32_t hash = 2166136261UL;   // FNV-1a
+
+    while (*path) {
+        hash ^= (uint8_t) toupper((unsigned char) *path++);
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+/* Gets the bucket of a path, either the one it's in or the empty one it would go to */
+static size_t verify_findBucket(const verify_Manifest *manifest, const char *path) {
+    size_t mask = manifest->bucketCount - 1;
+    size_t bucket = verify_hashPath(path) & mask;
+
+    while (manifest->buckets[bucket] != 0 && strcasecmp(manifest->entries[manifest->buckets[bucket] - 1].path, path) != 0)
+        bucket = (bucket + 1) & mask;
+
+    return bucket;
+}
+
+static void verify_rehash(verify_Manifest *manifest, size_t bucketCount) {
+    free(manifest->buckets);
+
+    manifest->bucketCount = bucketCount;
+    manifest->buckets = calloc(bucketCount, sizeof(size_t));
+    QI_ASSERT(manifest->buckets);
+
+    for (size_t i = 0; i < manifest->count; i++)
+        manifest->buckets[verify_findBucket(manifest, manifest->entries[i].path)] = i + 1;
+}
+
+verify_Manifest *verify_manifestCreate(void) {
+    verify_Manifest *manifest = calloc(1, sizeof(verify_Manifest));
+    QI_ASSERT(manifest);
+
+    verify_rehash(manifest, VERIFY_MIN_BUCKETS);
+    return manifest;
+}
+
+void verify_manifestDestroy(verify_Manifest *manifest) {
+    if (manifest == NULL)
+        return;
+
+    for (size_t i = 0; i < manifest->count; i++)
+        free(manifest->entries[i].path);
+
+    free(manifest->entries);
+    free(manifest->buckets);
+    free(manifest);
+}
+
+void verify_manifestAdd(verify_Manifest *manifest, const char *path, uint32_t size, uint32_t crc32) {
+    size_t bucket = verify_findBucket(manifest, path);
+
+    if (manifest->buckets[bucket] != 0) {
+        verify_Entry *entry = &manifest->entries[manifest->buckets[bucket] - 1];
+        manifest->totalBytes += (uint64_t) size - entry->size;
+        entry->size = size;
+        entry->crc32 = crc32;
+        return;
+    }
+
+    if (manifest->count == manifest->capacity) {
+        manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 256;
+        manifest->entries = realloc(manifest->entries, manifest->capacity * sizeof(verify_Entry));
+        QI_ASSERT(manifest->entries);
+    }
+
+    verify_Entry *entry = &manifest->entries[manifest->count++];
+    entry->path = strdup(path);
+    entry->size = size;
+    entry->crc32 = crc32;
+    QI_ASSERT(entry->path);
+
+    manifest->buckets[bucket] = manifest->count;
+    manifest->totalBytes += size;
+
+    // Keep it at most half full
+    if (manifest->count * 2 > manifest->bucketCount)
+        verify_rehash(manifest, manifest->bucketCount * 2);
+}
+
+size_t verify_manifestCount(const verify_Manifest *manifest) {
+    return manifest->count;
+}
+
+bool verify_isRotational(const util_HardDisk *disk) {
+    char path[64 + UTIL_HDD_DEVICE_STRING_LENGTH];
+    char value[16] = {0};
+
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/rotational", util_shortDeviceString(disk->device));
+
+    if (!util_readFirstLineFromFileIntoBuffer(path, value, sizeof(value)))
+        return true;
+
+    return value[0] != '0';
+}
+
+/* Reads a file back. Returns false and sets type if it doesn't match its entry. */
+static bool verify_checkFile(const verify_Entry *entry, char *path, uint8_t *buffer, verify_MismatchType *type, uint64_t *bytesRead) {
+    uint32_t crc32 = 0;
+    uint64_t size = 0;
+    ssize_t got;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        *type = VERIFY_MISSING;
+        return false;
+    }
+
+    // Only clean pages can be thrown out, anything else would be read from memory
+    if (fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+        close(fd);
+        *type = VERIFY_NOT_EVICTED;
+        return false;
+    }
+
+    while ((got = read(fd, buffer, VERIFY_BUFFER_SIZE)) > 0 || (got < 0 && errno == EINTR)) {
+        if (got < 0)
+            continue;
+
+        crc32 = util_crc32(crc32, buffer, (size_t) got);
+        size += (uint64_t) got;
+    }
+
+    close(fd);
+    *bytesRead += size;
+
+    if (got < 0) {
+        *type = VERIFY_READ_ERROR;
+    } else if (size != entry->size) {
+        *type = VERIFY_WRONG_SIZE;
+    } else if (crc32 != entry->crc32) {
+        *type = VERIFY_WRONG_CONTENT;
+    }
+
+    return got == 0 && size == entry->size && crc32 == entry->crc32;
+}
+
+static void verify_reportProgress(verify_Run *run, const verify_Callbacks *callbacks) {
+    if (callbacks == NULL || callbacks->progress == NULL)
+        return;
+
+    pthread_mutex_lock(&run->lock);
+    uint64_t done = run->bytesDone;
+    pthread_mutex_unlock(&run->lock);
+
+    callbacks->progress(callbacks->userData, done, run->manifest->totalBytes);
+}
+
+/* Checks entries until there are none left. The main thread does this too, and reports the progress while it's at it. */
+static void verify_work(verify_Run *run, trace_Track track, const verify_Callbacks *callbacks) {
+    char *path = malloc(strlen(run->installPath) + 256 + 1);   // MercyPak strings are 255 chars max
+    char *pathAppend = path + sprintf(path, "%s/", run->installPath);
+    uint8_t *buffer = malloc(VERIFY_BUFFER_SIZE);
+
+    QI_ASSERT(path && buffer);
+
+    while (true) {
+        pthread_mutex_lock(&run->lock);
+        size_t index = run->next;
+        run->next += (index < run->manifest->count) ? 1 : 0;
+        pthread_mutex_unlock(&run->lock);
+
+        if (index >= run->manifest->count)
+            break;
+
+        const verify_Entry *entry = &run->manifest->entries[index];
+        verify_MismatchType type = VERIFY_MISSING;
+        uint64_t bytesRead = 0;
+        uint64_t start = trace_timestamp();
+
+        strcpy(pathAppend, entry->path);
+        bool match = verify_checkFile(entry, path, buffer, &type, &bytesRead);
+        trace_span(track, "verify", start, match, entry->path);
+
+        pthread_mutex_lock(&run->lock);
+        run->bytesDone += entry->size;
+        run->result->files++;
+        run->result->bytesRead += bytesRead;
+
+        if (!match && run->result->mismatchCount < VERIFY_MAX_MISMATCHES) {
+            run->result->mismatches[run->result->mismatchCount].path = entry->path;
+            run->result->mismatches[run->result->mismatchCount].type = type;
+        }
+
+        run->result->mismatchCount += match ? 0 : 1;
+        pthread_mutex_unlock(&run->lock);
+
+        verify_reportProgress(run, callbacks);
+    }
+
+    free(buffer);
+    free(path);
+}
+
+static void *verify_threadFunc(void *param) {
+    verify_Worker *worker = (verify_Worker *) param;
+    verify_Run *run = worker->run;
+
+    verify_work(run, worker->track, NULL);
+
+    pthread_mutex_lock(&run->lock);
+    run->running--;
+    pthread_mutex_unlock(&run->lock);
+
+    return NULL;
+}
+
+static size_t verify_threadsRunning(verify_Run *run) {
+    pthread_mutex_lock(&run->lock);
+    size_t running = run->running;
+    pthread_mutex_unlock(&run->lock);
+    return running;
+}
+
+bool verify_run(const verify_Manifest *manifest, const char *installPath, size_t threadCount, const verify_Callbacks *callbacks,
+    verify_Result *result) {
+    QI_ASSERT(manifest != NULL && installPath != NULL && result != NULL);
+    QI_ASSERT(threadCount > 0 && threadCount <= VERIFY_MAX_THREADS);
+
+    pthread_t threads[VERIFY_MAX_THREADS];
+    verify_Worker workers[VERIFY_MAX_THREADS];
+    size_t started = 0;
+    verify_Run run = { 0 };
+
+    run.manifest = manifest;
+    run.installPath = installPath;
+    run.result = result;
+    memset(result, 0, sizeof(verify_Result));
+
+    if (pthread_mutex_init(&run.lock, NULL) != 0)
+        return false;
+
+    // The main thread is one of them. If a thread can't be started there are just fewer.
+    for (size_t i = 1; i < threadCount; i++) {
+        workers[started].run = &run;
+        workers[started].track = (trace_Track) (TRACE_TRACK_TARGET + started);
+        run.running++;
+
+        if (pthread_create(&threads[started], NULL, verify_threadFunc, &workers[started]) != 0) {
+            run.running--;
+            break;
+        }
+
+        started++;
+    }
+
+    verify_work(&run, TRACE_TRACK_MAIN, callbacks);
+
+    // The others may still be busy with their last files
+    while (verify_threadsRunning(&run) > 0) {
+        verify_reportProgress(&run, callbacks);
+        usleep(VERIFY_IDLE_SLEEP_US);
+    }
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    verify_reportProgress(&run, callbacks);
+    pthread_mutex_destroy(&run.lock);
+
+    return result->mismatchCount == 0;
+}
+
+const char *verify_mismatchTypeToString(verify_MismatchType type) {
+    switch (type) {
+        case VERIFY_MISSING:        return "não encontrado";
+        case VERIFY_READ_ERROR:     return "erro de leitura";
+        case VERIFY_WRONG_SIZE:     return "tamanho diferente";
+        case VERIFY_WRONG_CONTENT:  return "conteúdo diferente";
+        case VERIFY_NOT_EVICTED:    return "não pôde ser tirado do cache";
+        default:                    return "?";
+    }
+}
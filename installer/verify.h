@@ -0,0 +1,75 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+/*
+ * LUNMERCY - Reading an install back to check it
+ * (C) 2024 Eric Voirin (oerg866@googlemail.com)
+ *
+ * While the packs are unpacked, the extraction engine hands over a CRC32 of every file (mercypak_Callbacks.fileWritten),
+ * they go into a manifest. Files that are in several packs end up with the one from the last pack, like on the disk.
+ *
+ * Once everything is on the disk every file in the manifest is read back and compared. Before a file is read, its
+ * pages are written out and thrown out of the page cache (fdatasync + POSIX_FADV_DONTNEED), so it really comes from
+ * the disk and not from memory. Our kernels have no /proc/sys, so drop_caches isn't an option. If a file can't be
+ * thrown out it counts as a mismatch. That catches what bad RAM, a flaky cable or a dying disk did to the data on the
+ * way, none of which causes any errors while writing.
+ *
+ * Disks that aren't rotational (CF cards, SSDs) are read by several threads at once, seeking costs nothing there.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+#define VERIFY_MAX_THREADS (4)
+#define VERIFY_MAX_MISMATCHES (64)  // Only the first ones are kept, the count has all of them
+
+typedef struct verify_Manifest verify_Manifest;
+
+typedef enum {
+    VERIFY_MISSING = 0,         // Can't be opened
+    VERIFY_READ_ERROR,          // Reading it failed
+    VERIFY_WRONG_SIZE,
+    VERIFY_WRONG_CONTENT,       // CRC32 doesn't match
+    VERIFY_NOT_EVICTED,         // Couldn't be thrown out of the page cache, so it can't be checked
+} verify_MismatchType;
+
+typedef struct {
+    const char *path;           // Relative to the install path, points into the manifest
+    verify_MismatchType type;
+} verify_Mismatch;
+
+typedef struct {
+    uint64_t files;             // Files checked
+    uint64_t bytesRead;
+    size_t mismatchCount;
+    verify_Mismatch mismatches[VERIFY_MAX_MISMATCHES];
+} verify_Result;
+
+typedef struct {
+    // Called while reading back, with the bytes done and the total
+    void (*progress)(void *userData, uint64_t done, uint64_t total);
+    void *userData;
+} verify_Callbacks;
+
+// Creates an empty manifest
+verify_Manifest *verify_manifestCreate(void);
+// Frees a manifest
+void verify_manifestDestroy(verify_Manifest *manifest);
+// Adds a file to the manifest. path is relative to the install path, a file that is in it already is replaced.
+void verify_manifestAdd(verify_Manifest *manifest, const char *path, uint32_t size, uint32_t crc32);
+// Gets how many files are in the manifest
+size_t verify_manifestCount(const verify_Manifest *manifest);
+
+// Checks if a disk is rotational, the kernel knows. If it can't be found out it is.
+bool verify_isRotational(const util_HardDisk *disk);
+// Reads back every file in the manifest below installPath and compares it, with threadCount threads (1 to
+// VERIFY_MAX_THREADS). callbacks can be NULL. Returns true if everything matched.
+bool verify_run(const verify_Manifest *manifest, const char *installPath, size_t threadCount, const verify_Callbacks *callbacks,
+    verify_Result *result);
+// Gets a text for a mismatch type
+const char *verify_mismatchTypeToString(verify_MismatchType type);
+
+#endif
@@ -0,0 +1,151 @@
+'''
+Persistent build cache for Windows 98 QuickInstall sysprep.
+
+Keeps a manifest of every file that was packed (hash, DOS attributes and timestamps), keyed by
+the file's path, size, modification time, inode and attribute bits, so unchanged files don't have
+to be read and hashed again.
+
+It also remembers a fingerprint of the inputs of every sysprep stage (driver preprocessing,
+registry packs, driver packs, ...), which allows skipping a stage entirely if neither its
+inputs changed nor its outputs went missing.
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import os
+import json
+import hashlib
+import threading
+
+from mercypak import getfatattr
+
+BUILDCACHE_VERSION = 2
+BUILDCACHE_MANIFEST = 'manifest.json'
+
+def file_attributes(path, file_stat):
+    # The mode and the DOS attributes that end up in the pack, changing them doesn't touch the modification time
+    return f'{file_stat.st_mode:o}:{getfatattr(path):x}'
+
+class BuildCache:
+    def __init__(self, cache_dir):
+        self.cache_dir = cache_dir
+        self.manifest_path = os.path.join(cache_dir, BUILDCACHE_MANIFEST)
+        self.files = dict()
+        self.stages = dict()
+        # Stages can run in parallel (see jobs.py), so everything that modifies or saves the manifest takes this lock
+        self.lock = threading.RLock()
+
+        os.makedirs(cache_dir, exist_ok=True)
+
+        try:
+            with open(self.manifest_path, 'r', encoding='utf-8') as f:
+                manifest = json.load(f)
+            if manifest.get('version') == BUILDCACHE_VERSION:
+                self.files = manifest.get('files', dict())
+                self.stages = manifest.get('stages', dict())
+        except (OSError, ValueError):
+            pass    # No (valid) manifest yet, start from scratch.
+
+    def lookup_file(self, path, file_stat):
+        """
+        Gets the cached (sha256 digest, DOS attributes, DOS date, DOS time) for a file, or None if
+        the file is unknown or has changed since it was last recorded.
+        """
+        entry = self.files.get(path)
+
+        if entry is None:
+            return None
+
+        if entry['size'] != file_stat.st_size or entry['mtime'] != file_stat.st_mtime_ns or entry['inode'] != file_stat.st_ino:
+            return None
+
+        if entry['mode'] != file_attributes(path, file_stat):
+            return None
+
+        return bytes.fromhex(entry['sha256']), entry['attr'], entry['dos_date'], entry['dos_time']
+
+    def store_file(self, path, file_stat, digest, attr, dos_date, dos_time):
+        entry = {
+            'size':     file_stat.st_size,
+            'mtime':    file_stat.st_mtime_ns,
+            'inode':    file_stat.st_ino,
+            'mode':     file_attributes(path, file_stat),
+            'sha256':   digest.hex(),
+            'attr':     attr,
+            'dos_date': dos_date,
+            'dos_time': dos_time,
+        }
+        with self.lock:
+            self.files[path] = entry
+
+    def stage_is_current(self, name, fingerprint, outputs=()):
+        """
+        Checks if a stage was already run with the same input fingerprint and all of its outputs still exist.
+        """
+        if self.stages.get(name) != fingerprint:
+            return False
+        return all(os.path.exists(output) for output in outputs)
+
+    def stage_done(self, name, fingerprint):
+        with self.lock:
+            self.stages[name] = fingerprint
+            self.save()
+
+    def stage_invalidate(self, name):
+        # Saved right away so that an interrupted rebuild never leaves a half-written output marked as current
+        with self.lock:
+            if self.stages.pop(name, None) is not None:
+                self.save()
+
+    def prune(self):
+        """
+        Forgets about all files that don't exist anymore, so the manifest doesn't grow forever.
+        """
+        with self.lock:
+            self.files = {path: entry for path, entry in self.files.items() if os.path.exists(path)}
+
+    def save(self):
+        with self.lock:
+            manifest = {
+                'version':  BUILDCACHE_VERSION,
+                'files':    self.files,
+                'stages':   self.stages,
+            }
+
+            # Write to a temporary file first so an interrupted run doesn't leave a broken manifest behind
+            temp_path = self.manifest_path + '.tmp'
+            with open(temp_path, 'w', encoding='utf-8') as f:
+                json.dump(manifest, f)
+            os.replace(temp_path, self.manifest_path)
+
+def tree_fingerprint(*paths, extra=()):
+    """
+    Calculates a fingerprint of one or more directory trees (or single files) from the names, sizes,
+    modification times and attribute bits of everything in them. Doesn't read any file contents.
+    'extra' can contain additional strings that should influence the fingerprint, e.g. options.
+    """
+    hash = hashlib.sha256()
+
+    for value in extra:
+        hash.update(f'extra:{value}\n'.encode())
+
+    for path in paths:
+        hash.update(f'root:{path}\n'.encode())
+
+        if os.path.isfile(path):
+            file_stat = os.stat(path)
+            hash.update(f'file:{file_stat.st_size}:{file_stat.st_mtime_ns}:{file_attributes(path, file_stat)}\n'.encode())
+            continue
+
+        for root, dirs, files in os.walk(path):
+            dirs.sort()
+            for dir_name in dirs:
+                dir_path = os.path.join(root, dir_name)
+                hash.update(f'dir:{os.path.relpath(dir_path, path)}:{file_attributes(dir_path, os.stat(dir_path))}\n'.encode())
+            for file_name in sorted(files):
+                file_path = os.path.join(root, file_name)
+                file_stat = os.stat(file_path)
+                hash.update(f'file:{os.path.relpath(file_path, path)}:{file_stat.st_size}:{file_stat.st_mtime_ns}:{file_attributes(file_path, file_stat)}\n'.encode())
+
+    return hash.hexdigest()
@@ -0,0 +1,113 @@
+'''
+Driver index for Windows 98 QuickInstall sysprep.
+
+Lists which files of DRIVER.866 belong to which driver, and the PCI IDs each driver is for, so the installer can
+leave out the drivers for hardware the machine doesn't have (see installer/drivers.h). One entry per line, paths
+are relative to the pack with '/' as separator:
+
+    driver <INF path>       Starts a driver
+    file <path>             A file that belongs to it (the CABs drivercopy packed its files into)
+    id <hardware ID>        An ID it is for, upper case
+
+Drivers that have any IDs that aren't PCI ones (ISA PnP, ACPI, USB, ...) are left without IDs, the installer can't
+detect those and always installs them. Same for files that don't belong to any driver.
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import os
+import re
+
+DRIVER_INDEX_FILE = 'drivers.txt'
+
+CAB_NAME_PATTERN = re.compile(r'[^\s",=;\\/]+\.cab', re.IGNORECASE)
+
+def read_inf_sections(inf_path):
+    # Returns { section name (lower case): [lines] }, comments and empty lines left out
+    sections = dict()
+    lines = None
+
+    with open(inf_path, 'r', encoding='latin-1') as f:
+        for line in f:
+            line = line.split(';', 1)[0].strip()
+
+            if not line:
+                continue
+
+            if line.startswith('[') and ']' in line:
+                lines = sections.setdefault(line[1:line.index(']')].strip().lower(), list())
+            elif lines is not None:
+                lines.append(line)
+
+    return sections
+
+def inf_values(line):
+    # The comma separated values right of the '=', or the whole line if there is none
+    value = line.split('=', 1)[1] if '=' in line else line
+    return [item.strip().strip('"').strip() for item in value.split(',')]
+
+def get_inf_hardware_ids(sections):
+    strings = dict()
+
+    for line in sections.get('strings', ()):
+        if '=' in line:
+            key, value = line.split('=', 1)
+            strings[key.strip().lower()] = value.strip().strip('"')
+
+    def expand(token):
+        if len(token) > 2 and token.startswith('%') and token.endswith('%'):
+            return strings.get(token[1:-1].lower(), token)
+        return token
+
+    ids = set()
+
+    # [Manufacturer] names the model sections, their entries are "description = install section, hardware ID, compatible IDs..."
+    for manufacturer in sections.get('manufacturer', ()):
+        models_section = expand(inf_values(manufacturer)[0]).lower()
+
+        for model in sections.get(models_section, ()):
+            ids.update(expand(token).upper() for token in inf_values(model)[1:] if token)
+
+    return ids
+
+def get_inf_cab_files(inf_path, sections, cab_directory):
+    # drivercopy puts the files of an INF into CABs and names them in it, so every CAB name it mentions that we have
+    # belongs to it. Others (the Windows CABs) are in FULL.866.
+    cab_files = set()
+
+    for lines in sections.values():
+        for line in lines:
+            for cab_name in CAB_NAME_PATTERN.findall(line):
+                cab_files.add(cab_name.lower())
+
+    inf_base = os.path.splitext(os.path.basename(inf_path))[0].lower()
+    cab_files.add(inf_base + '.cab')
+
+    return sorted(file_name for file_name in os.listdir(cab_directory) if file_name.lower() in cab_files)
+
+def pack_path(*parts):
+    return os.path.join(*parts).replace('\\', '/')
+
+def write_driver_index(driver_directory, inf_directory_relative, cab_directory_relative, output_file):
+    # driver_directory is what DRIVER.866 is packed from, the INFs and CABs are in the given directories in it
+    inf_directory = os.path.join(driver_directory, inf_directory_relative)
+    cab_directory = os.path.join(driver_directory, cab_directory_relative)
+
+    with open(output_file, 'w', encoding='latin-1') as file:
+        for inf_name in sorted(os.listdir(inf_directory)):
+            if not inf_name.lower().endswith('.inf'):
+                continue
+
+            inf_path = os.path.join(inf_directory, inf_name)
+            sections = read_inf_sections(inf_path)
+            ids = get_inf_hardware_ids(sections)
+
+            file.write(f'driver {pack_path(inf_directory_relative, inf_name)}\n')
+
+            for cab_name in get_inf_cab_files(inf_path, sections, cab_directory):
+                file.write(f'file {pack_path(cab_directory_relative, cab_name)}\n')
+
+            if ids and all(hardware_id.startswith('PCI\\') for hardware_id in ids):
+                for hardware_id in sorted(ids):
+                    file.write(f'id {hardware_id}\n')
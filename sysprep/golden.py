@@ -0,0 +1,158 @@
+'''
+Golden partition images for Windows 98 QuickInstall sysprep.
+
+A golden image is a FAT32 partition with the default install choices (FULL.866, DRIVER.866 and FASTPNP.866)
+already laid out in it. The installer writes it to the target partition in one go instead of unpacking file
+by file (see installer/golden.h). Only the used part of the partition is stored:
+
+    Header                  1 sector, see GOLDEN_HEADER_FORMAT
+    Start of the FAT        Up to the last used cluster, padded to whole sectors
+    Data region             Cluster 2 up to the last used cluster
+
+The FAT is sized by the installer to fit the target partition. The data region always starts at the same
+sector though, there's room for the biggest FAT Win98 can handle in front of it. Whatever a smaller FAT doesn't
+need becomes reserved sectors.
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import os
+import struct
+import time
+
+from makeusb import FAT32Partition, FAT32Populator, create_empty_file, FAT32_RESERVED_SECTORS, FAT32_NUMBER_OF_FATS, FAT32_ROOT_DIRECTORY_CLUSTER
+from mercypak import mercypak_entries
+
+GOLDEN_MAGIC = b'QIGOLD01'
+GOLDEN_SECTOR_SIZE = 512
+
+# Magic, sector size, sectors per cluster, data region start (sectors), FAT size the data start leaves room for (sectors),
+# used clusters (2 up to 2 + this - 1, all of them), sectors of FAT stored in the image
+GOLDEN_HEADER_FORMAT = '<8sIIIIII'
+
+# More than this upsets ScanDisk (FORMAT_WIN98_MAX_CLUSTERS in installer/format.c)
+GOLDEN_MAX_CLUSTERS = 4177920
+
+# The data region starts on a 1 MB boundary of the partition
+GOLDEN_DATA_ALIGNMENT = 2048
+
+# In install order, files in later packs replace the ones from earlier packs
+GOLDEN_PACKS = ['FULL.866', 'DRIVER.866', 'FASTPNP.866']
+
+class GoldenImage:
+    """
+    Takes the place of a FAT32Partition for FAT32Populator, the clusters go to the image file instead of a disk image.
+    """
+    def __init__(self, bytes_per_cluster):
+        self.sectors_per_cluster = bytes_per_cluster // GOLDEN_SECTOR_SIZE
+        self.max_fat_sectors = (4 * (GOLDEN_MAX_CLUSTERS + 2) + GOLDEN_SECTOR_SIZE - 1) // GOLDEN_SECTOR_SIZE
+        data_start = FAT32_RESERVED_SECTORS + FAT32_NUMBER_OF_FATS * self.max_fat_sectors
+        self.data_start = (data_start + GOLDEN_DATA_ALIGNMENT - 1) // GOLDEN_DATA_ALIGNMENT * GOLDEN_DATA_ALIGNMENT
+        self.fat = FAT32Partition.FAT(GOLDEN_MAX_CLUSTERS)
+        self.data_offset = 0    # In the image file, known once everything is allocated
+
+    def bytes_per_cluster(self):
+        return self.sectors_per_cluster * GOLDEN_SECTOR_SIZE
+
+    def cluster_count(self):
+        return GOLDEN_MAX_CLUSTERS
+
+    def cluster_offset(self, cluster):
+        return self.data_offset + (cluster - FAT32_ROOT_DIRECTORY_CLUSTER) * self.bytes_per_cluster()
+
+    def write_block(self, file, data, offset=0, count=0):
+        if count == 0:
+            count = len(data)
+        file.seek(offset, 0)
+        file.write(data[:count])
+
+def get_directory(populator, nodes, parts, mtime, attributes=0):
+    """
+    Gets the directory node for a path (list of names), creating it and its parents if they aren't there yet.
+    """
+    if not parts:
+        return populator.root
+
+    key = '\\'.join(parts).upper()
+    node = nodes.get(key)
+
+    if node is None:
+        parent = get_directory(populator, nodes, parts[:-1], mtime)
+        node = populator.add_node(parent, FAT32Populator.Node(parts[-1], True, mtime=mtime, attributes=attributes))
+        nodes[key] = node
+    elif not node.is_directory:
+        raise ValueError(f'"{key}" is a file and a directory')
+
+    return node
+
+def add_pack(populator, nodes, pack_file):
+    """
+    Adds everything in a pack. nodes maps upper case paths to what's there already. Files that are there already
+    get replaced, like they do when the installer unpacks the packs one after the other.
+    """
+    # The installer creates the directories, so they get the time of the install. This is as close as we get.
+    mtime = time.time()
+
+    for entry in mercypak_entries(pack_file):
+        parts = [part for part in entry[1].replace('/', '\\').split('\\') if part]
+
+        if entry[0] == 'dir':
+            get_directory(populator, nodes, parts, mtime, entry[2])
+            continue
+
+        _, _, attributes, file_date, file_time, data_offset, size = entry
+        key = '\\'.join(parts).upper()
+        node = nodes.get(key)
+
+        if node is None:
+            parent = get_directory(populator, nodes, parts[:-1], mtime)
+            node = populator.add_node(parent, FAT32Populator.Node(parts[-1], False))
+            nodes[key] = node
+        elif node.is_directory:
+            raise ValueError(f'"{key}" is a file and a directory')
+
+        node.source_path = pack_file
+        node.source_offset = data_offset
+        node.size = size
+        node.attributes = attributes
+        node.dos_timestamp = (file_date, file_time)
+
+def make_golden_image(output_file, pack_files, bytes_per_cluster):
+    """
+    Lays out the contents of the packs in a FAT32 file system and writes it as a golden image.
+    """
+    if bytes_per_cluster < GOLDEN_SECTOR_SIZE or bytes_per_cluster > 32768 or bytes_per_cluster & (bytes_per_cluster - 1):
+        raise ValueError(f'Invalid cluster size for the golden image: {bytes_per_cluster}')
+
+    # No volume label, the installer's formatter doesn't set one either
+    populator = FAT32Populator(volume_label=None)
+    nodes = dict()
+
+    for pack_file in pack_files:
+        add_pack(populator, nodes, pack_file)
+
+    image = GoldenImage(bytes_per_cluster)
+    populator.allocate(image)
+
+    # Everything is allocated in one contiguous run from cluster 2 on
+    used_clusters = image.fat.last_allocated_cluster - 1
+    fat_bytes = image.fat.to_bytes()
+    fat_sectors = (len(fat_bytes) + GOLDEN_SECTOR_SIZE - 1) // GOLDEN_SECTOR_SIZE
+    image.data_offset = (1 + fat_sectors) * GOLDEN_SECTOR_SIZE
+
+    header = struct.pack(GOLDEN_HEADER_FORMAT, GOLDEN_MAGIC, GOLDEN_SECTOR_SIZE, image.sectors_per_cluster, image.data_start,
+                         image.max_fat_sectors, used_clusters, fat_sectors)
+
+    # Written next to it first, so an interrupted run doesn't leave a broken image behind
+    temp_file = output_file + '.tmp'
+    create_empty_file(temp_file, image.data_offset + used_clusters * image.bytes_per_cluster())
+
+    with open(temp_file, 'r+b', buffering=0) as f:
+        image.write_block(f, header)
+        image.write_block(f, fat_bytes, GOLDEN_SECTOR_SIZE)
+        populator.write(f, image)
+
+    os.replace(temp_file, output_file)
+
+    print(f'Golden image: {used_clusters} clusters of {bytes_per_cluster} bytes, data region at sector {image.data_start}')
@@ -0,0 +1,302 @@
+'''
+ISO layout helpers for Windows 98 QuickInstall sysprep.
+
+The installer reads the packs of a variant one after the other (FULL.866, DRIVER.866, then one of the
+registry packs), so on a CD-ROM they should come right after each other in exactly that order, each one
+starting on a large read boundary. mkisofs is told the order with a sort file, the alignment is done
+with hidden padding files in front of each pack. Since mkisofs can't tell us where it's going to put
+things, the ISO is read back afterwards to check (and if necessary correct) the layout.
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import os
+import struct
+
+ISO_SECTOR_SIZE = 2048
+
+# The installer reads the packs in blocks of this size (INST_CDROM_IO_SIZE in install.c), so every pack starts on such a boundary
+ISO_PACK_ALIGNMENT = 512 * 1024
+ISO_PACK_ALIGNMENT_SECTORS = ISO_PACK_ALIGNMENT // ISO_SECTOR_SIZE
+
+# Files needed before the first pack is read, in the order they are used (boot image, then what findcd.sh copies to RAM)
+ISO_BOOT_FILES = ['cdrom.img', 'bzImage.cd', 'bin/lunmercy', 'bin/cfdisk', 'bin/mkfs.fat', 'install.txt']
+
+# Packs of every variant, in the order the installer reads them. The user picks only one of the registry packs,
+# FASTPNP.866 is the first choice in the menu so it comes first. A golden image (sysprep.py --golden) replaces
+# all of them with the default choices, so if there is one that's read first.
+ISO_PACK_FILES = ['GOLDEN.IMG', 'FULL.866', 'DRIVER.866', 'FASTPNP.866', 'SLOWPNP.866']
+
+ISO_PAD_FILE_PREFIX = 'QIPAD'
+
+class IsoExtent:
+    def __init__(self, path, lba, size):
+        self.path = path
+        self.lba = lba
+        self.size = size
+
+    def sectors(self):
+        return (self.size + ISO_SECTOR_SIZE - 1) // ISO_SECTOR_SIZE
+
+def get_install_order(output_base):
+    """
+    Gets the files that are read before the packs and the packs themselves, as paths relative to the
+    image root (with '/' as separator), in install order. Files that don't exist are left out.
+    """
+    boot_files = [path for path in ISO_BOOT_FILES if os.path.isfile(os.path.join(output_base, path))]
+    packs = list()
+
+    osroots_base = os.path.join(output_base, 'osroots')
+    osroot_indices = sorted(int(name) for name in os.listdir(osroots_base) if name.isdigit()) if os.path.isdir(osroots_base) else []
+
+    # The variant names are read for the selection menu before anything is installed, the driver index
+    # for the drivers prompt and the pack sizes when the partition is formatted
+    for index in osroot_indices:
+        for name in ('win98qi.inf', 'drivers.txt', 'sizes.txt'):
+            path = f'osroots/{index}/{name}'
+            if os.path.isfile(os.path.join(output_base, path)):
+                boot_files.append(path)
+
+    for index in osroot_indices:
+        for pack in ISO_PACK_FILES:
+            pack_path = f'osroots/{index}/{pack}'
+            if os.path.isfile(os.path.join(output_base, pack_path)):
+                packs.append(pack_path)
+
+    return boot_files, packs
+
+def get_pad_file_name(index):
+    return f'{ISO_PAD_FILE_PREFIX}{index:03}.PAD'
+
+def write_pad_files(pad_dir, pad_sizes):
+    """
+    Creates the padding files that go right before every pack. Returns their paths.
+    """
+    pad_files = list()
+
+    for index, size in enumerate(pad_sizes):
+        pad_file = os.path.join(pad_dir, get_pad_file_name(index))
+        with open(pad_file, 'wb') as f:
+            f.truncate(size)
+        pad_files.append(pad_file)
+
+    return pad_files
+
+def write_sort_file(sort_file, boot_files, packs, pad_files):
+    """
+    Writes a mkisofs sort file. Higher weights go first on the disc, everything not listed gets weight 0
+    and ends up behind the packs. Paths are given the way mkisofs sees them ('.' is the image root).
+    """
+    entries = [f'./{path}' for path in boot_files]
+
+    for pack, pad_file in zip(packs, pad_files):
+        entries.append(pad_file)
+        entries.append(f'./{pack}')
+
+    weight = len(entries)
+
+    with open(sort_file, 'w', encoding='utf-8') as f:
+        for entry in entries:
+            f.write(f'{entry} {weight}\n')
+            weight -= 1
+
+def get_mkisofs_pad_arguments(pad_files):
+    """
+    Gets the mkisofs arguments to put the padding files into the image root without them showing up anywhere.
+    Hidden files still take up their space in the image.
+    """
+    arguments = ['-graft-points',
+                 '-hide', f'{ISO_PAD_FILE_PREFIX}*.PAD',
+                 '-hide-joliet', f'{ISO_PAD_FILE_PREFIX}*.PAD']
+    grafts = [f'/{os.path.basename(pad_file)}={pad_file}' for pad_file in pad_files]
+    return arguments, grafts
+
+def get_rock_ridge_name(system_use: bytes):
+    """
+    Gets the Rock Ridge alternate name (NM) from the system use area of a directory record, None if there is none.
+    """
+    name = b''
+    offset = 0
+
+    while offset + 4 <= len(system_use):
+        signature = system_use[offset:offset + 2]
+        length = system_use[offset + 2]
+
+        if length < 4:
+            break
+
+        if signature == b'NM':
+            name += system_use[offset + 5:offset + length]
+
+        offset += length
+
+    return name.decode('utf-8', errors='replace') if name else None
+
+def read_iso_extents(iso_path):
+    """
+    Reads the directory tree of an ISO9660 image and gets the extents of all files, sorted by their position.
+    Rock Ridge names are used if present.
+    """
+    extents = list()
+
+    with open(iso_path, 'rb') as f:
+        def read_sectors(lba, size):
+            f.seek(lba * ISO_SECTOR_SIZE)
+            return f.read(size)
+
+        volume_descriptor = read_sectors(16, ISO_SECTOR_SIZE)
+
+        if volume_descriptor[0] != 1 or volume_descriptor[1:6] != b'CD001':
+            raise ValueError(f'"{iso_path}" is not an ISO9660 image')
+
+        root_record = volume_descriptor[156:156 + 34]
+        directories = [('', struct.unpack_from('<I', root_record, 2)[0], struct.unpack_from('<I', root_record, 10)[0])]
+        visited = set()
+
+        while directories:
+            directory_path, directory_lba, directory_size = directories.pop()
+
+            if directory_lba in visited:
+                continue
+            visited.add(directory_lba)
+
+            data = read_sectors(directory_lba, directory_size)
+            offset = 0
+
+            while offset < len(data):
+                record_length = data[offset]
+
+                # Records never cross a sector boundary, a zero length means the rest of this sector is unused
+                if record_length == 0:
+                    offset = (offset // ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE
+                    continue
+
+                record = data[offset:offset + record_length]
+                offset += record_length
+
+                lba = struct.unpack_from('<I', record, 2)[0]
+                size = struct.unpack_from('<I', record, 10)[0]
+                flags = record[25]
+                name_length = record[32]
+                iso_name = record[33:33 + name_length]
+
+                # Skip '.' and '..'
+                if iso_name in (b'\x00', b'\x01'):
+                    continue
+
+                system_use_offset = 33 + name_length + (1 if name_length % 2 == 0 else 0)
+                name = get_rock_ridge_name(record[system_use_offset:])
+
+                if name is None:
+                    name = iso_name.decode('ascii', errors='replace').split(';')[0].rstrip('.')
+
+                path = f'{directory_path}/{name}' if directory_path else name
+
+                if flags & 0x02:
+                    directories.append((path, lba, size))
+                else:
+                    extents.append(IsoExtent(path, lba, size))
+
+    extents.sort(key=lambda extent: extent.lba)
+    return extents
+
+def find_extent(extents, path):
+    for extent in extents:
+        if extent.path.lower() == path.lower():
+            return extent
+    return None
+
+def plan_padding(extents, packs, pad_sizes):
+    """
+    Calculates new padding sizes so that every pack starts on an ISO_PACK_ALIGNMENT boundary, based on where
+    the packs ended up with the current padding. Growing a pad moves everything behind it, which is accounted for.
+    Returns None if a pack couldn't be found in the image.
+    """
+    new_pad_sizes = list()
+    shift = 0
+
+    for pack, pad_size in zip(packs, pad_sizes):
+        extent = find_extent(extents, pack)
+
+        if extent is None:
+            return None
+
+        pad_sectors = pad_size // ISO_SECTOR_SIZE
+        unpadded_lba = extent.lba + shift - pad_sectors
+        new_pad_sectors = (-unpadded_lba) % ISO_PACK_ALIGNMENT_SECTORS
+
+        new_pad_sizes.append(new_pad_sectors * ISO_SECTOR_SIZE)
+        shift += new_pad_sectors - pad_sectors
+
+    return new_pad_sizes
+
+def check_layout(extents, boot_files, packs):
+    """
+    Checks the layout, returns a list of problems (empty if everything is as planned).
+    """
+    problems = list()
+    planned = [find_extent(extents, path) for path in boot_files + packs]
+
+    for path, extent in zip(boot_files + packs, planned):
+        if extent is None:
+            problems.append(f'"{path}" not found in the image')
+
+    planned = [extent for extent in planned if extent is not None]
+
+    for previous, current in zip(planned, planned[1:]):
+        if current.lba < previous.lba:
+            problems.append(f'"{current.path}" comes before "{previous.path}"')
+
+    # Only padding may be between two packs
+    pack_extents = [find_extent(extents, path) for path in packs]
+    pack_extents = [extent for extent in pack_extents if extent is not None]
+
+    for previous, current in zip(pack_extents, pack_extents[1:]):
+        for extent in extents:
+            if previous.lba < extent.lba < current.lba:
+                problems.append(f'"{extent.path}" is between "{previous.path}" and "{current.path}"')
+
+    for path in packs:
+        extent = find_extent(extents, path)
+        if extent is not None and extent.lba % ISO_PACK_ALIGNMENT_SECTORS != 0:
+            problems.append(f'"{path}" is not aligned to {ISO_PACK_ALIGNMENT // 1024} KiB')
+
+    return problems
+
+def format_layout_report(extents, boot_files, packs, problems):
+    """
+    Makes a human readable report of the image layout. The boot files and packs are listed in detail, the rest is summarized.
+    """
+    lines = [f'ISO layout (sector size {ISO_SECTOR_SIZE} bytes, pack alignment {ISO_PACK_ALIGNMENT // 1024} KiB)',
+             f'{"LBA":>10} {"Sectors":>10} {"Offset MiB":>11} {"Aligned":>8}  File']
+
+    listed = set(path.lower() for path in boot_files + packs)
+    other_files = [extent for extent in extents if extent.path.lower() not in listed]
+
+    for path in boot_files + packs:
+        extent = find_extent(extents, path)
+        if extent is None:
+            lines.append(f'{"-":>10} {"-":>10} {"-":>11} {"-":>8}  {path} (missing)')
+            continue
+        aligned = ('yes' if extent.lba % ISO_PACK_ALIGNMENT_SECTORS == 0 else 'no') if path in packs else ''
+        lines.append(f'{extent.lba:>10} {extent.sectors():>10} {extent.lba * ISO_SECTOR_SIZE / (1024 * 1024):>11.2f} {aligned:>8}  {path}')
+
+    if other_files:
+        first_lba = min(extent.lba for extent in other_files)
+        last_lba = max(extent.lba + extent.sectors() for extent in other_files)
+        lines.append(f'{len(other_files)} other files between LBA {first_lba} and {last_lba}')
+
+    if problems:
+        lines.append('WARNING: The layout is not as planned:')
+        lines += [f'  {problem}' for problem in problems]
+    else:
+        lines.append('Layout OK: all packs are contiguous, in install order and aligned.')
+
+    return '\n'.join(lines)
+
+def format_full_layout(extents):
+    """
+    Lists every file in the image in disc order.
+    """
+    return '\n'.join(f'{extent.lba:>10} {extent.sectors():>10}  {extent.path}' for extent in extents)
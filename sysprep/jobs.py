@@ -0,0 +1,131 @@
+'''
+Simple job scheduler for Windows 98 QuickInstall sysprep.
+
+Every stage of the build is a job with a list of jobs it depends on. Jobs whose dependencies
+are all done are started right away, up to a maximum number of jobs running at the same time.
+
+The heavy lifting in the stages is done by external programs (wine, regedit, drivercopy, mkisofs)
+or is I/O / hashing bound, so plain threads are good enough here.
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import time
+import threading
+from concurrent.futures import ThreadPoolExecutor, FIRST_COMPLETED, wait
+
+class Job:
+    def __init__(self, name, func, args, depends):
+        self.name = name
+        self.func = func
+        self.args = args
+        self.depends = depends
+        self.start_time = None
+        self.duration = None
+
+class JobScheduler:
+    def __init__(self, max_jobs=1):
+        self.max_jobs = max(1, max_jobs)
+        self.jobs = dict()
+        self.print_lock = threading.Lock()
+
+    def add(self, name, func, *args, depends=()):
+        """
+        Adds a job. 'depends' is a list of names of jobs that need to be finished before this one can start.
+        Returns the name, so it can be used directly in the 'depends' list of other jobs.
+        """
+        if name in self.jobs:
+            raise ValueError(f'Job "{name}" was added twice')
+
+        self.jobs[name] = Job(name, func, args, tuple(depends))
+        return name
+
+    def log(self, message):
+        with self.print_lock:
+            print(message, flush=True)
+
+    def run_job(self, job: Job):
+        self.log(f'[{job.name}] Started')
+        job.start_time = time.monotonic()
+        job.func(*job.args)
+        job.duration = time.monotonic() - job.start_time
+        self.log(f'[{job.name}] Finished in {job.duration:.1f}s')
+
+    def check_dependencies(self):
+        for job in self.jobs.values():
+            for dependency in job.depends:
+                if dependency not in self.jobs:
+                    raise ValueError(f'Job "{job.name}" depends on unknown job "{dependency}"')
+
+        # Make sure there are no cycles, otherwise we'd wait forever
+        visiting = set()
+        visited = set()
+
+        def visit(name):
+            if name in visited:
+                return
+            if name in visiting:
+                raise ValueError(f'Dependency cycle involving job "{name}"')
+            visiting.add(name)
+            for dependency in self.jobs[name].depends:
+                visit(dependency)
+            visiting.remove(name)
+            visited.add(name)
+
+        for name in self.jobs:
+            visit(name)
+
+    def run(self):
+        """
+        Runs all jobs. If a job fails, no new jobs are started, the running ones are waited for
+        and the exception of the failed job is raised.
+        """
+        self.check_dependencies()
+
+        pending = dict(self.jobs)
+        done = set()
+        running = dict()
+        error = None
+        total_start_time = time.monotonic()
+
+        with ThreadPoolExecutor(max_workers=self.max_jobs) as executor:
+            while pending or running:
+                # Start everything that is ready, in the order the jobs were added
+                if error is None:
+                    for name, job in list(pending.items()):
+                        if len(running) >= self.max_jobs:
+                            break
+                        if all(dependency in done for dependency in job.depends):
+                            del pending[name]
+                            running[executor.submit(self.run_job, job)] = job
+                elif not running:
+                    break
+
+                finished, _ = wait(running, return_when=FIRST_COMPLETED)
+
+                for future in finished:
+                    job = running.pop(future)
+                    exception = future.exception()
+                    if exception is None:
+                        done.add(job.name)
+                    else:
+                        self.log(f'[{job.name}] FAILED: {exception}')
+                        if error is None:
+                            error = exception
+
+        self.print_timing(time.monotonic() - total_start_time)
+
+        if error is not None:
+            raise error
+
+    def print_timing(self, total_duration):
+        print('Stage timing:')
+        for job in self.jobs.values():
+            if job.duration is not None:
+                print(f'  {job.name:<32} {job.duration:8.1f}s')
+            elif job.start_time is not None:
+                print(f'  {job.name:<32}   failed')
+            else:
+                print(f'  {job.name:<32}  skipped')
+        print(f'  {"Total (wall clock)":<32} {total_duration:8.1f}s')
@@ -1,12 +1,12 @@
 import os
-import shutil
-import subprocess
-import platform
-import fs
-from fs.copy import copy_dir    
+import sys
+import time
+import errno
+import ctypes
 import struct
-from concurrent.futures import ThreadPoolExecutor
+from array import array
 import syslinux
+from mercypak import dos_date, dos_time
 
 # makeusb for Windows 98 QuickInstall.
 # Python version.
@@ -21,6 +21,36 @@ PARTITIONENTRY_SECTOR_SIZE = 512
 PARTITIONENTRY_SECTORS_PER_CLUSTER = 8
 PARTITIONENTRY_FAT32_MIN_SIZE = 512 * 1024 * 1024 # Min 512MiB
 
+FAT32_RESERVED_SECTORS = 32
+FAT32_NUMBER_OF_FATS = 2
+FAT32_ROOT_DIRECTORY_CLUSTER = 2
+FAT32_END_OF_CHAIN = 0x0FFFFFFF
+
+FAT_ATTR_READ_ONLY = 0x01
+FAT_ATTR_HIDDEN = 0x02
+FAT_ATTR_SYSTEM = 0x04
+FAT_ATTR_VOLUME_ID = 0x08
+FAT_ATTR_DIRECTORY = 0x10
+FAT_ATTR_ARCHIVE = 0x20
+FAT_ATTR_LONG_NAME = 0x0F
+
+FAT_DIR_ENTRY_SIZE = 32
+FAT_LFN_CHARS_PER_ENTRY = 13
+
+# NT "case" flags for short names that are all lowercase. Linux honours these, so we don't need long names for them.
+FAT_CASE_LOWER_BASE = 0x08
+FAT_CASE_LOWER_EXT = 0x10
+
+# Characters allowed in a 8.3 short name (besides anything > 127, which we don't use)
+FAT_SHORT_NAME_CHARS = set('ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#$%&\'()-@^_`{}~')
+
+COPY_BUFFER_SIZE = 4 * 1024 * 1024
+COPY_ZERO_BLOCK = bytes(COPY_BUFFER_SIZE)
+
+# fallocate() flags for punching holes into files (Linux)
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+
 class MasterBootRecord:
     """
     This class models a Master Boot Record.
@@ -184,8 +214,8 @@ class FAT32Partition:
                 
                 self.bytes_per_sector = PARTITIONENTRY_SECTOR_SIZE
                 self.logical_sectors_per_cluster = PARTITIONENTRY_SECTORS_PER_CLUSTER
-                self.reserved_logical_sectors = 32
-                self.number_of_fats = 2
+                self.reserved_logical_sectors = FAT32_RESERVED_SECTORS
+                self.number_of_fats = FAT32_NUMBER_OF_FATS
                 self.root_dir_entries = 0
                 self.total_logical_sectors = 0
                 self.media_descriptor = 0xf8
@@ -200,10 +230,12 @@ class FAT32Partition:
 
                 # DOS 7.10 stuff
 
-                self.large_logical_sectors_per_fat = 16363 # I see this value in Ranish partition manager formatted partition. 32 doesn't work, there's no docs on this...
+                # FAT size calculation from Microsoft's FAT specification. It can be a few sectors too big, but never too small.
+                fat_size_divisor = (256 * self.logical_sectors_per_cluster + self.number_of_fats) // 2
+                self.large_logical_sectors_per_fat = (self.large_total_logical_sectors - self.reserved_logical_sectors + fat_size_divisor - 1) // fat_size_divisor
                 self.fat_flags = 0  # Not used here
                 self.version_number = 0x0000
-                self.root_directory_cluster = 2 # No idea why but win98 does this
+                self.root_directory_cluster = FAT32_ROOT_DIRECTORY_CLUSTER # No idea why but win98 does this
                 self.fs_information_sector = 1
                 self.backup_sector = 6
                 self.boot_file_name = bytearray(12) # blank, unused
@@ -274,32 +306,70 @@ class FAT32Partition:
                                                     self.reserved2,
                                                     self.signature)
 
-    class FAT:  # Creates a blank fat32 for now. this is hard :(
-        def __init__(self):
+    class FAT:
+        """
+        This class models the file allocation table. It is built completely in memory and written in one go.
+        """
+        def __init__(self, cluster_count):
             self.FAT_ID = 0x0FFFFFF8 # fixed disk
-            self.end_of_chain = 0x0FFFFFFF # end of chain
-            self.root_directory_cluster = 0x0FFFFFFF # Cluster for root directory (we have none)
+            self.end_of_chain = FAT32_END_OF_CHAIN # end of chain
+            self.entries = array('I', bytes(4 * (cluster_count + 2)))
+            self.entries[0] = self.FAT_ID
+            self.entries[1] = self.end_of_chain
+            self.last_allocated_cluster = 1
+
+        def add_chain(self, first_cluster, cluster_count):
+            """
+            Adds a contiguous cluster chain.
+            """
+            last_cluster = first_cluster + cluster_count - 1
+            self.entries[first_cluster:last_cluster] = array('I', range(first_cluster + 1, last_cluster + 1))
+            self.entries[last_cluster] = self.end_of_chain
+            self.last_allocated_cluster = max(self.last_allocated_cluster, last_cluster)
 
         def to_bytes(self):
-            return struct.pack('III', self.FAT_ID, self.end_of_chain, self.root_directory_cluster)
+            # Everything after the last allocated cluster is zero, the image is freshly created so there's no need to write that
+            entries = self.entries[:self.last_allocated_cluster + 1]
+            if sys.byteorder != 'little':
+                entries.byteswap()
+            return entries.tobytes()
 
     def __init__(self, partition: MasterBootRecord.PartitionEntry):
         self.bootsector = self.BootSector(partition)
         self.fsinfosector = self.FSInfoSector()
-        self.fat = self.FAT()
         self.partition_entry = partition
+        self.fat = self.FAT(self.cluster_count())
 
     def bootsector_bytes(self):
         return self.bootsector.to_bytes()
     
     def fsinfosector_bytes(self):
         return self.fsinfosector.to_bytes()
-    
-    def fat_bytes(self):
-        b = self.fat.to_bytes()
-        ret = bytearray(512)
-        ret[:len(b)] = b
-        return ret
+
+    def cluster_count(self):
+        bpb = self.bootsector.bpb
+        data_sectors = bpb.large_total_logical_sectors - bpb.reserved_logical_sectors - bpb.number_of_fats * bpb.large_logical_sectors_per_fat
+        return data_sectors // bpb.logical_sectors_per_cluster
+
+    def bytes_per_cluster(self):
+        return self.bootsector.bpb.bytes_per_sector * self.bootsector.bpb.logical_sectors_per_cluster
+
+    def cluster_offset(self, cluster):
+        """
+        Gets the absolute offset of a cluster in the disk image.
+        """
+        bpb = self.bootsector.bpb
+        data_start_sector = self.partition_entry.lba_start + bpb.reserved_logical_sectors + bpb.number_of_fats * bpb.large_logical_sectors_per_fat
+        return data_start_sector * bpb.bytes_per_sector + (cluster - FAT32_ROOT_DIRECTORY_CLUSTER) * self.bytes_per_cluster()
+
+    @staticmethod
+    def partition_size_for_clusters(cluster_count):
+        """
+        Gets a partition size in bytes that is big enough to hold at least 'cluster_count' clusters.
+        """
+        fat_sectors = (4 * (cluster_count + 2) + PARTITIONENTRY_SECTOR_SIZE - 1) // PARTITIONENTRY_SECTOR_SIZE
+        sectors = FAT32_RESERVED_SECTORS + FAT32_NUMBER_OF_FATS * fat_sectors + cluster_count * PARTITIONENTRY_SECTORS_PER_CLUSTER
+        return sectors * PARTITIONENTRY_SECTOR_SIZE
     
     def write_block(self, file, data: bytearray, offset=0, count=0):
         if count == 0:
@@ -307,7 +377,11 @@ class FAT32Partition:
         file.seek(offset, 0)
         file.write(data[:count])
 
-    def write_to_file(self, filename):
+    def write_to_file(self, filename, populator=None):
+        """
+        Writes the file system to the image. If a populator is given, its files and directories are allocated and written, too.
+        The image must be freshly created (i.e. all zeros), areas that are supposed to be zero are not written.
+        """
         bps = self.bootsector.bpb.bytes_per_sector
         bootsector_start = self.partition_entry.lba_start * bps
         backup_offset = self.bootsector.bpb.backup_sector * bps
@@ -316,8 +390,16 @@ class FAT32Partition:
         fat_1_start = bootsector_start + self.bootsector.bpb.reserved_logical_sectors * bps
         fat_2_start = fat_1_start + self.bootsector.bpb.large_logical_sectors_per_fat * bps
 
-        # Write boot sector
-        with open(filename, 'r+b') as f:
+        if populator is None:
+            populator = FAT32Populator()
+
+        populator.allocate(self)
+
+        self.fsinfosector.last_free_data_clusters = self.cluster_count() + 1 - self.fat.last_allocated_cluster
+        self.fsinfosector.last_allocated_cluster = self.fat.last_allocated_cluster
+
+        # Unbuffered, the populator writes big blocks anyway and may use copy_file_range on the file descriptor
+        with open(filename, 'r+b', buffering=0) as f:
             # BOOT & FS info sector
             self.write_block(f, self.bootsector.to_bytes(), bootsector_start)
             self.write_block(f, self.fsinfosector.to_bytes(), fsinfosector_start)
@@ -327,8 +409,283 @@ class FAT32Partition:
             self.write_block(f, self.fsinfosector.to_bytes(), fsinfosector_start + backup_offset)
 
             # FAT stuff
-            self.write_block(f, self.fat.to_bytes(), fat_1_start)
-            self.write_block(f, self.fat.to_bytes(), fat_2_start)
+            fat_bytes = self.fat.to_bytes()
+            self.write_block(f, fat_bytes, fat_1_start)
+            self.write_block(f, fat_bytes, fat_2_start)
+
+            # Directories and files
+            populator.write(f, self)
+
+def fat_lfn_checksum(short_name: bytes):
+    checksum = 0
+    for c in short_name:
+        checksum = (((checksum & 1) << 7) + (checksum >> 1) + c) & 0xFF
+    return checksum
+
+def fat_split_name(name):
+    base, dot, ext = name.rpartition('.')
+    if not dot:
+        return name, ''
+    return base, ext
+
+def fat_get_case_flags(base, ext):
+    """
+    Gets the NT case flags for a name that would be a valid short name if it was upper case.
+    Returns None if the name has mixed case and thus needs a long name.
+    """
+    flags = 0
+    for part, lower_flag in ((base, FAT_CASE_LOWER_BASE), (ext, FAT_CASE_LOWER_EXT)):
+        if part == part.upper():
+            continue
+        if part == part.lower():
+            flags |= lower_flag
+            continue
+        return None
+    return flags
+
+def fat_make_short_name(name, used_short_names):
+    """
+    Gets (11 byte short name, needs long name, NT case flags) for a file name in a directory.
+    """
+    base, ext = fat_split_name(name)
+
+    # Does it fit in a 8.3 name as it is?
+    if 0 < len(base) <= 8 and len(ext) <= 3 and all(c in FAT_SHORT_NAME_CHARS for c in (base + ext).upper()):
+        short_name = (base.upper().ljust(8) + ext.upper().ljust(3)).encode('ascii')
+        case_flags = fat_get_case_flags(base, ext)
+        if short_name not in used_short_names:
+            if case_flags is not None:
+                return short_name, False, case_flags
+            return short_name, True, 0
+
+    # No, make a NAME~N.EXT style short name like Windows does
+    def clean(part):
+        return ''.join(c if c in FAT_SHORT_NAME_CHARS else '_' for c in part.upper() if c not in ' .')
+
+    if not base:    # Names like ".hidden"
+        base, ext = ext, ''
+
+    base = clean(base) or '_'
+    ext = clean(ext)[:3]
+
+    for n in range(1, 1000000):
+        tail = f'~{n}'
+        short_name = (base[:8 - len(tail)] + tail).ljust(8) + ext.ljust(3)
+        short_name = short_name.encode('ascii')
+        if short_name not in used_short_names:
+            return short_name, True, 0
+
+    raise ValueError(f'Too many files with similar names as "{name}"')
+
+def fat_make_lfn_entries(name, short_name: bytes):
+    """
+    Makes the VFAT long file name entries for a name. They come right before the short name entry, in reverse order.
+    """
+    checksum = fat_lfn_checksum(short_name)
+    name_bytes = name.encode('utf-16-le')
+
+    # Null terminated (unless it fits exactly) and padded with 0xFFFF
+    if len(name_bytes) % (FAT_LFN_CHARS_PER_ENTRY * 2):
+        name_bytes += b'\x00\x00'
+    while len(name_bytes) % (FAT_LFN_CHARS_PER_ENTRY * 2):
+        name_bytes += b'\xff\xff'
+
+    entry_count = len(name_bytes) // (FAT_LFN_CHARS_PER_ENTRY * 2)
+
+    if entry_count > 20:
+        raise ValueError(f'File name "{name}" is too long (max. 255 characters)')
+
+    entries = list()
+    for i in range(entry_count):
+        chunk = name_bytes[i * FAT_LFN_CHARS_PER_ENTRY * 2:(i + 1) * FAT_LFN_CHARS_PER_ENTRY * 2]
+        sequence = (i + 1) | (0x40 if i == entry_count - 1 else 0)
+        entries.append(struct.pack('<B10sBBB12sH4s', sequence, chunk[0:10], FAT_ATTR_LONG_NAME, 0, checksum, chunk[10:22], 0, chunk[22:26]))
+
+    return b''.join(reversed(entries))
+
+def fat_make_dir_entry(short_name: bytes, attributes, case_flags, first_cluster, size, mtime, dos_timestamp=None):
+    # dos_timestamp is a (date, time) tuple that is used as is instead of mtime, e.g. straight from a pack
+    date, time_ = dos_timestamp if dos_timestamp is not None else (dos_date(mtime), dos_time(mtime))
+    return struct.pack('<11sBBBHHHHHHHI', short_name, attributes, case_flags, 0, time_, date, date, first_cluster >> 16, time_, date, first_cluster & 0xFFFF, size)
+
+class FAT32Populator:
+    """
+    This class lays out a directory tree in a FAT32 file system and writes it directly to the image.
+    All cluster chains are planned up front and every directory and file gets exactly one contiguous
+    run of clusters, so the file bodies can be copied straight to the image without any FS layer.
+    """
+
+    class Node:
+        def __init__(self, name, is_directory, source_path=None, data=None, size=0, mtime=0, attributes=FAT_ATTR_ARCHIVE, source_offset=0, dos_timestamp=None):
+            self.name = name
+            self.is_directory = is_directory
+            self.source_path = source_path
+            self.source_offset = source_offset  # Where the data starts in source_path
+            self.data = data
+            self.size = size
+            self.mtime = mtime
+            self.dos_timestamp = dos_timestamp
+            self.attributes = attributes | (FAT_ATTR_DIRECTORY if is_directory else 0)
+            self.children = list()
+            self.used_short_names = set()
+            self.short_name = None
+            self.needs_long_name = False
+            self.case_flags = 0
+            self.parent = None
+            self.first_cluster = 0
+            self.cluster_count = 0
+
+    def __init__(self, volume_label=b'QUICKINST  '):
+        self.root = self.Node('', True, mtime=time.time())
+        self.volume_label = volume_label
+        self.directories = [self.root]
+        self.files = list()
+
+    def add_node(self, parent: Node, node: Node):
+        node.short_name, node.needs_long_name, node.case_flags = fat_make_short_name(node.name, parent.used_short_names)
+        parent.used_short_names.add(node.short_name)
+        parent.children.append(node)
+        node.parent = parent
+
+        if node.is_directory:
+            self.directories.append(node)
+        else:
+            self.files.append(node)
+
+        return node
+
+    def add_file(self, name, source_path, parent=None, attributes=FAT_ATTR_ARCHIVE):
+        file_stat = os.stat(source_path)
+        node = self.Node(name, False, source_path=source_path, size=file_stat.st_size, mtime=file_stat.st_mtime, attributes=attributes)
+        return self.add_node(parent or self.root, node)
+
+    def add_file_bytes(self, name, data, parent=None, attributes=FAT_ATTR_ARCHIVE):
+        node = self.Node(name, False, data=data, size=len(data), mtime=time.time(), attributes=attributes)
+        return self.add_node(parent or self.root, node)
+
+    def add_directory(self, name, mtime, parent=None):
+        return self.add_node(parent or self.root, self.Node(name, True, mtime=mtime))
+
+    def add_tree(self, input_path, parent=None):
+        """
+        Adds all directories and files in a directory tree.
+        """
+        parent = parent or self.root
+
+        with os.scandir(input_path) as it:
+            entries = sorted(it, key=lambda entry: entry.name)
+
+        for entry in entries:
+            if entry.is_dir():
+                directory = self.add_directory(entry.name, entry.stat().st_mtime, parent)
+                self.add_tree(entry.path, directory)
+            elif entry.is_file():
+                self.add_file(entry.name, entry.path, parent)
+
+    def directory_entry_count(self, directory: Node):
+        count = 0 if directory is self.root else 2          # '.' and '..'
+        count += 1 if directory is self.root and self.volume_label else 0
+        for child in directory.children:
+            count += 1
+            if child.needs_long_name:
+                count += len(fat_make_lfn_entries(child.name, child.short_name)) // FAT_DIR_ENTRY_SIZE
+        return count
+
+    def required_clusters(self, bytes_per_cluster):
+        """
+        Gets the number of clusters needed to hold everything that was added.
+        """
+        total = 0
+        for directory in self.directories:
+            total += max(1, (self.directory_entry_count(directory) * FAT_DIR_ENTRY_SIZE + bytes_per_cluster - 1) // bytes_per_cluster)
+        for file in self.files:
+            total += (file.size + bytes_per_cluster - 1) // bytes_per_cluster
+        return total
+
+    def allocate(self, partition):
+        """
+        Plans the cluster chains for everything. The root directory comes first (cluster 2), then all
+        other directories, then the files in the order they were added.
+        """
+        bytes_per_cluster = partition.bytes_per_cluster()
+        required = self.required_clusters(bytes_per_cluster)
+
+        if required > partition.cluster_count():
+            raise ValueError(f'The files need {required} clusters, but the partition only has {partition.cluster_count()}')
+
+        next_cluster = FAT32_ROOT_DIRECTORY_CLUSTER
+
+        for directory in self.directories:
+            directory.cluster_count = max(1, (self.directory_entry_count(directory) * FAT_DIR_ENTRY_SIZE + bytes_per_cluster - 1) // bytes_per_cluster)
+
+        for node in self.directories + self.files:
+            if node is not self.root:
+                node.cluster_count = max(node.cluster_count, (node.size + bytes_per_cluster - 1) // bytes_per_cluster)
+            if node.cluster_count == 0:
+                continue    # Empty files don't get a cluster
+            node.first_cluster = next_cluster
+            partition.fat.add_chain(node.first_cluster, node.cluster_count)
+            next_cluster += node.cluster_count
+
+    def directory_bytes(self, directory: Node):
+        entries = bytearray()
+
+        if directory is self.root:
+            if self.volume_label:
+                entries += fat_make_dir_entry(self.volume_label, FAT_ATTR_VOLUME_ID, 0, 0, 0, directory.mtime)
+        else:
+            parent_cluster = directory.parent.first_cluster if directory.parent is not self.root else 0
+            entries += fat_make_dir_entry(b'.          ', FAT_ATTR_DIRECTORY, 0, directory.first_cluster, 0, directory.mtime)
+            entries += fat_make_dir_entry(b'..         ', FAT_ATTR_DIRECTORY, 0, parent_cluster, 0, directory.parent.mtime)
+
+        for child in directory.children:
+            if child.needs_long_name:
+                entries += fat_make_lfn_entries(child.name, child.short_name)
+            size = 0 if child.is_directory else child.size
+            entries += fat_make_dir_entry(child.short_name, child.attributes, child.case_flags, child.first_cluster, size, child.mtime, child.dos_timestamp)
+
+        return entries
+
+    def write(self, f, partition):
+        """
+        Writes all directories and file bodies to the (unbuffered) image file in cluster order.
+        """
+        bytes_per_cluster = partition.bytes_per_cluster()
+
+        for directory in self.directories:
+            entries = self.directory_bytes(directory)
+            entries += bytes(directory.cluster_count * bytes_per_cluster - len(entries))
+            partition.write_block(f, entries, partition.cluster_offset(directory.first_cluster))
+
+        total_bytes = sum(file.size for file in self.files)
+        copied_bytes = 0
+        last_percent = -1
+
+        for file in self.files:
+            if file.size == 0:
+                continue
+
+            offset = partition.cluster_offset(file.first_cluster)
+
+            if file.data is not None:
+                partition.write_block(f, file.data, offset)
+            else:
+                with open(file.source_path, 'rb', buffering=0) as source:
+                    copy_range(source, f, file.source_offset, offset, file.size, output_is_zeroed=True)
+
+            copied_bytes += file.size
+            percent = copied_bytes * 100 // max(1, total_bytes)
+            if percent != last_percent:
+                print(f'\r => {copied_bytes // (1024 * 1024)} / {total_bytes // (1024 * 1024)} MiB ({percent}%)', end='')
+                last_percent = percent
+
+        print('\nDone')
+
+    def find(self, name):
+        for child in self.root.children:
+            if child.name == name:
+                return child
+        return None
 
 class HardDiskImage:
     def __init__(self, disk_size, filename, mbr_code_filename):
@@ -360,7 +717,7 @@ class HardDiskImage:
             f.seek(0, 0)
             f.write(self.mbr.to_bytes())
     
-    def format_partition(self, index):
+    def format_partition(self, index, populator=None):
         partition_entry = self.mbr.partitions[index]
         if partition_entry.type != PARTITIONENTRY_TYPE_FAT32:
             raise ValueError('Unsupported partition type')
@@ -368,95 +725,154 @@ class HardDiskImage:
         print('Formatting partition...')
 
         partition_data = FAT32Partition(partition_entry)
-        partition_data.write_to_file(self.filename)
+        partition_data.write_to_file(self.filename, populator)
+        return partition_data
 
-    def add_partition(self, partition_size_bytes, partition_offset_sectors, partition_type=PARTITIONENTRY_TYPE_FAT32, active=True):
+    def add_partition(self, partition_size_bytes, partition_offset_sectors, partition_type=PARTITIONENTRY_TYPE_FAT32, active=True, populator=None):
+        """
+        Adds and formats a partition. If a populator is given, its files are written to the new file system right away.
+        Returns the FAT32Partition.
+        """
         if (partition_size_bytes < PARTITIONENTRY_FAT32_MIN_SIZE):
             print('WARNING: FAT32 partitions must be at least 512MiB, increasing partition size.')
             partition_size_bytes = PARTITIONENTRY_FAT32_MIN_SIZE
         
         new_partition_index = self.mbr.add_partition(partition_size_bytes, partition_offset_sectors, partition_type, active)
         self.write_mbr()
-        self.format_partition(new_partition_index)
+        return self.format_partition(new_partition_index, populator)
+
+# Lazily loaded libc fallocate() for punching holes, None if not available (e.g. on Windows)
+libc_fallocate = None
+
+def punch_hole(out_file, offset, length):
+    """
+    Makes a range in an (unbuffered) output file read back as zeros. On Linux, this deallocates the blocks
+    instead of writing zeros, if the file system supports it.
+    """
+    global libc_fallocate
+
+    if length <= 0:
         return
 
-def dd (sin: str, sout: str, count=0, inoffset=0, outoffset=0):
-    infile = open(sin, 'rb')
-    outfile = open(sout, 'r+b')
-    infile.seek(0, 2)
-    infilesize = infile.tell()
-    
-    infile.seek(inoffset, 0)
-    outfile.seek(outoffset, 0)
-    
-    if count == 0:
-        count = infilesize
+    if libc_fallocate is None and sys.platform.startswith('linux'):
+        try:
+            libc_fallocate = ctypes.CDLL(None, use_errno=True).fallocate
+            libc_fallocate.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int64, ctypes.c_int64]
+        except (OSError, AttributeError):
+            libc_fallocate = False
 
-    block = infile.read(count)
+    if libc_fallocate and libc_fallocate(out_file.fileno(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0:
+        return
 
-    outfile.write(block)
+    # Fallback: Just write zeros
+    out_file.seek(offset)
+    while length > 0:
+        count = min(length, COPY_BUFFER_SIZE)
+        out_file.write(COPY_ZERO_BLOCK[:count])
+        length -= count
 
-    infile.close()
-    outfile.close()
-    return
+def get_data_regions(in_file, start, end):
+    """
+    Yields (offset, length, is_data) for the data and hole regions in a range of a file.
+    If the OS or file system can't tell us where the holes are, everything is data.
+    """
+    if not hasattr(os, 'SEEK_DATA'):
+        yield start, end - start, True
+        return
 
-def create_empty_file (filename, size):
-    with open(filename, 'wb') as f:
-        f.seek(size - 1)
-        f.write(b'\0')
+    fd = in_file.fileno()
+    position = start
 
-def delete_if_present(file):
-    if os.path.exists(file):
-        os.remove(file)
+    while position < end:
+        try:
+            data_start = min(os.lseek(fd, position, os.SEEK_DATA), end)
+        except OSError as e:
+            if e.errno != errno.ENXIO:
+                yield position, end - position, True     # SEEK_DATA not supported here
+                return
+            data_start = end                             # Only a hole until the end of the file
 
-# Gets the directory size. Files are padded to block_size byte boundaries.
-def get_directory_size(path, block_size):
-    total_size = 0
-    for dirpath, dirnames, filenames in os.walk(path):
-        for f in filenames:
-            fp = os.path.join(dirpath, f)
-            total_size += (( os.path.getsize(fp) + block_size - 1 ) // block_size) * block_size # padding
-    return total_size
-
-def copy_tree_to_fs_path(input_path, pyfilesystem_path):
-    filesystem = fs.open_fs(pyfilesystem_path, writeable=True)
-
-    progress = ''
-
-    for dirpath, dirnames, filenames in os.walk(input_path):
-        # Create all folders
-        for dir in dirnames:
-            source_dir = os.path.join(dirpath, dir)
-            target_dir = os.path.relpath(source_dir, input_path)
-            target_dir = target_dir.replace(os.path.sep, '/')
-            filesystem.makedir(target_dir, recreate=True)
-    
-        # Create and copy all files
-        for file in filenames:
-            source_file = os.path.join(dirpath, file)
-            target_file = os.path.relpath(source_file, input_path)
-            target_file = target_file.replace(os.path.sep, '/')
-    
-            if not os.path.isfile(source_file):
-                continue
+        if data_start > position:
+            yield position, data_start - position, False
+
+        if data_start >= end:
+            return
+
+        data_end = min(os.lseek(fd, data_start, os.SEEK_HOLE), end)
+        yield data_start, data_end - data_start, True
+        position = data_end
+
+def copy_range(in_file, out_file, in_offset, out_offset, count, output_is_zeroed=False):
+    """
+    Copies 'count' bytes between two unbuffered files. Memory use is bounded by COPY_BUFFER_SIZE.
+    Holes in the input and blocks of zeros are not written, but punched into the output instead
+    (or skipped altogether if 'output_is_zeroed', e.g. for a freshly created image).
+    Data is copied with copy_file_range if possible, so it doesn't have to go through user space.
+    """
+    use_copy_file_range = hasattr(os, 'copy_file_range')
+
+    for region_offset, region_length, is_data in get_data_regions(in_file, in_offset, in_offset + count):
+        region_out_offset = out_offset + region_offset - in_offset
+
+        if not is_data:
+            if not output_is_zeroed:
+                punch_hole(out_file, region_out_offset, region_length)
+            continue
+
+        copied = 0
+
+        if use_copy_file_range:
+            try:
+                while copied < region_length:
+                    result = os.copy_file_range(in_file.fileno(), out_file.fileno(), region_length - copied, region_offset + copied, region_out_offset + copied)
+                    if result == 0:
+                        break
+                    copied += result
+            except OSError:
+                use_copy_file_range = False     # e.g. not supported between these file systems, do the rest the old fashioned way
+
+        in_file.seek(region_offset + copied)
+
+        while copied < region_length:
+            block = in_file.read(min(COPY_BUFFER_SIZE, region_length - copied))
 
-            # Cursed way to display the progress. Sorry, it's late and I wanna finish this!
+            if not block:
+                raise IOError(f'"{in_file.name}" got shorter while copying it')
 
-            print('\r', end='')
-            print(' ' * len(progress), end='')
-            progress_file = target_file
-            terminal_width = os.get_terminal_size().columns
-            if len(progress_file) > terminal_width - 8:
-                progress_file = '...' + progress_file[len(progress_file) - terminal_width + 8 + 3:]
+            if block == COPY_ZERO_BLOCK[:len(block)]:
+                if not output_is_zeroed:
+                    punch_hole(out_file, region_out_offset + copied, len(block))
+            else:
+                out_file.seek(region_out_offset + copied)
+                out_file.write(block)
+
+            copied += len(block)
+
+# Copies 'count' bytes (0 = everything after 'inoffset') from one file into another one, like dd with conv=notrunc,sparse.
+def dd (sin: str, sout: str, count=0, inoffset=0, outoffset=0):
+    with open(sin, 'rb', buffering=0) as infile, open(sout, 'r+b', buffering=0) as outfile:
+        infilesize = os.fstat(infile.fileno()).st_size
 
-            progress = f'\r => {progress_file}'
-            print(progress, end='')
+        if count == 0:
+            count = infilesize - inoffset
+
+        count = max(0, min(count, infilesize - inoffset))
 
-            with open(source_file, "rb") as f:
-                filesystem.writebytes(target_file, f.read())
+        # Holes at the end wouldn't extend the output file
+        outfilesize = os.fstat(outfile.fileno()).st_size
+        if outoffset + count > outfilesize:
+            outfile.truncate(outoffset + count)
 
-    print('\nDone')
-    filesystem.close()
+        copy_range(infile, outfile, inoffset, outoffset, count, output_is_zeroed=False)
+
+# Creates a file of a given size that reads as zeros. This doesn't allocate any space on file systems that support sparse files.
+def create_empty_file (filename, size):
+    with open(filename, 'wb') as f:
+        f.truncate(size)
+
+def delete_if_present(file):
+    if os.path.exists(file):
+        os.remove(file)
 
 def make_usb(output_base, output_usb):
     bps = PARTITIONENTRY_SECTOR_SIZE
@@ -464,14 +880,26 @@ def make_usb(output_base, output_usb):
 
     print (f'Block size {padding_block_size}')
 
-    totalsize = get_directory_size(output_base, padding_block_size) 
-    partitionsize = (( totalsize + padding_block_size - 1 ) // padding_block_size) * padding_block_size # Pad to cluster boundary
-    partitionsize = partitionsize + 32 * 1024 * 1024  # Extra padding just to make sure... (I have no clue how to calculate this properly.)
-    disksize = partitionsize + 2 * 1024 * 1024 # 2MB padding for the disk
-    partoffset = 63 # 63 sector offset, as usual
     basedir = os.path.join(os.curdir)
     syslinux_mbr = os.path.join(basedir, 'tools', 'syslinux_mbr.bin')
 
+    # Plan the file system contents first, that way we know exactly how big the partition has to be.
+    # LDLINUX.SYS goes first so it ends up right after the directories, it must be contiguous (which all our files are)
+
+    populator = FAT32Populator()
+
+    ldlinux_sys_bytes, ldlinux_sys_size = syslinux.get_ldlinux_sys(bps)
+    populator.add_file_bytes('ldlinux.sys', ldlinux_sys_bytes, attributes=FAT_ATTR_READ_ONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM)
+    populator.add_file('ldlinux.c32', syslinux.get_ldlinux_c32_path())
+    populator.add_tree(output_base)
+
+    clusters = populator.required_clusters(padding_block_size)
+    totalsize = clusters * padding_block_size
+    partitionsize = FAT32Partition.partition_size_for_clusters(clusters)
+    partitionsize = partitionsize + 32 * 1024 * 1024  # Extra padding, so there's some room to add files after writing the image
+    disksize = partitionsize + 2 * 1024 * 1024 # 2MB padding for the disk
+    partoffset = 63 # 63 sector offset, as usual
+
     print('Creating USB image file...')
 
     print(f'Total size: {totalsize} bytes')
@@ -479,16 +907,11 @@ def make_usb(output_base, output_usb):
     delete_if_present(output_usb)
 
     hdd_img = HardDiskImage(disksize, output_usb, syslinux_mbr)
-    hdd_img.add_partition(partitionsize, partition_offset_sectors=partoffset)
-
-    # Install syslinux bootloader
-
-    syslinux.install_syslinux(output_usb, partoffset, bps)
 
-    protocol_file = f'fat://{fs.path.normpath(os.path.abspath(output_usb))}?offset={partoffset * bps}'
+    print ('Copying files to image...')
+    partition = hdd_img.add_partition(partitionsize, partition_offset_sectors=partoffset, populator=populator)
 
-    # Copy all the files to the new file system
+    # Install syslinux bootloader. We know exactly where LDLINUX.SYS is, no need to search for it.
 
-    print ('Copying files to image. WARNING: THIS IS VERY SLOW (I DO NOT KNOW WHY), BE PATIENT')
-    copy_tree_to_fs_path(output_base, protocol_file)
- 
\ No newline at end of file
+    ldlinux_sys_offset = partition.cluster_offset(populator.find('ldlinux.sys').first_cluster)
+    syslinux.install_syslinux(output_usb, partoffset, ldlinux_sys_offset, ldlinux_sys_size, len(ldlinux_sys_bytes), bps)
@@ -101,6 +101,7 @@ import sys
 import subprocess
 import time
 import hashlib
+import shutil
 
 MERCYPAK_V1_MAGIC = b'ZIEG'
 MERCYPAK_V2_MAGIC = b'MRCY'
@@ -112,6 +113,8 @@ FS_UNK      = 0
 
 MAX_FILES_PER_KNOWN_DATA = 8
 
+MERCYPAK_COPY_BUFFER_SIZE = 1024 * 1024
+
 mpak_fs_type = FS_UNK
 
 # Get the current local time in seconds since the epoch
@@ -188,40 +191,54 @@ class fileInfo:
 
 
 class fileData:
-    def __init__(self, data: bytearray):
-        self.data = data
-        self.hash = hashlib.sha256()
-        self.hash.update(self.data)
+    def __init__(self, path: str, size: int, digest: bytes):
+        # The data itself is not kept in memory, it is streamed from 'path' when the pack is written
+        self.path = path
+        self.size = size
+        self.digest = digest
         self.files_with_this_data = list()
     
     def add_file(self, filename: str, attribute, dos_date, dos_time):
         self.files_with_this_data.append(fileInfo(filename, attribute, dos_date, dos_time))
 
-def add_to_known_files(file_data_list: list, data:bytearray, filename, attribute, dos_date, dos_time):
-            
+    def write_data(self, f):
+        with open(self.path, 'rb') as infile:
+            shutil.copyfileobj(infile, f, MERCYPAK_COPY_BUFFER_SIZE)
+
+def hash_file(path):
     hash = hashlib.sha256()
-    hash.update(data)
-    
-    for file_data in file_data_list:
-        if file_data.hash.digest() == hash.digest() and len(file_data.files_with_this_data) < MAX_FILES_PER_KNOWN_DATA:
+    with open(path, 'rb') as f:
+        while True:
+            chunk = f.read(MERCYPAK_COPY_BUFFER_SIZE)
+            if not chunk:
+                break
+            hash.update(chunk)
+    return hash.digest()
+
+def add_to_known_files(file_data_list: list, file_data_by_digest: dict, path, size, digest, filename, attribute, dos_date, dos_time):
+
+    for file_data in file_data_by_digest.get(digest, ()):
+        if len(file_data.files_with_this_data) < MAX_FILES_PER_KNOWN_DATA:
             print(f'file {filename} is duplicate, optimizing...')
             file_data.add_file(filename, attribute, dos_date, dos_time)
             return
 
     # We don't know any files with this data block yet, so we add a new one
-    new_file_data = fileData(data)
+    new_file_data = fileData(path, size, digest)
     new_file_data.add_file(filename, attribute, dos_date, dos_time)
     file_data_list.append(new_file_data)
+    file_data_by_digest.setdefault(digest, list()).append(new_file_data)
 
 
-def mercypak_pack(dir_path, output_file, mercypak_v2=False):
+def mercypak_pack(dir_path, output_file, mercypak_v2=False, cache=None):
     # Collect directory and file information
+    # If a BuildCache is given, unchanged files are not read & hashed again.
     dir_count = 0
     file_count = 0
     dir_info = []
-#    file_info = []
     dir_path = os.path.abspath(dir_path)
     known_file_infos = list()
+    known_file_infos_by_digest = dict()
 
     for root, dirs, files in os.walk(dir_path):
         for dir_name in dirs:
@@ -235,18 +252,32 @@ def mercypak_pack(dir_path, output_file, mercypak_v2=False):
             file_abs_path = os.path.join(root, file_name)
             file_rel_path = os.path.relpath(file_abs_path, dir_path)
             file_stat = os.stat(file_abs_path)
-            file_dos_date = dos_date(file_stat.st_mtime)
-            file_dos_time = dos_time(file_stat.st_mtime)
-            file_dos_attr = getfatattr(file_abs_path)
-            with open(file_abs_path, 'rb') as f:
-                file_data = f.read()
 
-            add_to_known_files(known_file_infos, file_data, file_rel_path.encode(), file_dos_attr, file_dos_date, file_dos_time)
- #           file_info.append((file_rel_path.encode(), file_dos_attr, file_dos_date, file_dos_time, len(file_data), file_data))
+            cached = cache.lookup_file(file_abs_path, file_stat) if cache is not None else None
+
+            if cached is not None:
+                file_digest, file_dos_attr, file_dos_date, file_dos_time = cached
+            else:
+                file_dos_date = dos_date(file_stat.st_mtime)
+                file_dos_time = dos_time(file_stat.st_mtime)
+                file_dos_attr = getfatattr(file_abs_path)
+                file_digest = hash_file(file_abs_path)
+                if cache is not None:
+                    cache.store_file(file_abs_path, file_stat, file_digest, file_dos_attr, file_dos_date, file_dos_time)
+
+            add_to_known_files(known_file_infos, known_file_infos_by_digest, file_abs_path, file_stat.st_size, file_digest,
+                               file_rel_path.encode(), file_dos_attr, file_dos_date, file_dos_time)
 
     print(f'known unique files: {len(known_file_infos)}, total files {file_count}')
 
-    # Write the archive
+    mercypak_write(output_file, dir_info, known_file_infos, file_count, mercypak_v2)
+
+    if cache is not None:
+        cache.save()
+
+def mercypak_write(output_file, dir_info, known_file_infos, file_count, mercypak_v2=False):
+    # Writes the archive. dir_info is a list of (relative path, attributes), known_file_infos a list of
+    # fileData-like objects (size, files_with_this_data, write_data). Also used by mercypakgen.py.
     with open(output_file, 'wb') as f:
         # Write file header
         if mercypak_v2:
@@ -254,7 +285,7 @@ def mercypak_pack(dir_path, output_file, mercypak_v2=False):
         else:
             f.write(MERCYPAK_V1_MAGIC)
 
-        f.write(struct.pack('<II', dir_count, file_count))
+        f.write(struct.pack('<II', len(dir_info), file_count))
 
         # Write directory information
         for dir in dir_info:
@@ -265,7 +296,7 @@ def mercypak_pack(dir_path, output_file, mercypak_v2=False):
 
         # Write file information
         for file_data in known_file_infos:
-            file_size = len(file_data.data)
+            file_size = file_data.size
 
             if file_size > 0xffffffff:
                 raise ValueError(f'File is too big.')
@@ -293,7 +324,7 @@ def mercypak_pack(dir_path, output_file, mercypak_v2=False):
                     f.write(struct.pack('<HH', file_info.dos_date, file_info.dos_time))
 
                 f.write(struct.pack('<I', file_size))
-                f.write(file_data.data)
+                file_data.write_data(f)
             
             else:
 
@@ -310,9 +341,58 @@ def mercypak_pack(dir_path, output_file, mercypak_v2=False):
                     f.write(struct.pack('B', file_info.attribute & 0xff))
                     f.write(struct.pack('<HH', file_info.dos_date, file_info.dos_time))
                     f.write(struct.pack('<I', file_size))
-                    f.write(file_data.data)
+                    file_data.write_data(f)
+
+
+
+def mercypak_entries(pack_file):
+    # Walks the headers of a pack without reading any file data. Yields ('dir', path, attributes) for every directory,
+    # then ('file', path, attributes, dos_date, dos_time, data_offset, size) for every file.
+    # Identical files in V2 packs get one entry per copy, all pointing at the same data.
+    with open(pack_file, 'rb') as f:
+        magic = f.read(4)
+
+        if magic not in (MERCYPAK_V1_MAGIC, MERCYPAK_V2_MAGIC):
+            raise ValueError(f'"{pack_file}" is not a MercyPak file')
+
+        dir_count, file_count = struct.unpack('<II', f.read(8))
+
+        for _ in range(dir_count):
+            attributes, name_length = struct.unpack('BB', f.read(2))
+            yield ('dir', f.read(name_length).decode(), attributes)
+
+        files_done = 0
+
+        while files_done < file_count:
+            copies = struct.unpack('B', f.read(1))[0] if magic == MERCYPAK_V2_MAGIC else 1
+            file_infos = list()
+
+            for _ in range(copies):
+                name_length = struct.unpack('B', f.read(1))[0]
+                name = f.read(name_length).decode()
+                file_infos.append((name,) + struct.unpack('<BHH', f.read(5)))   # Attributes, date, time
+
+            file_size = struct.unpack('<I', f.read(4))[0]
+            data_offset = f.tell()
+            f.seek(file_size, os.SEEK_CUR)
+
+            for name, attributes, file_date, file_time in file_infos:
+                yield ('file', name, attributes, file_date, file_time, data_offset, file_size)
+
+            files_done += copies
+
+def mercypak_size_histogram(pack_file):
+    # Returns the number of files and their total size per size class (the bit length of the file size, 0 - 32),
+    # read from the headers of a pack. Identical files in V2 packs count once per copy, like on the disk.
+    histogram = [[0, 0] for _ in range(33)]
 
+    for entry in mercypak_entries(pack_file):
+        if entry[0] == 'file':
+            file_size = entry[6]
+            histogram[file_size.bit_length()][0] += 1
+            histogram[file_size.bit_length()][1] += file_size
 
+    return histogram
 
 def dos_date(mtime):
     timestamp = datetime.datetime.utcfromtimestamp(mtime) + mpak_utc_offset
@@ -0,0 +1,210 @@
+'''
+Synthetic MercyPak corpus generator.
+
+Generates MercyPak files (v1 or v2) that look like a Windows 9x OS root from the installer's point of view:
+lots of tiny INF / TXT files, a good amount of mid-size DLLs and drivers and a few large CABs, spread over
+a directory tree, with some identical files and a mix of DOS attributes. The file contents are random data.
+
+Everything is derived from the seed, so the same arguments always give the exact same pack. That way the
+packs can be used for installer benchmarks (see installer/bench.c) and throughput regression checks without
+having to ship real (non-redistributable) OS files.
+
+Example:
+    python mercypakgen.py --files 2500 --v2 SYNTH.866
+
+Python Version for Windows 98 QuickInstall
+(C) 2023 Eric Voirin (oerg866@googlemail.com)
+'''
+
+import sys
+import random
+import argparse
+import datetime
+
+from mercypak import fileInfo, mercypak_write, MAX_FILES_PER_KNOWN_DATA, MERCYPAK_COPY_BUFFER_SIZE
+
+# Size buckets (min bytes, max bytes, weight, file extensions), roughly what a Windows 98 SE install looks like
+DEFAULT_HISTOGRAM = '64-8192:47,8192-131072:38,131072-1048576:14,1048576-8388608:1'
+HISTOGRAM_EXTENSIONS = [
+    ['INF', 'TXT', 'INI', 'PIF', 'LNK', 'HLP'],
+    ['DLL', 'VXD', 'DRV', 'EXE', 'CPL', 'SYS'],
+    ['DLL', 'EXE', 'OCX', 'TLB', 'FON'],
+    ['CAB'],
+]
+
+# DOS attribute letters as shown by ATTRIB
+ATTRIBUTE_LETTERS = {'R': 0x01, 'H': 0x02, 'S': 0x04, 'A': 0x20}
+DEFAULT_ATTRIBUTE_MIX = 'A:85,RA:6,HA:4,HSA:3,R:2'
+
+DIRECTORY_ATTRIBUTE = 0x10
+
+NAME_CHARACTERS = 'ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_'
+
+# Windows 98 SE was released 1999-05-05, file dates are spread over the year before
+DATE_START = datetime.datetime(1998, 5, 5)
+DATE_RANGE_SECONDS = 365 * 24 * 60 * 60
+
+class generatedFileData:
+    # Same interface as mercypak.fileData, but the data is generated from a seed while writing
+    def __init__(self, size: int, seed: int):
+        self.size = size
+        self.seed = seed
+        self.files_with_this_data = list()
+
+    def add_file(self, filename: bytes, attribute, dos_date, dos_time):
+        self.files_with_this_data.append(fileInfo(filename, attribute, dos_date, dos_time))
+
+    def write_data(self, f):
+        rng = random.Random(self.seed)
+        left = self.size
+        while left > 0:
+            chunk_size = min(left, MERCYPAK_COPY_BUFFER_SIZE)
+            f.write(rng.randbytes(chunk_size))
+            left -= chunk_size
+
+def parse_weighted_list(text, parse_key):
+    """
+    Parses 'key:weight,key:weight,...' into a list of (parsed key, weight).
+    """
+    result = list()
+    for item in text.split(','):
+        key, _, weight = item.strip().rpartition(':')
+        if not key:
+            raise ValueError(f'Invalid entry "{item}", expected key:weight')
+        result.append((parse_key(key), float(weight)))
+    return result
+
+def parse_size_range(text):
+    min_size, _, max_size = text.partition('-')
+    min_size = int(min_size)
+    max_size = int(max_size) if max_size else min_size
+    if min_size < 0 or max_size < min_size or max_size > 0xffffffff:
+        raise ValueError(f'Invalid size range "{text}"')
+    return min_size, max_size
+
+def parse_attributes(text):
+    attribute = 0
+    for letter in text.upper():
+        if letter not in ATTRIBUTE_LETTERS:
+            raise ValueError(f'Unknown attribute "{letter}", use R, H, S and A')
+        attribute |= ATTRIBUTE_LETTERS[letter]
+    return attribute
+
+def random_name(rng, length, used):
+    while True:
+        name = ''.join(rng.choice(NAME_CHARACTERS) for _ in range(length))
+        if name not in used:
+            used.add(name)
+            return name
+
+def random_dos_timestamp(rng):
+    timestamp = DATE_START + datetime.timedelta(seconds=rng.randrange(DATE_RANGE_SECONDS))
+    dos_date = ((timestamp.year - 1980) << 9) | (timestamp.month << 5) | timestamp.day
+    dos_time = (timestamp.hour << 11) | (timestamp.minute << 5) | (timestamp.second // 2)
+    return dos_date, dos_time
+
+def random_file_size(rng, bucket):
+    # Log-uniform inside the bucket, small files are a lot more common than big ones everywhere
+    min_size, max_size = bucket
+    if min_size == max_size:
+        return min_size
+    low = max(min_size, 1)
+    size = int(round(low * (max_size / low) ** rng.random()))
+    return min(max(size, min_size), max_size)
+
+def generate_directories(rng, dir_count, max_depth):
+    """
+    Generates a directory tree. Returns a list of paths (DOS style, parents always come before their children).
+    """
+    directories = list()
+    names_used = {'': set()}
+
+    for _ in range(dir_count):
+        candidates = [''] + [path for path in directories if path.count('\\') + 1 < max_depth]
+        parent = rng.choice(candidates)
+        name = random_name(rng, rng.randint(3, 8), names_used[parent])
+        path = f'{parent}\\{name}' if parent else name
+        directories.append(path)
+        names_used[path] = set()
+
+    return directories, names_used
+
+def generate_corpus(args):
+    rng = random.Random(args.seed)
+
+    histogram = parse_weighted_list(args.histogram, parse_size_range)
+    attribute_mix = parse_weighted_list(args.attr_mix, parse_attributes)
+
+    directories, names_used = generate_directories(rng, args.dirs, args.depth)
+    dir_info = [(path.encode(), DIRECTORY_ATTRIBUTE) for path in directories]
+
+    # The root directory gets a fair share of files too, just like a Windows directory
+    file_directories = [''] + directories
+
+    file_datas = list()
+    total_size = 0
+
+    for _ in range(args.files):
+        directory = rng.choice(file_directories)
+        attribute = rng.choices([a for a, _ in attribute_mix], [w for _, w in attribute_mix])[0]
+        dos_date, dos_time = random_dos_timestamp(rng)
+
+        # Duplicate an existing file if we're lucky (and it doesn't have too many copies already)
+        duplicate_candidates = file_datas[-256:]
+        file_data = None
+
+        if duplicate_candidates and rng.random() < args.dup_ratio:
+            file_data = rng.choice(duplicate_candidates)
+            if len(file_data.files_with_this_data) >= MAX_FILES_PER_KNOWN_DATA:
+                file_data = None
+
+        if file_data is None:
+            bucket_index = rng.choices(range(len(histogram)), [w for _, w in histogram])[0]
+            size = random_file_size(rng, histogram[bucket_index][0])
+            extension = rng.choice(HISTOGRAM_EXTENSIONS[min(bucket_index, len(HISTOGRAM_EXTENSIONS) - 1)])
+            file_data = generatedFileData(size, rng.getrandbits(64))
+            file_datas.append(file_data)
+        else:
+            extension = file_data.files_with_this_data[0].filename.decode().rpartition('.')[2]
+
+        name = random_name(rng, rng.randint(1, 8), names_used[directory]) + '.' + extension
+        path = f'{directory}\\{name}' if directory else name
+
+        file_data.add_file(path.encode(), attribute, dos_date, dos_time)
+        total_size += file_data.size
+
+    return dir_info, file_datas, total_size
+
+def main():
+    parser = argparse.ArgumentParser(description='Synthetic MercyPak corpus generator', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    parser.add_argument('output', type=str, help='Output MercyPak file')
+    parser.add_argument('--v2', action='store_true', help='Write a MercyPak v2 file (identical files are stored once)')
+    parser.add_argument('--files', type=int, help='Number of files', default=2500)
+    parser.add_argument('--dirs', type=int, help='Number of directories (default: one per 25 files)', default=None)
+    parser.add_argument('--depth', type=int, help='Maximum directory depth', default=4)
+    parser.add_argument('--histogram', type=str, help='File size histogram, comma separated min-max:weight entries (bytes)', default=DEFAULT_HISTOGRAM)
+    parser.add_argument('--dup-ratio', type=float, help='Fraction of files that are identical to another file', default=0.08)
+    parser.add_argument('--attr-mix', type=str, help='DOS attribute mix, comma separated attributes:weight entries (letters R, H, S, A)', default=DEFAULT_ATTRIBUTE_MIX)
+    parser.add_argument('--seed', type=int, help='Random seed, the same seed and options always give the same pack', default=866)
+    args = parser.parse_args()
+
+    if args.dirs is None:
+        args.dirs = max(1, args.files // 25)
+
+    if args.files < 0 or args.dirs < 0 or args.depth < 1 or not (0.0 <= args.dup_ratio <= 1.0):
+        parser.error('Invalid corpus parameters')
+
+    try:
+        dir_info, file_datas, total_size = generate_corpus(args)
+    except ValueError as e:
+        parser.error(str(e))
+
+    print(f'Generating {args.output}: {len(dir_info)} directories, {args.files} files ({len(file_datas)} unique), {total_size / (1024 * 1024):.1f} MB, seed {args.seed}')
+
+    mercypak_write(args.output, dir_info, file_datas, args.files, args.v2)
+
+    print('Done.')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
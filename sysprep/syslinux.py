@@ -4,7 +4,6 @@
 
 import os
 import mmap
-import fs
 import struct
 
 # OK Realtalk(TM)
@@ -296,48 +295,43 @@ def patch_syslinux_bootsector(mm: mmap.mmap, partition_offset_sector, ldlinux_sy
 def get_padded_size(size, padding):
     return (size + padding - 1) // padding * padding
 
-def install_syslinux(filename, partition_starting_sector, bytes_per_sector=512):
-    print(f'Installing SYSLINUX bootloader to image "{filename}"')
-
-    protocol_file = f'fat://{fs.path.normpath(os.path.abspath(filename))}?offset={partition_starting_sector * bytes_per_sector}'
+def get_ldlinux_c32_path():
+    return os.path.join(os.curdir, 'tools', 'ldlinux.c32')
 
+def get_ldlinux_sys(bytes_per_sector=512):
+    """
+    Gets the LDLINUX.SYS file contents as they have to be written to the file system and its original size.
+    """
     ldlinux_sys_path = os.path.join(os.curdir, 'tools', 'ldlinux.sys')
-    ldlinux_c32_path = os.path.join(os.curdir, 'tools', 'ldlinux.c32')
 
-    with fs.open_fs(protocol_file) as filesystem:
-        # I think with PyFilesystem it's faster to write the files manually than using the copy functions? at least that's how it's behaving on my Windows box
+    with open(ldlinux_sys_path, 'rb') as infile:
+        ldlinux_sys_bytes = infile.read()
+        ldlinux_sys_size = len(ldlinux_sys_bytes)
 
-        with filesystem.open('ldlinux.sys', 'wb') as outfile:
-            with open(ldlinux_sys_path, 'rb') as infile:
-                ldlinux_sys_bytes = infile.read()
-                ldlinux_sys_size = len(ldlinux_sys_bytes) # Pad to sector size + 2 sectors for ADV
-            
-            # We need to pad to the next sector size and add 2 sectors to add the "ADV" region whatever the f*** that is
-            ldlinux_sys_write_size = get_padded_size(ldlinux_sys_size + 2 * bytes_per_sector, bytes_per_sector)
-            outfile.write(ldlinux_sys_bytes)
-            outfile.write(bytearray(ldlinux_sys_write_size - ldlinux_sys_size))
-            
+    # We need to pad to the next sector size and add 2 sectors to add the "ADV" region whatever the f*** that is
+    ldlinux_sys_write_size = get_padded_size(ldlinux_sys_size + 2 * bytes_per_sector, bytes_per_sector)
+    ldlinux_sys_bytes += bytearray(ldlinux_sys_write_size - ldlinux_sys_size)
 
-        with filesystem.open('ldlinux.c32', 'wb') as outfile:
-            with open(ldlinux_c32_path, 'rb') as infile:
-                ldlinux_c32_bytes = infile.read()
-                outfile.write(ldlinux_c32_bytes)
+    return ldlinux_sys_bytes, ldlinux_sys_size
 
-    filesystem.close()
-
-    # get offset of the ldlinux.sys file we just wrote.
-    # It seems this can be done with "get_cluster" but this is all a bit too complicated for my tiny brain
+def install_syslinux(filename, partition_starting_sector, ldlinux_sys_offset, ldlinux_sys_size, ldlinux_sys_write_size, bytes_per_sector=512):
+    """
+    Installs SYSLINUX to an image that already has LDLINUX.SYS (from get_ldlinux_sys) and LDLINUX.C32 on it.
+    LDLINUX.SYS must be contiguous, 'ldlinux_sys_offset' is its absolute offset in the image.
+    """
+    print(f'Installing SYSLINUX bootloader to image "{filename}"')
 
     with open(filename, "r+b") as f:
         mm = mmap.mmap(f.fileno(), 0)
 
-        ldlinux_sys_offset = mm.find(ldlinux_sys_bytes)
         ldlinux_sys_sector = ldlinux_sys_offset // bytes_per_sector
 
-        # print(f'LDLINUX.SYS found at {ldlinux_sys_offset} ({hex(ldlinux_sys_offset)}), sector {ldlinux_sys_sector} (hex({hex(ldlinux_sys_sector)}))')
+        # print(f'LDLINUX.SYS at {ldlinux_sys_offset} ({hex(ldlinux_sys_offset)}), sector {ldlinux_sys_sector} (hex({hex(ldlinux_sys_sector)}))')
 
         # Patch boot sector to include the starting sector of syslinux
         patch_syslinux_bootsector(mm, partition_starting_sector, ldlinux_sys_sector)
 
         # Patch all the crap to be patched in LDLINUX.SYS
-        patch_ldlinux_sys(mm, partition_starting_sector, ldlinux_sys_offset, ldlinux_sys_size, ldlinux_sys_write_size, bytes_per_sector)
\ No newline at end of file
+        patch_ldlinux_sys(mm, partition_starting_sector, ldlinux_sys_offset, ldlinux_sys_size, ldlinux_sys_write_size, bytes_per_sector)
+
+        mm.close()
@@ -12,13 +12,20 @@ import platform
 import shutil
 import re
 import fnmatch
+import filecmp
 import stat
+import zlib
 
 from makeusb import make_usb
-from mercypak import mercypak_pack
+from mercypak import mercypak_pack, mercypak_size_histogram
+from golden import make_golden_image, GOLDEN_PACKS
+from driverindex import write_driver_index, DRIVER_INDEX_FILE
+from buildcache import BuildCache, tree_fingerprint
+from jobs import JobScheduler
+import isolayout
 
-# Store the current working directory in a global variable
-cwd_stack = [os.getcwd()]
+# mkisofs can't be told where to put files, so the image is built again if the packs didn't end up aligned
+ISO_LAYOUT_MAX_PASSES = 3
 
 # Global script basepath
 script_base_path = os.path.dirname(os.path.abspath(__file__))
@@ -26,15 +33,6 @@ script_base_path = os.path.dirname(os.path.abspath(__file__))
 # Global output verbose
 global_stdout=subprocess.DEVNULL
 
-def pushd(directory):
-    os.chdir(directory)
-    cwd_stack.append(os.getcwd())
-
-def popd():
-    if len(cwd_stack) > 1:
-        cwd_stack.pop()
-        os.chdir(cwd_stack[-1])
-
 def file_exists(directory, filename):
 # Check if a file with a given filename exists in a directory in a case-insensitive manner.
     for file in os.listdir(directory):
@@ -66,15 +64,17 @@ def handle_remove_readonly(func, path, exc_info):
     else:
         raise OSError("Unable to delete file: %s" % path)
 
-# Delete a file with a given filename in a directory in a case-insensitive manner. 'filename' may include wildcards ('*')
-def delete_file(directory, filename):
+# Delete a file with a given filename in a directory in a case-insensitive manner. 'filename' may include wildcards ('*'),
+# the names in 'keep' are left alone
+def delete_file(directory, filename, keep=()):
     if not os.path.exists(directory):
         return True
 
     result = False
+    keep = [name.lower() for name in keep]
 
     for file in os.listdir(directory):
-        if re.match(fnmatch.translate(filename), file, re.IGNORECASE):
+        if re.match(fnmatch.translate(filename), file, re.IGNORECASE) and file.lower() not in keep:
             try:
                 full_path = os.path.join(directory, file)
                 print(full_path)
@@ -128,39 +128,32 @@ def get_wine_path(path):
     return subprocess.check_output(['winepath', '-w', path]).strip()  # idk why winepath appends a \n here and why it trips up everything...
 
 # Run Windows 98's REGEDIT in 16-bit DOS emulation (bundled, sorry microsoft, don't sue me :C)
-def run_regedit(reg_file):
+# SYSTEM.DAT and USER.DAT are expected in 'work_dir'. Stages run in parallel, so this never changes our own working directory.
+def run_regedit(reg_file, work_dir):
     regedit_exe = os.path.join(script_base_path, 'registry', 'regedit.exe')
     msdos_exe = os.path.join(script_base_path, 'tools', 'msdos.exe')
 
     # regedit is called from *within* msdos.exe.
 
     if platform.system() == 'Windows':
-        subprocess.run([msdos_exe, regedit_exe, '/L:SYSTEM.DAT', '/R:USER.DAT', reg_file], check=True, stdout=global_stdout)
+        subprocess.run([msdos_exe, regedit_exe, '/L:SYSTEM.DAT', '/R:USER.DAT', reg_file], check=True, stdout=global_stdout, cwd=work_dir)
     else:
         reg_file = get_wine_path(reg_file)
         regedit_exe = get_wine_path(regedit_exe)
-        subprocess.run(['wine', msdos_exe, regedit_exe, '/L:SYSTEM.DAT', '/R:USER.DAT', reg_file], check=True, stdout=global_stdout)
+        subprocess.run(['wine', msdos_exe, regedit_exe, '/L:SYSTEM.DAT', '/R:USER.DAT', reg_file], check=True, stdout=global_stdout, cwd=work_dir)
 
 # Add registry file to a given windows installation and pack the registry with mercypak
-def registry_add_reg(osroot_base, osroot_windir_relative, reg_file, output_866_file):
+# 'registry_temp_path' must be unique for every call that may run at the same time.
+def registry_add_reg(osroot_base, osroot_windir_relative, reg_file, output_866_file, registry_temp_path, cache):
     osroot_windir_absolute = os.path.join(osroot_base, osroot_windir_relative)
     osroot_sysdir_absolute = case_insensitive_to_sensitive(osroot_windir_absolute, 'SYSTEM')
-    registry_temp_path = os.path.join(script_base_path, '.regtmp')
     registry_temp_windir_absolute = os.path.join(registry_temp_path, osroot_windir_relative)
 
     print('Processing system registry...')
 
-    delete_recursive(registry_temp_path)
-
-    # Prepare directory with SYSTEM.DAT and USER.DAT files
-    mkdir(registry_temp_windir_absolute)
-
     system_dat = case_insensitive_to_sensitive(osroot_windir_absolute, 'SYSTEM.DAT')
     user_dat = case_insensitive_to_sensitive(osroot_windir_absolute, 'USER.DAT')
 
-    shutil.copy2(system_dat, registry_temp_windir_absolute)
-    shutil.copy2(user_dat, registry_temp_windir_absolute)
-
     # Reboot hack, find appropriate shell32 version.
 
     shell32_dll = 'SHELL32.DLL'
@@ -176,23 +169,40 @@ def registry_add_reg(osroot_base, osroot_windir_relative, reg_file, output_866_f
 
     print(f'Using {shell32_dll} to reboot!')
 
-    pushd(registry_temp_windir_absolute)
+    # Skip running regedit if neither the registry nor the .reg file changed since the last run
+    stage_name = f'registry:{output_866_file}'
+    stage_fingerprint = tree_fingerprint(system_dat, user_dat, reg_file, extra=(osroot_windir_relative, shell32_dll))
+
+    if cache.stage_is_current(stage_name, stage_fingerprint, (output_866_file,)):
+        print(f'Registry unchanged, keeping "{output_866_file}"')
+        return
+
+    cache.stage_invalidate(stage_name)
+
+    delete_recursive(registry_temp_path)
+
+    # Prepare directory with SYSTEM.DAT and USER.DAT files
+    mkdir(registry_temp_windir_absolute)
+
+    shutil.copy2(system_dat, registry_temp_windir_absolute)
+    shutil.copy2(user_dat, registry_temp_windir_absolute)
 
     # Copy to temporary file and append reboot file to it
-    shutil.copy2(reg_file, 'tmp.reg')
-    append_line_to_file('tmp.reg', f'[HKEY_LOCAL_MACHINE\\Software\\Microsoft\\Windows\\CurrentVersion\\RunOnce]')
-    append_line_to_file('tmp.reg', f'"Reboot"="RUNDLL32.EXE {shell32_dll},SHExitWindowsEx 2"\n')
+    temp_reg_file = os.path.join(registry_temp_windir_absolute, 'tmp.reg')
+    shutil.copy2(reg_file, temp_reg_file)
+    append_line_to_file(temp_reg_file, f'[HKEY_LOCAL_MACHINE\\Software\\Microsoft\\Windows\\CurrentVersion\\RunOnce]')
+    append_line_to_file(temp_reg_file, f'"Reboot"="RUNDLL32.EXE {shell32_dll},SHExitWindowsEx 2"\n')
 
-    run_regedit('tmp.reg')
-    
-    os.remove('tmp.reg')
+    run_regedit(temp_reg_file, registry_temp_windir_absolute)
 
-    mercypak_pack(registry_temp_path, output_866_file)
+    os.remove(temp_reg_file)
 
-    popd()
+    mercypak_pack(registry_temp_path, output_866_file)
 
     delete_recursive(directory_path=registry_temp_path)
 
+    cache.stage_done(stage_name, stage_fingerprint)
+
 # Move INF and CAB files after drivercopy processing into the relative directories they would be in after installation.
 def move_inf_cab_files(directory_path, inf_directory, cab_directory):
     # Create the target directories if they do not exist
@@ -211,46 +221,62 @@ def move_inf_cab_files(directory_path, inf_directory, cab_directory):
             # Move the file to the CAB directory
             shutil.move(file_path, os.path.join(cab_directory, file_name))
 
-# Runs the "drivercopy" tool, platform independent as usual with WINE magic... 
-def drivercopy(source_path, output_path):
+# Runs the "drivercopy" tool, platform independent as usual with WINE magic...
+# drivercopy needs makecab.exe in its working directory, 'work_dir' must be unique for every call that may run at the same time.
+def drivercopy(source_path, output_path, work_dir):
 
     drivercopy_path = os.path.join(script_base_path, 'tools', 'drivercopy.exe')
 
-    shutil.copy2(os.path.join(script_base_path, 'tools', 'makecab.exe'), 'makecab.exe')
+    mkdir(work_dir)
+    shutil.copy2(os.path.join(script_base_path, 'tools', 'makecab.exe'), os.path.join(work_dir, 'makecab.exe'))
 
     if platform.system() == 'Windows':
-        subprocess.run([drivercopy_path, source_path, output_path], check=True, stdout=global_stdout)       
+        subprocess.run([drivercopy_path, source_path, output_path], check=True, stdout=global_stdout, cwd=work_dir)
     else:
         source_path = get_wine_path(source_path)
         output_path = get_wine_path(output_path)
-        subprocess.run(['wine', drivercopy_path, source_path, output_path], check=True, stdout=global_stdout)
+        subprocess.run(['wine', drivercopy_path, source_path, output_path], check=True, stdout=global_stdout, cwd=work_dir)
 
-    os.remove('makecab.exe')
+    delete_recursive(work_dir)
 
-# Preprocess the slipstream + extra drivers for this sysprep run
-def preprocess_drivers(output_base, input_drivers_base, input_drivers_extra):
-    driver_temp = os.path.join(output_base, '.drvtmp')
+# Preprocess a driver directory with drivercopy. Skipped if no driver changed since the last run.
+# The extra drivers go straight to the output, the slipstream drivers are kept in the build cache and later finalized for each OSRoot.
+def preprocess_drivers(input_drivers, output_drivers, stage_name, cache):
+    print(f'Preprocessing drivers from "{input_drivers}"...')
 
-    print('Preprocessing drivers...')
+    stage_fingerprint = tree_fingerprint(input_drivers)
 
-    # First do the extra drivers
-    print('Preprocessing EXTRA drivers...')
-    output_drivers_extra = os.path.join(output_base, 'driver.ex')
-    drivercopy(input_drivers_extra, output_drivers_extra)
+    if cache.stage_is_current(stage_name, stage_fingerprint, (output_drivers,)):
+        print(f'Drivers unchanged, keeping "{output_drivers}"')
+        return
 
-    # Prepare the drivers. Later we need to finalize them for each OSRoot.
-    print('Preprocessing SLIPSTREAMED drivers...')
-    drivercopy(input_drivers_base, driver_temp)
+    cache.stage_invalidate(stage_name)
+    delete_recursive(output_drivers)
+
+    drivercopy(input_drivers, output_drivers, output_drivers + '.work')
+
+    cache.stage_done(stage_name, stage_fingerprint)
 
 # Finalize the slipstream drivers for this sysprep run for a given OSRoot
-def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relative):
+def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relative, cache):
     print('Finalizing drivers for this OSRoot...')
 
+    input_driver_temp = os.path.join(cache.cache_dir, 'drvtmp')
+    output_866_file = os.path.join(output_osroot, 'DRIVER.866')
+    output_index_file = os.path.join(output_osroot, DRIVER_INDEX_FILE)
+    stage_name = f'driverpack:{output_866_file}'
+    stage_fingerprint = tree_fingerprint(input_driver_temp, extra=(osroot_cabdir_relative,))
+
+    if cache.stage_is_current(stage_name, stage_fingerprint, (output_866_file, output_index_file)):
+        print(f'Drivers unchanged, keeping "{output_866_file}"')
+        return
+
+    cache.stage_invalidate(stage_name)
+
     # Working around a bug in drivercopy (or more specifically makecab) where the output has to be relative
     # So all the cab files go into a local directory.
 
-    input_driver_temp = os.path.join(output_base, '.drvtmp')
-    output_driver_temp = os.path.join(output_base, '.drvtmp_osroot')
+    output_driver_temp = os.path.join(output_base, f'.drvtmp_osroot_{os.path.basename(output_osroot)}')
     shutil.rmtree(output_driver_temp, ignore_errors=True)
     mkdir(output_driver_temp)
 
@@ -261,27 +287,199 @@ def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relati
 
     move_inf_cab_files(output_driver_temp, driver_temp_infdir, driver_temp_cabdir)
 
-    output_866_file = os.path.join(output_osroot, 'DRIVER.866')
+    # Which files are for which hardware, so the installer can leave out what the machine doesn't need
+    write_driver_index(output_driver_temp, 'DRIVER', osroot_cabdir_relative, output_index_file)
+
     mercypak_pack(output_driver_temp, output_866_file)
 
     shutil.rmtree(output_driver_temp)
 
-# Cleanup after processing the drivers
-def process_drivers_cleanup(output_base):
-    shutil.rmtree(os.path.join(output_base, '.drvtmp'))
+    cache.stage_done(stage_name, stage_fingerprint)
+
+# Lay out the default install choices in a golden partition image the installer can write in one go (see golden.py)
+def write_golden_image(output_osroot, bytes_per_cluster, cache):
+    print('Writing golden partition image...')
+
+    output_image = os.path.join(output_osroot, 'GOLDEN.IMG')
+    pack_files = [os.path.join(output_osroot, pack_name) for pack_name in GOLDEN_PACKS if file_exists(output_osroot, pack_name)]
+    stage_name = f'golden:{output_image}'
+    stage_fingerprint = tree_fingerprint(*pack_files, extra=(bytes_per_cluster,))
+
+    if cache.stage_is_current(stage_name, stage_fingerprint, (output_image,)):
+        print(f'Packs unchanged, keeping "{output_image}"')
+        return
+
+    cache.stage_invalidate(stage_name)
+    make_golden_image(output_image, pack_files, bytes_per_cluster)
+    cache.stage_done(stage_name, stage_fingerprint)
+
+# File size histogram of every pack, the installer picks the cluster size with it (see installer/format.h)
+def write_pack_sizes(output_osroot):
+    with open(os.path.join(output_osroot, 'sizes.txt'), 'w') as file:
+        for pack_name in ('FULL.866', 'DRIVER.866', 'SLOWPNP.866', 'FASTPNP.866'):
+            if not file_exists(output_osroot, pack_name):
+                continue
+
+            histogram = mercypak_size_histogram(os.path.join(output_osroot, pack_name))
+
+            for size_class, (count, size) in enumerate(histogram):
+                if count > 0:
+                    file.write(f'{pack_name} {size_class} {count} {size}\n')
+
+# CRC32 of every pack, the installer's media test checks the disc against these
+def write_pack_checksums(output_osroot, cache):
+    output_file = os.path.join(output_osroot, 'checksums.txt')
+    pack_names = [pack_name for pack_name in ('GOLDEN.IMG', 'FULL.866', 'DRIVER.866', 'SLOWPNP.866', 'FASTPNP.866') if file_exists(output_osroot, pack_name)]
+    stage_name = f'checksums:{output_file}'
+    stage_fingerprint = tree_fingerprint(*(os.path.join(output_osroot, pack_name) for pack_name in pack_names))
+
+    if cache.stage_is_current(stage_name, stage_fingerprint, (output_file,)):
+        print(f'Packs unchanged, keeping "{output_file}"')
+        return
+
+    cache.stage_invalidate(stage_name)
+
+    with open(output_file, 'w') as file:
+        for pack_name in pack_names:
+            crc = 0
+            size = 0
+
+            with open(os.path.join(output_osroot, pack_name), 'rb') as pack:
+                for chunk in iter(lambda: pack.read(1024 * 1024), b''):
+                    crc = zlib.crc32(chunk, crc)
+                    size += len(chunk)
+
+            file.write(f'{pack_name} {size} {crc:08x}\n')
+
+    cache.stage_done(stage_name, stage_fingerprint)
+
+# Clean up an OS root before packing. Only touches what needs it, so a clean OS root keeps its fingerprint (see pack_osroot).
+def cleanup_osroot(osroot, osroot_windir, input_oeminfo):
+    osroot_infdir = case_insensitive_to_sensitive(osroot_windir, 'inf')
+    osroot_sysdir = case_insensitive_to_sensitive(osroot_windir, 'system')
+
+    # Cleanup unnecessary files
+    delete_file(osroot_windir,                                              'win386.swp')
+    delete_file(osroot_windir,                                              'ndislog.txt')
+    delete_file(osroot_windir,                                              '*.log')
+    delete_file(osroot_infdir,                                              'mdm*.inf', keep=('mdmgen.inf',))
+    delete_file(osroot_infdir,                                              'wdma_*.inf')
+    delete_file(osroot_infdir,                                              'drv*.bin')
+    delete_file(case_insensitive_to_sensitive(osroot_windir, 'recent'),     '*')
+    delete_file(case_insensitive_to_sensitive(osroot_windir, 'temp'),       '*')
+    delete_file(case_insensitive_to_sensitive(osroot_windir, 'applog'),     '*')
+    delete_file(case_insensitive_to_sensitive(osroot_windir, 'sysbckup'),   '*')
+    delete_file(case_insensitive_to_sensitive(osroot_infdir, 'other'),      '*')
+    delete_file(case_insensitive_to_sensitive(osroot,        'recycled'),   '*')
+    delete_file(osroot,                                                     'win386.swp')
+    delete_file(osroot,                                                     'bootlog.*')
+    delete_file(osroot,                                                     'frunlog.txt')
+    delete_file(osroot,                                                     'detlog.txt')
+    delete_file(osroot,                                                     'setuplog.txt')
+    delete_file(osroot,                                                     'scandisk.log')
+    delete_file(osroot,                                                     'netlog.txt')
+    delete_file(osroot,                                                     'suhdlog.dat')
+    delete_file(osroot,                                                     'msdos.---')
+    delete_file(osroot,                                                     'config.bak')
+    delete_file(osroot,                                                     'autoexec.bak')
+    delete_file(osroot,                                                     'io.bak')
+    delete_file(osroot,                                                     'command.dos')
+    delete_file(osroot,                                                     'videorom.bin')
+
+    # Copy oeminfo
+    for oem_file in ('oeminfo.ini', 'oemlogo.bmp'):
+        source = os.path.join(input_oeminfo, oem_file)
+        destination = case_insensitive_to_sensitive(osroot_sysdir, oem_file)
+
+        if not os.path.exists(destination) or not filecmp.cmp(source, destination, shallow=False):
+            shutil.copy2(source, destination)
+
+# Pack an OS root. If nothing in the OS root changed, the existing pack is kept.
+def pack_osroot(osroot, output_osroot, cache):
+    print("Packing system root...")
+
+    full_866 = os.path.join(output_osroot, 'FULL.866')
+    stage_name = f'pack:{full_866}'
+    stage_fingerprint = tree_fingerprint(osroot, extra=('v2',))
+
+    if cache.stage_is_current(stage_name, stage_fingerprint, (full_866,)):
+        print(f'OS root unchanged, keeping "{full_866}"')
+        return
+
+    cache.stage_invalidate(stage_name)
+    mercypak_pack(osroot, full_866, mercypak_v2=True, cache=cache)
+
+    if not file_exists(output_osroot, 'FULL.866'):
+        raise RuntimeError('There was an error. The required OSROOT pack file was not created ("FULL.866")')
+
+    cache.stage_done(stage_name, stage_fingerprint)
+
+# Copy the installer base files and the extra CD files to the output
+def copy_image_base_files(input_cdromroot, input_extras, input_unattend, output_base, output_extras):
+    print('Copying installation image base files...')
+    shutil.copytree(input_cdromroot, output_base, dirs_exist_ok=True)
+
+    # If the image has an answer file, the installer runs unattended (see installer/unattend.h)
+    output_unattend = os.path.join(output_base, 'unattend.txt')
+    if input_unattend is not None:
+        print('Copying unattended install answer file...')
+        shutil.copyfile(input_unattend, output_unattend)
+    elif os.path.exists(output_unattend):
+        os.remove(output_unattend)
+
+    print('Copying extra CD files...')
+    for extradir in input_extras:
+        shutil.copytree(extradir, output_extras, dirs_exist_ok=True)
 
 # Make an ISO File (TODO: Use pycdlib to remove mkisofs dependency)
-def make_iso(output_base, output_iso):
+# The packs are placed in install order and aligned, so the installer can read them in one forward sweep (see isolayout.py)
+def make_iso(output_base, output_iso, cache_dir):
     print('Creating ISO file...')
-    pushd(output_base)
     if platform.system() == 'Windows':
         mkisofs_path = os.path.join(script_base_path, 'tools', 'mkisofs.exe')
     else:
         mkisofs_path = 'mkisofs' # no path on Linux & co
 
-    os.remove(output_iso) if os.path.exists(output_iso) else None
-    subprocess.run([mkisofs_path, '-J', '-r', '-V', 'Win98 QuickInstall', '-o', output_iso, '-b', 'cdrom.img', '.'], check=True, stdout=global_stdout, stderr=global_stdout)
-    popd()
+    layout_dir = os.path.join(cache_dir, 'isolayout')
+    delete_recursive(layout_dir)
+    mkdir(layout_dir)
+
+    sort_file = os.path.join(layout_dir, 'sort.txt')
+    boot_files, packs = isolayout.get_install_order(output_base)
+    pad_sizes = [0] * len(packs)
+
+    for layout_pass in range(ISO_LAYOUT_MAX_PASSES):
+        pad_files = isolayout.write_pad_files(layout_dir, pad_sizes)
+        isolayout.write_sort_file(sort_file, boot_files, packs, pad_files)
+        pad_arguments, pad_grafts = isolayout.get_mkisofs_pad_arguments(pad_files)
+
+        if os.path.exists(output_iso):
+            os.remove(output_iso)
+
+        subprocess.run([mkisofs_path, '-J', '-r', '-V', 'Win98 QuickInstall', '-o', output_iso, '-b', 'cdrom.img', '-sort', sort_file] + pad_arguments + ['.'] + pad_grafts,
+                       check=True, stdout=global_stdout, stderr=global_stdout, cwd=output_base)
+
+        extents = isolayout.read_iso_extents(output_iso)
+        new_pad_sizes = isolayout.plan_padding(extents, packs, pad_sizes)
+
+        if new_pad_sizes is None or new_pad_sizes == pad_sizes:
+            break
+
+        print(f'Adjusting ISO layout (pass {layout_pass + 2})...')
+        pad_sizes = new_pad_sizes
+
+    delete_recursive(layout_dir)
+
+    # Report where everything ended up
+    problems = isolayout.check_layout(extents, boot_files, packs)
+    report = isolayout.format_layout_report(extents, boot_files, packs, problems)
+    print(report)
+
+    layout_file = output_iso + '.layout.txt'
+    with open(layout_file, 'w', encoding='utf-8') as f:
+        f.write(report + '\n\nAll files:\n' + isolayout.format_full_layout(extents) + '\n')
+
+    print(f'ISO layout written to "{layout_file}"')
 
 #############################################################################
 #
@@ -297,7 +495,12 @@ parser.add_argument('--osroot', type=str, action='append', help='Path to an OS r
 parser.add_argument('--extra', type=str, action='append', help='Path to extra files to be added to the output image\'s "extras" directory (can be specified multiple times)', default=['_EXTRA_CD_FILES_'])
 parser.add_argument('--drivers', type=str, help='Path to base drivers to slipstream.', default='_DRIVER_')
 parser.add_argument('--extradrivers', type=str, help='Path to drivers to be added to the output image\'s "driver.ex" directory. These are *NOT* slipstreamed.', default='_EXTRA_DRIVER_')
+parser.add_argument('--unattend', type=str, help='Answer file for an unattended install (see installer/unattend.h). The installer will not ask any questions!', default=None)
 parser.add_argument('--verbose', type=bool, help='Be verbose (show output of subprocesses)', default=False)
+parser.add_argument('-j', '--jobs', type=int, help='Maximum number of build stages to run in parallel', default=os.cpu_count() or 1)
+parser.add_argument('--clean', action='store_true', help='Discard the build cache and previous output, rebuild everything from scratch')
+parser.add_argument('--golden', action='store_true', help='Also write a golden partition image per OS root, which the installer streams to the disk instead of unpacking the default choices file by file')
+parser.add_argument('--golden-cluster', type=int, help='Cluster size of the golden images in bytes. The partitions they can fill are limited to about 4 million clusters (16 GB with 4 KB clusters)', default=4096)
 
 args = parser.parse_args()
 
@@ -315,6 +518,7 @@ input_osroots = args.osroot
 input_extras = args.extra
 input_drivers_base = os.path.abspath(args.drivers)
 input_drivers_extra = os.path.abspath(args.extradrivers)
+input_unattend = os.path.abspath(args.unattend) if args.unattend is not None else None
 
 if args.verbose:
     global_stdout = None
@@ -327,6 +531,7 @@ script_dir = os.path.dirname(os.path.abspath(__file__))
 output_base = os.path.join(script_dir, '_OUTPUT_')
 output_osroots_base = os.path.join(output_base, 'osroots')
 output_regtmp = os.path.join(script_dir, '.regtmp')
+output_cache = os.path.join(script_dir, '.buildcache')
 output_extras = os.path.join(output_base, 'extras')
 input_cdromroot = os.path.join(script_dir, 'cdromroot')
 input_oeminfo = os.path.join(script_dir, '_OEMINFO_')
@@ -338,16 +543,35 @@ print('Input OS roots: ' + str(input_osroots))
 print('Input Extra files: ' + str(input_extras))
 print('Input Base Drivers: ' + str(input_drivers_base))
 print('Input Extra Drivers: ' + str(input_drivers_extra))
+print('Unattended install answer file: ' + str(input_unattend))
+print('Parallel jobs: ' + str(args.jobs))
+
+if args.clean:
+    print('Cleaning build cache and previous output...')
+    shutil.rmtree(output_base, ignore_errors=True)
+    shutil.rmtree(output_cache, ignore_errors=True)
+
+# The output directory is kept between runs, so packs whose inputs didn't change don't have to be rebuilt.
+# Only remove what is definitely stale: OS roots that are no longer part of this build and the extra files.
+if os.path.isdir(output_osroots_base):
+    for osroot_dir in os.listdir(output_osroots_base):
+        if not osroot_dir.isdigit() or int(osroot_dir) > len(input_osroots):
+            delete_recursive(os.path.join(output_osroots_base, osroot_dir))
 
-shutil.rmtree(output_base, ignore_errors=True)
+delete_recursive(output_extras)
 
 mkdir(output_base)
 mkdir(output_regtmp)
 
+build_cache = BuildCache(output_cache)
+jobs = JobScheduler(args.jobs)
+
 # Preprocess drivers
-preprocess_drivers(output_base, input_drivers_base, input_drivers_extra)
+drivers_extra_job = jobs.add('drivers-extra', preprocess_drivers, input_drivers_extra, os.path.join(output_base, 'driver.ex'), 'drivers:extra', build_cache)
+drivers_base_job = jobs.add('drivers-base', preprocess_drivers, input_drivers_base, os.path.join(output_cache, 'drvtmp'), 'drivers:base', build_cache)
+build_jobs = [drivers_extra_job, drivers_base_job]
 
-# Process all OSroots.
+# Process all OSroots. Everything that needs user input is done here, the actual work is queued up as jobs.
 osroot_idx = 1
 for osroot in input_osroots:
     osroot = os.path.realpath(osroot)
@@ -381,68 +605,36 @@ for osroot in input_osroots:
     print(f'Windows directory: {osroot_windir} (relative: {osroot_windir_relative})')
     print(f'Windows CAB directory: {osroot_cabdir} (relative: {osroot_cabdir_relative})')
 
-    # Process registry
-    fastpnp_reg = os.path.join(script_dir, 'registry', 'fastpnp.reg')
-    fastpnp_866 = os.path.join(output_osroot, 'FASTPNP.866')
-    slowpnp_reg = os.path.join(script_dir, 'registry', 'slowpnp.reg')
-    slowpnp_866 = os.path.join(output_osroot, 'SLOWPNP.866')
-    registry_add_reg(osroot, osroot_windir_relative, slowpnp_reg, slowpnp_866)
-    registry_add_reg(osroot, osroot_windir_relative, fastpnp_reg, fastpnp_866)
-
-    # Backup generic modem driver file
-    osroot_infdir = case_insensitive_to_sensitive(osroot_windir, 'inf')
-    modem_inf_file = case_insensitive_to_sensitive(osroot_infdir, 'mdmgen.inf')
-    modem_bak_file = os.path.join(osroot_infdir, 'mdmgen.bak')
+    osroot_pack_jobs = []
 
-    if os.path.exists(modem_inf_file):
-        shutil.move(modem_inf_file, modem_bak_file)
+    # Process registry. Both variants only read SYSTEM.DAT / USER.DAT from the OS root, so they don't depend on anything.
+    for reg_name, pack_name in (('slowpnp.reg', 'SLOWPNP.866'), ('fastpnp.reg', 'FASTPNP.866')):
+        reg_file = os.path.join(script_dir, 'registry', reg_name)
+        output_866 = os.path.join(output_osroot, pack_name)
+        registry_temp = os.path.join(output_regtmp, f'{osroot_idx}_{pack_name}')
+        osroot_pack_jobs.append(jobs.add(f'osroot{osroot_idx}-registry-{pack_name}', registry_add_reg, osroot, osroot_windir_relative, reg_file, output_866, registry_temp, build_cache))
 
-    # Cleanup unnecessary files
-    delete_file(osroot_windir,                                              'win386.swp')
-    delete_file(osroot_windir,                                              'ndislog.txt')
-    delete_file(osroot_windir,                                              '*.log')
-    delete_file(osroot_infdir,                                              'mdm*.inf')
-    delete_file(osroot_infdir,                                              'wdma_*.inf')
-    delete_file(osroot_infdir,                                              'drv*.bin')
-    delete_file(case_insensitive_to_sensitive(osroot_windir, 'recent'),     '*')
-    delete_file(case_insensitive_to_sensitive(osroot_windir, 'temp'),       '*')
-    delete_file(case_insensitive_to_sensitive(osroot_windir, 'applog'),     '*')
-    delete_file(case_insensitive_to_sensitive(osroot_windir, 'sysbckup'),   '*')
-    delete_file(case_insensitive_to_sensitive(osroot_infdir, 'other'),      '*')
-    delete_file(case_insensitive_to_sensitive(osroot,        'recycled'),   '*')
-    delete_file(osroot,                                                     'win386.swp')
-    delete_file(osroot,                                                     'bootlog.*')
-    delete_file(osroot,                                                     'frunlog.txt')
-    delete_file(osroot,                                                     'detlog.txt')
-    delete_file(osroot,                                                     'setuplog.txt')
-    delete_file(osroot,                                                     'scandisk.log')
-    delete_file(osroot,                                                     'netlog.txt')
-    delete_file(osroot,                                                     'suhdlog.dat')
-    delete_file(osroot,                                                     'msdos.---')
-    delete_file(osroot,                                                     'config.bak')
-    delete_file(osroot,                                                     'autoexec.bak')
-    delete_file(osroot,                                                     'io.bak')
-    delete_file(osroot,                                                     'command.dos')
-    delete_file(osroot,                                                     'videorom.bin')
+    # Cleanup must be done before the OS root is packed.
+    cleanup_job = jobs.add(f'osroot{osroot_idx}-cleanup', cleanup_osroot, osroot, osroot_windir, input_oeminfo)
+    osroot_pack_jobs.append(jobs.add(f'osroot{osroot_idx}-pack', pack_osroot, osroot, output_osroot, build_cache, depends=[cleanup_job]))
 
-    # Restore generic modem driver file
-    if os.path.exists(modem_bak_file):
-        shutil.move(modem_bak_file, modem_inf_file)
+    # Finalize drivers for every package.
+    osroot_pack_jobs.append(jobs.add(f'osroot{osroot_idx}-drivers', finalize_drivers_for_osroot, output_base, output_osroot, osroot_cabdir_relative, build_cache, depends=[drivers_base_job]))
 
-    # Copy oeminfo
-    shutil.copy2(os.path.join(input_oeminfo, 'oeminfo.ini'), case_insensitive_to_sensitive(osroot_windir, 'system'))
-    shutil.copy2(os.path.join(input_oeminfo, 'oemlogo.bmp'), case_insensitive_to_sensitive(osroot_windir, 'system'))
+    build_jobs.extend(osroot_pack_jobs)
 
-    # Finalize drivers for every package.
-    finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relative)
+    # Only reads the pack headers, cheap enough to always do
+    build_jobs.append(jobs.add(f'osroot{osroot_idx}-sizes', write_pack_sizes, output_osroot, depends=osroot_pack_jobs))
 
-    print("Packing system root...")
+    checksum_depends = list(osroot_pack_jobs)
 
-    # Do the OSROOT mercypaking now.
-    mercypak_pack(osroot, os.path.join(output_osroot, 'FULL.866'), mercypak_v2=True)
+    if args.golden:
+        checksum_depends.append(jobs.add(f'osroot{osroot_idx}-golden', write_golden_image, output_osroot, args.golden_cluster, build_cache, depends=osroot_pack_jobs))
+        build_jobs.append(checksum_depends[-1])
+    else:
+        delete_file(output_osroot, 'GOLDEN.IMG')
 
-    if not file_exists(output_osroot, 'FULL.866'):
-        raise RuntimeError('There was an error. The required OSROOT pack file was not created ("FULL.866")')
+    build_jobs.append(jobs.add(f'osroot{osroot_idx}-checksums', write_pack_checksums, output_osroot, build_cache, depends=checksum_depends))
 
     # Do the title tag file.
     with open(os.path.join(output_osroot, 'win98qi.inf'), 'w', encoding="utf-8") as file:
@@ -450,24 +642,22 @@ for osroot in input_osroots:
 
     osroot_idx += 1
 
-# Copy CDROM Root stuff
-print('Copying installation image base files...')
-shutil.copytree(input_cdromroot, output_base, dirs_exist_ok=True)
-
-# Copy extra CD files.
-print('Copying extra CD files...')
+# Copy CDROM Root stuff and extra CD files.
+build_jobs.append(jobs.add('base-files', copy_image_base_files, input_cdromroot, input_extras, input_unattend, output_base, output_extras))
 
-for extradir in input_extras:
-    shutil.copytree(extradir, output_extras, dirs_exist_ok=True)
+def finish_sysprep():
+    build_cache.prune()
+    build_cache.save()
+    print(f'Sysprep complete, output is in "{output_base}"')
 
-process_drivers_cleanup(output_base)
-
-print(f'Sysprep complete, output is in "{output_base}"')
+finish_job = jobs.add('finish', finish_sysprep, depends=build_jobs)
 
 # Create output images
 
 if output_image_iso is not None:
-    make_iso(output_base, output_image_iso)
+    jobs.add('iso', make_iso, output_base, output_image_iso, output_cache, depends=[finish_job])
 
 if output_image_usb is not None:
-    make_usb(output_base, output_image_usb)
+    jobs.add('usb', make_usb, output_base, output_image_usb, depends=[finish_job])
+
+jobs.run()